@@ -2,60 +2,254 @@
 # Simple python script to connect to the drone's ESP32's BluetoothLE signal to retrieve sensor data
 # Author: Brandon Lee, brandon.kf.lee@gmail.com
 # Code partially derived from hbldh's service_explorer.py example code (https://github.com/hbldh/bleak/blob/develop/examples/service_explorer.py)
+#
+# The log, then the voxel map, are sent in chunks (see the protocol description in lib/ble_comms/ble_comms.hpp).
+# Received data is kept in a .part file, so if the connection drops (or this script is restarted)
+# the transfer resumes from where it left off instead of starting over.
+# Setting query fetches just part of a run instead (see lib/sample_query/sample_query.hpp).
+# Setting telemetry_live watches the flight as it happens instead, plotted live if matplotlib is installed.
+# Setting show_metrics prints the drone's runtime metrics (see lib/metrics/metrics.hpp) whenever it connects.
 
+import os
 import platform
 import asyncio
-import time
+import struct
+import zlib
 from bleak import BleakClient, BleakScanner
 
 drone_name = "EcoDrone_Data"
-drone_transmit_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e" # WARNING: this UUID is hard linked to the drone! 
+drone_transmit_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e" # WARNING: this UUID is hard linked to the drone!
+drone_control_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"  # Transfer requests are written here
+drone_telemetry_uuid = "6e400004-b5a3-f393-e0a9-e50e24dcca9e" # In-flight telemetry is notified here
+drone_metrics_uuid = "6e400005-b5a3-f393-e0a9-e50e24dcca9e"   # Runtime metrics snapshot, read on demand
 macos_use_bdaddr = False # When true use Bluetooth address instead of UUID on macOS
 
+out_path = "/Users/student/Documents/data.bin"
+map_path = "/Users/student/Documents/voxels.bin"
+transfers = [out_path, map_path] # Files the drone sends, in order, one transfer each
+credit_window = 32 # Data frames the drone may send ahead of us
+
+# Only fetch the records of a run (0 for the latest) between start and end, as uptimes in ms (key 0) or Tello motor
+# times in s (key 1), keeping every Nth of each stream and only the streams whose bit is set (0 for all)
+query = None # e.g. dict(run=0, key=0, start=30000, end=60000, every=1, streams=0)
+query_path = "/Users/student/Documents/query.bin"
+
+telemetry_live = False
+telemetry_period_ms = 200 # How often the drone sends a frame, it only sends one if something changed
+telemetry_window = 300 # Frames kept on the plot
+# TelemetryFrame, see lib/sensor_sched/telemetry.hpp
+telemetry_format = "<BBHIhhhhhhhBBHhHhHhIH"
+telemetry_fields = ("version", "flags", "seq", "uptime", "alt_cm", "vz_cms", "x_cm", "y_cm", "pitch", "roll", "yaw",
+                    "bat", "reserved", "motor_time", "margin", "co2", "scd4x_temp", "humd", "bmp3xx_temp", "pres",
+                    "tello_age_ms")
+telemetry_version = 1
+
+show_metrics = False
+# MetricsSnapshot, see lib/metrics/metrics.hpp. Names in the order of MetricSite and MetricCounter
+metrics_version = 1
+metric_sites = ("state parse", "cmd rtt", "flash write", "flash commit", "store", "scd4x read", "bmp3xx read")
+metric_counters = ("state packets", "parse errors", "replies dropped", "cmd timeouts", "records dropped", "flash bytes",
+                   "flash bytes lost", "sensor errors")
+metric_bucket_base_us = 8
+
+class TransferFailed(Exception):
+    pass
+
+async def offload(client, frames, part, request=None):
+    """Request the log from the current end of part, returns once the whole log is received and verified.
+    request (a query) is sent first, to have the drone send its result instead"""
+    await client.start_notify(drone_transmit_uuid, lambda _, data: frames.put_nowait(bytes(data)))
+
+    if request:
+        await client.write_gatt_char(drone_control_uuid, request, response=True)
+    offset = part.tell()
+    await client.write_gatt_char(drone_control_uuid, struct.pack("<BI", ord("S"), offset), response=True)
+    await client.write_gatt_char(drone_control_uuid, struct.pack("<BH", ord("C"), credit_window), response=True)
+
+    size = None
+    unacked = 0
+    while True:
+        frame = await frames.get()
+        if frame is None:
+            raise TransferFailed("disconnected")
+        kind = chr(frame[0])
+
+        if kind == "H":
+            size, chunk = struct.unpack_from("<IH", frame, 1)
+            print(f"Receiving {size} bytes from offset {offset} ({chunk} byte chunks)")
+
+        elif kind == "D":
+            seq, frame_offset = struct.unpack_from("<HI", frame, 1)
+            if frame_offset != offset:
+                raise TransferFailed(f"expected offset {offset}, got {frame_offset} (frame {seq})")
+            payload = frame[7:]
+            part.write(payload)
+            offset += len(payload)
+
+            # Hand credits back in batches so the drone never stalls waiting for us
+            unacked += 1
+            if unacked >= credit_window // 2:
+                await client.write_gatt_char(drone_control_uuid, struct.pack("<BH", ord("C"), unacked), response=False)
+                unacked = 0
+            if size:
+                print(f"\r{offset}/{size} bytes", end="", flush=True)
+
+        elif kind == "E":
+            size, crc = struct.unpack_from("<II", frame, 1)
+            part.flush()
+            with open(part.name, "rb") as f:
+                received = f.read()
+            print()
+            if len(received) != size or zlib.crc32(received) != crc:
+                # Corrupt somewhere along the way, start over from scratch
+                part.seek(0)
+                part.truncate()
+                raise TransferFailed("checksum mismatch")
+            await client.write_gatt_char(drone_control_uuid, bytes([ord("A")]), response=True)
+            return received
+
+def decode_telemetry(frame):
+    """TelemetryFrame as a dict, in plain units, or None if it is not one this script knows"""
+    if len(frame) < struct.calcsize(telemetry_format) or frame[0] != telemetry_version:
+        return None
+    t = dict(zip(telemetry_fields, struct.unpack_from(telemetry_format, frame)))
+    t["margin"] /= 10
+    for key in ("scd4x_temp", "humd", "bmp3xx_temp"):
+        t[key] /= 100
+    return t
+
+def print_metrics(snapshot):
+    """Print a MetricsSnapshot as read from the drone"""
+    if len(snapshot) < 20 or snapshot[0] != metrics_version:
+        print("No metrics (compiled out, or a version this script does not know)")
+        return
+    _, sites, buckets, counters, tasks, uptime, heap_free, heap_min = struct.unpack_from("<BBBBB3xIII", snapshot)
+    print(f"Metrics at {uptime / 1000:.1f} s: heap {heap_free} bytes free, {heap_min} at least")
+    at = 20
+    site_format = f"<III{buckets}H"
+    for i in range(sites):
+        count, sum_us, max_us, *hist = struct.unpack_from(site_format, snapshot, at)
+        at += struct.calcsize(site_format)
+        if count:
+            hist = " ".join(f"<{metric_bucket_base_us << b}:{n}" for b, n in enumerate(hist) if n)
+            name = metric_sites[i] if i < len(metric_sites) else f"site {i}"
+            print(f"  {name:12s} {count:6d} x, avg {sum_us // count} us, max {max_us} us | {hist}")
+    for i, n in enumerate(struct.unpack_from(f"<{counters}I", snapshot, at)):
+        name = metric_counters[i] if i < len(metric_counters) else f"counter {i}"
+        print(f"  {name:16s} {n}")
+    at += 4 * counters
+    for i in range(tasks):
+        name, stack, stack_free = struct.unpack_from("<12sHH", snapshot, at + 16 * i)
+        print(f"  task {name.rstrip(bytes(1)).decode()}: {stack_free} of {stack} stack bytes never used")
+
+class TelemetryPlot:
+    """Rolling plot of the latest telemetry_window frames, drawn without blocking the event loop"""
+    panels = (("alt_cm", "Altitude (cm)"), ("co2", "CO2 (ppm)"), ("bmp3xx_temp", "Temperature (C)"), ("bat", "Battery (%)"))
+
+    def __init__(self):
+        import matplotlib.pyplot as plt
+        self.plt = plt
+        plt.ion()
+        self.fig, axes = plt.subplots(len(self.panels), 1, sharex=True)
+        self.axes = dict(zip((key for key, _ in self.panels), axes))
+        self.lines = {}
+        for key, label in self.panels:
+            self.axes[key].set_ylabel(label)
+            self.lines[key], = self.axes[key].plot([], [])
+        axes[-1].set_xlabel("Uptime (s)")
+        self.frames = []
+
+    def add(self, t):
+        self.frames = (self.frames + [t])[-telemetry_window:]
+        x = [f["uptime"] / 1000 for f in self.frames]
+        for key, _ in self.panels:
+            self.lines[key].set_data(x, [f[key] for f in self.frames])
+            self.axes[key].relim()
+            self.axes[key].autoscale_view()
+        self.fig.canvas.draw_idle()
+        self.fig.canvas.flush_events()
+
+async def watch(client, frames):
+    """Print (and plot) telemetry until the drone goes away"""
+    await client.start_notify(drone_telemetry_uuid, lambda _, data: frames.put_nowait(bytes(data)))
+    await client.write_gatt_char(drone_control_uuid, struct.pack("<BH", ord("T"), telemetry_period_ms), response=True)
+    try:
+        plot = TelemetryPlot()
+    except ImportError:
+        plot = None
+    last_seq = None
+    while True:
+        frame = await frames.get()
+        if frame is None:
+            raise TransferFailed("disconnected")
+        t = decode_telemetry(frame)
+        if t is None:
+            continue
+        missed = (t["seq"] - last_seq - 1) & 0xFFFF if last_seq is not None else 0
+        last_seq = t["seq"]
+        print(f"\r{t['uptime'] / 1000:8.1f} s  alt {t['alt_cm']:5d} cm  pos ({t['x_cm']}, {t['y_cm']}) cm  "
+              f"CO2 {t['co2']:5d} ppm  {t['bmp3xx_temp']:5.2f} C  {t['pres']} Pa  bat {t['bat']}% "
+              f"(margin {t['margin']:.1f}%)  state {t['tello_age_ms']} ms old" + (f"  {missed} missed" if missed else ""),
+              end="", flush=True)
+        if plot:
+            plot.add(t)
+
 async def main():
+    global macos_use_bdaddr
     if platform.system() == "Darwin":
         macos_use_bdaddr = True
 
-    print("Starting scan...", end=" ", flush=True)
+    if telemetry_live:
+        while True:
+            device = await BleakScanner.find_device_by_name(drone_name, cb=dict(use_bdaddr=macos_use_bdaddr))
+            if device is None:
+                print(f"Could not find device with name {drone_name}, retrying")
+                continue
+            frames = asyncio.Queue()
+            try:
+                async with BleakClient(device, disconnected_callback=lambda _: frames.put_nowait(None)) as client:
+                    print("Connected, watching telemetry")
+                    await watch(client, frames)
+            except Exception as e:
+                print(f"\nTelemetry interrupted ({e}), reconnecting")
 
-    device = await BleakScanner.find_device_by_name(
-        drone_name, cb=dict(use_bdaddr=macos_use_bdaddr)
-    )
-    if device is None:
-        print(f"Could not find device with name {drone_name}")
-        return
+    request = None
+    if query:
+        request = struct.pack("<BHBIIHB", ord("Q"), query["run"], query["key"], query["start"], query["end"],
+                              query["every"], query["streams"])
+    for path in ([query_path] if query else transfers):
+        part_path = path + ".part"
+        # A query is asked afresh, so its result cannot carry on from an earlier run of this script
+        with open(part_path, "wb+" if query else "ab+") as part:
+            while True:
+                print("Starting scan...", end=" ", flush=True)
+
+                device = await BleakScanner.find_device_by_name(
+                    drone_name, cb=dict(use_bdaddr=macos_use_bdaddr)
+                )
+                if device is None:
+                    print(f"Could not find device with name {drone_name}, retrying")
+                    continue
+
+                print("Connecting to device...", end=" ", flush=True)
+                frames = asyncio.Queue()
+                try:
+                    async with BleakClient(device, disconnected_callback=lambda _: frames.put_nowait(None)) as client:
+                        print("Connected!")
+                        if show_metrics:
+                            print_metrics(await client.read_gatt_char(drone_metrics_uuid))
+                        data = await offload(client, frames, part, request)
+                        # Only ask once, the drone keeps the result for a resumed transfer
+                        request = None
+                        print("Disconnecting...", end=" ", flush=True)
+                    break
+                except Exception as e:
+                    request = None if part.tell() else request
+                    print(f"\nTransfer interrupted ({e}), resuming from {part.tell()} bytes")
+
+        os.replace(part_path, path)
+        print("Disconnected")
+        # Both are binary, convert with decode_log and decode_voxels (see decode_log.cpp, decode_voxels.cpp)
+        print(f"Saved {len(data)} bytes to {path}")
 
-    print("Connecting to device...", end=" ", flush=True)
-
-    async with BleakClient(device) as client:
-        print("Connected!")
-
-        # Search through all BLE services and all their characteristics
-        await client.get_services()
-        for service in client.services:
-            print("Reading...", end="", flush=True)
-            for char in service.characteristics:
-                if char.uuid == drone_transmit_uuid:
-                    acq_data = False
-                    
-                    while not acq_data:
-                        if "read" in char.properties:
-                            try:
-                                # If this characteristic has values to read, read it and write it into "value"
-                                value = await client.read_gatt_char(char.uuid)
-                            except Exception as e:
-                                value = "Error: {e}"
-
-                        if not value:
-                            print(".", end="", flush=True)
-                        else:
-                            acq_data = True
-                            print()
-                            print(value.decode("utf-8"))
-                            with open("/Users/student/Documents/data.csv", "w") as text_file:
-                                text_file.write(f"{value.decode("utf-8")}")
-
-        print("Disconnecting...", end=" ", flush=True)
-    print("Disconnected")
-
-asyncio.run(main())
\ No newline at end of file
+asyncio.run(main())
@@ -0,0 +1,151 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Host-side tool to convert a binary sample log retrieved from the drone back into csv
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -I lib/sample_record -I lib/littlefs_io addl_resources/decode_log.cpp lib/sample_record/sample_record.cpp \
+ *       lib/littlefs_io/delta_codec.cpp -o decode_log
+ * Usage:
+ *   ./decode_log data.bin [prefix] [--from OFFSET]
+ * Each sensor stream goes to its own file, <prefix>_<stream>.csv (e.g. data_scd4x.csv, data_bmp3xx.csv, data_tello.csv).
+ * prefix defaults to the log's name without its extension.
+ * Both raw and delta encoded logs are understood. A delta encoded log carries on past a damaged part (such as a
+ * journal block that failed its checksum, which the drone sends as zeros) from the next sync marker. With --from,
+ * decoding starts at the first sync marker at or after OFFSET.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "sample_record.hpp"
+#include "delta_codec.hpp"
+
+int main(int argc, char **argv){
+    const char *in_path = NULL, *prefix_arg = NULL;
+    long from = -1;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--from") == 0 && i + 1 < argc){
+            from = strtol(argv[++i], NULL, 0);
+        }
+        else if(!in_path){
+            in_path = argv[i];
+        }
+        else{
+            prefix_arg = argv[i];
+        }
+    }
+    if(!in_path){
+        fprintf(stderr, "Usage: %s <log.bin> [prefix] [--from OFFSET]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(in_path, "rb");
+    if(!in){
+        perror(in_path);
+        return 1;
+    }
+
+    SampleLogHeader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || !sample_check_header(&hdr)){
+        fprintf(stderr, "%s: not a schema %d sample log\n", in_path, SAMPLE_SCHEMA_ID);
+        return 1;
+    }
+
+    /* Logs are at most a flash partition, just read the whole thing */
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0){
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    std::string prefix = prefix_arg ? prefix_arg : in_path;
+    if(!prefix_arg && prefix.rfind('.') != std::string::npos && prefix.rfind('.') > prefix.rfind('/') + 1){
+        prefix.erase(prefix.rfind('.'));
+    }
+
+    /* pos indexes data, which starts sizeof(hdr) into the file */
+    size_t pos = 0;
+    if(from > (long)sizeof(hdr)){
+        if(hdr.encoding != SAMPLE_ENCODING_DELTA){
+            fprintf(stderr, "%s: --from needs a delta encoded log\n", in_path);
+            return 1;
+        }
+        pos = from - sizeof(hdr);
+        long sync = pos < data.size() ? DeltaDecoder::findSync(data.data() + pos, data.size() - pos, from) : -1;
+        if(sync < 0){
+            fprintf(stderr, "%s: no sync marker after offset %ld\n", in_path, from);
+            return 1;
+        }
+        pos += sync;
+        fprintf(stderr, "Decoding from the sync marker at offset %lu\n", (unsigned long)(pos + sizeof(hdr)));
+    }
+
+    /* Output files are only created for streams that appear in the log */
+    FILE *out[SAMPLE_NUM_STREAMS] = {NULL};
+    unsigned long counts[SAMPLE_NUM_STREAMS] = {0};
+    DeltaDecoder decoder;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    char line[256];
+    while(pos < data.size()){
+        unsigned long offset = pos + sizeof(hdr);
+        size_t len;
+        int used;
+        if(hdr.encoding == SAMPLE_ENCODING_DELTA){
+            used = decoder.decode(data.data() + pos, data.size() - pos, offset, rec, &len);
+        }
+        else{
+            len = sample_record_size(data[pos]);
+            used = len == 0 ? -1 : pos + len <= data.size() ? (int)len : 0;
+            if(used > 0){
+                memcpy(rec, data.data() + pos, len);
+            }
+        }
+        if(used < 0){
+            long sync = hdr.encoding == SAMPLE_ENCODING_DELTA ?
+                        DeltaDecoder::findSync(data.data() + pos + 1, data.size() - pos - 1, offset + 1) : -1;
+            if(sync < 0){
+                fprintf(stderr, "%s: corrupt record at offset %lu, stopping (see --from)\n", in_path, offset);
+                break;
+            }
+            pos += 1 + sync;
+            fprintf(stderr, "%s: corrupt record at offset %lu, skipped to the sync marker at %lu\n", in_path, offset,
+                    (unsigned long)(pos + sizeof(hdr)));
+            decoder.reset();
+            continue;
+        }
+        if(used == 0){
+            fprintf(stderr, "%s: log ends part way through a record at offset %lu\n", in_path, offset);
+            break;
+        }
+        pos += used;
+        if(len == 0){
+            continue;
+        }
+
+        uint8_t c = rec[0];
+        if(out[c] == NULL){
+            std::string path = prefix + "_" + sample_stream_name(c) + ".csv";
+            out[c] = fopen(path.c_str(), "w");
+            if(!out[c]){
+                perror(path.c_str());
+                return 1;
+            }
+            fprintf(out[c], "%s\n", sample_csv_header(c));
+        }
+        sample_format_csv(rec, line, sizeof(line));
+        fprintf(out[c], "%s\n", line);
+        counts[c]++;
+    }
+
+    for(int s = 0; s < SAMPLE_NUM_STREAMS; ++s){
+        if(out[s]){
+            fprintf(stderr, "Decoded %lu %s samples into %s_%s.csv\n", counts[s], sample_stream_name(s), prefix.c_str(), sample_stream_name(s));
+            fclose(out[s]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Host-side tool to convert the voxel map retrieved from the drone into csv
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -I lib/voxel_map -I lib/hal addl_resources/decode_voxels.cpp -o decode_voxels
+ * Usage:
+ *   ./decode_voxels voxels.bin [out.csv] [--at X Y Z]
+ * Writes one row per visited cube, with the position of its centre in m relative to the takeoff point
+ * (x along the heading at takeoff, y to its right, z up). out.csv defaults to the map's name with .csv.
+ * --at looks up the cube containing the point X Y Z (in m) instead, by binary search of the sorted cells.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "voxel_map.hpp"
+
+static bool cell_less(const VoxelCellRecord &c, int16_t x, int16_t y, int16_t z){
+    if(c.z != z){
+        return c.z < z;
+    }
+    if(c.y != y){
+        return c.y < y;
+    }
+    return c.x < x;
+}
+
+int main(int argc, char **argv){
+    const char *in_path = NULL, *out_arg = NULL;
+    bool lookup = false;
+    float at[3] = {0, 0, 0};
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--at") == 0 && i + 3 < argc){
+            lookup = true;
+            for(int k = 0; k < 3; ++k){
+                at[k] = atof(argv[++i]);
+            }
+        }
+        else if(!in_path){
+            in_path = argv[i];
+        }
+        else{
+            out_arg = argv[i];
+        }
+    }
+    if(!in_path){
+        fprintf(stderr, "Usage: %s <voxels.bin> [out.csv] [--at X Y Z]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(in_path, "rb");
+    if(!in){
+        perror(in_path);
+        return 1;
+    }
+    VoxelFileHeader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != VOXEL_FILE_MAGIC || hdr.version != VOXEL_FILE_VERSION){
+        fprintf(stderr, "%s: not a version %d voxel map\n", in_path, VOXEL_FILE_VERSION);
+        return 1;
+    }
+    std::vector<VoxelCellRecord> cells(hdr.count);
+    if(hdr.count && fread(cells.data(), sizeof(VoxelCellRecord), hdr.count, in) != hdr.count){
+        fprintf(stderr, "%s: map ends early\n", in_path);
+        return 1;
+    }
+    fclose(in);
+    float cell_m = hdr.cell_cm / 100.0f;
+
+    if(lookup){
+        int16_t x = (int16_t)floorf(at[0] / cell_m), y = (int16_t)floorf(at[1] / cell_m), z = (int16_t)floorf(at[2] / cell_m);
+        size_t lo = 0, hi = cells.size();
+        while(lo < hi){
+            size_t mid = (lo + hi) / 2;
+            if(cell_less(cells[mid], x, y, z)){
+                lo = mid + 1;
+            }
+            else{
+                hi = mid;
+            }
+        }
+        if(lo == cells.size() || cells[lo].x != x || cells[lo].y != y || cells[lo].z != z){
+            printf("No readings in the cube at (%d, %d, %d)\n", x, y, z);
+            return 1;
+        }
+        const VoxelCellRecord &c = cells[lo];
+        printf("Cube (%d, %d, %d): CO2 mean %u ppm, max %u ppm over %u readings; temperature mean %.2f C over %u readings\n",
+               x, y, z, c.co2_mean, c.co2_max, c.co2_n, c.temp_mean / 100.0f, c.temp_n);
+        return 0;
+    }
+
+    std::string out_path = out_arg ? out_arg : in_path;
+    if(!out_arg){
+        size_t dot = out_path.rfind('.');
+        if(dot != std::string::npos && (out_path.rfind('/') == std::string::npos || dot > out_path.rfind('/'))){
+            out_path.erase(dot);
+        }
+        out_path += ".csv";
+    }
+    FILE *out = fopen(out_path.c_str(), "w");
+    if(!out){
+        perror(out_path.c_str());
+        return 1;
+    }
+    fprintf(out, "x (m),y (m),z (m),CO2 Readings,CO2 Mean (ppm),CO2 Max (ppm),Temperature Readings,Temperature Mean (C)\n");
+    for(const VoxelCellRecord &c : cells){
+        fprintf(out, "%.2f,%.2f,%.2f,%u,", (c.x + 0.5f) * cell_m, (c.y + 0.5f) * cell_m, (c.z + 0.5f) * cell_m, c.co2_n);
+        if(c.co2_n){
+            fprintf(out, "%u,%u,", c.co2_mean, c.co2_max);
+        }
+        else{
+            fprintf(out, ",,");
+        }
+        fprintf(out, "%u,", c.temp_n);
+        if(c.temp_n){
+            fprintf(out, "%.2f", c.temp_mean / 100.0f);
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+    fprintf(stderr, "Decoded %u cubes of %u cm into %s, %u readings were dropped on the drone\n", hdr.count, hdr.cell_cm,
+            out_path.c_str(), hdr.dropped);
+    return 0;
+}
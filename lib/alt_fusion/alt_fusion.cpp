@@ -0,0 +1,117 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the fused altitude estimator
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include "alt_fusion.hpp"
+
+void AltitudeFusion::reset(){
+    z = v = 0;
+    p[0][0] = p[1][1] = 1;
+    p[0][1] = p[1][0] = 0;
+    last_ms = 0;
+    ref_pres = ref_baro = 0;
+    ref_tof = config.tof_min_cm;
+    ground_samples = 0;
+    have_pres = have_baro = false;
+    tof_used = tof_rejected = 0;
+    estimate = AltitudeEstimate();
+}
+
+/* Constant velocity model, acceleration is white noise */
+void AltitudeFusion::predict(float dt){
+    float q = config.accel_std * config.accel_std;
+    z += v * dt;
+    p[0][0] += dt * (2 * p[0][1] + dt * p[1][1]) + q * dt * dt * dt / 3;
+    p[0][1] += dt * p[1][1] + q * dt * dt / 2;
+    p[1][0] = p[0][1];
+    p[1][1] += q * dt;
+}
+
+/* Fold in a direct altitude measurement with variance var. With gate > 0, measurements more than gate
+ * standard deviations from the prediction are ignored. Returns false if the measurement was gated out */
+bool AltitudeFusion::update(float meas, float var, float gate){
+    float y = meas - z;
+    float s = p[0][0] + var;
+    if(gate > 0 && y * y > gate * gate * s){
+        return false;
+    }
+    float k0 = p[0][0] / s;
+    float k1 = p[1][0] / s;
+    z += k0 * y;
+    v += k1 * y;
+    float p00 = p[0][0], p01 = p[0][1];
+    p[0][0] -= k0 * p00;
+    p[0][1] -= k0 * p01;
+    p[1][0] = p[0][1];
+    p[1][1] -= k1 * p01;
+    return true;
+}
+
+/* On the ground: move the references towards the current readings and hold the estimate at 0 */
+void AltitudeFusion::track_ground(const AltitudeInputs& in){
+    float a = config.ground_alpha;
+    if(in.bmp){
+        ref_pres = have_pres ? ref_pres + a * (in.pres_pa - ref_pres) : in.pres_pa;
+        have_pres = true;
+        ground_samples++;
+    }
+    if(in.tello){
+        ref_baro = have_baro ? ref_baro + a * (in.baro - ref_baro) : in.baro;
+        have_baro = true;
+        ref_tof += a * (in.tof_cm - ref_tof);
+    }
+    z = v = 0;
+    p[0][0] = p[1][1] = 1;
+    p[0][1] = p[1][0] = 0;
+}
+
+const AltitudeEstimate& AltitudeFusion::step(uint32_t now_ms, const AltitudeInputs& in){
+    if(in.tello){
+        estimate.grounded = in.h_cm == 0 && in.tof_cm <= config.tof_min_cm;
+    }
+
+    if(estimate.grounded){
+        track_ground(in);
+    }
+    else{
+        /* A step that comes late still predicts the right distance, but don't extrapolate across a stall */
+        float dt = estimate.seq ? (now_ms - last_ms) / 1000.0f : 0;
+        predict(dt > 0.5f ? 0.5f : dt);
+
+        if(in.bmp){
+            if(!have_pres){
+                /* Never saw the ground, the best we can do is take off from here */
+                ref_pres = in.pres_pa;
+                have_pres = true;
+            }
+            float alt = 4433000.0f * (1.0f - powf(in.pres_pa / ref_pres, 0.1903f));
+            update(alt, config.bmp_std_cm * config.bmp_std_cm, 0);
+        }
+        if(in.tello){
+            if(!have_baro){
+                ref_baro = in.baro;
+                have_baro = true;
+            }
+            update((in.baro - ref_baro) * config.baro_cm_per_unit, config.baro_std_cm * config.baro_std_cm, 0);
+            if(in.tof_cm > config.tof_min_cm && in.tof_cm <= config.tof_max_cm){
+                if(update(in.tof_cm - ref_tof, config.tof_std_cm * config.tof_std_cm, config.tof_gate)){
+                    tof_used++;
+                }
+                else{
+                    tof_rejected++;
+                }
+            }
+        }
+    }
+
+    last_ms = now_ms;
+    estimate.uptime = now_ms;
+    estimate.alt_cm = z;
+    estimate.vz_cms = v;
+    estimate.alt_std_cm = sqrtf(p[0][0]);
+    estimate.calibrated = ground_samples >= ALT_FUSION_GROUND_SAMPLES;
+    estimate.seq++;
+    return estimate;
+}
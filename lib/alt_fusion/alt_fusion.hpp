@@ -0,0 +1,90 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the altitude estimator that fuses the Tello's ToF and barometer with the BMP3xx
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A two-state (altitude, vertical velocity) Kalman filter in single precision, stepped at a fixed rate.
+ * Each step predicts with a constant velocity model, then folds in whichever readings are new:
+ *   - BMP3xx pressure, turned into height with the pressure at the takeoff point as the reference
+ *   - Tello barometer, relative to its reading at the takeoff point
+ *   - Tello ToF, the most precise but it sees the ground rather than the takeoff point, so readings
+ *     far from the estimate (terrain, out of range) are gated out
+ * While the drone is on the ground the estimate is pinned to 0 and the references track the readings,
+ * so the baro references are calibrated at takeoff rather than against a fixed sea-level pressure.
+ * Altitudes are in cm above the takeoff point.
+*/
+
+#ifndef ALT_FUSION_HPP
+#define ALT_FUSION_HPP
+
+#include <stdint.h>
+
+#define ALT_FUSION_PERIOD_MS 20 /* 50 Hz, the BMP3xx's output data rate */
+#define ALT_FUSION_BUDGET_US 500 /* Longest a step may take on the ESP32 before it counts as over budget */
+#define ALT_FUSION_GROUND_SAMPLES 25 /* Ground readings before the references count as calibrated */
+
+class AltitudeFusionConfig{
+    public:
+        float accel_std = 200;    /* Unmodelled vertical acceleration, in cm/s^2 rms */
+        float bmp_std_cm = 30;    /* BMP3xx altitude noise */
+        float baro_std_cm = 60;   /* Tello barometer noise */
+        float tof_std_cm = 3;     /* Tello ToF noise */
+        float tof_gate = 4;       /* ToF readings further than this many standard deviations from the estimate are ignored */
+        int tof_min_cm = 10;      /* The Tello reports this when the ToF sees nothing (or the ground right below it) */
+        int tof_max_cm = 500;     /* ToF readings above this are not trusted */
+        /* The SDK documents baro in cm, but its readings move about 1 per metre of climb (so does the simulator's) */
+        float baro_cm_per_unit = 100;
+        float ground_alpha = 0.02f; /* Weight of each new ground reading in the references, about 1 s at 50 Hz */
+};
+
+/* Readings that arrived since the last step */
+class AltitudeInputs{
+    public:
+        bool bmp = false;   /* pres_pa is new */
+        float pres_pa = 0;
+        bool tello = false; /* tof_cm, h_cm and baro are from a new state packet */
+        int tof_cm = 0;
+        int h_cm = 0;
+        float baro = 0;
+};
+
+/* What the filter publishes every step */
+class AltitudeEstimate{
+    public:
+        uint32_t uptime = 0; /* When the step ran, in ms */
+        float alt_cm = 0;    /* Above the takeoff point */
+        float vz_cms = 0;    /* Positive upwards */
+        float alt_std_cm = 0;
+        bool grounded = true;
+        bool calibrated = false; /* The references have seen ALT_FUSION_GROUND_SAMPLES ground readings */
+        uint32_t seq = 0;     /* Steps since reset, 0 = no estimate yet */
+};
+
+class AltitudeFusion{
+    public:
+        AltitudeFusion() { reset(); }
+        /* Forget the state and the references */
+        void reset();
+        /* Advance the filter to now_ms, fold in the new readings and return the new estimate */
+        const AltitudeEstimate& step(uint32_t now_ms, const AltitudeInputs& in);
+
+        AltitudeFusionConfig config;
+        AltitudeEstimate estimate;
+
+        /* Statistics since reset() */
+        uint32_t tof_used, tof_rejected;
+
+    private:
+        float z, v;     /* State */
+        float p[2][2];  /* State covariance */
+        uint32_t last_ms;
+
+        float ref_pres, ref_baro, ref_tof;
+        uint32_t ground_samples;
+        bool have_pres, have_baro;
+
+        void predict(float dt);
+        bool update(float meas, float var, float gate);
+        void track_ground(const AltitudeInputs& in);
+};
+
+#endif // ALT_FUSION_HPP
@@ -5,26 +5,109 @@
  */ 
 
 #include "ble_comms.hpp"
+#include "hal.hpp"
+#include "crc32.hpp"
+#include "log_writer.hpp"
+#include "log_journal.hpp"
 
+BLEServer *pServer;
 BLECharacteristic *pCharacteristic;
+BLECharacteristic *pTelemetry;
+BLE2902 *pTelemetryCccd; /* Says whether the client subscribed to telemetry */
 bool deviceConnected = false;
 
+/* Transfer requests and connection changes, passed from the BLE stack's task to the sender */
+struct BleXferEvent{
+  char type; /* BLE_XFER_START/CREDIT/ACK/QUERY, or 'X' for disconnect */
+  uint32_t arg; /* Length of the request for a query */
+};
+static QueueHandle_t xferEvents = NULL;
+/* Latest query request, written on the BLE stack's task before its event is queued */
+static uint8_t queryReq[BLE_XFER_QUERY_MAX];
+static size_t queryLen = 0;
+static bool queryPending = false;
+
+/* Telemetry, see startTelemetryOverBLE() */
+static TelemetrySource telemetrySource = NULL;
+static void *telemetryCtx = NULL;
+static volatile uint32_t telemetryPeriod = 0; /* ms, 0 when stopped. Set by the client with 'T' */
+
+static MetricsSource metricsSource = NULL;
+
 void EcoDroneBLECallbacks::onConnect(BLEServer* pServer) {
     deviceConnected = true;
-    
-    if(drone_ctrl_t != NULL){
-      xTaskNotifyGive(drone_ctrl_t);
-    }
 };
 
+/* Called alongside the one above, with the client's address */
+void EcoDroneBLECallbacks::onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t *param) {
+  /* Longest link-layer packets and, with BLE 5, the 2M PHY: a telemetry frame or a data frame then goes in one
+   * packet at twice the bit rate, so BLE holds the radio for a fraction of the time it shares with Wi-Fi.
+   * The client may refuse either, the link then stays as it was */
+  esp_ble_gap_set_pkt_data_len(param->connect.remote_bda, BLE_DATA_LEN);
+#ifdef BLE_50_FEATURE_SUPPORT
+  esp_ble_gap_set_prefered_phy(param->connect.remote_bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                               ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+  pServer->updateConnParams(param->connect.remote_bda, BLE_CONN_MIN_INTERVAL, BLE_CONN_MAX_INTERVAL, 0, BLE_CONN_TIMEOUT);
+}
+
 void EcoDroneBLECallbacks::onDisconnect(BLEServer* pServer) {
   deviceConnected = false;
+
+  /* Let the client reconnect and resume */
+  BleXferEvent ev = {'X', 0};
+  xQueueSend(xferEvents, &ev, 0);
+  pServer->startAdvertising();
+}
+
+void EcoDroneControlCallbacks::onWrite(BLECharacteristic* pChar) {
+  uint8_t *data = pChar->getData();
+  size_t len = pChar->getLength();
+  BleXferEvent ev = {0, 0};
+
+  if (len >= 5 && data[0] == BLE_XFER_START) {
+    ev.type = BLE_XFER_START;
+    memcpy(&ev.arg, data + 1, 4);
+  } else if (len >= 3 && data[0] == BLE_XFER_CREDIT) {
+    uint16_t credits;
+    memcpy(&credits, data + 1, 2);
+    ev.type = BLE_XFER_CREDIT;
+    ev.arg = credits;
+  } else if (len >= 1 && data[0] == BLE_XFER_ACK) {
+    ev.type = BLE_XFER_ACK;
+  } else if (len >= 3 && data[0] == BLE_XFER_TELEMETRY) {
+    /* Only the telemetry task reads it, nothing to queue */
+    uint16_t period;
+    memcpy(&period, data + 1, 2);
+    telemetryPeriod = period;
+    return;
+  } else if (len >= 1 && len <= BLE_XFER_QUERY_MAX && data[0] == BLE_XFER_QUERY) {
+    memcpy(queryReq, data, len);
+    ev.type = BLE_XFER_QUERY;
+    ev.arg = len;
+  } else {
+    Serial.println("BLE: ignoring malformed transfer request");
+    return;
+  }
+  xQueueSend(xferEvents, &ev, 0);
+}
+
+/* Runs on the BLE stack's task before the read is answered, so each read gets a snapshot of its own */
+void EcoDroneMetricsCallbacks::onRead(BLECharacteristic* pChar) {
+  static uint8_t snapshot[BLE_METRICS_MAX];
+  MetricsSource source = metricsSource;
+  size_t len = source ? source(snapshot, sizeof(snapshot)) : 0;
+  pChar->setValue(snapshot, len);
 }
 
 /* Initialise BLE server, start advertising connection  */
 void initBLE(String name) {
+  if (pServer != NULL) {
+    return;
+  }
   BLEDevice::init(name.c_str());
-  BLEServer *pServer = BLEDevice::createServer();
+  BLEDevice::setMTU(BLE_XFER_MTU);
+  pServer = BLEDevice::createServer();
   pServer->setCallbacks(new EcoDroneBLECallbacks());
 
   // Create BLE Service
@@ -36,6 +119,32 @@ void initBLE(String name) {
                       BLECharacteristic::PROPERTY_READ   |
                       BLECharacteristic::PROPERTY_NOTIFY
                     );
+  pCharacteristic->addDescriptor(new BLE2902());
+
+  // Create BLE Characteristic for transfer requests
+  BLECharacteristic *pControl = pService->createCharacteristic(
+                      CONTROL_UUID,
+                      BLECharacteristic::PROPERTY_WRITE
+                    );
+  pControl->setCallbacks(new EcoDroneControlCallbacks());
+
+  // Create BLE Characteristic for in-flight telemetry
+  pTelemetry = pService->createCharacteristic(
+                      TELEMETRY_UUID,
+                      BLECharacteristic::PROPERTY_NOTIFY
+                    );
+  pTelemetryCccd = new BLE2902();
+  pTelemetry->addDescriptor(pTelemetryCccd);
+
+  // Create BLE Characteristic for runtime metrics
+  BLECharacteristic *pMetrics = pService->createCharacteristic(
+                      METRICS_UUID,
+                      BLECharacteristic::PROPERTY_READ
+                    );
+  pMetrics->setCallbacks(new EcoDroneMetricsCallbacks());
+  if (xferEvents == NULL) {
+    xferEvents = xQueueCreate(16, sizeof(BleXferEvent));
+  }
 
   // Start service
   pService->start();
@@ -47,6 +156,10 @@ void initBLE(String name) {
   Serial.println("Advertising started. Waiting for client connection...");
 }
 
+boolean bleConnected(){
+    return deviceConnected;
+}
+
 /* Write msg data to the BLE server's characteristic */
 boolean writeData(String msg){
     if (deviceConnected) {
@@ -55,4 +168,190 @@ boolean writeData(String msg){
         Serial.println("Notified value: \n" + msg);
     }
     return deviceConnected;
-}
\ No newline at end of file
+}
+
+/* Notify one transfer frame, returns false if the client went away */
+static boolean notifyFrame(uint8_t *frame, size_t len){
+    if (!deviceConnected) {
+        return false;
+    }
+    pCharacteristic->setValue(frame, len);
+    pCharacteristic->notify();
+    return true;
+}
+
+/* Stream what reader has open to the client with the chunked transfer protocol (see ble_comms.hpp).
+ * Reader is a FileChunkReader or LogJournalReader whose arena is frame, behind the frame header.
+ * Keeps serving requests across disconnects, so the client can resume from the last offset it has.
+ * Returns true once the client acknowledges the whole transfer. */
+template <typename Reader>
+static boolean streamOverBLE(Reader &reader, uint8_t *frame, size_t frame_size, const char *name){
+    const uint32_t size = reader.size();
+    const uint8_t *data;
+    uint32_t offset = 0;
+    uint32_t crc = 0;
+    uint32_t credits = 0;
+    uint16_t seq = 0;
+    size_t chunk = 0;
+    bool streaming = false;
+    bool ended = false;
+    BleXferEvent ev;
+
+    while (1) {
+        /* Only block when there is nothing we are allowed to send */
+        bool canSend = streaming && credits > 0 && offset < size;
+        if (xQueueReceive(xferEvents, &ev, canSend ? 0 : portMAX_DELAY) == pdTRUE) {
+            switch (ev.type) {
+                case BLE_XFER_START: {
+                    /* Checksum covers the whole file, so catch up on the part the client already has */
+                    offset = min(ev.arg, size);
+                    crc = 0;
+                    reader.setChunkSize(frame_size);
+                    reader.seek(0);
+                    size_t n;
+                    while ((n = reader.next(&data, offset - reader.position())) > 0) {
+                        crc = crc32_update(crc, data, n);
+                    }
+                    reader.seek(offset);
+
+                    /* Each data frame has to fit in one notification at the negotiated MTU */
+                    size_t mtu = pServer->getPeerMTU(pServer->getConnId());
+                    chunk = min(frame_size, mtu - 3) - BLE_XFER_DATA_HDR_LEN;
+                    reader.setChunkSize(chunk);
+                    seq = 0;
+                    credits = 0;
+                    streaming = true;
+                    ended = false;
+                    Serial.printf("BLE: sending %s from offset %u in %u byte chunks\n", name, offset, chunk);
+
+                    frame[0] = BLE_XFER_HEADER;
+                    memcpy(frame + 1, &size, 4);
+                    uint16_t chunk16 = chunk;
+                    memcpy(frame + 5, &chunk16, 2);
+                    notifyFrame(frame, 7);
+                    break;
+                }
+                case BLE_XFER_CREDIT:
+                    credits += ev.arg;
+                    break;
+                case BLE_XFER_ACK:
+                    if (streaming && offset == size) {
+                        reader.close();
+                        return true;
+                    }
+                    break;
+                case BLE_XFER_QUERY:
+                    /* The client wants something else, leave it for waitQueryOverBLE() */
+                    queryLen = ev.arg;
+                    queryPending = true;
+                    reader.close();
+                    return false;
+                default:
+                    /* Disconnected, wait for the client to come back with a new start offset */
+                    streaming = false;
+                    credits = 0;
+                    break;
+            }
+        } else {
+            size_t n = reader.next(&data);
+            frame[0] = BLE_XFER_DATA;
+            memcpy(frame + 1, &seq, 2);
+            memcpy(frame + 3, &offset, 4);
+            if (n == 0 || !notifyFrame(frame, BLE_XFER_DATA_HDR_LEN + n)) {
+                /* Stop until the client asks again */
+                streaming = false;
+                continue;
+            }
+            crc = crc32_update(crc, data, n);
+            offset += n;
+            seq++;
+            credits--;
+        }
+
+        /* Finish with the checksum once the last byte is out (straight away if resuming at the end) */
+        if (streaming && !ended && offset == size) {
+            frame[0] = BLE_XFER_END;
+            memcpy(frame + 1, &size, 4);
+            memcpy(frame + 5, &crc, 4);
+            notifyFrame(frame, 9);
+            ended = true;
+        }
+    }
+}
+
+boolean sendFileOverBLE(const char *path){
+    /* Data frames are read straight into the frame buffer, behind the frame header */
+    uint8_t frame[BLE_XFER_MTU - 3];
+    FileChunkReader reader(frame + BLE_XFER_DATA_HDR_LEN, sizeof(frame) - BLE_XFER_DATA_HDR_LEN);
+    if (!reader.open(path)) {
+        return false;
+    }
+    return streamOverBLE(reader, frame, sizeof(frame), path);
+}
+
+boolean sendRunOverBLE(uint32_t run){
+    uint8_t frame[BLE_XFER_MTU - 3];
+    LogJournalReader reader(frame + BLE_XFER_DATA_HDR_LEN, sizeof(frame) - BLE_XFER_DATA_HDR_LEN);
+    if (!reader.open(run)) {
+        return false;
+    }
+    char name[LOG_PATH_LEN];
+    logSegmentPath(name, run, 0);
+    boolean done = streamOverBLE(reader, frame, sizeof(frame), name);
+    if (reader.badBlocks) {
+        Serial.printf("BLE: %u corrupt blocks of run %u sent as zeros\n", reader.badBlocks, run);
+    }
+    return done;
+}
+
+boolean bleQueryPending(){
+    return queryPending;
+}
+
+size_t waitQueryOverBLE(uint8_t *req, size_t cap){
+    BleXferEvent ev;
+    while (!queryPending) {
+        /* Anything else is left over from a transfer that has finished */
+        if (xQueueReceive(xferEvents, &ev, portMAX_DELAY) == pdTRUE && ev.type == BLE_XFER_QUERY) {
+            queryLen = ev.arg;
+            queryPending = true;
+        }
+    }
+    queryPending = false;
+    size_t len = min(queryLen, cap);
+    memcpy(req, queryReq, len);
+    return len;
+}
+
+/* Notifies the latest telemetry on its own schedule, whatever else the BLE server is doing. Frames go out on a
+ * fixed period rather than as values arrive, so a client that cannot keep up only ever sees the latest */
+static void telemetryTask(void *params){
+    uint8_t frame[BLE_TELEMETRY_MAX];
+    TickType_t wake = xTaskGetTickCount();
+    while (1) {
+        uint32_t period = telemetryPeriod;
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(period ? period : 1000));
+        if (!period || !deviceConnected || !pTelemetryCccd->getNotifications()) {
+            continue;
+        }
+        size_t n = telemetrySource(frame, sizeof(frame), telemetryCtx);
+        if (n > 0) {
+            pTelemetry->setValue(frame, n);
+            pTelemetry->notify();
+        }
+    }
+}
+
+boolean startTelemetryOverBLE(TelemetrySource source, void *ctx, uint32_t period_ms, unsigned priority, int core){
+    if (pServer == NULL || telemetrySource != NULL) {
+        return false;
+    }
+    telemetrySource = source;
+    telemetryCtx = ctx;
+    telemetryPeriod = period_ms;
+    return hal::task_create(telemetryTask, "ble_telemetry", 4096, NULL, priority, core) != NULL;
+}
+
+void serveMetricsOverBLE(MetricsSource source){
+    metricsSource = source;
+}
@@ -11,21 +11,90 @@
 #include <BLEDevice.h>
 #include <BLEServer.h>
 #include <BLEUtils.h>
+#include <BLE2902.h>
+#include <esp_gap_ble_api.h>
 
 // Drone UUID info
 #define SERVICE_UUID        "6e400001-b5a3-f393-e0a9-e50e24dcca9e"
 #define CHARACTERISTIC_UUID "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
+#define CONTROL_UUID        "6e400002-b5a3-f393-e0a9-e50e24dcca9e" /* Client writes transfer requests here */
+#define TELEMETRY_UUID      "6e400004-b5a3-f393-e0a9-e50e24dcca9e" /* In-flight telemetry frames are notified here */
+#define METRICS_UUID        "6e400005-b5a3-f393-e0a9-e50e24dcca9e" /* Read for a runtime metrics snapshot */
 
-/* FreeRTOS task handle to send drone connection status updates to */
-extern TaskHandle_t drone_ctrl_t;
+/* Chunked log transfer protocol, all fields little-endian
+ * Client -> drone, written to CONTROL_UUID:
+ *   'S' u32 offset    Start (or resume) sending the log from offset
+ *   'C' u16 credits   Allow the drone to send this many more data frames
+ *   'A'               Transfer complete and checksum verified
+ *   'Q' query         Range query of a log run, see sample_query.hpp. Ends any transfer in progress; the result
+ *                     is then sent as a transfer of its own, started with 'S' as usual
+ *   'T' u16 period    Notify telemetry every period ms from now on, 0 to stop
+ * Drone -> client, notified on CHARACTERISTIC_UUID:
+ *   'H' u32 size, u16 chunk           Sent in reply to 'S': log size and max payload per data frame
+ *   'D' u16 seq, u32 offset, payload  Data frame, consumes one credit. seq restarts at 0 on every 'S'
+ *   'E' u32 size, u32 crc32           All data sent, CRC-32 of the whole log (zlib.crc32)
+ *   telemetry frame                   On TELEMETRY_UUID, see telemetry.hpp. Independent of transfers
+ * Reading METRICS_UUID returns a snapshot of the runtime metrics (see metrics.hpp) taken for that read, at any time.
+ * Only one frame buffer is used regardless of the log size. */
+#define BLE_XFER_START  'S'
+#define BLE_XFER_CREDIT 'C'
+#define BLE_XFER_ACK    'A'
+#define BLE_XFER_QUERY  'Q'
+#define BLE_XFER_TELEMETRY 'T'
+#define BLE_XFER_HEADER 'H'
+#define BLE_XFER_DATA   'D'
+#define BLE_XFER_END    'E'
+#define BLE_XFER_DATA_HDR_LEN 7
+#define BLE_XFER_MTU 517 /* Largest ATT MTU we ask for, the client may negotiate less */
+#define BLE_XFER_QUERY_MAX 32 /* Longest query request kept */
+#define BLE_DATA_LEN 251 /* Link-layer payload asked for with data length extension, a whole frame per packet */
+/* Connection interval asked for, in 1.25 ms units. Short enough for telemetry at tens of Hz, long enough to leave
+ * the radio to the Tello's Wi-Fi link most of the time */
+#define BLE_CONN_MIN_INTERVAL 12 /* 15 ms */
+#define BLE_CONN_MAX_INTERVAL 24 /* 30 ms */
+#define BLE_CONN_TIMEOUT 400     /* 4 s, in 10 ms units */
+#define BLE_TELEMETRY_MAX 64 /* Largest telemetry frame */
+#define BLE_METRICS_MAX 512   /* Largest metrics snapshot, the most one attribute can hold */
+
+/* Builds the next telemetry frame into out (cap bytes), returns its length or 0 if there is nothing new to send */
+typedef size_t (*TelemetrySource)(uint8_t *out, size_t cap, void *ctx);
+/* Writes a metrics snapshot into out (cap bytes), returns its length */
+typedef size_t (*MetricsSource)(uint8_t *out, size_t cap);
 
 /* Create callbacks to notify server when device connects/disconnects */
 class EcoDroneBLECallbacks: public BLEServerCallbacks{
     void onConnect(BLEServer* pServer);
+    void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t *param);
     void onDisconnect(BLEServer* pServer);
 };
 
+/* Receive transfer requests written by the client */
+class EcoDroneControlCallbacks: public BLECharacteristicCallbacks{
+    void onWrite(BLECharacteristic* pChar);
+};
+
+/* Take a fresh metrics snapshot whenever the client reads it */
+class EcoDroneMetricsCallbacks: public BLECharacteristicCallbacks{
+    void onRead(BLECharacteristic* pChar);
+};
+
+/* Bring up the server and start advertising, once; later calls do nothing */
 void initBLE(String name);
+boolean bleConnected();
 boolean writeData(String msg);
+/* Send the file at path, or a journaled log run as the single log it was written as (see log_journal.hpp).
+ * Both return true once the client acknowledges the whole transfer, false if there is nothing to send */
+boolean sendFileOverBLE(const char *path);
+boolean sendRunOverBLE(uint32_t run);
+/* Whether a transfer ended early because the client sent a query */
+boolean bleQueryPending();
+/* Wait for the next query (or take the one that ended a transfer) and copy it to req, returns its length */
+size_t waitQueryOverBLE(uint8_t *req, size_t cap);
+
+/* Notify what source builds to a subscribed client every period_ms, from a task of its own. The client can change
+ * the period with 'T'. Call after initBLE(), and before flight so the mission can be watched live */
+boolean startTelemetryOverBLE(TelemetrySource source, void *ctx, uint32_t period_ms, unsigned priority, int core);
+/* Answer reads of METRICS_UUID with what source writes. Until it is called such reads return nothing */
+void serveMetricsOverBLE(MetricsSource source);
 
 #endif //BLE_COMMS_HPP
\ No newline at end of file
@@ -0,0 +1,23 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for CRC-32
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#include "crc32.hpp"
+
+/* Half-byte table keeps the footprint at 64 bytes while staying fast enough for flash/BLE rates */
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while(len--){
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+    }
+    return ~crc;
+}
@@ -0,0 +1,15 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for CRC-32 (IEEE 802.3, same as zlib/Python's zlib.crc32)
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#ifndef CRC32_HPP
+#define CRC32_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Continue a CRC over len more bytes. Start with crc = 0, chains like zlib.crc32(data, crc) */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+#endif // CRC32_HPP
@@ -0,0 +1,201 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the battery model and the mission budget
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include <string.h>
+#include "energy_model.hpp"
+#include "hal.hpp"
+
+#define VEL_CM_PER_UNIT 10 /* vgx/vgy are reported in dm/s, as in DeadReckonerConfig */
+#define MAX_GAP_S 2 /* Longer gaps between state packets only count this much, the manoeuvre in between is unknown */
+#define MIN_RATE 0.01f
+#define MAX_RATE 2.0f
+
+void EnergyModel::reset(){
+    for(int i = 0; i < ENERGY_NUM_MANOEUVRES; ++i){
+        rate[i] = config.prior_rate[i];
+        for(int j = 0; j < ENERGY_NUM_MANOEUVRES; ++j){
+            p[i][j] = i == j ? config.prior_std * config.prior_std : 0;
+        }
+        spent_s[i] = 0;
+    }
+    last_ms = 0;
+    last_bat = 0;
+    aligned = false;
+    estimate = EnergyEstimate();
+}
+
+/* One recursive least squares step: the time spent in each manoeuvre should explain the drop */
+void EnergyModel::fit(float dropped){
+    float px[ENERGY_NUM_MANOEUVRES];
+    float denom = config.drop_std * config.drop_std, predicted = 0;
+    for(int i = 0; i < ENERGY_NUM_MANOEUVRES; ++i){
+        px[i] = 0;
+        for(int j = 0; j < ENERGY_NUM_MANOEUVRES; ++j){
+            px[i] += p[i][j] * spent_s[j];
+        }
+        denom += spent_s[i] * px[i];
+        predicted += spent_s[i] * rate[i];
+    }
+    float err = dropped - predicted;
+    for(int i = 0; i < ENERGY_NUM_MANOEUVRES; ++i){
+        rate[i] += px[i] / denom * err;
+        rate[i] = rate[i] < MIN_RATE ? MIN_RATE : rate[i] > MAX_RATE ? MAX_RATE : rate[i];
+    }
+    for(int i = 0; i < ENERGY_NUM_MANOEUVRES; ++i){
+        for(int j = 0; j < ENERGY_NUM_MANOEUVRES; ++j){
+            p[i][j] = (p[i][j] - px[i] * px[j] / denom) / config.forget;
+        }
+    }
+    estimate.drops++;
+}
+
+const EnergyEstimate& EnergyModel::update(uint32_t uptime_ms, const TelloState& state, float vz_cms, bool grounded, const Position& pos){
+    float dt = estimate.seq ? (uptime_ms - last_ms) / 1000.0f : 0;
+    if(dt < 0 || dt > MAX_GAP_S){
+        dt = dt < 0 ? 0 : MAX_GAP_S;
+    }
+    last_ms = uptime_ms;
+
+    if(!grounded){
+        float h = sqrtf((float)(state.vgx * state.vgx + state.vgy * state.vgy)) * VEL_CM_PER_UNIT;
+        int m = fabsf(vz_cms) > config.climb_cms ? ENERGY_CLIMB : h > config.fly_cms ? ENERGY_FLY : ENERGY_HOVER;
+        spent_s[m] += dt;
+    }
+    if(estimate.seq && state.bat != last_bat){
+        /* The first drop in the air only marks where an interval starts, the battery was part way down a percent */
+        if(state.bat < last_bat && aligned && !grounded){
+            fit(last_bat - state.bat);
+        }
+        aligned = state.bat < last_bat && !grounded;
+        memset(spent_s, 0, sizeof(spent_s));
+    }
+    if(grounded){
+        aligned = false;
+    }
+    last_bat = state.bat;
+
+    EnergyEstimate& e = estimate;
+    e.uptime = uptime_ms;
+    e.bat = state.bat;
+    e.time = state.time;
+    memcpy(e.rate, rate, sizeof(rate));
+    float home_fly_s = sqrtf(pos.x_cm * pos.x_cm + pos.y_cm * pos.y_cm) / config.home_cms;
+    float home_climb_s = (pos.z_cm > 0 ? pos.z_cm : 0) / config.descend_cms;
+    e.home_pct = cost_pct(0, home_fly_s, home_climb_s);
+    e.home_s = home_fly_s + home_climb_s;
+    e.margin_pct = e.bat - e.home_pct - config.reserve_pct;
+    e.seq++;
+    return e;
+}
+
+float EnergyModel::cost_pct(float hover_s, float fly_s, float climb_s) const{
+    return hover_s * rate[ENERGY_HOVER] + fly_s * rate[ENERGY_FLY] + climb_s * rate[ENERGY_CLIMB];
+}
+
+/* Mission budget ------------------------------------------------------------------------------------------------------------- */
+
+void MissionBudget::leg_time(const RcWaypoint& a, const RcWaypoint& b, float speed, float* fly_s, float* climb_s){
+    float dx = b.x_cm - a.x_cm, dy = b.y_cm - a.y_cm, dz = b.z_cm - a.z_cm;
+    float horiz = sqrtf(dx * dx + dy * dy);
+    float len = sqrtf(horiz * horiz + dz * dz);
+    float t = len / (speed > 1 ? speed : 1);
+    /* Split by direction, the same way the model sorts manoeuvres */
+    *fly_s = len > 0 ? t * horiz / len : 0;
+    *climb_s = len > 0 ? t * fabsf(dz) / len : 0;
+}
+
+void MissionBudget::prepare(const RcPathFollower& path, uint8_t from){
+    if(path.num_points == 0){
+        return;
+    }
+    uint8_t last = path.num_points - 1;
+    rest_fly_s[last] = rest_climb_s[last] = 0;
+    for(int i = last - 1; i >= from; --i){
+        float fly, climb;
+        leg_time(path.points[i], path.points[i + 1], path.points[i + 1].speed_cms, &fly, &climb);
+        rest_fly_s[i] = rest_fly_s[i + 1] + fly;
+        rest_climb_s[i] = rest_climb_s[i + 1] + climb;
+    }
+}
+
+void MissionBudget::begin(const RcPathFollower& path){
+    prepare(path, 0);
+}
+
+/* Whether the drone can fly from pos through the rest of the path, home and down, and keep the reserve */
+bool MissionBudget::fits(const RcPathFollower& path, const Position& pos, const EnergyEstimate& est, float* margin_pct){
+    RcWaypoint here;
+    here.x_cm = pos.x_cm;
+    here.y_cm = pos.y_cm;
+    here.z_cm = pos.z_cm;
+    const RcWaypoint& next = path.points[path.leg];
+    const RcWaypoint& last = path.points[path.num_points - 1];
+    float fly, climb;
+    leg_time(here, next, next.speed_cms, &fly, &climb);
+    fly += rest_fly_s[path.leg];
+    climb += rest_climb_s[path.leg];
+    float home_fly = sqrtf(last.x_cm * last.x_cm + last.y_cm * last.y_cm) / config.home_cms;
+    float home_climb = (last.z_cm > 0 ? last.z_cm : 0) / config.descend_cms;
+    float total_s = fly + climb + home_fly + home_climb;
+    fly += home_fly;
+    climb += home_climb;
+
+    *margin_pct = est.bat - (fly * est.rate[ENERGY_FLY] + climb * est.rate[ENERGY_CLIMB]) - config.reserve_pct;
+    bool time_ok = config.max_flight_s == 0 || est.time + total_s <= config.max_flight_s;
+    return *margin_pct >= 0 && time_ok;
+}
+
+uint8_t MissionBudget::check(RcPathFollower& path, const Position& pos){
+    EnergyEstimate est;
+    energy.read(est);
+    if(est.seq == 0 || path.done()){
+        return 0;
+    }
+    checks++;
+    float margin;
+    bool ok = fits(path, pos, est, &margin);
+    if(margin < worst_margin_pct){
+        worst_margin_pct = margin;
+    }
+
+    /* Only when the path no longer fits: give up the waypoint whose detour costs the most, until it does.
+     * The last waypoint is where the path was meant to end up and is kept, the plan can test margin after it */
+    uint8_t n = 0;
+    while(!ok && path.num_points - path.leg > 1){
+        RcWaypoint here;
+        here.x_cm = pos.x_cm;
+        here.y_cm = pos.y_cm;
+        here.z_cm = pos.z_cm;
+        float best = -1;
+        uint8_t drop = path.leg;
+        for(uint8_t i = path.leg; i + 1 < path.num_points; ++i){
+            const RcWaypoint& prev = i == path.leg ? here : path.points[i - 1];
+            const RcWaypoint& to = path.points[i];
+            const RcWaypoint& next = path.points[i + 1];
+            float f1, c1, f2, c2, f3, c3;
+            leg_time(prev, to, to.speed_cms, &f1, &c1);
+            leg_time(to, next, next.speed_cms, &f2, &c2);
+            leg_time(prev, next, next.speed_cms, &f3, &c3);
+            float saving = (f1 + f2 - f3) * est.rate[ENERGY_FLY] + (c1 + c2 - c3) * est.rate[ENERGY_CLIMB];
+            if(saving > best){
+                best = saving;
+                drop = i;
+            }
+        }
+        hal::log("Mission budget: %.1f%% short, dropping waypoint (%.0f, %.0f, %.0f)\n", -margin,
+                 path.points[drop].x_cm, path.points[drop].y_cm, path.points[drop].z_cm);
+        path.drop(drop);
+        n++;
+        dropped++;
+        prepare(path, path.leg);
+        ok = fits(path, pos, est, &margin);
+    }
+    return n;
+}
+
+void MissionBudget::hook(RcPathFollower& path, const TelloStateSnapshot& /*snap*/, const Position& pos, void* ctx){
+    ((MissionBudget*)ctx)->check(path, pos);
+}
@@ -0,0 +1,116 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the battery model and the mission budget that keeps a reserve to get home
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * EnergyModel learns how fast the battery drains while hovering, flying and climbing. The Tello only
+ * reports bat in whole percent, so every time it drops the time spent in each manoeuvre since the last
+ * drop becomes one equation, (hover s, fly s, climb s) . rates = % dropped, folded into a 3-parameter
+ * recursive least squares fit that forgets old intervals, so the rates follow the battery as it sags.
+ * Each state packet costs a fixed amount of work, and from the rates the model estimates what
+ * returning to the takeoff point and landing would take from where the drone is.
+ *
+ * MissionBudget uses that to keep an rc path (lib/rc_ctrl) affordable: on every state packet it checks,
+ * in constant time from sums prepared when the path starts, that finishing the path, flying home and
+ * landing still leaves the reserve. If not, it drops the waypoint whose removal saves the most until the
+ * rest fits, keeping as many sampling points as the battery allows. The path's last waypoint is always kept.
+ * Each drop rescans and re-sums the n waypoints left, so a packet that has to drop them all costs O(n^2),
+ * with n at most RC_PATH_MAX_POINTS.
+*/
+
+#ifndef ENERGY_MODEL_HPP
+#define ENERGY_MODEL_HPP
+
+#include <stdint.h>
+#include "seq_latch.hpp"
+#include "tello_ctrl.hpp"
+#include "voxel_map.hpp"
+#include "rc_ctrl.hpp"
+
+enum EnergyManoeuvre{
+    ENERGY_HOVER, ENERGY_FLY, ENERGY_CLIMB,
+    ENERGY_NUM_MANOEUVRES
+};
+
+class EnergyModelConfig{
+    public:
+        /* Starting rates in %/s, roughly a 13 minute hover on a full battery */
+        float prior_rate[ENERGY_NUM_MANOEUVRES] = {0.125f, 0.14f, 0.2f};
+        float prior_std = 0.05f;    /* How far off the starting rates may be, %/s */
+        float drop_std = 0.5f;      /* Noise of each reported drop, bat is rounded to whole percent */
+        float forget = 0.97f;       /* Weight kept by the fit at each new drop, about 30 drops of memory */
+        float fly_cms = 20;         /* Horizontal speed above which the drone counts as flying */
+        float climb_cms = 15;       /* Vertical speed above which it counts as climbing (or descending) */
+        float home_cms = 50;        /* Speed it flies home at */
+        float descend_cms = 50;     /* and lands at */
+        float reserve_pct = 10;     /* Battery to have left once landed */
+        uint32_t max_flight_s = 0;  /* Motor time the flight must fit in, 0 for no limit */
+};
+
+/* What the model publishes on every state packet */
+class EnergyEstimate{
+    public:
+        uint32_t uptime = 0;
+        int bat = 0;                /* Last reported, % */
+        int time = 0;               /* Last reported motor time, s */
+        float rate[ENERGY_NUM_MANOEUVRES] = {0}; /* %/s */
+        float home_pct = 0;         /* To fly home and land from the last position */
+        float home_s = 0;
+        float margin_pct = 0;       /* bat - home_pct - reserve, what the mission may still spend */
+        uint32_t drops = 0;         /* Battery drops the rates were fitted to */
+        uint32_t seq = 0;           /* 0 = no state packet yet */
+};
+
+class EnergyModel{
+    public:
+        EnergyModel() { reset(); }
+        void reset();
+        /* Fold in a state packet: its time, the fused vertical speed and the position it left the drone at.
+         * Constant time, never blocks */
+        const EnergyEstimate& update(uint32_t uptime_ms, const TelloState& state, float vz_cms, bool grounded, const Position& pos);
+        /* Battery needed for so many seconds of each manoeuvre, at the current rates */
+        float cost_pct(float hover_s, float fly_s, float climb_s) const;
+
+        EnergyModelConfig config;
+        EnergyEstimate estimate;
+
+    private:
+        float rate[ENERGY_NUM_MANOEUVRES];
+        float p[ENERGY_NUM_MANOEUVRES][ENERGY_NUM_MANOEUVRES]; /* Covariance of the rates */
+        float spent_s[ENERGY_NUM_MANOEUVRES]; /* Time in each manoeuvre since the last drop */
+        uint32_t last_ms;
+        int last_bat;
+        bool aligned; /* A drop has been seen since takeoff, so spent_s starts at one */
+
+        void fit(float dropped);
+};
+
+/* Keeps the waypoints of an rc path that are still to come within the battery, see above.
+ * Only used from the task flying the path */
+class MissionBudget{
+    public:
+        MissionBudget(const SeqLatch<EnergyEstimate>& energy, const EnergyModelConfig& config) : energy(energy), config(config) {}
+        /* Prepare for path, which begins at its first waypoint */
+        void begin(const RcPathFollower& path);
+        /* Check the rest of path against the latest estimate and drop waypoints until it fits,
+         * returns the number dropped. Meant as the RcStateHook of run_rc_path() */
+        uint8_t check(RcPathFollower& path, const Position& pos);
+        static void hook(RcPathFollower& path, const TelloStateSnapshot& snap, const Position& pos, void* ctx);
+
+        const SeqLatch<EnergyEstimate>& energy;
+        EnergyModelConfig config; /* The model's, for the reserve and the speeds home */
+        uint32_t checks = 0;
+        uint32_t dropped = 0;   /* Waypoints given up on */
+        float worst_margin_pct = 1e9f; /* Lowest margin left after finishing the path, over every check */
+
+    private:
+        /* From waypoint i to the end of the path: seconds flying horizontally and climbing */
+        float rest_fly_s[RC_PATH_MAX_POINTS];
+        float rest_climb_s[RC_PATH_MAX_POINTS];
+
+        void prepare(const RcPathFollower& path, uint8_t from);
+        /* Seconds of horizontal and vertical flight for a leg */
+        static void leg_time(const RcWaypoint& a, const RcWaypoint& b, float speed, float* fly_s, float* climb_s);
+        bool fits(const RcPathFollower& path, const Position& pos, const EnergyEstimate& est, float* margin_pct);
+};
+
+#endif // ENERGY_MODEL_HPP
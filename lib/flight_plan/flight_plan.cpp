@@ -0,0 +1,700 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for compiling and flying flight plans
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdarg.h>
+#include "flight_plan.hpp"
+#include "hal.hpp"
+
+#define MAX_TOKENS 9
+#define MAX_FIXUPS 16
+#define LABEL_LEN 16
+
+/* Tello SDK commands that take one number, with its valid range */
+struct NumericCmd{
+    const char* name;
+    int32_t min, max;
+};
+
+static const NumericCmd numeric_cmds[] = {
+    {"up", 20, 500}, {"down", 20, 500}, {"left", 20, 500}, {"right", 20, 500}, {"forward", 20, 500}, {"back", 20, 500},
+    {"cw", 1, 3600}, {"ccw", 1, 3600}, {"speed", 10, 100}
+};
+
+static const char* const plain_cmds[] = {"command", "takeoff", "land", "emergency", "streamon", "streamoff"};
+static const char* const query_cmds[] = {"speed?", "battery?", "time?", "height?", "temp?", "attitude?", "baro?", "acceleration?", "tof?", "wifi?"};
+
+/* State fields conditions may test */
+struct ConditionField{
+    const char* name;
+    uint8_t field; /* TelloStateField, FLIGHT_FIELD_ALT or FLIGHT_FIELD_MARGIN */
+};
+
+static const ConditionField condition_fields[] = {
+    {"bat", TELLO_BAT}, {"h", TELLO_H}, {"tof", TELLO_TOF}, {"time", TELLO_TIME}, {"temph", TELLO_TEMPH},
+    {"alt", FLIGHT_FIELD_ALT}, {"margin", FLIGHT_FIELD_MARGIN}
+};
+
+static const char* const cmp_names[] = {"<", "<=", ">", ">=", "==", "!="};
+
+/* Compiler state that is only needed while loading */
+class FlightPlanCompiler{
+    public:
+        FlightPlanCompiler(FlightPlan* plan, FlightPlanError* err){
+            this->plan = plan;
+            this->err = err;
+            plan->num_ops = 0;
+        }
+        /* Compile text, which may end part way through a line */
+        bool feed(const char* text, size_t len);
+        /* Compile the last line and resolve labels */
+        bool finish();
+
+    private:
+        FlightPlan* plan;
+        FlightPlanError* err;
+        uint16_t line_no = 0;
+
+        char buf[FLIGHT_PLAN_MAX_LINE + 1]; /* Current line, without its comment */
+        size_t len = 0;
+        bool comment = false; /* Rest of the current line is a comment */
+        bool too_long = false;
+
+        char label_names[FLIGHT_PLAN_MAX_LABELS][LABEL_LEN];
+        uint16_t label_ops[FLIGHT_PLAN_MAX_LABELS];
+        uint8_t num_labels = 0;
+
+        /* Jumps whose label was not defined yet when they were compiled */
+        char fixup_names[MAX_FIXUPS][LABEL_LEN];
+        uint16_t fixup_ops[MAX_FIXUPS];
+        uint8_t num_fixups = 0;
+
+        uint16_t loop_starts[FLIGHT_PLAN_MAX_DEPTH]; /* Op index of each open repeat's first body op */
+        uint8_t depth = 0;
+
+        bool fail(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+        FlightOp* emit(FlightOpCode code);
+        bool number(const char* tok, int32_t min, int32_t max, int32_t* out);
+        bool command(char** tok, int n);
+        bool jump(FlightOp* op, const char* label);
+        bool line(char* text);
+};
+
+bool FlightPlanCompiler::fail(const char* fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(err->msg, sizeof(err->msg), fmt, args);
+    va_end(args);
+    err->line = line_no;
+    plan->num_ops = 0;
+    return false;
+}
+
+FlightOp* FlightPlanCompiler::emit(FlightOpCode code){
+    if(plan->num_ops >= FLIGHT_PLAN_MAX_OPS){
+        fail("plan longer than %d ops", FLIGHT_PLAN_MAX_OPS);
+        return NULL;
+    }
+    FlightOp* op = &plan->ops[plan->num_ops++];
+    memset(op, 0, sizeof(*op));
+    op->code = code;
+    op->line = line_no;
+    return op;
+}
+
+bool FlightPlanCompiler::number(const char* tok, int32_t min, int32_t max, int32_t* out){
+    char* end;
+    long val = strtol(tok, &end, 10);
+    if(end == tok || *end != '\0'){
+        return fail("\"%s\" is not a number", tok);
+    }
+    if(val < min || val > max){
+        return fail("%ld out of range %ld..%ld", val, (long)min, (long)max);
+    }
+    *out = val;
+    return true;
+}
+
+/* Validate a Tello SDK command and compile it into a FLIGHT_OP_CMD */
+bool FlightPlanCompiler::command(char** tok, int n){
+    int32_t val[7];
+    bool valid = false;
+
+    for(size_t i = 0; i < sizeof(plain_cmds) / sizeof(plain_cmds[0]) && !valid; ++i){
+        valid = strcmp(tok[0], plain_cmds[i]) == 0 && n == 1;
+    }
+    for(size_t i = 0; i < sizeof(query_cmds) / sizeof(query_cmds[0]) && !valid; ++i){
+        valid = strcmp(tok[0], query_cmds[i]) == 0 && n == 1;
+    }
+    for(size_t i = 0; i < sizeof(numeric_cmds) / sizeof(numeric_cmds[0]) && !valid; ++i){
+        if(strcmp(tok[0], numeric_cmds[i].name) == 0){
+            if(n != 2){
+                return fail("%s takes 1 argument", tok[0]);
+            }
+            if(!number(tok[1], numeric_cmds[i].min, numeric_cmds[i].max, &val[0])){
+                return false;
+            }
+            valid = true;
+        }
+    }
+    if(!valid && strcmp(tok[0], "flip") == 0){
+        if(n != 2 || strlen(tok[1]) != 1 || !strchr("lrfb", tok[1][0])){
+            return fail("flip takes one of l, r, f or b");
+        }
+        valid = true;
+    }
+    if(!valid && (strcmp(tok[0], "go") == 0 || strcmp(tok[0], "curve") == 0)){
+        /* go x y z speed, curve x1 y1 z1 x2 y2 z2 speed */
+        int coords = strcmp(tok[0], "go") == 0 ? 3 : 6;
+        if(n != coords + 2){
+            return fail("%s takes %d arguments", tok[0], coords + 1);
+        }
+        for(int i = 0; i < coords; ++i){
+            if(!number(tok[1 + i], -500, 500, &val[i])){
+                return false;
+            }
+        }
+        if(!number(tok[1 + coords], 10, coords == 3 ? 100 : 60, &val[coords])){
+            return false;
+        }
+        /* The drone refuses points within 20 cm of where it is on every axis */
+        for(int p = 0; p < coords; p += 3){
+            if(abs(val[p]) <= 20 && abs(val[p + 1]) <= 20 && abs(val[p + 2]) <= 20){
+                return fail("%s point too close, needs a coordinate beyond +-20 cm", tok[0]);
+            }
+        }
+        valid = true;
+    }
+    if(!valid){
+        return fail("unknown command \"%s\"", tok[0]);
+    }
+
+    FlightOp* op = emit(FLIGHT_OP_CMD);
+    if(op == NULL){
+        return false;
+    }
+    /* Rebuild the command from its tokens so spacing and comments never reach the drone */
+    size_t len = 0;
+    for(int i = 0; i < n; ++i){
+        int w = snprintf(op->cmd + len, sizeof(op->cmd) - len, i ? " %s" : "%s", tok[i]);
+        if(w < 0 || len + w >= sizeof(op->cmd)){
+            return fail("command longer than %d characters", TELLO_CMD_MAX_LEN - 1);
+        }
+        len += w;
+    }
+    op->timeout_ms = tello_cmd_default_timeout(op->cmd);
+    op->retries = tello_cmd_default_retries(op->cmd);
+    return true;
+}
+
+/* Point op at label, now if it is already defined or once finish() runs if not */
+bool FlightPlanCompiler::jump(FlightOp* op, const char* label){
+    for(uint8_t i = 0; i < num_labels; ++i){
+        if(strcmp(label_names[i], label) == 0){
+            op->target = label_ops[i];
+            return true;
+        }
+    }
+    if(num_fixups >= MAX_FIXUPS){
+        return fail("too many forward jumps");
+    }
+    snprintf(fixup_names[num_fixups], LABEL_LEN, "%s", label);
+    fixup_ops[num_fixups++] = op - plan->ops;
+    return true;
+}
+
+bool FlightPlanCompiler::feed(const char* text, size_t n){
+    for(size_t i = 0; i < n; ++i){
+        char c = text[i];
+        if(c == '\n'){
+            ++line_no;
+            if(too_long){
+                return fail("line longer than %d characters", FLIGHT_PLAN_MAX_LINE);
+            }
+            buf[len] = '\0';
+            if(!line(buf)){
+                return false;
+            }
+            len = 0;
+            comment = false;
+        }
+        else if(c == '#'){
+            comment = true;
+        }
+        else if(!comment){
+            if(len < FLIGHT_PLAN_MAX_LINE){
+                buf[len++] = c;
+            }
+            else{
+                too_long = true;
+            }
+        }
+    }
+    return true;
+}
+
+bool FlightPlanCompiler::line(char* text){
+    char* tok[MAX_TOKENS];
+    int n = 0;
+    char* save;
+    for(char* t = strtok_r(text, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)){
+        if(n == MAX_TOKENS){
+            return fail("too many words");
+        }
+        tok[n++] = t;
+    }
+    if(n == 0){
+        return true;
+    }
+
+    size_t len = strlen(tok[0]);
+    if(tok[0][len - 1] == ':'){
+        if(n != 1 || len < 2 || len > LABEL_LEN){
+            return fail("bad label \"%s\"", tok[0]);
+        }
+        tok[0][len - 1] = '\0';
+        for(uint8_t i = 0; i < num_labels; ++i){
+            if(strcmp(label_names[i], tok[0]) == 0){
+                return fail("label \"%s\" defined twice", tok[0]);
+            }
+        }
+        if(num_labels >= FLIGHT_PLAN_MAX_LABELS){
+            return fail("more than %d labels", FLIGHT_PLAN_MAX_LABELS);
+        }
+        snprintf(label_names[num_labels], LABEL_LEN, "%s", tok[0]);
+        label_ops[num_labels++] = plan->num_ops;
+        return true;
+    }
+
+    if(strcmp(tok[0], "dwell") == 0){
+        if(n != 2){
+            return fail("dwell takes a time in seconds");
+        }
+        char* end;
+        float s = strtof(tok[1], &end);
+        if(end == tok[1] || *end != '\0' || s <= 0 || s > 3600){
+            return fail("bad dwell time \"%s\"", tok[1]);
+        }
+        FlightOp* op = emit(FLIGHT_OP_DWELL);
+        if(op){
+            op->value = (int32_t)(s * 1000);
+        }
+        return op != NULL;
+    }
+
+    if(strcmp(tok[0], "repeat") == 0){
+        if(n != 2){
+            return fail("repeat takes a count");
+        }
+        if(depth >= FLIGHT_PLAN_MAX_DEPTH){
+            return fail("repeat nested more than %d deep", FLIGHT_PLAN_MAX_DEPTH);
+        }
+        FlightOp* op = emit(FLIGHT_OP_LOOP);
+        if(op == NULL || !number(tok[1], 1, 1000, &op->value)){
+            return false;
+        }
+        op->slot = depth;
+        loop_starts[depth++] = plan->num_ops;
+        return true;
+    }
+
+    if(strcmp(tok[0], "end") == 0){
+        if(n != 1 || depth == 0){
+            return fail("end without repeat");
+        }
+        FlightOp* op = emit(FLIGHT_OP_NEXT);
+        if(op == NULL){
+            return false;
+        }
+        op->slot = --depth;
+        op->target = loop_starts[depth];
+        return true;
+    }
+
+    if(strcmp(tok[0], "goto") == 0){
+        if(n != 2){
+            return fail("goto takes a label");
+        }
+        FlightOp* op = emit(FLIGHT_OP_JUMP);
+        return op != NULL && jump(op, tok[1]);
+    }
+
+    if(strcmp(tok[0], "if") == 0){
+        /* if <field> <cmp> <value> goto <label> */
+        if(n != 6 || strcmp(tok[4], "goto") != 0){
+            return fail("expected \"if <field> <cmp> <value> goto <label>\"");
+        }
+        FlightOp* op = emit(FLIGHT_OP_JUMP_IF);
+        if(op == NULL){
+            return false;
+        }
+        size_t f = 0, c = 0;
+        while(f < sizeof(condition_fields) / sizeof(condition_fields[0]) && strcmp(tok[1], condition_fields[f].name) != 0){
+            ++f;
+        }
+        if(f == sizeof(condition_fields) / sizeof(condition_fields[0])){
+            return fail("unknown state field \"%s\"", tok[1]);
+        }
+        while(c < sizeof(cmp_names) / sizeof(cmp_names[0]) && strcmp(tok[2], cmp_names[c]) != 0){
+            ++c;
+        }
+        if(c == sizeof(cmp_names) / sizeof(cmp_names[0])){
+            return fail("unknown comparison \"%s\"", tok[2]);
+        }
+        op->field = condition_fields[f].field;
+        op->cmp = c;
+        return number(tok[3], -100000, 100000, &op->value) && jump(op, tok[5]);
+    }
+
+    if(strcmp(tok[0], "fly") == 0){
+        /* fly x y z speed */
+        static const int32_t min[4] = {-5000, -5000, 20, 10}, max[4] = {5000, 5000, 1000, 100};
+        if(n != 5){
+            return fail("fly takes x y z speed");
+        }
+        FlightOp* op = emit(FLIGHT_OP_FLY);
+        if(op == NULL){
+            return false;
+        }
+        for(int i = 0; i < 4; ++i){
+            int32_t v;
+            if(!number(tok[1 + i], min[i], max[i], &v)){
+                return false;
+            }
+            op->point[i] = v;
+        }
+        /* Each run of fly statements is flown as one path */
+        uint16_t run = 0;
+        while(run < plan->num_ops && plan->ops[plan->num_ops - 1 - run].code == FLIGHT_OP_FLY){
+            ++run;
+        }
+        if(run > RC_PATH_MAX_POINTS){
+            return fail("more than %d fly statements in a row", RC_PATH_MAX_POINTS);
+        }
+        return true;
+    }
+
+    return command(tok, n);
+}
+
+bool FlightPlanCompiler::finish(){
+    /* The last line may not have a newline */
+    if((len || too_long) && !feed("\n", 1)){
+        return false;
+    }
+    line_no = 0;
+    if(depth){
+        return fail("%d repeat block(s) missing end", depth);
+    }
+    for(uint8_t i = 0; i < num_fixups; ++i){
+        uint8_t l = 0;
+        while(l < num_labels && strcmp(label_names[l], fixup_names[i]) != 0){
+            ++l;
+        }
+        if(l == num_labels){
+            line_no = plan->ops[fixup_ops[i]].line;
+            return fail("undefined label \"%s\"", fixup_names[i]);
+        }
+        plan->ops[fixup_ops[i]].target = label_ops[l];
+    }
+    /* A backward jump with nothing that takes time in between would spin forever */
+    for(uint16_t i = 0; i < plan->num_ops; ++i){
+        const FlightOp& op = plan->ops[i];
+        if((op.code == FLIGHT_OP_JUMP || op.code == FLIGHT_OP_JUMP_IF) && op.target <= i){
+            uint16_t t = op.target;
+            while(t < i && plan->ops[t].code != FLIGHT_OP_CMD && plan->ops[t].code != FLIGHT_OP_DWELL && plan->ops[t].code != FLIGHT_OP_FLY){
+                ++t;
+            }
+            if(t == i){
+                line_no = op.line;
+                return fail("loop without a command or dwell");
+            }
+        }
+    }
+    /* Labels at the very end point here */
+    return emit(FLIGHT_OP_END) != NULL;
+}
+
+bool FlightPlan::compile(const char* text, FlightPlanError* err){
+    FlightPlanCompiler compiler(this, err);
+    return compiler.feed(text, strlen(text)) && compiler.finish();
+}
+
+bool FlightPlan::load(const char* path, FlightPlanError* err){
+    hal::File file;
+    if(!file.open(path, "r")){
+        err->line = 0;
+        snprintf(err->msg, sizeof(err->msg), "cannot open %s", path);
+        num_ops = 0;
+        return false;
+    }
+
+    /* Read a block at a time, each line is compiled as soon as it is complete */
+    FlightPlanCompiler compiler(this, err);
+    char buf[128];
+    size_t n;
+    while((n = file.read(buf, sizeof(buf))) > 0){
+        if(!compiler.feed(buf, n)){
+            return false;
+        }
+    }
+    return compiler.finish();
+}
+
+void FlightPlan::dump() const{
+    static const char* const names[] = {"cmd", "dwell", "loop", "next", "jump", "jump_if", "fly", "end"};
+    for(uint16_t i = 0; i < num_ops; ++i){
+        const FlightOp& op = ops[i];
+        hal::log("%2u (line %2u) %-7s", i, op.line, names[op.code]);
+        switch(op.code){
+            case FLIGHT_OP_CMD: hal::log(" \"%s\" timeout %u ms, %u retries\n", op.cmd, op.timeout_ms, op.retries); break;
+            case FLIGHT_OP_DWELL: hal::log(" %d ms\n", op.value); break;
+            case FLIGHT_OP_LOOP: hal::log(" slot %u = %d\n", op.slot, op.value); break;
+            case FLIGHT_OP_NEXT: hal::log(" slot %u -> %u\n", op.slot, op.target); break;
+            case FLIGHT_OP_JUMP: hal::log(" -> %u\n", op.target); break;
+            case FLIGHT_OP_JUMP_IF: hal::log(" %s %s %d -> %u\n", op.field == FLIGHT_FIELD_ALT ? "alt" : op.field == FLIGHT_FIELD_MARGIN ? "margin" : tello_state_keys[op.field], cmp_names[op.cmp], op.value, op.target); break;
+            case FLIGHT_OP_FLY: hal::log(" (%d, %d, %d) cm at %d cm/s\n", op.point[0], op.point[1], op.point[2], op.point[3]); break;
+            default: hal::log("\n"); break;
+        }
+    }
+}
+
+/* Flying --------------------------------------------------------------------------------------------------------------------- */
+
+/* False until the first state packet wherever the Tello's state is needed, rather than comparing against zeros */
+static bool test_condition(const FlightOp& op, const TelloStateSnapshot& snap, const SeqLatch<AltitudeEstimate>* altitude,
+                           const SeqLatch<EnergyEstimate>* energy){
+    const TelloState& state = snap.state;
+    int32_t v;
+    AltitudeEstimate est;
+    EnergyEstimate e;
+    switch(op.field){
+        case FLIGHT_FIELD_ALT:
+            if(altitude){
+                altitude->read(est);
+            }
+            if(!(altitude && est.seq) && snap.seq == 0){
+                return false;
+            }
+            v = altitude && est.seq ? (int32_t)est.alt_cm : state.h;
+            break;
+        case FLIGHT_FIELD_MARGIN:
+            if(energy){
+                energy->read(e);
+            }
+            if(!(energy && e.seq) && snap.seq == 0){
+                return false;
+            }
+            v = energy && e.seq ? (int32_t)floorf(e.margin_pct) : state.bat;
+            break;
+        default:
+            if(snap.seq == 0){
+                return false;
+            }
+            v = tello_state_value(state, op.field);
+            break;
+    }
+    switch(op.cmp){
+        case FLIGHT_CMP_LT: return v < op.value;
+        case FLIGHT_CMP_LE: return v <= op.value;
+        case FLIGHT_CMP_GT: return v > op.value;
+        case FLIGHT_CMP_GE: return v >= op.value;
+        case FLIGHT_CMP_EQ: return v == op.value;
+        default: return v != op.value;
+    }
+}
+
+/* Commands queued on the engine, oldest first */
+class FlightWindow{
+    public:
+        TelloCommand cmds[FLIGHT_PLAN_WINDOW];
+        uint16_t lines[FLIGHT_PLAN_WINDOW];
+        uint8_t head = 0, count = 0;
+};
+
+/* Wait for the oldest queued command, returns false if it failed.
+ * Every queued command gives this task TELLO_CMD_NOTIFY_BIT, and the engine completes them in order, so one
+ * wakeup may stand for several: only sleep while the oldest is still pending. A bit left by a command that was
+ * already retired just costs an extra check here or in a later TelloControl::wait() */
+static TelloCmdStatus wait_oldest(FlightWindow& w){
+    TelloCommand& cmd = w.cmds[w.head];
+    while(cmd.status == TELLO_CMD_PENDING){
+        hal::notify_wait(TELLO_CMD_NOTIFY_BIT, NULL, HAL_FOREVER);
+    }
+    return cmd.status;
+}
+
+static bool retire(FlightWindow& w, FlightPlanResult& res){
+    TelloCommand& cmd = w.cmds[w.head];
+    TelloCmdStatus status = wait_oldest(w);
+    uint16_t line = w.lines[w.head];
+    w.head = (w.head + 1) % FLIGHT_PLAN_WINDOW;
+    w.count--;
+    if(status != TELLO_CMD_OK){
+        /* Keep the first failure, later ones are usually a consequence of it */
+        if(res.status == TELLO_CMD_OK){
+            res.status = status;
+            res.line = line;
+        }
+        hal::log("Flight plan: line %u \"%s\" failed (%s)\n", line, cmd.cmd, status == TELLO_CMD_TIMEOUT ? "timeout" : cmd.resp);
+        return false;
+    }
+    res.cmds++;
+    return true;
+}
+
+/* Wait for every queued command, returns false at the first that failed, leaving the rest queued */
+static bool drain(FlightWindow& w, FlightPlanResult& res){
+    while(w.count){
+        if(!retire(w, res)){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Wait for the engine to let go of whatever is still queued once the plan has given up. Commands queued behind
+ * another are chained to it, so those behind a failure are cancelled by the engine rather than sent */
+static void settle(FlightWindow& w){
+    while(w.count){
+        wait_oldest(w);
+        w.head = (w.head + 1) % FLIGHT_PLAN_WINDOW;
+        w.count--;
+    }
+}
+
+/* Fly the run of fly ops starting at pc as one rc path, and move pc past it. Returns false if the path was abandoned */
+static bool fly_path(TelloControl& tello, const FlightPlan& plan, uint16_t& pc, const SeqLatch<Position>* position,
+                     const SeqLatch<EnergyEstimate>* energy, const EnergyModelConfig& energy_config, FlightPlanResult& res){
+    const FlightOp& first = plan.ops[pc];
+    if(position == NULL){
+        hal::log("Flight plan: line %u needs the position track to fly\n", first.line);
+        res.status = TELLO_CMD_REJECTED;
+        res.line = first.line;
+        return false;
+    }
+    RcPathFollower path;
+    uint16_t from = pc;
+    while(pc < plan.num_ops && plan.ops[pc].code == FLIGHT_OP_FLY && path.num_points < RC_PATH_MAX_POINTS){
+        const FlightOp& op = plan.ops[pc++];
+        RcWaypoint wp;
+        wp.x_cm = op.point[0];
+        wp.y_cm = op.point[1];
+        wp.z_cm = op.point[2];
+        wp.speed_cms = op.point[3];
+        path.add(wp);
+    }
+    RcPathStatus status;
+    if(energy){
+        MissionBudget budget(*energy, energy_config);
+        budget.begin(path);
+        status = run_rc_path(tello, path, *position, &res.rc, MissionBudget::hook, &budget);
+        res.waypoints_dropped += budget.dropped;
+        if(budget.worst_margin_pct < res.worst_margin_pct){
+            res.worst_margin_pct = budget.worst_margin_pct;
+        }
+    }
+    else{
+        status = run_rc_path(tello, path, *position, &res.rc);
+    }
+    if(status != RC_PATH_DONE){
+        static const char* const reasons[] = {"", "state stopped arriving", "took too long", "rc setpoints could not be sent"};
+        res.status = status == RC_PATH_SEND_FAILED ? TELLO_CMD_REJECTED : TELLO_CMD_TIMEOUT;
+        /* Waypoints may have been dropped along the way, so find the line by the point */
+        const RcWaypoint& wp = path.points[path.leg];
+        res.line = first.line;
+        for(uint16_t i = from; i < pc; ++i){
+            if(plan.ops[i].point[0] == wp.x_cm && plan.ops[i].point[1] == wp.y_cm && plan.ops[i].point[2] == wp.z_cm){
+                res.line = plan.ops[i].line;
+                break;
+            }
+        }
+        hal::log("Flight plan: path from line %u abandoned on the way to line %u, %s\n", first.line, res.line, reasons[status]);
+        return false;
+    }
+    return true;
+}
+
+FlightPlanResult run_flight_plan(TelloControl& tello, const FlightPlan& plan, const SeqLatch<AltitudeEstimate>* altitude,
+                                 const SeqLatch<Position>* position, const SeqLatch<EnergyEstimate>* energy,
+                                 const EnergyModelConfig& energy_config){
+    FlightPlanResult res;
+    FlightWindow w;
+    int32_t counters[FLIGHT_PLAN_MAX_DEPTH] = {0};
+    uint32_t start = hal::millis();
+    uint16_t pc = 0;
+    bool ok = plan.num_ops > 0;
+
+    while(ok && pc < plan.num_ops){
+        const FlightOp& op = plan.ops[pc];
+        switch(op.code){
+            case FLIGHT_OP_CMD:{
+                if(w.count == FLIGHT_PLAN_WINDOW && !retire(w, res)){
+                    ok = false;
+                    break;
+                }
+                uint8_t slot = (w.head + w.count) % FLIGHT_PLAN_WINDOW;
+                TelloCommand& cmd = w.cmds[slot];
+                memcpy(cmd.cmd, op.cmd, sizeof(cmd.cmd));
+                cmd.timeout_ms = op.timeout_ms;
+                cmd.retries = op.retries;
+                cmd.notify = hal::current_task();
+                cmd.chained = w.count > 0;
+                w.lines[slot] = op.line;
+                w.count++;
+                if(!tello.submit(&cmd)){
+                    /* Retire what was queued before it, up to and including the rejection */
+                    drain(w, res);
+                    ok = false;
+                    break;
+                }
+                ++pc;
+                break;
+            }
+            case FLIGHT_OP_DWELL:
+                ok = drain(w, res);
+                if(ok){
+                    hal::delay(op.value);
+                }
+                ++pc;
+                break;
+            case FLIGHT_OP_LOOP:
+                counters[op.slot] = op.value;
+                ++pc;
+                break;
+            case FLIGHT_OP_NEXT:
+                pc = --counters[op.slot] > 0 ? op.target : pc + 1;
+                break;
+            case FLIGHT_OP_JUMP:
+                pc = op.target;
+                break;
+            case FLIGHT_OP_JUMP_IF:
+                ok = drain(w, res);
+                pc = test_condition(op, tello.get_state(), altitude, energy) ? op.target : pc + 1;
+                break;
+            case FLIGHT_OP_FLY:
+                /* rc setpoints are not acknowledged, so nothing may still be moving the drone */
+                ok = drain(w, res) && fly_path(tello, plan, pc, position, energy, energy_config, res);
+                break;
+            default:
+                ok = drain(w, res);
+                res.ok = ok;
+                pc = plan.num_ops;
+                break;
+        }
+    }
+
+    if(!res.ok){
+        settle(w);
+        hal::log("Flight plan: aborted, landing\n");
+        TelloCommand land("land");
+        tello.send_cmd(&land);
+    }
+    res.elapsed_ms = hal::millis() - start;
+    return res;
+}
@@ -0,0 +1,122 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for flight plans: a small mission language stored on flash, compiled into a flat op array
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A plan is plain text, one statement per line, '#' starts a comment:
+ *
+ *     takeoff
+ *     speed 50
+ *     repeat 3                 # loops nest up to FLIGHT_PLAN_MAX_DEPTH deep
+ *         go 100 0 0 50        # waypoint, x y z in cm relative to the drone, at speed cm/s
+ *         dwell 5              # hover in place for 5 s while the sensors sample
+ *         if bat < 30 goto home
+ *     end
+ *     home:
+ *     land
+ *
+ * Any Tello SDK 1.3 control, set or read command is a statement of its own and is range checked.
+ * "fly x y z speed" flies to a point in cm from the takeoff point (x along the heading at takeoff, y to its
+ * right, z up) at speed cm/s by streaming rc setpoints (see lib/rc_ctrl). Consecutive fly statements form
+ * one continuous path, the drone only slows down at the last of them.
+ * Conditions compare a Tello state field (bat, h, tof, time, temph), the fused altitude (alt, in cm
+ * above the takeoff point) or the battery margin (margin, % left after getting home with the reserve,
+ * see lib/energy_model) with <, <=, >, >=, == or !=, and "goto label" jumps unconditionally.
+ *
+ * Everything is validated and resolved when the plan is loaded, so nothing is parsed in flight.
+*/
+
+#ifndef FLIGHT_PLAN_HPP
+#define FLIGHT_PLAN_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tello_ctrl.hpp"
+#include "alt_fusion.hpp"
+#include "voxel_map.hpp"
+#include "rc_ctrl.hpp"
+#include "energy_model.hpp"
+
+#define FLIGHT_PLAN_MAX_OPS 64 /* Compiled ops in one plan */
+#define FLIGHT_PLAN_MAX_DEPTH 4 /* Nested repeat blocks */
+#define FLIGHT_PLAN_MAX_LABELS 8
+#define FLIGHT_PLAN_MAX_LINE 80 /* Longest statement, not counting comments */
+#define FLIGHT_FIELD_ALT TELLO_NUM_FIELDS /* Condition field for the fused altitude, after the Tello's own fields */
+#define FLIGHT_FIELD_MARGIN (TELLO_NUM_FIELDS + 1) /* and for the battery margin */
+#define FLIGHT_PLAN_WINDOW 2 /* Commands outstanding on the command engine at once, the one in flight and those queued behind it */
+
+enum FlightOpCode{
+    FLIGHT_OP_CMD, /* Send cmd */
+    FLIGHT_OP_DWELL, /* Hover for value ms */
+    FLIGHT_OP_LOOP, /* Set loop counter slot to value */
+    FLIGHT_OP_NEXT, /* Decrement loop counter slot, jump to target while it is above 0 */
+    FLIGHT_OP_JUMP, /* Jump to target */
+    FLIGHT_OP_JUMP_IF, /* Jump to target if state field cmp value */
+    FLIGHT_OP_FLY, /* Waypoint of an rc path, point */
+    FLIGHT_OP_END
+};
+
+enum FlightCmp{
+    FLIGHT_CMP_LT, FLIGHT_CMP_LE, FLIGHT_CMP_GT, FLIGHT_CMP_GE, FLIGHT_CMP_EQ, FLIGHT_CMP_NE
+};
+
+/* One compiled statement */
+class FlightOp{
+    public:
+        uint8_t code; /* FlightOpCode */
+        uint8_t field; /* FLIGHT_OP_JUMP_IF: TelloStateField, FLIGHT_FIELD_ALT or FLIGHT_FIELD_MARGIN */
+        uint8_t cmp; /* FLIGHT_OP_JUMP_IF: FlightCmp */
+        uint8_t slot; /* FLIGHT_OP_LOOP/NEXT: loop counter */
+        int32_t value;
+        uint16_t target; /* Op index to jump to */
+        uint16_t line; /* Source line, for messages */
+        uint32_t timeout_ms; /* FLIGHT_OP_CMD: reply timeout & retries, from tello_cmd_default_* */
+        uint8_t retries;
+        char cmd[TELLO_CMD_MAX_LEN];
+        int16_t point[4]; /* FLIGHT_OP_FLY: x, y, z in cm from the takeoff point, speed in cm/s */
+};
+
+class FlightPlanError{
+    public:
+        uint16_t line = 0; /* 0 if not tied to a line */
+        char msg[64] = "";
+};
+
+class FlightPlan{
+    public:
+        /* Compile the plan at path (on the file system mounted by hal::fs_begin) or in text.
+         * On failure the plan is left empty and err says why. */
+        bool load(const char* path, FlightPlanError* err);
+        bool compile(const char* text, FlightPlanError* err);
+        void dump() const; /* Log the compiled ops */
+
+        FlightOp ops[FLIGHT_PLAN_MAX_OPS];
+        uint16_t num_ops = 0;
+};
+
+/* How a run ended */
+class FlightPlanResult{
+    public:
+        bool ok = false; /* Reached the end of the plan */
+        uint16_t line = 0; /* Line of the command that failed */
+        TelloCmdStatus status = TELLO_CMD_OK; /* and how it failed */
+        uint32_t cmds = 0; /* Commands completed */
+        uint32_t elapsed_ms = 0;
+        RcLoopStats rc; /* Over every fly path */
+        uint32_t waypoints_dropped = 0; /* Fly waypoints given up on to keep the battery reserve */
+        float worst_margin_pct = 1e9f; /* Lowest battery margin a fly path was checked against */
+};
+
+/* Fly plan, from the calling task. Consecutive commands are queued on the command engine ahead of time,
+ * so the next leg is sent the moment the previous one is acknowledged. Dwells and conditions wait for
+ * everything queued to finish first, so they see the state the previous commands left behind.
+ * If a command fails or times out the rest of the plan is abandoned (commands already queued behind it
+ * are cancelled unsent) and the drone is told to land.
+ * Conditions on alt read altitude, or the Tello's own relative height h when there is no fused altitude.
+ * Fly paths need the dead-reckoned position, a plan with them is abandoned without it.
+ * With the battery estimate, fly paths drop waypoints they can no longer afford (see MissionBudget, whose
+ * reserve and speeds home come from energy_config) and conditions on margin read it, otherwise margin is bat. */
+FlightPlanResult run_flight_plan(TelloControl& tello, const FlightPlan& plan, const SeqLatch<AltitudeEstimate>* altitude = NULL,
+                                 const SeqLatch<Position>* position = NULL, const SeqLatch<EnergyEstimate>* energy = NULL,
+                                 const EnergyModelConfig& energy_config = EnergyModelConfig());
+
+#endif // FLIGHT_PLAN_HPP
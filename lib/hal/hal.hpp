@@ -0,0 +1,190 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the hardware abstraction layer (HAL)
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Everything the control and logging libraries need from the platform goes through here, so the
+ * same code builds for the ESP32 (hal_esp32.cpp, FreeRTOS/LittleFS/I2C sensors) and for the host
+ * ([env:native], hal_native.cpp, threads/stdio/synthetic sensors). UDP uses BSD sockets on both
+ * (lwIP on the ESP32), see hal_udp.cpp.
+*/ 
+
+#ifndef HAL_HPP
+#define HAL_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "FS.h"
+#else
+#include <stdio.h>
+#endif
+
+#define HAL_FOREVER 0xFFFFFFFFu /* Timeout that never expires */
+
+namespace hal{
+
+/* Clock & logging ---------------------------------------------------------------------------------------------------------- */
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms); /* Sleeps, letting other tasks run */
+/* Sleep until period_ms after wake_ms and advance wake_ms by period_ms, for loops that must keep a fixed
+ * cadence without drifting. Returns at once if that time has already passed */
+void delay_until(uint32_t& wake_ms, uint32_t period_ms);
+void log(const char* fmt, ...) __attribute__((format(printf, 1, 2))); /* Serial on the ESP32, stdout on the host */
+/* Free-running cycle counter for timing short stretches of code, wraps every 2^32 cycles (about 18 s at 240 MHz).
+ * Each ESP32 core has its own, so only compare readings taken on the same task */
+uint32_t cycles();
+uint32_t cycles_per_us();
+
+/* Tasks & synchronisation -------------------------------------------------------------------------------------------------- */
+
+typedef void* Task;
+
+/* Start fn(arg) as a task. priority and core are only used on the ESP32 */
+Task task_create(void (*fn)(void*), const char* name, uint32_t stack, void* arg, unsigned priority, int core);
+Task current_task();
+/* Set bits in task's notification value and wake it */
+void notify(Task task, uint32_t bits);
+/* Wait for a notification to the calling task. On success stores the notification value in bits (if not NULL),
+ * then clears clear_on_exit from it. Returns false on timeout */
+bool notify_wait(uint32_t clear_on_exit, uint32_t* bits, uint32_t timeout_ms);
+
+/* Tasks whose stack use can be read back: every task started by task_create, and any added with task_watch */
+#define HAL_MAX_TASKS 12
+
+class TaskInfo{
+    public:
+        const char* name = "";
+        uint32_t stack = 0;      /* Bytes */
+        uint32_t stack_free = 0; /* Bytes never used so far, its high-water mark. 0 if unknown */
+};
+
+/* Watch a task created some other way, stack in bytes */
+void task_watch(Task task, const char* name, uint32_t stack);
+/* Stop watching a task, before it is deleted */
+void task_forget(Task task);
+/* Copy up to cap watched tasks into out, returns how many */
+size_t task_info(TaskInfo* out, size_t cap);
+/* Free heap now and the least there has been since boot, in bytes. 0 if unknown */
+uint32_t heap_free();
+uint32_t heap_min_free();
+
+class Mutex{
+    public:
+        Mutex();
+        ~Mutex();
+        void lock();
+        void unlock();
+    private:
+        void* handle;
+};
+
+/* Fixed-size FIFO of fixed-size items, safe between tasks */
+class Queue{
+    public:
+        Queue(size_t len, size_t item_size);
+        ~Queue();
+        bool send(const void* item, uint32_t timeout_ms);
+        bool recv(void* item, uint32_t timeout_ms);
+    private:
+        void* handle;
+};
+
+/* Messages of varying length, each copied in and out whole (a FreeRTOS message buffer on the ESP32).
+ * Lock-free on the ESP32, so only one task may send and only one task may receive */
+class MessageBuffer{
+    public:
+        /* size bytes of storage, each message takes HAL_MESSAGE_OVERHEAD bytes of it on top of its own length */
+        MessageBuffer(size_t size);
+        ~MessageBuffer();
+        /* Copy in a message of len bytes, waiting up to timeout_ms for room. Returns false if it did not fit */
+        bool send(const void* data, size_t len, uint32_t timeout_ms);
+        /* Copy the oldest message into buf (cap bytes), waiting up to timeout_ms for one.
+         * Returns its length, 0 on timeout or if it is longer than cap (it is then left queued) */
+        size_t recv(void* buf, size_t cap, uint32_t timeout_ms);
+        /* Bytes free, a message of len bytes fits if len + HAL_MESSAGE_OVERHEAD <= space() */
+        size_t space();
+    private:
+        void* handle;
+};
+
+#define HAL_MESSAGE_OVERHEAD 4 /* Length stored with each message */
+
+/* UDP ---------------------------------------------------------------------------------------------------------------------- */
+
+class UdpSocket{
+    public:
+        UdpSocket();
+        ~UdpSocket();
+        /* Open the socket and bind it to port on all interfaces, 0 picks any free port */
+        bool bind(uint16_t port);
+        bool send_to(const char* ip, uint16_t port, const void* data, size_t len);
+        /* Read one waiting datagram into buf (truncated to cap), without blocking.
+         * Returns its length, or -1 if nothing is waiting */
+        int recv(void* buf, size_t cap);
+        void close();
+        bool is_open() const { return sock >= 0; }
+        /* Block until a datagram is waiting on any of the n sockets, or timeout_ms passes (select() underneath).
+         * Returns a mask with bit i set if socks[i] is readable, 0 on timeout */
+        static uint32_t wait_any(UdpSocket* const* socks, size_t n, uint32_t timeout_ms);
+    private:
+        int sock;
+};
+
+/* Files -------------------------------------------------------------------------------------------------------------------- */
+
+/* Mount the file system the logs live on (LittleFS on the ESP32, a directory on the host) */
+bool fs_begin();
+bool file_exists(const char* path);
+bool file_remove(const char* path);
+
+class File{
+    public:
+        File();
+        ~File();
+        /* mode is "r", "w" or "a", as for FILE_READ/FILE_WRITE/FILE_APPEND */
+        bool open(const char* path, const char* mode);
+        size_t read(void* buf, size_t len);
+        size_t write(const void* buf, size_t len);
+        bool seek(uint32_t offset);
+        uint32_t size();
+        void flush(); /* Commit written data to storage */
+        void close();
+        bool is_open() const;
+    private:
+#ifdef ARDUINO
+        fs::File file;
+#else
+        FILE* file;
+#endif
+};
+
+/* Sensors ------------------------------------------------------------------------------------------------------------------ */
+
+bool sensors_begin();
+/* True once the SCD4x has a new measurement waiting (every 5 s), a cheap check that avoids failed reads */
+bool scd4x_data_ready();
+/* Read the SCD4x, returns false if there is no fresh, valid measurement */
+bool scd4x_read(uint16_t& co2, float& temp, float& humd);
+/* Read the BMP3xx (temperature in C, pressure in Pa, approximate altitude in m), returns false on failure */
+bool bmp3xx_read(float& temp, float& pres, float& alt);
+
+#ifndef ARDUINO
+/* Height of the simulated drone above its takeoff point, which the synthetic BMP3xx follows */
+void native_set_height(float cm);
+/* Stop following the computer's clock: millis()/micros() read start_us from now on and only move with
+ * native_clock_advance() and delays, which return at once. For replaying captures as fast as possible and
+ * repeatably, from a single task */
+void native_clock_manual(uint32_t start_us);
+void native_clock_advance(uint32_t us);
+/* Make every file write take at least ms longer, to see how the logger copes with slow flash */
+void native_set_flash_latency(uint32_t ms);
+#endif
+
+}
+
+#endif // HAL_HPP
@@ -0,0 +1,331 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the HAL on the ESP32 (FreeRTOS, LittleFS, SCD4x and BMP3xx over I2C)
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ * Code partially derived from Sensirion AG (SCD4x)
+*/ 
+
+#ifdef ARDUINO
+
+#include "hal.hpp"
+#include "freertos/message_buffer.h"
+#include <Wire.h>
+#include <LittleFS.h>
+#include <Adafruit_Sensor.h>
+#include <Adafruit_BMP3XX.h>
+#include <SensirionI2CScd4x.h>
+
+#define SEALEVELPRESSURE_HPA 1013.25
+
+static SensirionI2CScd4x scd4x;
+static Adafruit_BMP3XX bmp;
+
+static TickType_t to_ticks(uint32_t ms){
+    return ms == HAL_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(ms);
+}
+
+namespace hal{
+
+/* Clock & logging ---------------------------------------------------------------------------------------------------------- */
+
+uint32_t millis(){
+    return ::millis();
+}
+
+uint32_t micros(){
+    return ::micros();
+}
+
+void delay(uint32_t ms){
+    ::delay(ms);
+}
+
+void delay_until(uint32_t& wake_ms, uint32_t period_ms){
+    wake_ms += period_ms;
+    int32_t wait = (int32_t)(wake_ms - ::millis());
+    if(wait > 0){
+        vTaskDelay(to_ticks(wait));
+    }
+}
+
+void log(const char* fmt, ...){
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    Serial.print(buf);
+}
+
+uint32_t cycles(){
+    return ESP.getCycleCount();
+}
+
+uint32_t cycles_per_us(){
+    static uint32_t mhz = ESP.getCpuFreqMHz();
+    return mhz;
+}
+
+/* Tasks & synchronisation -------------------------------------------------------------------------------------------------- */
+
+struct WatchedTask{
+    TaskHandle_t task;
+    const char* name;
+    uint32_t stack;
+};
+static WatchedTask watched[HAL_MAX_TASKS];
+static size_t num_watched = 0;
+static portMUX_TYPE watched_lock = portMUX_INITIALIZER_UNLOCKED;
+
+Task task_create(void (*fn)(void*), const char* name, uint32_t stack, void* arg, unsigned priority, int core){
+    TaskHandle_t task = NULL;
+    if(xTaskCreatePinnedToCore(fn, name, stack, arg, priority, &task, core) != pdPASS){
+        return NULL;
+    }
+    task_watch(task, name, stack);
+    return task;
+}
+
+void task_watch(Task task, const char* name, uint32_t stack){
+    portENTER_CRITICAL(&watched_lock);
+    if(num_watched < HAL_MAX_TASKS){
+        watched[num_watched++] = {(TaskHandle_t)task, name, stack};
+    }
+    portEXIT_CRITICAL(&watched_lock);
+}
+
+void task_forget(Task task){
+    portENTER_CRITICAL(&watched_lock);
+    for(size_t i = 0; i < num_watched; ++i){
+        if(watched[i].task == (TaskHandle_t)task){
+            watched[i] = watched[--num_watched];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&watched_lock);
+}
+
+size_t task_info(TaskInfo* out, size_t cap){
+    /* Stack sizes on the ESP32 are in bytes, not words as in stock FreeRTOS. The high-water mark walks the
+     * task's stack, so it is read outside the critical section: a task must be forgotten before it is deleted */
+    WatchedTask copy[HAL_MAX_TASKS];
+    portENTER_CRITICAL(&watched_lock);
+    size_t n = num_watched < cap ? num_watched : cap;
+    memcpy(copy, watched, n * sizeof(copy[0]));
+    portEXIT_CRITICAL(&watched_lock);
+    for(size_t i = 0; i < n; ++i){
+        out[i].name = copy[i].name;
+        out[i].stack = copy[i].stack;
+        out[i].stack_free = uxTaskGetStackHighWaterMark(copy[i].task);
+    }
+    return n;
+}
+
+uint32_t heap_free(){
+    return ESP.getFreeHeap();
+}
+
+uint32_t heap_min_free(){
+    return ESP.getMinFreeHeap();
+}
+
+Task current_task(){
+    return xTaskGetCurrentTaskHandle();
+}
+
+void notify(Task task, uint32_t bits){
+    xTaskNotify((TaskHandle_t)task, bits, eSetBits);
+}
+
+bool notify_wait(uint32_t clear_on_exit, uint32_t* bits, uint32_t timeout_ms){
+    return xTaskNotifyWait(0, clear_on_exit, bits, to_ticks(timeout_ms)) == pdTRUE;
+}
+
+Mutex::Mutex(){
+    handle = xSemaphoreCreateMutex();
+}
+
+Mutex::~Mutex(){
+    vSemaphoreDelete((SemaphoreHandle_t)handle);
+}
+
+void Mutex::lock(){
+    xSemaphoreTake((SemaphoreHandle_t)handle, portMAX_DELAY);
+}
+
+void Mutex::unlock(){
+    xSemaphoreGive((SemaphoreHandle_t)handle);
+}
+
+Queue::Queue(size_t len, size_t item_size){
+    handle = xQueueCreate(len, item_size);
+}
+
+Queue::~Queue(){
+    vQueueDelete((QueueHandle_t)handle);
+}
+
+bool Queue::send(const void* item, uint32_t timeout_ms){
+    return xQueueSend((QueueHandle_t)handle, item, to_ticks(timeout_ms)) == pdTRUE;
+}
+
+bool Queue::recv(void* item, uint32_t timeout_ms){
+    return xQueueReceive((QueueHandle_t)handle, item, to_ticks(timeout_ms)) == pdTRUE;
+}
+
+MessageBuffer::MessageBuffer(size_t size){
+    handle = xMessageBufferCreate(size);
+}
+
+MessageBuffer::~MessageBuffer(){
+    vMessageBufferDelete((MessageBufferHandle_t)handle);
+}
+
+bool MessageBuffer::send(const void* data, size_t len, uint32_t timeout_ms){
+    return xMessageBufferSend((MessageBufferHandle_t)handle, data, len, to_ticks(timeout_ms)) == len;
+}
+
+size_t MessageBuffer::recv(void* buf, size_t cap, uint32_t timeout_ms){
+    return xMessageBufferReceive((MessageBufferHandle_t)handle, buf, cap, to_ticks(timeout_ms));
+}
+
+size_t MessageBuffer::space(){
+    return xMessageBufferSpacesAvailable((MessageBufferHandle_t)handle);
+}
+
+/* Files -------------------------------------------------------------------------------------------------------------------- */
+
+bool fs_begin(){
+    /* TODO: Using LittleFS library, but partition label is ffat, strange */
+    return LittleFS.begin(true, "/littlefs", 10, "ffat");
+}
+
+bool file_exists(const char* path){
+    return LittleFS.exists(path);
+}
+
+bool file_remove(const char* path){
+    return LittleFS.remove(path);
+}
+
+File::File(){}
+
+File::~File(){
+    close();
+}
+
+bool File::open(const char* path, const char* mode){
+    file = LittleFS.open(path, mode);
+    if(file && file.isDirectory()){
+        file.close();
+    }
+    return file;
+}
+
+size_t File::read(void* buf, size_t len){
+    return file.read((uint8_t*)buf, len);
+}
+
+size_t File::write(const void* buf, size_t len){
+    return file.write((const uint8_t*)buf, len);
+}
+
+bool File::seek(uint32_t offset){
+    return file.seek(offset);
+}
+
+uint32_t File::size(){
+    return file.size();
+}
+
+void File::flush(){
+    file.flush();
+}
+
+void File::close(){
+    if(file){
+        file.close();
+    }
+}
+
+bool File::is_open() const{
+    return file;
+}
+
+/* Sensors ------------------------------------------------------------------------------------------------------------------ */
+
+bool sensors_begin(){
+    /* Initialise Sensirion SCD4x */
+    Wire.begin();
+    scd4x.begin(Wire);
+    uint16_t error;
+    char errorMessage[256];
+
+    /* Stop potentially previously started measurement */
+    error = scd4x.stopPeriodicMeasurement();
+    if (error) {
+        Serial.print("SCD4x: Error trying to execute stopPeriodicMeasurement(): ");
+        errorToString(error, errorMessage, 256);
+        Serial.println(errorMessage);
+    }
+
+    /* Start Measurement */
+    error = scd4x.startPeriodicMeasurement();
+    if (error) {
+        Serial.print("Error trying to execute startPeriodicMeasurement(): ");
+        errorToString(error, errorMessage, 256);
+        Serial.println(errorMessage);
+    }
+
+    /* Initialise Bosch BMP3xx 
+     * hardware I2C mode, can pass in address & alt Wire */
+    if (!bmp.begin_I2C()) {   
+        Serial.println("Could not find a valid BMP3 sensor, check wiring!");
+        return false;
+    }
+
+    /* Set up oversampling and filter initialization
+     * performReading() runs a forced conversion and waits for it, at 2x temperature & 4x pressure oversampling
+     * that takes about 13 ms, leaving room in each 20 ms period of the 50 Hz sampling (8x took about 25 ms) */
+    bmp.setTemperatureOversampling(BMP3_OVERSAMPLING_2X);
+    bmp.setPressureOversampling(BMP3_OVERSAMPLING_4X);
+    bmp.setIIRFilterCoeff(BMP3_IIR_FILTER_COEFF_3);
+    bmp.setOutputDataRate(BMP3_ODR_50_HZ);
+    return true;
+}
+
+bool scd4x_data_ready(){
+    bool ready = false;
+    return scd4x.getDataReadyFlag(ready) == 0 && ready;
+}
+
+bool scd4x_read(uint16_t& co2, float& temp, float& humd){
+    uint16_t error = scd4x.readMeasurement(co2, temp, humd);
+    if(error){
+        /* Print out error message unless it is "NotEnoughDataError", which just means no new measurement is ready (check scd4x_data_ready() first).
+           Grab lower byte since NotEnoughDataError is a low level error (see SensirionErrors.cpp) */
+        if ((error & 0x00FF) != NotEnoughDataError){
+            char errorMessage[256];
+            errorToString(error, errorMessage, 256);
+            //Serial.printf("SCD4x: Error trying to execute readMeasurement(): %s\n", errorMessage);
+        }
+        return false;
+    }
+    /* A CO2 reading of 0 is an invalid sample */
+    return co2 != 0;
+}
+
+bool bmp3xx_read(float& temp, float& pres, float& alt){
+    if(!bmp.performReading()){
+        //Serial.println("BMP3xx: Failed to perform reading.");
+        return false;
+    }
+    temp = bmp.temperature;
+    pres = bmp.pressure;
+    /* Same formula as readAltitude(), which would trigger a second conversion just to get the pressure again */
+    alt = 44330.0 * (1.0 - pow(pres / 100.0 / SEALEVELPRESSURE_HPA, 0.1903));
+    return true;
+}
+
+}
+
+#endif // ARDUINO
@@ -0,0 +1,459 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the HAL on the host ([env:native]): threads, stdio files and synthetic sensors
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#ifndef ARDUINO
+
+#include "hal.hpp"
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Directory standing in for the LittleFS partition */
+#define HAL_FS_ROOT "native_fs"
+
+static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+/* When set, the clock only moves through native_clock_advance() and delays, see hal.hpp */
+static std::atomic<bool> manual_clock{false};
+static std::atomic<uint64_t> manual_us{0};
+static std::atomic<uint32_t> flash_latency_ms{0};
+
+/* Per-thread stand-in for a FreeRTOS task notification value */
+struct NotifyState{
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t value = 0;
+    bool pending = false;
+};
+static thread_local NotifyState* self = NULL;
+
+struct QueueState{
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<uint8_t> buf;
+    size_t item_size, len, head = 0, count = 0;
+};
+
+/* Messages are stored as a 4 byte length then the message, wrapping around the end of buf */
+struct MessageBufferState{
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<uint8_t> buf;
+    size_t head = 0, used = 0;
+
+    void copy_in(size_t at, const void* data, size_t len){
+        for(size_t i = 0; i < len; ++i){
+            buf[(at + i) % buf.size()] = ((const uint8_t*)data)[i];
+        }
+    }
+    void copy_out(size_t at, void* data, size_t len) const{
+        for(size_t i = 0; i < len; ++i){
+            ((uint8_t*)data)[i] = buf[(at + i) % buf.size()];
+        }
+    }
+};
+
+/* Wait on cv until pred holds or timeout_ms passes (HAL_FOREVER never times out) */
+template <typename Pred>
+static bool wait_for(std::condition_variable& cv, std::unique_lock<std::mutex>& lk, uint32_t timeout_ms, Pred pred){
+    if(timeout_ms == HAL_FOREVER){
+        cv.wait(lk, pred);
+        return true;
+    }
+    return cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), pred);
+}
+
+static void path_on_host(const char* path, char* out, size_t cap){
+    snprintf(out, cap, "%s/%s", HAL_FS_ROOT, path[0] == '/' ? path + 1 : path);
+}
+
+namespace hal{
+
+/* Clock & logging ---------------------------------------------------------------------------------------------------------- */
+
+uint32_t millis(){
+    if(manual_clock){
+        return (uint32_t)(manual_us / 1000);
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+uint32_t micros(){
+    if(manual_clock){
+        return (uint32_t)manual_us;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+void delay(uint32_t ms){
+    if(manual_clock){
+        manual_us += (uint64_t)ms * 1000;
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delay_until(uint32_t& wake_ms, uint32_t period_ms){
+    wake_ms += period_ms;
+    if(manual_clock){
+        if((int32_t)(wake_ms - millis()) > 0){
+            manual_us = (uint64_t)wake_ms * 1000;
+        }
+        return;
+    }
+    std::this_thread::sleep_until(boot + std::chrono::milliseconds(wake_ms));
+}
+
+void native_clock_manual(uint32_t start_us){
+    manual_us = start_us;
+    manual_clock = true;
+}
+
+void native_clock_advance(uint32_t us){
+    manual_us += us;
+}
+
+void native_set_flash_latency(uint32_t ms){
+    flash_latency_ms = ms;
+}
+
+void log(const char* fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+/* Wall-clock nanoseconds, the manual clock has nothing to do with how long code takes */
+uint32_t cycles(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+uint32_t cycles_per_us(){
+    return 1000;
+}
+
+/* Tasks & synchronisation -------------------------------------------------------------------------------------------------- */
+
+/* Threads have no stack limit to watch, only their names and requested sizes are kept */
+static std::mutex watched_lock;
+static std::vector<std::pair<Task, TaskInfo>> watched;
+
+Task task_create(void (*fn)(void*), const char* name, uint32_t stack, void* arg, unsigned priority, int core){
+    NotifyState* state = new NotifyState();
+    std::thread([=]{
+        self = state;
+        fn(arg);
+    }).detach();
+    task_watch(state, name, stack);
+    return state;
+}
+
+void task_watch(Task task, const char* name, uint32_t stack){
+    std::lock_guard<std::mutex> lk(watched_lock);
+    if(watched.size() < HAL_MAX_TASKS){
+        TaskInfo info;
+        info.name = name;
+        info.stack = stack;
+        watched.push_back(std::make_pair(task, info));
+    }
+}
+
+void task_forget(Task task){
+    std::lock_guard<std::mutex> lk(watched_lock);
+    for(size_t i = 0; i < watched.size(); ++i){
+        if(watched[i].first == task){
+            watched.erase(watched.begin() + i);
+            break;
+        }
+    }
+}
+
+size_t task_info(TaskInfo* out, size_t cap){
+    std::lock_guard<std::mutex> lk(watched_lock);
+    size_t n = 0;
+    for(; n < watched.size() && n < cap; ++n){
+        out[n] = watched[n].second;
+    }
+    return n;
+}
+
+uint32_t heap_free(){
+    return 0;
+}
+
+uint32_t heap_min_free(){
+    return 0;
+}
+
+Task current_task(){
+    if(self == NULL){
+        self = new NotifyState();
+    }
+    return self;
+}
+
+void notify(Task task, uint32_t bits){
+    NotifyState* state = (NotifyState*)task;
+    std::lock_guard<std::mutex> lk(state->lock);
+    state->value |= bits;
+    state->pending = true;
+    state->cv.notify_one();
+}
+
+bool notify_wait(uint32_t clear_on_exit, uint32_t* bits, uint32_t timeout_ms){
+    NotifyState* state = (NotifyState*)current_task();
+    std::unique_lock<std::mutex> lk(state->lock);
+    if(!wait_for(state->cv, lk, timeout_ms, [&]{ return state->pending; })){
+        return false;
+    }
+    state->pending = false;
+    if(bits){
+        *bits = state->value;
+    }
+    state->value &= ~clear_on_exit;
+    return true;
+}
+
+Mutex::Mutex(){
+    handle = new std::mutex();
+}
+
+Mutex::~Mutex(){
+    delete (std::mutex*)handle;
+}
+
+void Mutex::lock(){
+    ((std::mutex*)handle)->lock();
+}
+
+void Mutex::unlock(){
+    ((std::mutex*)handle)->unlock();
+}
+
+Queue::Queue(size_t len, size_t item_size){
+    QueueState* q = new QueueState();
+    q->buf.resize(len * item_size);
+    q->item_size = item_size;
+    q->len = len;
+    handle = q;
+}
+
+Queue::~Queue(){
+    delete (QueueState*)handle;
+}
+
+bool Queue::send(const void* item, uint32_t timeout_ms){
+    QueueState* q = (QueueState*)handle;
+    std::unique_lock<std::mutex> lk(q->lock);
+    if(!wait_for(q->cv, lk, timeout_ms, [&]{ return q->count < q->len; })){
+        return false;
+    }
+    memcpy(&q->buf[((q->head + q->count) % q->len) * q->item_size], item, q->item_size);
+    q->count++;
+    q->cv.notify_all();
+    return true;
+}
+
+bool Queue::recv(void* item, uint32_t timeout_ms){
+    QueueState* q = (QueueState*)handle;
+    std::unique_lock<std::mutex> lk(q->lock);
+    if(!wait_for(q->cv, lk, timeout_ms, [&]{ return q->count > 0; })){
+        return false;
+    }
+    memcpy(item, &q->buf[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    q->cv.notify_all();
+    return true;
+}
+
+MessageBuffer::MessageBuffer(size_t size){
+    MessageBufferState* m = new MessageBufferState();
+    m->buf.resize(size);
+    handle = m;
+}
+
+MessageBuffer::~MessageBuffer(){
+    delete (MessageBufferState*)handle;
+}
+
+bool MessageBuffer::send(const void* data, size_t len, uint32_t timeout_ms){
+    MessageBufferState* m = (MessageBufferState*)handle;
+    std::unique_lock<std::mutex> lk(m->lock);
+    if(!wait_for(m->cv, lk, timeout_ms, [&]{ return m->used + HAL_MESSAGE_OVERHEAD + len <= m->buf.size(); })){
+        return false;
+    }
+    uint32_t n = len;
+    size_t tail = m->head + m->used;
+    m->copy_in(tail, &n, sizeof(n));
+    m->copy_in(tail + sizeof(n), data, len);
+    m->used += sizeof(n) + len;
+    m->cv.notify_all();
+    return true;
+}
+
+size_t MessageBuffer::recv(void* buf, size_t cap, uint32_t timeout_ms){
+    MessageBufferState* m = (MessageBufferState*)handle;
+    std::unique_lock<std::mutex> lk(m->lock);
+    if(!wait_for(m->cv, lk, timeout_ms, [&]{ return m->used > 0; })){
+        return 0;
+    }
+    uint32_t n;
+    m->copy_out(m->head, &n, sizeof(n));
+    if(n > cap){
+        return 0;
+    }
+    m->copy_out(m->head + sizeof(n), buf, n);
+    m->head = (m->head + sizeof(n) + n) % m->buf.size();
+    m->used -= sizeof(n) + n;
+    m->cv.notify_all();
+    return n;
+}
+
+size_t MessageBuffer::space(){
+    MessageBufferState* m = (MessageBufferState*)handle;
+    std::lock_guard<std::mutex> lk(m->lock);
+    return m->buf.size() - m->used;
+}
+
+/* Files -------------------------------------------------------------------------------------------------------------------- */
+
+bool fs_begin(){
+    mkdir(HAL_FS_ROOT, 0755);
+    struct stat st;
+    return stat(HAL_FS_ROOT, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool file_exists(const char* path){
+    char host[256];
+    path_on_host(path, host, sizeof(host));
+    struct stat st;
+    return stat(host, &st) == 0;
+}
+
+bool file_remove(const char* path){
+    char host[256];
+    path_on_host(path, host, sizeof(host));
+    return remove(host) == 0;
+}
+
+File::File(){
+    file = NULL;
+}
+
+File::~File(){
+    close();
+}
+
+bool File::open(const char* path, const char* mode){
+    char host[256];
+    char host_mode[4];
+    close();
+    path_on_host(path, host, sizeof(host));
+    snprintf(host_mode, sizeof(host_mode), "%cb", mode[0]);
+    file = fopen(host, host_mode);
+    return file != NULL;
+}
+
+size_t File::read(void* buf, size_t len){
+    return file ? fread(buf, 1, len, file) : 0;
+}
+
+size_t File::write(const void* buf, size_t len){
+    if(flash_latency_ms && !manual_clock){
+        std::this_thread::sleep_for(std::chrono::milliseconds(flash_latency_ms));
+    }
+    return file ? fwrite(buf, 1, len, file) : 0;
+}
+
+bool File::seek(uint32_t offset){
+    return file && fseek(file, offset, SEEK_SET) == 0;
+}
+
+uint32_t File::size(){
+    struct stat st;
+    if(file == NULL){
+        return 0;
+    }
+    fflush(file);
+    return fstat(fileno(file), &st) == 0 ? st.st_size : 0;
+}
+
+void File::flush(){
+    if(file){
+        fflush(file);
+    }
+}
+
+void File::close(){
+    if(file){
+        fclose(file);
+        file = NULL;
+    }
+}
+
+bool File::is_open() const{
+    return file != NULL;
+}
+
+/* Sensors ------------------------------------------------------------------------------------------------------------------ */
+
+/* Synthetic readings that drift slowly, with the SCD4x's 5 s measurement interval */
+static uint32_t last_scd4x = 0;
+
+bool sensors_begin(){
+    last_scd4x = millis();
+    return true;
+}
+
+bool scd4x_data_ready(){
+    return millis() - last_scd4x >= 5000;
+}
+
+bool scd4x_read(uint16_t& co2, float& temp, float& humd){
+    uint32_t now = millis();
+    if(!scd4x_data_ready()){
+        return false;
+    }
+    last_scd4x = now;
+    float t = now / 1000.0f;
+    co2 = 420 + (uint16_t)(40 * (1 + sinf(t / 60)));
+    /* A plume drifts past every few minutes, so event handling has something to trigger on */
+    if(fmodf(t, 180) >= 20 && fmodf(t, 180) < 30){
+        co2 += 350;
+    }
+    temp = 22.5f + sinf(t / 300);
+    humd = 45.0f + 5 * sinf(t / 200);
+    return true;
+}
+
+static std::atomic<float> sim_height_cm{0};
+static uint32_t bmp_noise = 12345;
+
+void native_set_height(float cm){
+    sim_height_cm = cm;
+}
+
+bool bmp3xx_read(float& temp, float& pres, float& alt){
+    float t = millis() / 1000.0f;
+    temp = 23.0f + sinf(t / 300);
+    /* About 0.12 Pa per cm of climb, on top of slow weather drift and a few Pa of sensor noise */
+    bmp_noise = bmp_noise * 1103515245u + 12345u;
+    float noise = ((int)((bmp_noise >> 16) % 601) - 300) / 100.0f;
+    pres = 101325.0f - 12.0f * (1 + sinf(t / 600)) - 0.12f * sim_height_cm + noise;
+    alt = 44330.0f * (1.0f - powf(pres / 101325.0f, 0.1903f));
+    return true;
+}
+
+}
+
+#endif // ARDUINO
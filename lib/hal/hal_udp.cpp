@@ -0,0 +1,108 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the HAL's UDP sockets, shared by the ESP32 (lwIP) and the host (POSIX)
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#include <string.h>
+#include "hal.hpp"
+
+#ifdef ARDUINO
+#include "lwip/sockets.h"
+#include <unistd.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#endif
+
+namespace hal{
+
+UdpSocket::UdpSocket(){
+    sock = -1;
+}
+
+UdpSocket::~UdpSocket(){
+    close();
+}
+
+bool UdpSocket::bind(uint16_t port){
+    close();
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0){
+        return false;
+    }
+
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(::bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        log("UDP: failed to bind port %u\n", port);
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool UdpSocket::send_to(const char* ip, uint16_t port, const void* data, size_t len){
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    return sendto(sock, data, len, 0, (struct sockaddr*)&addr, sizeof(addr)) == (ssize_t)len;
+}
+
+int UdpSocket::recv(void* buf, size_t cap){
+    if(sock < 0){
+        return -1;
+    }
+    ssize_t len = recvfrom(sock, buf, cap, 0, NULL, NULL);
+    return len < 0 ? -1 : (int)len;
+}
+
+uint32_t UdpSocket::wait_any(UdpSocket* const* socks, size_t n, uint32_t timeout_ms){
+    fd_set fds;
+    FD_ZERO(&fds);
+    int top = -1;
+    for(size_t i = 0; i < n; ++i){
+        if(socks[i]->sock >= 0){
+            FD_SET(socks[i]->sock, &fds);
+            top = socks[i]->sock > top ? socks[i]->sock : top;
+        }
+    }
+    if(top < 0){
+        delay(timeout_ms == HAL_FOREVER ? 1000 : timeout_ms);
+        return 0;
+    }
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    if(select(top + 1, &fds, NULL, NULL, timeout_ms == HAL_FOREVER ? NULL : &tv) <= 0){
+        return 0;
+    }
+    uint32_t mask = 0;
+    for(size_t i = 0; i < n; ++i){
+        if(socks[i]->sock >= 0 && FD_ISSET(socks[i]->sock, &fds)){
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+void UdpSocket::close(){
+    if(sock >= 0){
+        ::close(sock);
+        sock = -1;
+    }
+}
+
+}
@@ -0,0 +1,202 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the delta + varint encoding of sample logs
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include "delta_codec.hpp"
+
+static void setColumn(uint8_t *rec, const SampleColumn &col, int64_t v) {
+  for (uint8_t i = 0; i < col.size; i++) {
+    rec[col.offset + i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+static size_t putVarint(uint8_t *out, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+/* Returns the number of bytes read, 0 if the varint runs past len, -1 if it is too long to be ours */
+static int getVarint(const uint8_t *data, size_t len, uint64_t *v) {
+  *v = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (i == 10) {
+      return -1;
+    }
+    *v |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+    if (!(data[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/* Map signed deltas to unsigned so small negative numbers stay small: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ... */
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void putSync(uint8_t *out, uint32_t offset) {
+  out[0] = DELTA_SYNC_BYTE;
+  out[1] = 'S';
+  out[2] = 'Y';
+  out[3] = 'N';
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = (uint8_t)(offset >> (8 * i));
+  }
+}
+
+static bool isSync(const uint8_t *data, uint32_t offset) {
+  if (data[0] != DELTA_SYNC_BYTE || data[1] != 'S' || data[2] != 'Y' || data[3] != 'N') {
+    return false;
+  }
+  uint32_t at = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+  return at == offset;
+}
+
+/* DeltaEncoder --------------------------------------------------------------------------------------------------------------- */
+
+DeltaEncoder::DeltaEncoder() {
+  syncInterval = DELTA_SYNC_INTERVAL;
+  reset(0);
+}
+
+void DeltaEncoder::reset(uint32_t offset) {
+  this->offset = offset;
+  nextSync = offset;
+  memset(havePrev, 0, sizeof(havePrev));
+}
+
+size_t DeltaEncoder::encode(const uint8_t *rec, uint8_t *out) {
+  uint8_t stream = rec[0];
+  size_t numCols;
+  const SampleColumn *cols = sample_columns(stream, &numCols);
+  if (cols == NULL) {
+    return 0;
+  }
+
+  size_t len = 0;
+  if ((int32_t)(offset - nextSync) >= 0) {
+    putSync(out, offset);
+    len += DELTA_SYNC_LEN;
+    nextSync = offset + syncInterval;
+    memset(havePrev, 0, sizeof(havePrev));
+  }
+
+  bool key = !havePrev[stream];
+  int64_t deltas[SAMPLE_MAX_COLUMNS];
+  uint32_t mask = 0;
+  for (size_t i = 0; i < numCols; i++) {
+    deltas[i] = sample_column_value(rec, &cols[i]) - (key ? 0 : sample_column_value(prev[stream], &cols[i]));
+    if (deltas[i]) {
+      mask |= 1u << i;
+    }
+  }
+
+  out[len++] = stream | (key ? DELTA_KEYFRAME_FLAG : 0);
+  len += putVarint(out + len, mask);
+  for (size_t i = 0; i < numCols; i++) {
+    if (deltas[i]) {
+      len += putVarint(out + len, zigzag(deltas[i]));
+    }
+  }
+
+  memcpy(prev[stream], rec, sample_record_size(stream));
+  havePrev[stream] = true;
+  offset += len;
+  return len;
+}
+
+/* DeltaDecoder --------------------------------------------------------------------------------------------------------------- */
+
+DeltaDecoder::DeltaDecoder() {
+  reset();
+}
+
+void DeltaDecoder::reset() {
+  memset(havePrev, 0, sizeof(havePrev));
+}
+
+int DeltaDecoder::decode(const uint8_t *data, size_t len, uint32_t offset, uint8_t *rec, size_t *rec_len) {
+  *rec_len = 0;
+  if (len == 0) {
+    return 0;
+  }
+
+  if (data[0] == DELTA_SYNC_BYTE) {
+    if (len < DELTA_SYNC_LEN) {
+      return 0;
+    }
+    if (!isSync(data, offset)) {
+      return -1;
+    }
+    reset();
+    return DELTA_SYNC_LEN;
+  }
+
+  uint8_t stream = data[0] & ~DELTA_KEYFRAME_FLAG;
+  bool key = data[0] & DELTA_KEYFRAME_FLAG;
+  size_t numCols;
+  const SampleColumn *cols = sample_columns(stream, &numCols);
+  if (cols == NULL || (!key && !havePrev[stream])) {
+    return -1;
+  }
+
+  size_t pos = 1;
+  uint64_t mask;
+  int n = getVarint(data + pos, len - pos, &mask);
+  if (n <= 0) {
+    return n;
+  }
+  pos += n;
+  if (mask >> numCols) {
+    return -1;
+  }
+
+  /* Decode into a scratch copy so a record cut off by the end of data leaves no trace */
+  size_t size = sample_record_size(stream);
+  uint8_t out[SAMPLE_MAX_RECORD_SIZE];
+  if (key) {
+    memset(out, 0, size);
+  } else {
+    memcpy(out, prev[stream], size);
+  }
+  out[0] = stream;
+  for (size_t i = 0; i < numCols; i++) {
+    if (!(mask & (1u << i))) {
+      continue;
+    }
+    uint64_t zz;
+    n = getVarint(data + pos, len - pos, &zz);
+    if (n <= 0) {
+      return n;
+    }
+    pos += n;
+    setColumn(out, cols[i], sample_column_value(out, &cols[i]) + unzigzag(zz));
+  }
+
+  memcpy(prev[stream], out, size);
+  havePrev[stream] = true;
+  memcpy(rec, out, size);
+  *rec_len = size;
+  return pos;
+}
+
+long DeltaDecoder::findSync(const uint8_t *data, size_t len, uint32_t offset) {
+  for (size_t i = 0; i + DELTA_SYNC_LEN <= len; i++) {
+    if (isSync(data + i, offset + i)) {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,67 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the delta + varint encoding of sample logs (SAMPLE_ENCODING_DELTA)
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Each record is stored column by column as the difference from the previous record of the same stream:
+ *
+ *   tag     stream id, | DELTA_KEYFRAME_FLAG if the deltas are from zero rather than the previous record
+ *   mask    varint, bit i set if column i changed (columns as listed by sample_columns)
+ *   deltas  one zigzag varint per changed column, in column order
+ *
+ * Readings barely move between samples, so most records shrink to a few bytes.
+ * Every DELTA_SYNC_INTERVAL bytes the encoder writes a sync marker (0xA5 "SYN" and the marker's own file
+ * offset, little-endian) and starts every stream again from a keyframe, so a reader can pick up the log
+ * from the middle by scanning for the next marker. The embedded offset rules out look-alikes in the data.
+*/
+
+#ifndef DELTA_CODEC_HPP
+#define DELTA_CODEC_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sample_record.hpp"
+
+#define DELTA_KEYFRAME_FLAG 0x80
+#define DELTA_SYNC_BYTE 0xA5 /* Never a valid tag */
+#define DELTA_SYNC_LEN 8
+#define DELTA_SYNC_INTERVAL 4096 /* One flash block */
+/* Worst case encoded size of one record, including a sync marker in front of it */
+#define DELTA_MAX_ENCODED (DELTA_SYNC_LEN + 1 + 4 + SAMPLE_MAX_COLUMNS * 10)
+
+class DeltaEncoder{
+  public:
+    DeltaEncoder();
+    /* Start a new log, offset is where the first encoded byte goes in the file (just after the header) */
+    void reset(uint32_t offset);
+    /* Encode the raw record rec into out (at least DELTA_MAX_ENCODED bytes).
+     * Returns the number of bytes written, 0 if rec's stream is unknown */
+    size_t encode(const uint8_t *rec, uint8_t *out);
+
+    uint32_t syncInterval;
+
+  private:
+    uint8_t prev[SAMPLE_NUM_STREAMS][SAMPLE_MAX_RECORD_SIZE];
+    bool havePrev[SAMPLE_NUM_STREAMS];
+    uint32_t offset;
+    uint32_t nextSync;
+};
+
+class DeltaDecoder{
+  public:
+    DeltaDecoder();
+    /* Forget all previous records, e.g. before decoding from a sync marker */
+    void reset();
+    /* Decode what starts at data, which sits at offset in the file.
+     * Returns the number of bytes consumed, 0 if more data is needed, or -1 if the data is corrupt or
+     * depends on records that were never seen. rec (SAMPLE_MAX_RECORD_SIZE bytes) receives the raw record
+     * and rec_len its size, which is 0 when a sync marker was consumed instead. */
+    int decode(const uint8_t *data, size_t len, uint32_t offset, uint8_t *rec, size_t *rec_len);
+    /* Index of the first genuine sync marker in data (which sits at offset in the file), or -1 */
+    static long findSync(const uint8_t *data, size_t len, uint32_t offset);
+
+  private:
+    uint8_t prev[SAMPLE_NUM_STREAMS][SAMPLE_MAX_RECORD_SIZE];
+    bool havePrev[SAMPLE_NUM_STREAMS];
+};
+
+#endif // DELTA_CODEC_HPP
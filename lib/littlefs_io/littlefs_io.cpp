@@ -6,6 +6,8 @@
 
 #include "littlefs_io.hpp"
 
+#ifdef ARDUINO
+
 /* You only need to format LittleFS the first time you run a
    test or else use the LITTLEFS plugin to create a partition
    https://github.com/lorol/arduino-esp32littlefs-plugin
@@ -72,11 +74,18 @@ String readFile(fs::FS &fs, const char *path) {
     return data;
   }
 
+  /* The whole file has to fit in heap, prefer readFileChunks/FileChunkReader for logs */
+  if (!data.reserve(file.size())) {
+    Serial.println("- not enough memory to read file");
+    file.close();
+    return data;
+  }
+
   //Serial.println("- read from file:");
-  while (file.available()) {
-    int c = file.read();
-    //Serial.write(c);
-    data.concat((char)c);
+  uint8_t buf[256];
+  size_t n;
+  while ((n = file.read(buf, sizeof(buf))) > 0) {
+    data.concat((const char *)buf, n);
   }
   file.close();
   return data;
@@ -242,4 +251,80 @@ void testFileIO(fs::FS &fs, const char *path) {
   } else {
     Serial.println("- failed to open file for reading");
   }
-}
\ No newline at end of file
+}
+
+/* Compare per-sample appendFile against LogWriter on a typical sensor_read row */
+void testLogWriter(fs::FS &fs, const char *path) {
+  Serial.printf("Testing log writer throughput with %s\r\n", path);
+
+  static LogWriter writer;
+  const char *line = "\n123,87,105,612,24.51,25.02,41.27,1008.93,36.12";
+  const uint32_t samples = 1000;
+  uint32_t i;
+
+  /* Baseline: open, append and close the file for every sample */
+  writeFile(fs, path, "");
+  uint32_t start = millis();
+  for (i = 0; i < samples; i++) {
+    appendFile(fs, path, line);
+  }
+  uint32_t end = millis() - start;
+  if (end == 0) {
+    end = 1;
+  }
+  Serial.printf("- appendFile: %u samples in %lu ms, %.1f samples/s, %.2f flash writes/sample\r\n",
+                samples, end, samples * 1000.0 / end, 1.0);
+
+  /* LogWriter: file stays open, records are flushed in whole blocks */
+  if (!writer.begin(path)) {
+    return;
+  }
+  start = millis();
+  for (i = 0; i < samples; i++) {
+    writer.print(line);
+  }
+  writer.end();
+  end = millis() - start;
+  if (end == 0) {
+    end = 1;
+  }
+  Serial.printf("- LogWriter:  %u samples in %lu ms, %.1f samples/s, %.2f flash writes/sample\r\n",
+                samples, end, samples * 1000.0 / end, (float)writer.flash_writes / samples);
+}
+
+
+
+/* Compare reading a whole file into a String against streaming it through a 512 byte arena */
+static bool countChunk(const uint8_t *data, size_t len, uint32_t offset, void *ctx) {
+  *(uint32_t *)ctx += data[len - 1];
+  return true;
+}
+
+void testFileRead(fs::FS &fs, const char *path) {
+  Serial.printf("Testing read throughput with %s\r\n", path);
+
+  uint32_t heap = ESP.getFreeHeap();
+  uint32_t start = millis();
+  String data = readFile(fs, path);
+  uint32_t end = millis() - start;
+  if (end == 0) {
+    end = 1;
+  }
+  uint32_t used = heap - ESP.getFreeHeap();
+  Serial.printf("- readFile:       %u bytes in %lu ms, %.1f KB/s, %u bytes of heap\r\n",
+                data.length(), end, data.length() / 1.024 / end, used);
+  data = String();
+
+  static uint8_t arena[512];
+  uint32_t sum = 0;
+  start = millis();
+  size_t total = readFileChunks(path, 0, arena, sizeof(arena), countChunk, &sum);
+  end = millis() - start;
+  if (end == 0) {
+    end = 1;
+  }
+  Serial.printf("- readFileChunks: %u bytes in %lu ms, %.1f KB/s, %u bytes of arena\r\n",
+                total, end, total / 1.024 / end, sizeof(arena));
+}
+
+#endif // ARDUINO
\ No newline at end of file
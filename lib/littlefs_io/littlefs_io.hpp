@@ -4,6 +4,11 @@
  * Code derived from Arduino ESP32 LittleFS example (https://github.com/espressif/arduino-esp32/blob/master/libraries/LittleFS/examples/LITTLEFS_test/LITTLEFS_test.ino)
  */ 
 
+#include "log_writer.hpp"
+
+/* The helpers below work on Arduino fs::FS objects and are only available on the ESP32 */
+#ifdef ARDUINO
+
 #include <Arduino.h>
 #include "FS.h"
 #include <LittleFS.h>
@@ -31,4 +36,8 @@ void deleteFile(fs::FS &fs, const char *path);
 // SPIFFS-like write and delete file, better use #define CONFIG_LITTLEFS_SPIFFS_COMPAT 1
 void writeFile2(fs::FS &fs, const char *path, const char *message);
 void deleteFile2(fs::FS &fs, const char *path);
-void testFileIO(fs::FS &fs, const char *path);
\ No newline at end of file
+void testFileIO(fs::FS &fs, const char *path);
+void testLogWriter(fs::FS &fs, const char *path);
+void testFileRead(fs::FS &fs, const char *path);
+
+#endif // ARDUINO
\ No newline at end of file
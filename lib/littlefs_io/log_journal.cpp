@@ -0,0 +1,337 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the journaled log layout
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "log_journal.hpp"
+#include "crc32.hpp"
+
+/* Stored in LOG_RUN_COUNTER_PATH, check is ~next so a half-written counter is never believed */
+struct __attribute__((packed)) LogRunCounter{
+  uint32_t next;
+  uint32_t check;
+};
+
+static uint32_t segmentCrc(const LogSegmentHeader &hdr) {
+  return crc32_update(0, &hdr, offsetof(LogSegmentHeader, crc));
+}
+
+static uint32_t blockHeaderCrc(const LogBlockHeader &hdr) {
+  return crc32_update(0, &hdr, offsetof(LogBlockHeader, crc));
+}
+
+/* Header of segment index of run, read from the start of f */
+static bool readSegmentHeader(hal::File &f, uint32_t run, uint16_t index, LogSegmentHeader *hdr) {
+  return f.seek(0) && f.read(hdr, sizeof(*hdr)) == sizeof(*hdr) && hdr->magic == LOG_SEGMENT_MAGIC &&
+         hdr->version == LOG_JOURNAL_VERSION && hdr->segment == index && hdr->run == run && hdr->crc == segmentCrc(*hdr);
+}
+
+/* Whether a block header could have been written by LogWriter, before its checksum is known */
+static bool plausibleBlock(const LogBlockHeader &hdr, uint32_t expect) {
+  return hdr.magic == LOG_BLOCK_MAGIC && hdr.offset == expect && hdr.len <= LOG_BLOCK_PAYLOAD &&
+         (!(hdr.flags & LOG_BLOCK_COMMIT) || hdr.len == 0);
+}
+
+/* Check a block's payload, which f is positioned at, against its header. Reads it through buf */
+static bool checkPayload(hal::File &f, const LogBlockHeader &hdr, uint8_t *buf, size_t buf_size) {
+  uint32_t crc = blockHeaderCrc(hdr);
+  size_t left = hdr.len;
+  while (left) {
+    size_t n = f.read(buf, std::min(left, buf_size));
+    if (n == 0) {
+      return false;
+    }
+    crc = crc32_update(crc, buf, n);
+    left -= n;
+  }
+  return crc == hdr.crc;
+}
+
+void logSegmentPath(char out[LOG_PATH_LEN], uint32_t run, uint32_t segment) {
+  snprintf(out, LOG_PATH_LEN, "/run%04lu.%03u", (unsigned long)run, (unsigned)segment);
+}
+
+uint32_t logNextRun() {
+  LogRunCounter counter;
+  uint32_t run = 1;
+  hal::File f;
+  if (f.open(LOG_RUN_COUNTER_PATH, "r") && f.read(&counter, sizeof(counter)) == sizeof(counter) &&
+      counter.check == ~counter.next && counter.next > 0) {
+    run = counter.next;
+  }
+  f.close();
+
+  /* The counter may not have been committed before a brownout, never reuse a run that has files */
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, run, 0);
+  while (hal::file_exists(path)) {
+    logSegmentPath(path, ++run, 0);
+  }
+  return run;
+}
+
+uint32_t logClaimRun() {
+  uint32_t run = logNextRun();
+  LogRunCounter counter = {run + 1, ~(run + 1)};
+  hal::File f;
+  if (!f.open(LOG_RUN_COUNTER_PATH, "w") || f.write(&counter, sizeof(counter)) != sizeof(counter)) {
+    hal::log("- failed to update the run counter\n");
+    return 0;
+  }
+  f.flush();
+  f.close();
+  return run;
+}
+
+uint32_t logLastRun() {
+  uint32_t run = logNextRun() - 1;
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, run, 0);
+  return run > 0 && hal::file_exists(path) ? run : 0;
+}
+
+uint16_t logSegmentCount(uint32_t run) {
+  char path[LOG_PATH_LEN];
+  uint16_t n = 0;
+  while (n < LOG_MAX_SEGMENTS) {
+    logSegmentPath(path, run, n);
+    if (!hal::file_exists(path)) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+/* Walk every block of one segment, checking its checksum. Returns false if the segment header is unusable */
+static bool scanSegment(uint32_t run, uint16_t index, LogRecovery *out) {
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, run, index);
+  hal::File f;
+  LogSegmentHeader seg;
+  if (!f.open(path, "r") || !readSegmentHeader(f, run, index, &seg)) {
+    return false;
+  }
+
+  /* Everything before this segment was committed when it was started */
+  uint32_t size = f.size();
+  uint32_t at = sizeof(seg);
+  uint32_t expect = seg.offset;
+  out->bytes = seg.offset;
+  out->committed = seg.offset;
+  out->closed = false;
+  uint8_t buf[256];
+  LogBlockHeader hdr;
+  while (at + sizeof(hdr) <= size && f.read(&hdr, sizeof(hdr)) == sizeof(hdr) && plausibleBlock(hdr, expect) &&
+         at + sizeof(hdr) + hdr.len <= size) {
+    if (checkPayload(f, hdr, buf, sizeof(buf))) {
+      out->blocks++;
+      out->bytes = hdr.offset + hdr.len;
+      if (hdr.flags & LOG_BLOCK_COMMIT) {
+        out->committed = hdr.offset;
+      }
+      out->closed = (hdr.flags & LOG_BLOCK_COMMIT) != 0;
+    } else {
+      out->bad++;
+      out->closed = false;
+      f.seek(at + sizeof(hdr) + hdr.len);
+    }
+    at += sizeof(hdr) + hdr.len;
+    expect = hdr.offset + hdr.len;
+  }
+  out->torn = size - at;
+  out->closed = out->closed && out->torn == 0;
+  return true;
+}
+
+bool logRecover(uint32_t run, LogRecovery *out) {
+  *out = LogRecovery();
+  out->run = run;
+  out->segments = run ? logSegmentCount(run) : 0;
+
+  /* A segment can be created but cut off before its header was committed, then the previous one is the end */
+  for (int i = out->segments - 1; i >= 0 && i >= out->segments - 2; i--) {
+    if (scanSegment(run, i, out)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void LogRecovery::log() const {
+  hal::log("Log run %lu: %lu bytes in %u segments, committed up to %lu, %lu bad blocks, %lu torn bytes, %s\n",
+           (unsigned long)run, (unsigned long)bytes, segments, (unsigned long)committed, (unsigned long)bad,
+           (unsigned long)torn, closed ? "closed cleanly" : "cut off");
+}
+
+/* LogJournalReader ----------------------------------------------------------------------------------------------------------- */
+
+#define LOG_NO_SEGMENT 0xFFFFFFFF /* segStart of a segment whose header is unusable */
+
+LogJournalReader::LogJournalReader(uint8_t *arena, size_t arena_size) {
+  this->arena = arena;
+  this->arena_size = arena_size;
+  chunk = arena_size;
+  run = 0;
+  badBlocks = 0;
+  pos = 0;
+  len = 0;
+  open_ = false;
+  segments = 0;
+  segment = 0;
+  blockAt = 0;
+  blockOffset = 0;
+  blockLen = 0;
+  blockChecked = true;
+  blockValid = false;
+}
+
+bool LogJournalReader::open(uint32_t run, uint32_t offset) {
+  LogRecovery rec;
+  if (!logRecover(run, &rec)) {
+    close();
+    hal::log("- failed to open log run for reading\n");
+    return false;
+  }
+  return open(run, offset, rec.bytes);
+}
+
+bool LogJournalReader::open(uint32_t run, uint32_t offset, uint32_t size) {
+  close();
+  segments = logSegmentCount(run);
+  if (segments == 0) {
+    return false;
+  }
+
+  /* Segments that start at or past the end have nothing in them to read (the first is kept, for an empty run) */
+  char path[LOG_PATH_LEN];
+  LogSegmentHeader hdr;
+  for (uint16_t i = 0; i < segments; i++) {
+    logSegmentPath(path, run, i);
+    segStart[i] = file.open(path, "r") && readSegmentHeader(file, run, i, &hdr) ? hdr.offset : LOG_NO_SEGMENT;
+    file.close();
+  }
+  while (segments > 0 && (segStart[segments - 1] == LOG_NO_SEGMENT || (segments > 1 && segStart[segments - 1] >= size))) {
+    segments--;
+  }
+
+  this->run = run;
+  badBlocks = 0;
+  len = size;
+  open_ = true;
+  segment = segments;
+  return seek(offset);
+}
+
+bool LogJournalReader::seek(uint32_t offset) {
+  if (!open_ || offset > len) {
+    return false;
+  }
+
+  /* Carry on from the current block when going forwards or staying in it, as when a record was cut off */
+  uint16_t target = 0;
+  for (uint16_t i = 0; i < segments; i++) {
+    if (segStart[i] != LOG_NO_SEGMENT && segStart[i] <= offset) {
+      target = i;
+    }
+  }
+  if (segment != target || offset < blockOffset) {
+    if (!openSegment(target)) {
+      return false;
+    }
+  }
+  pos = offset;
+  return true;
+}
+
+void LogJournalReader::setChunkSize(size_t len) {
+  chunk = std::min(len, arena_size);
+}
+
+size_t LogJournalReader::next(const uint8_t **data, size_t max) {
+  if (!open_ || pos >= len) {
+    return 0;
+  }
+  size_t want = std::min(std::min(chunk, max), (size_t)(len - pos));
+
+  /* Find the block pos is in, or the first one after it */
+  bool found = true;
+  while (found && pos >= blockOffset + blockLen) {
+    found = nextBlock();
+  }
+
+  size_t n;
+  /* Only blocks that are actually read are checked, so seeking past the others costs a header read each */
+  if (found && pos >= blockOffset && !blockChecked) {
+    blockValid = file.seek(blockAt) && checkPayload(file, block, arena, arena_size);
+    blockChecked = true;
+    badBlocks += !blockValid;
+  }
+  if (found && pos >= blockOffset && blockValid) {
+    n = std::min(want, (size_t)(blockOffset + blockLen - pos));
+    if (!file.seek(blockAt + (pos - blockOffset)) || file.read(arena, n) != n) {
+      return 0;
+    }
+  } else {
+    /* Lost data reads as zeros up to where the log picks up again, so every later offset stays put */
+    uint32_t end = !found ? len : pos >= blockOffset ? blockOffset + blockLen : blockOffset;
+    n = std::min(want, (size_t)(end - pos));
+    memset(arena, 0, n);
+  }
+  pos += n;
+  *data = arena;
+  return n;
+}
+
+void LogJournalReader::close() {
+  if (open_) {
+    file.close();
+    open_ = false;
+  }
+}
+
+bool LogJournalReader::openSegment(uint16_t index) {
+  file.close();
+  segment = index;
+  blockAt = sizeof(LogSegmentHeader);
+  blockOffset = segStart[index];
+  blockLen = 0;
+  blockChecked = true;
+  blockValid = false;
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, run, index);
+  return file.open(path, "r");
+}
+
+/* Step to the next block, moving on to the next segment at the end of this one. Returns false after the last */
+bool LogJournalReader::nextBlock() {
+  while (segment < segments) {
+    LogBlockHeader hdr;
+    if (file.is_open() && file.seek(blockAt + blockLen) && file.read(&hdr, sizeof(hdr)) == sizeof(hdr) &&
+        plausibleBlock(hdr, blockOffset + blockLen)) {
+      blockAt += blockLen + sizeof(hdr);
+      blockOffset = hdr.offset;
+      blockLen = hdr.len;
+      block = hdr;
+      blockChecked = false;
+      blockValid = false;
+      return true;
+    }
+
+    /* Nothing more can be trusted in this segment */
+    uint16_t n = segment + 1;
+    while (n < segments && segStart[n] == LOG_NO_SEGMENT) {
+      n++;
+    }
+    if (n >= segments) {
+      file.close();
+      segment = segments;
+      return false;
+    }
+    openSegment(n);
+  }
+  return false;
+}
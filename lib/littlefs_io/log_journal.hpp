@@ -0,0 +1,148 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the journaled log layout: per-run segment files, checksummed blocks and commit markers
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Every boot that logs claims the next run number from LOG_RUN_COUNTER_PATH, so no run ever overwrites
+ * another. A run is a series of segment files (logSegmentPath), each at most about LOG_SEGMENT_SIZE:
+ *
+ *   LogSegmentHeader   which run and segment this is, and the log offset of its first block
+ *   LogBlockHeader     then a block of up to LOG_BLOCK_PAYLOAD bytes of the log, repeated
+ *
+ * Each block carries its offset in the log and a CRC-32 over its header and payload, and only ever holds whole
+ * write()s (LogWriter refuses records longer than LOG_BLOCK_PAYLOAD in a run), so a valid block always ends on a
+ * record. Every file system commit ends with a LOG_BLOCK_COMMIT
+ * block (no payload): where there is one, everything before it survived. LittleFS only loses what was written
+ * since the last commit, but the checksums also catch torn or corrupt blocks on any file system.
+ *
+ * Only the last segment of a run can have been cut short by a brownout (the others were committed when the
+ * next one was started), so logRecover() reads just that one. It checksums the whole segment, so do it once (at
+ * mount) rather than on every read: a run still being written can be read up to LogWriter::committed() instead.
+ * LogJournalReader reads a run back as the log
+ * it was written as: offsets are preserved and any block that fails its checksum reads as zeros, which the
+ * sample log decoder skips up to its next sync marker (see delta_codec.hpp).
+*/
+
+#ifndef LOG_JOURNAL_HPP
+#define LOG_JOURNAL_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+#include "log_writer.hpp"
+
+#define LOG_SEGMENT_MAGIC 0x47534A45 /* "EJSG" */
+#define LOG_BLOCK_MAGIC 0x4B424A45   /* "EJBK" */
+#define LOG_JOURNAL_VERSION 1
+
+#define LOG_RUN_COUNTER_PATH "/run.cnt"
+#define LOG_PATH_LEN 32 /* Room for any segment path, e.g. "/run0007.002" */
+#define LOG_SEGMENT_SIZE (16 * LOG_BLOCK_SIZE) /* A new segment is started once a block would not fit in this */
+#define LOG_MAX_SEGMENTS 64 /* Per run, 4 MB. The last segment keeps growing past LOG_SEGMENT_SIZE after that */
+/* In journaled mode buffered data is written out and committed at least this often, in ms. Each commit writes
+ * whatever is buffered as a block of its own, usually well short of LOG_BLOCK_PAYLOAD, then a commit block: unlike
+ * a plain log, which only writes whole blocks until LOG_FLUSH_INTERVAL_MS, a run makes partial flash writes so
+ * that a brownout loses at most this much */
+#define LOG_COMMIT_INTERVAL_MS 2000
+
+/* Start of every segment file, 20 bytes */
+struct __attribute__((packed)) LogSegmentHeader{
+  uint32_t magic;    /* LOG_SEGMENT_MAGIC */
+  uint16_t version;  /* LOG_JOURNAL_VERSION */
+  uint16_t segment;  /* Index in the run, from 0 */
+  uint32_t run;
+  uint32_t offset;   /* Log offset of the segment's first block */
+  uint32_t crc;      /* CRC-32 of the fields above */
+};
+
+enum LogBlockFlags{
+  LOG_BLOCK_COMMIT = 1 /* Last block of each commit, len is 0 */
+};
+
+/* In front of every block, 16 bytes */
+struct __attribute__((packed)) LogBlockHeader{
+  uint32_t magic;   /* LOG_BLOCK_MAGIC */
+  uint32_t offset;  /* Log offset of the first payload byte */
+  uint16_t len;     /* Payload bytes that follow */
+  uint8_t flags;    /* LogBlockFlags */
+  uint8_t reserved;
+  uint32_t crc;     /* CRC-32 of the header up to here, then the payload */
+};
+
+/* Most payload in one block, so a framed block is LOG_BLOCK_SIZE bytes. It is not aligned to a flash block though:
+ * segments start with the 20 byte LogSegmentHeader, so a full block generally straddles two flash blocks */
+#define LOG_BLOCK_PAYLOAD (LOG_BLOCK_SIZE - sizeof(LogBlockHeader))
+
+/* What logRecover() found at the end of a run */
+struct LogRecovery{
+  uint32_t run = 0;       /* 0 if there is no run on the file system */
+  uint16_t segments = 0;  /* Segment files in the run */
+  uint32_t bytes = 0;     /* Log bytes up to the end of the last valid block, which ends on a record */
+  uint32_t committed = 0; /* Log bytes up to the last commit marker */
+  uint32_t blocks = 0;    /* Valid blocks in the last segment */
+  uint32_t bad = 0;       /* Blocks in the last segment that failed their checksum */
+  uint32_t torn = 0;      /* Bytes at the end of the last segment that are not part of a valid block */
+  bool closed = false;    /* The run ended with a commit rather than being cut off */
+
+  void log() const;
+};
+
+/* Path of one segment of a run */
+void logSegmentPath(char out[LOG_PATH_LEN], uint32_t run, uint32_t segment);
+/* Run number the next beginRun() will claim, never one that already has files */
+uint32_t logNextRun();
+/* Take logNextRun() for a new run and commit the counter past it, returns 0 if the counter cannot be written */
+uint32_t logClaimRun();
+/* Most recent run, 0 if there is none */
+uint32_t logLastRun();
+/* Number of segment files in a run */
+uint16_t logSegmentCount(uint32_t run);
+/* Find where a run's log validly ends, reading only its last segment. Returns false if the run has no segments */
+bool logRecover(uint32_t run, LogRecovery *out);
+
+/* Reads a run back as one log, with FileChunkReader's interface, through a fixed-size, caller-owned arena */
+class LogJournalReader{
+  public:
+    LogJournalReader(uint8_t *arena, size_t arena_size);
+
+    /* Open a run, its size is where logRecover() says it ends */
+    bool open(uint32_t run, uint32_t offset = 0);
+    /* Open a run whose size is already known, e.g. from a recovery made at mount or LogWriter::committed() for the
+     * run being written, without scanning it again */
+    bool open(uint32_t run, uint32_t offset, uint32_t size);
+    bool seek(uint32_t offset);
+    void setChunkSize(size_t len);
+    /* Read the next chunk of up to min(chunk size, max) bytes of the log into the arena and point data at it.
+     * Returns its length, 0 at the end of the run. The chunk is valid until the next call. */
+    size_t next(const uint8_t **data, size_t max = (size_t)-1);
+    void close();
+
+    bool isOpen() const { return open_; }
+    uint32_t position() const { return pos; }
+    uint32_t size() const { return len; }
+
+    uint32_t run;
+    uint32_t badBlocks; /* Blocks read so far that failed their checksum and read as zeros */
+
+  private:
+    hal::File file;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t chunk;
+    uint32_t pos;
+    uint32_t len;
+    bool open_;
+    uint16_t segments;
+    uint16_t segment;           /* Segment file open */
+    uint32_t segStart[LOG_MAX_SEGMENTS]; /* Log offset each segment starts at */
+    uint32_t blockAt;           /* File position of the current block's payload */
+    uint32_t blockOffset;       /* Log offset and length of the current block's payload */
+    uint32_t blockLen;
+    LogBlockHeader block;
+    bool blockChecked;          /* Its checksum has been checked, and blockValid says how that went */
+    bool blockValid;
+
+    bool openSegment(uint16_t index);
+    bool nextBlock();
+};
+
+#endif // LOG_JOURNAL_HPP
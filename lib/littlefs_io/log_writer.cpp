@@ -0,0 +1,366 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for buffered log writing and chunked log reading
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include "log_writer.hpp"
+#include "log_journal.hpp"
+#include "crc32.hpp"
+#include "metrics.hpp"
+
+size_t readFileChunks(const char *path, uint32_t offset, uint8_t *arena, size_t arena_size, ChunkCallback cb, void *ctx) {
+  FileChunkReader reader(arena, arena_size);
+  if (!reader.open(path, offset)) {
+    return 0;
+  }
+
+  size_t total = 0;
+  const uint8_t *data;
+  size_t n;
+  while ((n = reader.next(&data)) > 0) {
+    uint32_t at = reader.position() - n;
+    total += n;
+    if (!cb(data, n, at, ctx)) {
+      break;
+    }
+  }
+  reader.close();
+  return total;
+}
+
+/* LogWriter ------------------------------------------------------------------------------------------------------------------ */
+
+LogWriter::LogWriter() {
+  open = false;
+  runId = 0;
+  reset();
+}
+
+/* Start the statistics and buffer afresh, caller must hold the lock */
+void LogWriter::reset() {
+  records = 0;
+  bytes_written = 0;
+  flash_writes = 0;
+  dropped = 0;
+  commits = 0;
+  head = 0;
+  count = 0;
+  last_flush = hal::millis();
+  last_commit = last_flush;
+  segment = 0;
+  segmentBytes = 0;
+  offset = 0;
+  committed_ = 0;
+  dirty = false;
+}
+
+bool LogWriter::begin(const char *path, const char *header) {
+  return begin(path, (const uint8_t *)header, header ? strlen(header) : 0);
+}
+
+bool LogWriter::begin(const char *path, const uint8_t *header, size_t header_len) {
+  if (open) {
+    end();
+  }
+
+  lock.lock();
+  if (!file.open(path, "w")) {
+    hal::log("- failed to open file for logging\n");
+    lock.unlock();
+    return false;
+  }
+  open = true;
+  runId = 0;
+  reset();
+  lock.unlock();
+
+  if (header_len) {
+    write(header, header_len);
+    records = 0;
+  }
+  return true;
+}
+
+bool LogWriter::beginRun(const uint8_t *header, size_t header_len) {
+  if (open) {
+    end();
+  }
+
+  lock.lock();
+  reset();
+  runId = logClaimRun();
+  if (!runId || !openSegment(0)) {
+    hal::log("- failed to start a log run\n");
+    runId = 0;
+    lock.unlock();
+    return false;
+  }
+  open = true;
+  lock.unlock();
+
+  if (header_len) {
+    write(header, header_len);
+    records = 0;
+  }
+  return true;
+}
+
+size_t LogWriter::write(const uint8_t *data, size_t len) {
+  if (!open) {
+    return 0;
+  }
+  lock.lock();
+  records++;
+
+  /* Journal blocks only hold whole records, so a record that cannot fit in one is refused */
+  if (runId && len > LOG_BLOCK_PAYLOAD) {
+    dropped += len;
+    METRIC_COUNT(METRIC_FLASH_LOST, len);
+    lock.unlock();
+    return 0;
+  }
+
+  /* Only records larger than a block can overflow the ring, write out everything buffered first.
+   * In a journal a block goes out as soon as the next record would not fit in it */
+  if (count + len > (runId ? LOG_BLOCK_PAYLOAD : LOG_BUFFER_SIZE)) {
+    flushBuffer(count);
+  }
+
+  if (len > LOG_BUFFER_SIZE) {
+    size_t written = 0;
+    {
+      METRIC_TIME(METRIC_FLASH_WRITE);
+      written = file.write(data, len);
+    }
+    flash_writes++;
+    bytes_written += written;
+    dropped += len - written;
+    METRIC_COUNT(METRIC_FLASH_BYTES, written);
+    METRIC_COUNT(METRIC_FLASH_LOST, len - written);
+  } else {
+    size_t tail = (head + count) % LOG_BUFFER_SIZE;
+    size_t first = std::min(len, (size_t)LOG_BUFFER_SIZE - tail);
+    memcpy(buf + tail, data, first);
+    memcpy(buf, data + first, len - first);
+    count += len;
+  }
+
+  /* Write out whole blocks as soon as they are available, or everything if the time threshold passed */
+  if (runId) {
+    if (count >= LOG_BLOCK_PAYLOAD) {
+      flushBuffer(count);
+    }
+    if (hal::millis() - last_commit >= LOG_COMMIT_INTERVAL_MS) {
+      flushBuffer(count);
+      commit();
+    }
+  } else if (count >= LOG_BLOCK_SIZE) {
+    flushBuffer(count - (count % LOG_BLOCK_SIZE));
+  } else if (hal::millis() - last_flush >= LOG_FLUSH_INTERVAL_MS) {
+    flushBuffer(count);
+  }
+  lock.unlock();
+  return len;
+}
+
+uint32_t LogWriter::committed() {
+  lock.lock();
+  uint32_t n = committed_;
+  lock.unlock();
+  return n;
+}
+
+size_t LogWriter::print(const char *msg) {
+  return write((const uint8_t *)msg, strlen(msg));
+}
+
+void LogWriter::poll() {
+  if (!open) {
+    return;
+  }
+  lock.lock();
+  if (runId) {
+    if (hal::millis() - last_commit >= LOG_COMMIT_INTERVAL_MS) {
+      flushBuffer(count);
+      commit();
+    }
+  } else if (count && hal::millis() - last_flush >= LOG_FLUSH_INTERVAL_MS) {
+    flushBuffer(count);
+  }
+  lock.unlock();
+}
+
+bool LogWriter::sync() {
+  if (!open) {
+    return false;
+  }
+  lock.lock();
+  uint32_t lost = dropped;
+  flushBuffer(count);
+  if (runId) {
+    commit();
+  } else {
+    file.flush();
+  }
+  lock.unlock();
+  return dropped == lost;
+}
+
+void LogWriter::end() {
+  if (!open) {
+    return;
+  }
+  sync();
+  lock.lock();
+  file.close();
+  open = false;
+  lock.unlock();
+}
+
+/* Write len bytes from the front of the ring buffer to the file, caller must hold the lock.
+ * Partial flushes always empty the buffer, so whole-block flushes stay block aligned and go out as a single write.
+ * In a journaled run each LOG_BLOCK_PAYLOAD bytes become one block, wherever they sit in the ring. */
+size_t LogWriter::flushBuffer(size_t len) {
+  size_t total = 0;
+  while (len) {
+    size_t seg = std::min(len, runId ? (size_t)LOG_BLOCK_PAYLOAD : (size_t)LOG_BUFFER_SIZE - head);
+    size_t first = std::min(seg, (size_t)LOG_BUFFER_SIZE - head);
+    size_t written;
+    {
+      METRIC_TIME(METRIC_FLASH_WRITE);
+      written = runId ? writeBlock(buf + head, first, buf, seg - first, 0) : file.write(buf + head, seg);
+    }
+    flash_writes++;
+    bytes_written += written;
+    dropped += seg - written;
+    METRIC_COUNT(METRIC_FLASH_BYTES, written);
+    METRIC_COUNT(METRIC_FLASH_LOST, seg - written);
+    total += written;
+    head = (head + seg) % LOG_BUFFER_SIZE;
+    count -= seg;
+    len -= seg;
+  }
+  if (count == 0) {
+    head = 0;
+  }
+  last_flush = hal::millis();
+  return total;
+}
+
+/* Start segment index of the current run at the current log offset, caller must hold the lock */
+bool LogWriter::openSegment(uint16_t index) {
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, runId, index);
+  file.close();
+  if (!file.open(path, "w")) {
+    return false;
+  }
+  LogSegmentHeader hdr = {LOG_SEGMENT_MAGIC, LOG_JOURNAL_VERSION, index, runId, offset, 0};
+  hdr.crc = crc32_update(0, &hdr, offsetof(LogSegmentHeader, crc));
+  segment = index;
+  segmentBytes = file.write(&hdr, sizeof(hdr));
+  dirty = true;
+  return segmentBytes == sizeof(hdr);
+}
+
+/* Frame alen bytes at a followed by blen bytes at b as one block of the run, caller must hold the lock.
+ * Returns the payload bytes the file system took, the log offset moves on by all of them regardless */
+size_t LogWriter::writeBlock(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen, uint8_t flags) {
+  size_t len = alen + blen;
+
+  /* Commit the segment before starting the next, so only the last one of a run can ever be cut short */
+  if (len && segmentBytes + sizeof(LogBlockHeader) + len > LOG_SEGMENT_SIZE && segmentBytes > sizeof(LogSegmentHeader) &&
+      segment + 1 < LOG_MAX_SEGMENTS) {
+    commit();
+    if (!openSegment(segment + 1)) {
+      hal::log("- failed to start log segment %u\n", segment + 1);
+    }
+  }
+
+  LogBlockHeader hdr = {LOG_BLOCK_MAGIC, offset, (uint16_t)len, flags, 0, 0};
+  uint32_t crc = crc32_update(0, &hdr, offsetof(LogBlockHeader, crc));
+  crc = crc32_update(crc, a, alen);
+  hdr.crc = crc32_update(crc, b, blen);
+
+  size_t written = 0;
+  if (file.write(&hdr, sizeof(hdr)) == sizeof(hdr)) {
+    written = (alen ? file.write(a, alen) : 0) + (blen ? file.write(b, blen) : 0);
+  }
+  segmentBytes += sizeof(hdr) + len;
+  offset += len;
+  dirty = dirty || !(flags & LOG_BLOCK_COMMIT);
+  return written;
+}
+
+/* Mark everything written so far as committed and make it durable, if anything was. Caller must hold the lock */
+void LogWriter::commit() {
+  last_commit = hal::millis();
+  if (!dirty) {
+    return;
+  }
+  METRIC_TIME(METRIC_FLASH_COMMIT);
+  writeBlock(NULL, 0, NULL, 0, LOG_BLOCK_COMMIT);
+  file.flush();
+  commits++;
+  committed_ = offset;
+  dirty = false;
+}
+
+/* FileChunkReader ------------------------------------------------------------------------------------------------------------ */
+
+FileChunkReader::FileChunkReader(uint8_t *arena, size_t arena_size) {
+  this->arena = arena;
+  this->arena_size = arena_size;
+  chunk = arena_size;
+  pos = 0;
+  len = 0;
+  open_ = false;
+}
+
+bool FileChunkReader::open(const char *path, uint32_t offset) {
+  close();
+  if (!file.open(path, "r")) {
+    hal::log("- failed to open file for reading\n");
+    return false;
+  }
+  open_ = true;
+  len = file.size();
+  pos = 0;
+  return seek(offset);
+}
+
+bool FileChunkReader::seek(uint32_t offset) {
+  if (!open_ || offset > len) {
+    return false;
+  }
+  if (!file.seek(offset)) {
+    return false;
+  }
+  pos = offset;
+  return true;
+}
+
+void FileChunkReader::setChunkSize(size_t len) {
+  chunk = std::min(len, arena_size);
+}
+
+size_t FileChunkReader::next(const uint8_t **data, size_t max) {
+  if (!open_ || pos >= len) {
+    return 0;
+  }
+  size_t want = std::min(std::min(chunk, max), (size_t)(len - pos));
+  size_t n = file.read(arena, want);
+  pos += n;
+  *data = arena;
+  return n;
+}
+
+void FileChunkReader::close() {
+  if (open_) {
+    file.close();
+    open_ = false;
+  }
+}
@@ -0,0 +1,122 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for buffered log writing and chunked log reading, on top of the HAL's files
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Paths are on the file system mounted by hal::fs_begin() (LittleFS on the ESP32).
+*/ 
+
+#ifndef LOG_WRITER_HPP
+#define LOG_WRITER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+
+/* Called by readFileChunks for each chunk, return false to stop early */
+typedef bool (*ChunkCallback)(const uint8_t *data, size_t len, uint32_t offset, void *ctx);
+
+/* Read the file at path from offset onwards in chunks of up to arena_size bytes, handing each to cb.
+ * Memory use is the caller's arena regardless of the file size. Returns the number of bytes delivered. */
+size_t readFileChunks(const char *path, uint32_t offset, uint8_t *arena, size_t arena_size, ChunkCallback cb, void *ctx);
+
+/* Iterator-style reader that streams a file through a fixed-size, caller-owned arena */
+class FileChunkReader{
+  public:
+    FileChunkReader(uint8_t *arena, size_t arena_size);
+
+    bool open(const char *path, uint32_t offset = 0);
+    bool seek(uint32_t offset);
+    /* Largest chunk next() returns, clamped to the arena size (the default) */
+    void setChunkSize(size_t len);
+    /* Read the next chunk of up to min(chunk size, max) bytes into the arena and point data at it.
+     * Returns its length, 0 at the end of the file. The chunk is valid until the next call. */
+    size_t next(const uint8_t **data, size_t max = (size_t)-1);
+    void close();
+
+    bool isOpen() const { return open_; }
+    uint32_t position() const { return pos; }
+    uint32_t size() const { return len; }
+
+  private:
+    hal::File file;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t chunk;
+    uint32_t pos;
+    uint32_t len;
+    bool open_;
+};
+
+/* LittleFS block size on the ESP32's flash, buffered log data is written out in multiples of this */
+#define LOG_BLOCK_SIZE 4096
+/* Size of the RAM ring buffer that holds log records not yet written to flash */
+#define LOG_BUFFER_SIZE (2 * LOG_BLOCK_SIZE)
+/* Write out whatever is buffered if nothing has been flushed for this long, in ms */
+#define LOG_FLUSH_INTERVAL_MS 10000
+
+/* Long-lived, buffered writer for sensor logs.
+ * Keeps the log file open for the whole run and gathers records in a RAM ring buffer, only
+ * touching flash once a whole block has accumulated or LOG_FLUSH_INTERVAL_MS has passed (a journaled
+ * run also writes out a partial block at every commit, see LOG_COMMIT_INTERVAL_MS).
+ * Data is only guaranteed to survive a power loss after sync() returns, or for a journaled run
+ * (beginRun, see log_journal.hpp) once the commit every LOG_COMMIT_INTERVAL_MS has gone out.
+ * All methods are safe to call from multiple tasks. */
+class LogWriter{
+  public:
+    LogWriter();
+
+    /* Create (or truncate) the log at path, optionally writing a header first */
+    bool begin(const char *path, const char *header = NULL);
+    bool begin(const char *path, const uint8_t *header, size_t header_len);
+    /* Start the next journaled run instead of a single file, optionally writing a header first */
+    bool beginRun(const uint8_t *header, size_t header_len);
+    /* Queue a record for writing, returns the number of bytes accepted. In a journaled run records longer than
+     * LOG_BLOCK_PAYLOAD are refused and counted in dropped */
+    size_t write(const uint8_t *data, size_t len);
+    size_t print(const char *msg);
+    /* Flush buffered data if the time threshold has passed, call periodically when idle */
+    void poll();
+    /* Write out everything buffered and commit it to flash (durability point) */
+    bool sync();
+    /* Sync and close the log file */
+    void end();
+
+    bool isOpen() const { return open; }
+    /* Run being written, 0 unless begun with beginRun() */
+    uint32_t run() const { return runId; }
+    /* Log bytes of the run up to its last commit, which a LogJournalReader can read back while it is written */
+    uint32_t committed();
+
+    /* Statistics since begin() */
+    uint32_t records;       /* Number of write()/print() calls */
+    uint32_t bytes_written; /* Bytes handed to the file system, not counting journal framing */
+    uint32_t flash_writes;  /* Number of writes issued to the file system */
+    uint32_t dropped;       /* Bytes lost because the file system refused them */
+    uint32_t commits;       /* Journal commits */
+
+  private:
+    hal::File file;
+    bool open;
+    hal::Mutex lock;
+    uint8_t buf[LOG_BUFFER_SIZE];
+    size_t head;  /* Index of the oldest buffered byte */
+    size_t count; /* Number of buffered bytes */
+    uint32_t last_flush;
+
+    /* Journaled runs only */
+    uint32_t runId;
+    uint16_t segment;       /* Segment file open */
+    uint32_t segmentBytes;  /* Its size so far */
+    uint32_t offset;        /* Log bytes framed so far, including any the file system refused */
+    uint32_t last_commit;
+    uint32_t committed_;    /* offset at the last commit */
+    bool dirty;             /* Written to since the last commit */
+
+    void reset();
+    size_t flushBuffer(size_t len);
+    bool openSegment(uint16_t index);
+    size_t writeBlock(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen, uint8_t flags);
+    void commit();
+};
+
+#endif // LOG_WRITER_HPP
\ No newline at end of file
@@ -0,0 +1,164 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the hot-path instrumentation: latency histograms, event counters and a resource snapshot
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include "metrics.hpp"
+
+static const char* const site_names[METRIC_NUM_SITES] = {
+    "state parse", "cmd rtt", "flash write", "flash commit", "store", "scd4x read", "bmp3xx read"
+};
+static const char* const counter_names[METRIC_NUM_COUNTERS] = {
+    "state packets", "parse errors", "replies dropped", "cmd timeouts", "records dropped", "flash bytes",
+    "flash bytes lost", "sensor errors"
+};
+
+#if ECODRONE_METRICS
+
+class SiteMetrics{
+    public:
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint32_t> sum_us{0};
+        std::atomic<uint32_t> max_us{0};
+        std::atomic<uint32_t> buckets[METRIC_BUCKETS] = {};
+};
+
+static SiteMetrics sites[METRIC_NUM_SITES];
+static std::atomic<uint32_t> counters[METRIC_NUM_COUNTERS] = {};
+
+static unsigned bucket_of(uint32_t us){
+    us /= METRIC_BUCKET_BASE_US;
+    unsigned b = us ? 32 - __builtin_clz(us) : 0;
+    return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+
+void metric_record(MetricSite site, uint32_t us){
+    SiteMetrics& s = sites[site];
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.sum_us.fetch_add(us, std::memory_order_relaxed);
+    s.buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = s.max_us.load(std::memory_order_relaxed);
+    while(us > max && !s.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)){
+    }
+}
+
+void metric_count(MetricCounter counter, uint32_t n){
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+bool metrics_snapshot(MetricsSnapshot* out){
+    memset(out, 0, sizeof(*out));
+    out->version = METRICS_VERSION;
+    out->sites = METRIC_NUM_SITES;
+    out->buckets = METRIC_BUCKETS;
+    out->counters = METRIC_NUM_COUNTERS;
+    out->uptime = hal::millis();
+    out->heap_free = hal::heap_free();
+    out->heap_min_free = hal::heap_min_free();
+    for(int i = 0; i < METRIC_NUM_SITES; i++){
+        MetricSiteStats& o = out->site[i];
+        o.count = sites[i].count.load(std::memory_order_relaxed);
+        o.sum_us = sites[i].sum_us.load(std::memory_order_relaxed);
+        o.max_us = sites[i].max_us.load(std::memory_order_relaxed);
+        for(int b = 0; b < METRIC_BUCKETS; b++){
+            uint32_t n = sites[i].buckets[b].load(std::memory_order_relaxed);
+            o.buckets[b] = n < 0xFFFF ? n : 0xFFFF;
+        }
+    }
+    for(int i = 0; i < METRIC_NUM_COUNTERS; i++){
+        out->counter[i] = counters[i].load(std::memory_order_relaxed);
+    }
+    hal::TaskInfo tasks[METRIC_MAX_TASKS];
+    out->tasks = hal::task_info(tasks, METRIC_MAX_TASKS);
+    for(int i = 0; i < out->tasks; i++){
+        strncpy(out->task[i].name, tasks[i].name, METRIC_TASK_NAME_LEN);
+        out->task[i].stack = tasks[i].stack < 0xFFFF ? tasks[i].stack : 0xFFFF;
+        out->task[i].stack_free = tasks[i].stack_free < 0xFFFF ? tasks[i].stack_free : 0xFFFF;
+    }
+    return true;
+}
+
+void metrics_reset(){
+    for(SiteMetrics& s : sites){
+        s.count.store(0, std::memory_order_relaxed);
+        s.sum_us.store(0, std::memory_order_relaxed);
+        s.max_us.store(0, std::memory_order_relaxed);
+        for(std::atomic<uint32_t>& b : s.buckets){
+            b.store(0, std::memory_order_relaxed);
+        }
+    }
+    for(std::atomic<uint32_t>& c : counters){
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+#else
+
+bool metrics_snapshot(MetricsSnapshot* out){
+    memset(out, 0, sizeof(*out));
+    return false;
+}
+
+void metrics_reset(){
+}
+
+#endif // ECODRONE_METRICS
+
+/* Too big for the stack of every task that might log, so one is shared and callers (loop() and drone_ctrl)
+ * take turns with it */
+static MetricsSnapshot snap;
+static hal::Mutex log_lock;
+
+void metrics_log(){
+    log_lock.lock();
+    if(!metrics_snapshot(&snap)){
+        hal::log("Metrics: compiled out (ECODRONE_METRICS=0)\n");
+        log_lock.unlock();
+        return;
+    }
+    hal::log("Metrics at %lu ms", (unsigned long)snap.uptime);
+    if(snap.heap_free){
+        hal::log(": heap %lu bytes free, %lu at least", (unsigned long)snap.heap_free, (unsigned long)snap.heap_min_free);
+    }
+    hal::log("\n");
+    for(int i = 0; i < METRIC_NUM_SITES; i++){
+        const MetricSiteStats& s = snap.site[i];
+        if(!s.count){
+            continue;
+        }
+        /* Histogram as bucket upper bounds (us) and counts, empty buckets left out */
+        char hist[METRIC_BUCKETS * 16];
+        size_t n = 0;
+        for(int b = 0; b < METRIC_BUCKETS && n < sizeof(hist); b++){
+            if(s.buckets[b]){
+                if(b == METRIC_BUCKETS - 1){
+                    n += snprintf(hist + n, sizeof(hist) - n, " >=%lu:%u",
+                                  (unsigned long)METRIC_BUCKET_BASE_US << (b - 1), s.buckets[b]);
+                }
+                else{
+                    n += snprintf(hist + n, sizeof(hist) - n, " <%lu:%u",
+                                  (unsigned long)METRIC_BUCKET_BASE_US << b, s.buckets[b]);
+                }
+            }
+        }
+        hist[n < sizeof(hist) ? n : sizeof(hist) - 1] = '\0';
+        hal::log("  %-12s %6lu x, avg %lu us, max %lu us |%s\n", site_names[i], (unsigned long)s.count,
+                 (unsigned long)(s.sum_us / s.count), (unsigned long)s.max_us, hist);
+    }
+    for(int i = 0; i < METRIC_NUM_COUNTERS; i++){
+        hal::log("  %-16s %lu\n", counter_names[i], (unsigned long)snap.counter[i]);
+    }
+    for(int i = 0; i < snap.tasks; i++){
+        const MetricTaskStats& t = snap.task[i];
+        if(t.stack_free){
+            hal::log("  task %-.*s: %u of %u stack bytes never used\n", METRIC_TASK_NAME_LEN, t.name, t.stack_free, t.stack);
+        }
+        else{
+            hal::log("  task %-.*s: %u stack bytes\n", METRIC_TASK_NAME_LEN, t.name, t.stack);
+        }
+    }
+    log_lock.unlock();
+}
@@ -0,0 +1,123 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the hot-path instrumentation: latency histograms, event counters and a resource snapshot
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Each timed site (MetricSite) feeds a fixed histogram of log2 buckets from the cycle counter (hal::cycles):
+ * METRIC_TIME(site) times the rest of the enclosing scope, METRIC_RECORD(site, us) adds a duration measured some
+ * other way, such as a command round trip that spans two tasks. Counters (MetricCounter) only ever go up.
+ * Both are relaxed atomics, so any task records without taking a lock, at the cost of a snapshot possibly
+ * catching one site a sample ahead of another.
+ *
+ * metrics_snapshot() adds the free heap, its low-water mark and the stack high-water mark of every task the HAL
+ * watches (see hal::task_info), in a MetricsSnapshot small enough for one BLE read. metrics_log() prints it all.
+ *
+ * Build with -DECODRONE_METRICS=0 to compile all of it out: the macros then expand to nothing, arguments
+ * included, and the snapshot is empty.
+*/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+
+#ifndef ECODRONE_METRICS
+#define ECODRONE_METRICS 1
+#endif
+
+#define METRICS_VERSION 1
+#define METRIC_BUCKETS 16      /* Bucket 0 is < METRIC_BUCKET_BASE_US, bucket i < METRIC_BUCKET_BASE_US << i */
+#define METRIC_BUCKET_BASE_US 8 /* So the last bucket holds everything from 131 ms up */
+#define METRIC_MAX_TASKS 8     /* Tasks in a snapshot */
+#define METRIC_TASK_NAME_LEN 12
+
+enum MetricSite{
+    METRIC_STATE_PARSE = 0,  /* Parsing one Tello state datagram */
+    METRIC_CMD_RTT = 1,      /* Tello command round trip, per attempt that got a reply */
+    METRIC_FLASH_WRITE = 2,  /* One write of buffered log data to the file system */
+    METRIC_FLASH_COMMIT = 3, /* Committing the log to flash */
+    METRIC_STORE = 4,        /* Aggregating, encoding and storing one record */
+    METRIC_SCD4X_READ = 5,   /* SCD4x read over I2C */
+    METRIC_BMP3XX_READ = 6,  /* BMP3xx read over I2C */
+    METRIC_NUM_SITES = 7
+};
+
+enum MetricCounter{
+    METRIC_STATE_PACKETS = 0,   /* Tello state datagrams received */
+    METRIC_PARSE_ERRORS = 1,    /* State datagrams rejected by the parser */
+    METRIC_REPLIES_DROPPED = 2, /* Command replies the command engine had no room for */
+    METRIC_CMD_TIMEOUTS = 3,    /* Commands that got no reply after every retry */
+    METRIC_RECORDS_DROPPED = 4, /* Sample records lost on the way to storage */
+    METRIC_FLASH_BYTES = 5,     /* Log bytes the file system took */
+    METRIC_FLASH_LOST = 6,      /* Log bytes the file system refused */
+    METRIC_SENSOR_ERRORS = 7,   /* Failed SCD4x and BMP3xx reads */
+    METRIC_NUM_COUNTERS = 8
+};
+
+/* What metrics_snapshot() writes, little-endian. 488 bytes, under the 512 of one BLE attribute */
+struct __attribute__((packed)) MetricSiteStats{
+    uint32_t count;
+    uint32_t sum_us;  /* Wraps after 71 minutes in total */
+    uint32_t max_us;
+    uint16_t buckets[METRIC_BUCKETS]; /* Saturate at 65535 */
+};
+
+struct __attribute__((packed)) MetricTaskStats{
+    char name[METRIC_TASK_NAME_LEN]; /* Truncated, not always terminated */
+    uint16_t stack;      /* Bytes */
+    uint16_t stack_free; /* Bytes never used so far, 0 if unknown */
+};
+
+struct __attribute__((packed)) MetricsSnapshot{
+    uint8_t version;   /* METRICS_VERSION */
+    uint8_t sites;     /* METRIC_NUM_SITES */
+    uint8_t buckets;   /* METRIC_BUCKETS */
+    uint8_t counters;  /* METRIC_NUM_COUNTERS */
+    uint8_t tasks;     /* Entries of task that are used */
+    uint8_t reserved[3];
+    uint32_t uptime;   /* ms */
+    uint32_t heap_free;
+    uint32_t heap_min_free; /* Low-water mark since boot */
+    MetricSiteStats site[METRIC_NUM_SITES];
+    uint32_t counter[METRIC_NUM_COUNTERS];
+    MetricTaskStats task[METRIC_MAX_TASKS];
+};
+
+#if ECODRONE_METRICS
+
+void metric_record(MetricSite site, uint32_t us);
+void metric_count(MetricCounter counter, uint32_t n);
+
+/* Times its own lifetime into a site */
+class MetricTimer{
+    public:
+        MetricTimer(MetricSite site) : site(site), start(hal::cycles()) {}
+        ~MetricTimer() { metric_record(site, (hal::cycles() - start) / hal::cycles_per_us()); }
+    private:
+        MetricSite site;
+        uint32_t start;
+};
+
+#define METRIC_CONCAT_(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT_(a, b)
+#define METRIC_TIME(site) MetricTimer METRIC_CONCAT(metric_timer_, __LINE__)(site)
+#define METRIC_RECORD(site, us) metric_record(site, us)
+#define METRIC_COUNT(counter, n) metric_count(counter, n)
+
+#else
+
+#define METRIC_TIME(site) ((void)0)
+#define METRIC_RECORD(site, us) ((void)0)
+#define METRIC_COUNT(counter, n) ((void)0)
+
+#endif // ECODRONE_METRICS
+
+/* Fill out with everything recorded so far, returns false (out zeroed) if metrics are compiled out */
+bool metrics_snapshot(MetricsSnapshot* out);
+/* Print a snapshot, e.g. over Serial on the ESP32 */
+void metrics_log();
+/* Forget everything recorded so far */
+void metrics_reset();
+
+#endif // METRICS_HPP
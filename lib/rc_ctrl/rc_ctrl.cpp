@@ -0,0 +1,280 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for flying continuous paths with rc setpoints
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rc_ctrl.hpp"
+
+#define VEL_CM_PER_UNIT 10 /* vgx/vgy are reported in dm/s, as in DeadReckonerConfig */
+
+static int clamp_stick(float v, int max){
+    int s = (int)lroundf(v);
+    return s < -max ? -max : s > max ? max : s;
+}
+
+/* Degrees into -180..180 */
+static float wrap_deg(float deg){
+    deg = fmodf(deg, 360);
+    return deg > 180 ? deg - 360 : deg < -180 ? deg + 360 : deg;
+}
+
+void RcPathFollower::clear(){
+    num_points = 0;
+    begin(Position());
+}
+
+void RcPathFollower::begin(const Position& pos){
+    start = RcWaypoint();
+    start.x_cm = pos.x_cm;
+    start.y_cm = pos.y_cm;
+    start.z_cm = pos.z_cm;
+    leg = 0;
+    max_cross_cm = 0;
+    heading_deg = 0;
+    have_heading = false;
+}
+
+bool RcPathFollower::add(const RcWaypoint& wp){
+    if(num_points >= RC_PATH_MAX_POINTS){
+        return false;
+    }
+    points[num_points++] = wp;
+    return true;
+}
+
+void RcPathFollower::drop(uint8_t i){
+    if(i < leg || i >= num_points){
+        return;
+    }
+    memmove(&points[i], &points[i + 1], (num_points - i - 1) * sizeof(points[0]));
+    num_points--;
+}
+
+float RcPathFollower::length_cm() const{
+    float len = 0;
+    const RcWaypoint* a = &start;
+    for(uint8_t i = 0; i < num_points; a = &points[i++]){
+        const RcWaypoint& b = points[i];
+        len += sqrtf((b.x_cm - a->x_cm) * (b.x_cm - a->x_cm) + (b.y_cm - a->y_cm) * (b.y_cm - a->y_cm) + (b.z_cm - a->z_cm) * (b.z_cm - a->z_cm));
+    }
+    return len;
+}
+
+RcSticks RcPathFollower::step(uint32_t now_ms, const Position& pos, const TelloState& state){
+    RcSticks sticks;
+    if(done()){
+        return sticks;
+    }
+
+    /* Reported velocity, rotated into the takeoff frame like the dead reckoner does */
+    float rad = state.yaw * (float)M_PI / 180;
+    float cy = cosf(rad), sy = sinf(rad);
+    float bx = state.vgx * VEL_CM_PER_UNIT, by = state.vgy * VEL_CM_PER_UNIT;
+    float vx = bx * cy - by * sy;
+    float vy = bx * sy + by * cy;
+
+    /* The track only moves with each state packet, carry it forward to now */
+    uint32_t age = now_ms - pos.uptime;
+    if(age > config.state_timeout_ms){
+        age = config.state_timeout_ms;
+    }
+    float px = pos.x_cm + vx * age / 1000, py = pos.y_cm + vy * age / 1000, pz = pos.z_cm;
+
+    /* Move on to the next leg as soon as this one's waypoint is close or behind the drone, without stopping */
+    float ux, uy, uz, len, along, to_go;
+    const RcWaypoint* a;
+    const RcWaypoint* b;
+    while(1){
+        a = leg ? &points[leg - 1] : &start;
+        b = &points[leg];
+        float dx = b->x_cm - a->x_cm, dy = b->y_cm - a->y_cm, dz = b->z_cm - a->z_cm;
+        len = sqrtf(dx * dx + dy * dy + dz * dz);
+        ux = len > 1 ? dx / len : 0;
+        uy = len > 1 ? dy / len : 0;
+        uz = len > 1 ? dz / len : 0;
+        along = (px - a->x_cm) * ux + (py - a->y_cm) * uy + (pz - a->z_cm) * uz;
+        to_go = sqrtf((b->x_cm - px) * (b->x_cm - px) + (b->y_cm - py) * (b->y_cm - py) + (b->z_cm - pz) * (b->z_cm - pz));
+        bool last = leg + 1 == num_points;
+        if(last && to_go < config.arrive_cm){
+            leg++;
+            return sticks;
+        }
+        if(last || (to_go >= config.accept_cm && along < len)){
+            break;
+        }
+        leg++;
+    }
+
+    /* Error from the closest point on the leg */
+    float t = along < 0 ? 0 : along > len ? len : along;
+    float ex = px - (a->x_cm + ux * t), ey = py - (a->y_cm + uy * t), ez = pz - (a->z_cm + uz * t);
+    float cross = sqrtf(ex * ex + ey * ey + ez * ez);
+    if(cross > max_cross_cm){
+        max_cross_cm = cross;
+    }
+
+    float speed = b->speed_cms;
+    if(leg + 1 == num_points && config.approach_gain * to_go < speed){
+        speed = config.approach_gain * to_go;
+    }
+    float wx, wy, wz;
+    if(len > 1){
+        wx = ux * speed - config.cross_gain * ex;
+        wy = uy * speed - config.cross_gain * ey;
+        wz = uz * speed - config.z_gain * ez;
+    }
+    else{
+        /* A leg with no length, just head for the waypoint */
+        wx = (b->x_cm - px) * config.approach_gain;
+        wy = (b->y_cm - py) * config.approach_gain;
+        wz = (b->z_cm - pz) * config.z_gain;
+    }
+
+    /* Feed the wanted velocity forward, and push harder while the drone is short of it */
+    float sx = wx * config.stick_per_cms + (wx - vx) * config.vel_gain;
+    float sy_ = wy * config.stick_per_cms + (wy - vy) * config.vel_gain;
+    sticks.b = clamp_stick(sx * cy + sy_ * sy, config.max_stick);
+    sticks.a = clamp_stick(-sx * sy + sy_ * cy, config.max_stick);
+    sticks.c = clamp_stick(wz * config.stick_per_cms, config.max_stick);
+
+    if(!have_heading){
+        heading_deg = state.yaw;
+        have_heading = true;
+    }
+    float horiz = sqrtf((b->x_cm - a->x_cm) * (b->x_cm - a->x_cm) + (b->y_cm - a->y_cm) * (b->y_cm - a->y_cm));
+    if(config.face_path && horiz >= config.accept_cm){
+        heading_deg = atan2f(b->y_cm - a->y_cm, b->x_cm - a->x_cm) * 180 / (float)M_PI;
+    }
+    sticks.d = clamp_stick(wrap_deg(heading_deg - state.yaw) * config.yaw_gain, config.max_stick);
+    return sticks;
+}
+
+/* Running the loop ------------------------------------------------------------------------------------------------------------ */
+
+void RcLoopStats::log() const{
+    static const char* const buckets[RC_JITTER_BUCKETS] = {"<0.25", "<0.5", "<1", "<2", "<4", "<8", "<16", ">=16"};
+    hal::log("rc loop: %u ticks in %u ms, %.0f cm flown (at most %.0f cm off the path), period jitter mean/max %u/%u us, %u late, %u skipped, %u held, %u send errors\n",
+             ticks, flown_ms, flown_cm, max_cross_cm, periods ? (uint32_t)(jitter_sum_us / periods) : 0, max_jitter_us, late,
+             skipped, held, send_errors);
+    hal::log("rc jitter (ms):");
+    for(int i = 0; i < RC_JITTER_BUCKETS; ++i){
+        hal::log(" %s %u", buckets[i], jitter_hist[i]);
+    }
+    hal::log("\n");
+}
+
+RcPathStatus run_rc_path(TelloControl& tello, RcPathFollower& path, const SeqLatch<Position>& position, RcLoopStats* stats,
+                         RcStateHook hook, void* ctx){
+    RcLoopStats local;
+    RcLoopStats& st = stats ? *stats : local;
+    const RcConfig& config = path.config;
+
+    /* Give up once the path has taken twice as long as its legs at their speeds, plus time to settle */
+    uint32_t budget_ms = 10000;
+    Position start_pos;
+    position.read(start_pos);
+    path.begin(start_pos);
+    RcWaypoint from;
+    from.x_cm = start_pos.x_cm;
+    from.y_cm = start_pos.y_cm;
+    from.z_cm = start_pos.z_cm;
+    for(uint8_t i = 0; i < path.num_points; from = path.points[i++]){
+        const RcWaypoint& to = path.points[i];
+        float len = sqrtf((to.x_cm - from.x_cm) * (to.x_cm - from.x_cm) + (to.y_cm - from.y_cm) * (to.y_cm - from.y_cm) + (to.z_cm - from.z_cm) * (to.z_cm - from.z_cm));
+        budget_ms += (uint32_t)(2000 * len / (to.speed_cms > 1 ? to.speed_cms : 1));
+    }
+
+    RcPathStatus status;
+    uint32_t start_ms = hal::millis(), wake = start_ms;
+    uint32_t last_us = hal::micros();
+    uint32_t failures = 0; /* Sends in a row that failed */
+    uint32_t seq = 0; /* Last state packet given to hook */
+    bool first = true;
+    while(1){
+        uint32_t now_us = hal::micros();
+        uint32_t now_ms = hal::millis();
+        st.ticks++;
+        if(!first){
+            int32_t off = (int32_t)(now_us - last_us) - (int32_t)(config.period_ms * 1000);
+            uint32_t jitter = off < 0 ? -off : off;
+            int b = 0;
+            for(uint32_t limit = 250; b < RC_JITTER_BUCKETS - 1 && jitter >= limit; limit *= 2){
+                b++;
+            }
+            st.jitter_hist[b]++;
+            st.periods++;
+            st.jitter_sum_us += jitter;
+            if(jitter > st.max_jitter_us){
+                st.max_jitter_us = jitter;
+            }
+            if(jitter > config.jitter_bound_us){
+                st.late++;
+            }
+        }
+        last_us = now_us;
+        first = false;
+
+        TelloStateSnapshot snap = tello.get_state();
+        Position pos;
+        position.read(pos);
+        uint32_t age_ms = snap.seq ? (now_us - snap.arrival_us) / 1000 : UINT32_MAX;
+        if(age_ms > config.abort_ms){
+            status = RC_PATH_NO_STATE;
+            break;
+        }
+        if(now_ms - start_ms > budget_ms){
+            status = RC_PATH_TIMEOUT;
+            break;
+        }
+
+        RcSticks sticks;
+        if(age_ms > config.state_timeout_ms || !pos.valid){
+            /* Hover rather than steer on an old position */
+            st.held++;
+        }
+        else{
+            if(hook && snap.seq != seq){
+                seq = snap.seq;
+                hook(path, snap, pos, ctx);
+            }
+            sticks = path.step(now_ms, pos, snap.state);
+            if(path.done()){
+                status = RC_PATH_DONE;
+                break;
+            }
+        }
+        if(tello.send_rc(sticks.a, sticks.b, sticks.c, sticks.d)){
+            failures = 0;
+        }
+        else{
+            st.send_errors++;
+            if(++failures * config.period_ms >= config.abort_ms){
+                status = RC_PATH_SEND_FAILED;
+                break;
+            }
+        }
+
+        hal::delay_until(wake, config.period_ms);
+        /* A whole period behind: drop the missed ticks rather than send them back to back */
+        uint32_t behind = hal::millis() - wake;
+        if((int32_t)behind >= (int32_t)config.period_ms){
+            st.skipped += behind / config.period_ms;
+            wake += behind / config.period_ms * config.period_ms;
+        }
+    }
+
+    /* Centre the sticks so the drone hovers where it is, twice as nothing acknowledges them */
+    tello.send_rc(0, 0, 0, 0);
+    tello.send_rc(0, 0, 0, 0);
+    st.flown_ms += hal::millis() - start_ms;
+    if(path.max_cross_cm > st.max_cross_cm){
+        st.max_cross_cm = path.max_cross_cm;
+    }
+    if(status == RC_PATH_DONE){
+        st.flown_cm += path.length_cm();
+    }
+    return status;
+}
@@ -0,0 +1,127 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for flying continuous paths by streaming rc stick setpoints to the Tello
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Discrete SDK moves ("forward 300") make the drone brake and hover at the end of every leg. Instead,
+ * RcPathFollower turns a list of waypoints into "rc a b c d" stick setpoints, one per tick, so the drone
+ * flies through each waypoint and straight on into the next leg:
+ *   - the velocity along the leg is fed forward, plus a pull back onto the leg for any cross-track error
+ *     and a correction for the difference from the velocity the Tello reports (vgx/vgy)
+ *   - the position comes from the dead-reckoned track (lib/voxel_map), extrapolated with the reported
+ *     velocity since the last state packet, as state arrives at 10 Hz and the sticks go out faster
+ *   - the nose is turned to face along each leg, and the sticks are rotated by the reported yaw so the
+ *     drone keeps to the leg while it turns
+ * run_rc_path() sends them at a fixed rate from the calling task, and measures how regular that rate is.
+*/
+
+#ifndef RC_CTRL_HPP
+#define RC_CTRL_HPP
+
+#include <stdint.h>
+#include "hal.hpp"
+#include "tello_ctrl.hpp"
+#include "voxel_map.hpp"
+
+#define RC_PERIOD_MS 25 /* 40 Hz, the Tello takes rc setpoints at 20-50 Hz */
+#define RC_PATH_MAX_POINTS 16 /* Waypoints in one continuous path */
+#define RC_JITTER_BUCKETS 8 /* Histogram of period jitter: under 250 us, 500 us, 1 ms ... 16 ms, and above */
+
+/* A point to fly through, in cm from the takeoff point (x along the heading at takeoff, y to its right, z up) */
+class RcWaypoint{
+    public:
+        float x_cm = 0, y_cm = 0, z_cm = 0;
+        float speed_cms = 50; /* Along the leg that ends here */
+};
+
+/* Stick setpoints, -100..100: a roll (right), b pitch (forward), c throttle (up), d yaw (clockwise) */
+class RcSticks{
+    public:
+        int a = 0, b = 0, c = 0, d = 0;
+};
+
+class RcConfig{
+    public:
+        uint32_t period_ms = RC_PERIOD_MS; /* 20..50 */
+        float stick_per_cms = 1;   /* Stick travel per cm/s commanded, full stick is about 100 cm/s */
+        float vel_gain = 0.5f;     /* Extra stick per cm/s the reported velocity is short of the commanded one */
+        float cross_gain = 1;      /* cm/s back towards the leg per cm off it */
+        float z_gain = 1.5f;       /* cm/s of climb per cm below the leg */
+        float yaw_gain = 1.5f;     /* Yaw stick per degree off the leg's heading */
+        float approach_gain = 1;   /* Slow into the last waypoint, at most this many cm/s per cm still to go */
+        float accept_cm = 25;      /* A waypoint counts as passed within this distance, except the last */
+        float arrive_cm = 10;      /* and the last one once within this distance */
+        int max_stick = 100;
+        bool face_path = true;     /* Turn the nose along each leg, otherwise keep the heading the path started with */
+        uint32_t state_timeout_ms = 300; /* Hover while the latest state packet is older than this */
+        uint32_t abort_ms = 2000;  /* and give up on the path once it is older than this */
+        uint32_t jitter_bound_us = 5000; /* Ticks whose period is off by more than this count as late */
+};
+
+class RcPathFollower{
+    public:
+        RcPathFollower() { clear(); }
+        /* Forget the waypoints */
+        void clear();
+        /* Append a waypoint, returns false if the path is full */
+        bool add(const RcWaypoint& wp);
+        /* Give up on waypoint i, which must not have been reached yet (i >= leg) */
+        void drop(uint8_t i);
+        /* Start flying the waypoints from pos, from the first one */
+        void begin(const Position& pos);
+        /* Setpoint for now_ms, given the latest dead-reckoned position and the state packet it was built from */
+        RcSticks step(uint32_t now_ms, const Position& pos, const TelloState& state);
+        /* The last waypoint has been reached */
+        bool done() const { return leg >= num_points; }
+        /* Length of the path from its start, in cm */
+        float length_cm() const;
+
+        RcConfig config;
+        RcWaypoint points[RC_PATH_MAX_POINTS];
+        uint8_t num_points;
+        uint8_t leg; /* Index of the waypoint being flown to */
+
+        /* Statistics since begin() */
+        float max_cross_cm; /* Furthest the drone was off the leg it was flying */
+
+    private:
+        RcWaypoint start;
+        float heading_deg; /* Held when not facing along the path */
+        bool have_heading;
+};
+
+/* How regularly the setpoints went out, accumulated over every path flown */
+class RcLoopStats{
+    public:
+        uint32_t ticks = 0;
+        uint32_t late = 0;    /* Ticks whose period was off by more than jitter_bound_us */
+        uint32_t skipped = 0; /* Whole periods missed because the task was held up, not made up with a burst */
+        uint32_t held = 0;    /* Ticks that hovered because the state was stale */
+        uint32_t send_errors = 0;
+        uint32_t periods = 0; /* Periods measured, the first tick of each path has none */
+        uint32_t max_jitter_us = 0;
+        uint64_t jitter_sum_us = 0; /* Divide by periods for the mean */
+        uint32_t jitter_hist[RC_JITTER_BUCKETS] = {0};
+        uint32_t flown_ms = 0;
+        float flown_cm = 0; /* Length of the paths flown */
+        float max_cross_cm = 0; /* Furthest off a leg on any of them */
+
+        void log() const;
+};
+
+enum RcPathStatus{
+    RC_PATH_DONE,     /* Reached the last waypoint */
+    RC_PATH_NO_STATE, /* State packets stopped arriving */
+    RC_PATH_TIMEOUT,  /* Took far longer than the path's length and speeds allow */
+    RC_PATH_SEND_FAILED
+};
+
+/* Called by run_rc_path() once per new state packet, e.g. to drop waypoints the battery can no longer afford */
+typedef void (*RcStateHook)(RcPathFollower& path, const TelloStateSnapshot& snap, const Position& pos, void* ctx);
+
+/* Fly path from the calling task, sending a setpoint every config.period_ms until the last waypoint is
+ * reached, then centre the sticks so the drone hovers there. position is the dead-reckoned track.
+ * Must not run while a movement command is in flight. stats and hook may be NULL */
+RcPathStatus run_rc_path(TelloControl& tello, RcPathFollower& path, const SeqLatch<Position>& position, RcLoopStats* stats,
+                         RcStateHook hook = NULL, void* ctx = NULL);
+
+#endif // RC_CTRL_HPP
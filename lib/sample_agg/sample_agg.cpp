@@ -0,0 +1,190 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the windowed aggregation stage
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <math.h>
+#include "sample_agg.hpp"
+
+void ChannelStats::reset(){
+    count = 0;
+    min = INT32_MAX;
+    max = INT32_MIN;
+    mean = 0;
+    m2 = 0;
+}
+
+void ChannelStats::add(int32_t val){
+    count++;
+    if(val < min){
+        min = val;
+    }
+    if(val > max){
+        max = val;
+    }
+    /* Welford: stays accurate where sum/sum-of-squares would cancel out, e.g. pressure around 101300 Pa in a float */
+    float delta = val - mean;
+    mean += delta / count;
+    m2 += delta * (val - mean);
+}
+
+float ChannelStats::stddev() const{
+    return count ? sqrtf(m2 / count) : 0;
+}
+
+/* Aggregator ----------------------------------------------------------------------------------------------------------------- */
+
+static uint32_t record_uptime(const uint8_t* rec){
+    uint32_t uptime;
+    memcpy(&uptime, rec + offsetof(SampleRecordHeader, uptime), sizeof(uptime));
+    return uptime;
+}
+
+void SampleAggregator::reset(){
+    for(int s = 0; s < SAMPLE_NUM_STREAMS; ++s){
+        for(int i = 0; i < SAMPLE_MAX_COLUMNS; ++i){
+            stats[s][i].reset();
+        }
+        window_start[s] = 0;
+        window_open[s] = false;
+    }
+    have_co2 = false;
+    retaining = false;
+    ring_head = ring_count = 0;
+    records_in = records_kept = summaries = events = 0;
+}
+
+void SampleAggregator::add(const uint8_t* rec, size_t len){
+    uint8_t stream = rec[0];
+    uint32_t uptime = record_uptime(rec);
+    records_in++;
+    if(config.window_ms == 0 || stream == SAMPLE_STREAM_SUMMARY){
+        store(rec, len);
+        return;
+    }
+
+    /* Close every window that ended before this record, not just its own stream's, so a stream that goes quiet still gets its summary */
+    for(uint8_t s = 0; s < SAMPLE_NUM_STREAMS; ++s){
+        if(window_open[s] && uptime - window_start[s] >= config.window_ms && (int32_t)(uptime - window_start[s]) > 0){
+            close_window(s);
+        }
+    }
+
+    bool raw = config.raw_streams & (1 << stream);
+    if(!raw){
+        size_t num_cols;
+        const SampleColumn* cols = sample_columns(stream, &num_cols);
+        if(!window_open[stream]){
+            /* Tello records are stamped with their arrival, so one can be a little older than a window that was just closed */
+            uint32_t start = uptime - uptime % config.window_ms;
+            if((int32_t)(start - window_start[stream]) > 0){
+                window_start[stream] = start;
+            }
+            window_open[stream] = true;
+        }
+        /* Column 0 is the uptime, which the window already covers */
+        for(size_t i = 1; i < num_cols; ++i){
+            stats[stream][i].add(sample_column_value(rec, &cols[i]));
+        }
+    }
+
+    if(stream == SAMPLE_STREAM_SCD4X){
+        Scd4xRecord r;
+        memcpy(&r, rec, sizeof(r));
+        if((config.co2_high_ppm && r.co2 >= config.co2_high_ppm) ||
+           (config.co2_spike_ppm && have_co2 && r.co2 >= last_co2 + config.co2_spike_ppm)){
+            trigger(uptime);
+        }
+        last_co2 = r.co2;
+        have_co2 = true;
+    }
+
+    if(raw || (retaining && (int32_t)(uptime - retain_until) <= 0)){
+        store(rec, len);
+    }
+    else{
+        retaining = false;
+        ring_push(rec, len);
+    }
+}
+
+void SampleAggregator::finish(){
+    for(uint8_t s = 0; s < SAMPLE_NUM_STREAMS; ++s){
+        if(window_open[s]){
+            close_window(s);
+        }
+    }
+}
+
+void SampleAggregator::store(const uint8_t* rec, size_t len){
+    records_kept++;
+    sink(rec, len, ctx);
+}
+
+void SampleAggregator::close_window(uint8_t stream){
+    size_t num_cols;
+    sample_columns(stream, &num_cols);
+    for(size_t i = 1; i < num_cols; ++i){
+        ChannelStats& c = stats[stream][i];
+        if(c.count == 0){
+            continue;
+        }
+        SummaryRecord r;
+        r.hdr.stream = SAMPLE_STREAM_SUMMARY;
+        r.hdr.uptime = window_start[stream];
+        r.source = stream;
+        r.column = i;
+        r.count = c.count > UINT16_MAX ? UINT16_MAX : c.count;
+        r.min = c.min;
+        r.max = c.max;
+        r.mean = sample_quantise(c.mean, 1);
+        r.stddev = sample_quantise(c.stddev(), 1);
+        sink((const uint8_t*)&r, sizeof(r), ctx);
+        summaries++;
+        c.reset();
+    }
+    window_start[stream] += config.window_ms;
+    window_open[stream] = false;
+}
+
+/* Store the raw records from the last pre_ms, then keep storing raw records for post_ms */
+void SampleAggregator::trigger(uint32_t uptime){
+    events++;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    size_t len;
+    while(ring_count){
+        ring_pop(rec, &len);
+        if((int32_t)(record_uptime(rec) - (uptime - config.pre_ms)) >= 0){
+            store(rec, len);
+        }
+    }
+    retaining = true;
+    retain_until = uptime + config.post_ms;
+}
+
+void SampleAggregator::ring_push(const uint8_t* rec, size_t len){
+    if(len > sizeof(ring)){
+        return;
+    }
+    /* Make room by forgetting the oldest records */
+    uint8_t old[SAMPLE_MAX_RECORD_SIZE];
+    size_t old_len;
+    while(ring_count + len > sizeof(ring)){
+        ring_pop(old, &old_len);
+    }
+    size_t tail = (ring_head + ring_count) % sizeof(ring);
+    size_t first = len < sizeof(ring) - tail ? len : sizeof(ring) - tail;
+    memcpy(ring + tail, rec, first);
+    memcpy(ring, rec + first, len - first);
+    ring_count += len;
+}
+
+void SampleAggregator::ring_pop(uint8_t* rec, size_t* len){
+    *len = sample_record_size(ring[ring_head]);
+    size_t first = *len < sizeof(ring) - ring_head ? *len : sizeof(ring) - ring_head;
+    memcpy(rec, ring + ring_head, first);
+    memcpy(rec + first, ring, *len - first);
+    ring_head = (ring_head + *len) % sizeof(ring);
+    ring_count -= *len;
+}
@@ -0,0 +1,92 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the windowed aggregation stage between sample acquisition and storage
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Instead of storing every record of a fast stream, the aggregator keeps a running min/max/mean/variance
+ * of each of its columns (Welford's algorithm, constant memory) and stores one SummaryRecord per column
+ * when a window ends. Windows are aligned to multiples of window_ms of uptime.
+ * Raw records are still stored around events: when the SCD4x sees a CO2 spike, the last pre_ms of raw
+ * records (kept in a fixed-size ring) and the next post_ms of them go to storage alongside the summaries.
+*/
+
+#ifndef SAMPLE_AGG_HPP
+#define SAMPLE_AGG_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sample_record.hpp"
+
+#define AGG_PRETRIGGER_SIZE 8192 /* Bytes of recent raw records kept in case an event needs them */
+
+/* Called with every record the aggregator decides to store */
+typedef void (*SampleSink)(const uint8_t* rec, size_t len, void* ctx);
+
+/* Running statistics of one column, Welford's algorithm */
+class ChannelStats{
+    public:
+        uint32_t count;
+        int32_t min, max;
+        float mean;
+        float m2; /* Sum of squared differences from the mean */
+
+        void reset();
+        void add(int32_t val);
+        float stddev() const;
+};
+
+class AggregatorConfig{
+    public:
+        uint32_t window_ms = 10000; /* 0 stores every record raw, like no aggregation at all */
+        uint32_t raw_streams = 1 << SAMPLE_STREAM_SCD4X; /* Bitmask of streams always stored raw (they are slow anyway) */
+
+        /* Raw retention around CO2 events */
+        uint16_t co2_spike_ppm = 100; /* Rise between two SCD4x readings that counts as an event, 0 to disable */
+        uint16_t co2_high_ppm = 2000; /* Level that counts as an event, 0 to disable */
+        uint32_t pre_ms = 5000;       /* Raw records kept from before an event */
+        uint32_t post_ms = 15000;     /* and after it */
+};
+
+class SampleAggregator{
+    public:
+        SampleAggregator(SampleSink sink, void* ctx) : sink(sink), ctx(ctx) { reset(); }
+
+        /* Forget all windows and events, e.g. when a new log starts */
+        void reset();
+        /* Feed one raw record */
+        void add(const uint8_t* rec, size_t len);
+        /* Store the summaries of every window still open, e.g. before closing the log */
+        void finish();
+
+        AggregatorConfig config;
+
+        /* Statistics since reset() */
+        uint32_t records_in;   /* Raw records fed in */
+        uint32_t records_kept; /* Raw records stored */
+        uint32_t summaries;    /* Summary records stored */
+        uint32_t events;       /* Events that triggered raw retention */
+
+    private:
+        SampleSink sink;
+        void* ctx;
+
+        ChannelStats stats[SAMPLE_NUM_STREAMS][SAMPLE_MAX_COLUMNS];
+        uint32_t window_start[SAMPLE_NUM_STREAMS];
+        bool window_open[SAMPLE_NUM_STREAMS];
+
+        uint16_t last_co2;
+        bool have_co2;
+        bool retaining;
+        uint32_t retain_until;
+
+        /* Ring of raw records that were not stored, oldest first */
+        uint8_t ring[AGG_PRETRIGGER_SIZE];
+        size_t ring_head, ring_count;
+
+        void store(const uint8_t* rec, size_t len);
+        void close_window(uint8_t stream);
+        void ring_push(const uint8_t* rec, size_t len);
+        void ring_pop(uint8_t* rec, size_t* len);
+        void trigger(uint32_t uptime);
+};
+
+#endif // SAMPLE_AGG_HPP
@@ -0,0 +1,139 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the sparse time index of sample log runs
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "sample_index.hpp"
+
+void sample_index_path(char out[SAMPLE_INDEX_PATH_LEN], uint32_t run){
+    snprintf(out, SAMPLE_INDEX_PATH_LEN, "/run%04lu.idx", (unsigned long)run);
+}
+
+bool sample_motor_time(const uint8_t* rec, uint16_t* min_s, uint16_t* max_s){
+    if(rec[0] == SAMPLE_STREAM_TELLO){
+        TelloRecord r;
+        memcpy(&r, rec, sizeof(r));
+        *min_s = *max_s = r.time;
+        return true;
+    }
+    if(rec[0] == SAMPLE_STREAM_SUMMARY){
+        /* Summaries of the motor time column, which comes after the uptime in sample_columns */
+        SummaryRecord r;
+        memcpy(&r, rec, sizeof(r));
+        if(r.source == SAMPLE_STREAM_TELLO && r.column == 1 + TELLO_TIME && r.count){
+            *min_s = r.min;
+            *max_s = r.max;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* SampleIndexWriter ---------------------------------------------------------------------------------------------------------- */
+
+bool SampleIndexWriter::begin(uint32_t run, uint32_t offset){
+    char path[SAMPLE_INDEX_PATH_LEN];
+    sample_index_path(path, run);
+    lock.lock();
+    file.close();
+    spans = 0;
+    num_pending = 0;
+    span_used = false;
+    span.offset = offset;
+    SampleIndexHeader hdr = {SAMPLE_INDEX_MAGIC, SAMPLE_INDEX_VERSION, 0, run};
+    bool ok = file.open(path, "w") && file.write(&hdr, sizeof(hdr)) == sizeof(hdr);
+    if(!ok){
+        file.close();
+    }
+    lock.unlock();
+    return ok;
+}
+
+void SampleIndexWriter::add(const uint8_t* rec, uint32_t offset, bool start_span){
+    lock.lock();
+    if(!file.is_open()){
+        lock.unlock();
+        return;
+    }
+    if(start_span && span_used){
+        close_span(offset);
+        span.offset = offset;
+    }
+
+    uint32_t uptime;
+    memcpy(&uptime, rec + offsetof(SampleRecordHeader, uptime), sizeof(uptime));
+    if(!span_used){
+        span.first_ms = span.last_ms = uptime;
+        span.motor_min = SAMPLE_INDEX_NO_MOTOR;
+        span.motor_max = 0;
+        span_used = true;
+    }
+    span.first_ms = uptime < span.first_ms ? uptime : span.first_ms;
+    span.last_ms = uptime > span.last_ms ? uptime : span.last_ms;
+    uint16_t lo, hi;
+    if(sample_motor_time(rec, &lo, &hi)){
+        span.motor_min = lo < span.motor_min ? lo : span.motor_min;
+        span.motor_max = hi > span.motor_max ? hi : span.motor_max;
+    }
+    lock.unlock();
+}
+
+void SampleIndexWriter::flush(){
+    lock.lock();
+    if(file.is_open()){
+        write_pending();
+    }
+    lock.unlock();
+}
+
+void SampleIndexWriter::end(uint32_t offset){
+    lock.lock();
+    if(file.is_open()){
+        if(span_used){
+            close_span(offset);
+        }
+        write_pending();
+        file.close();
+    }
+    lock.unlock();
+}
+
+/* Caller must hold the lock */
+void SampleIndexWriter::close_span(uint32_t end){
+    span.size = end - span.offset;
+    if(num_pending == SAMPLE_INDEX_BUFFER){
+        write_pending();
+    }
+    pending[num_pending++] = span;
+    spans++;
+    span_used = false;
+}
+
+/* Append and commit the closed spans, caller must hold the lock */
+void SampleIndexWriter::write_pending(){
+    if(num_pending){
+        file.write(pending, num_pending * sizeof(pending[0]));
+        file.flush();
+        num_pending = 0;
+    }
+}
+
+/* SampleIndexReader ---------------------------------------------------------------------------------------------------------- */
+
+bool SampleIndexReader::open(uint32_t run){
+    char path[SAMPLE_INDEX_PATH_LEN];
+    sample_index_path(path, run);
+    SampleIndexHeader hdr;
+    if(!file.open(path, "r") || file.read(&hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != SAMPLE_INDEX_MAGIC ||
+       hdr.version != SAMPLE_INDEX_VERSION || hdr.run != run){
+        file.close();
+        return false;
+    }
+    return true;
+}
+
+bool SampleIndexReader::next(SampleIndexEntry* entry){
+    return file.is_open() && file.read(entry, sizeof(*entry)) == sizeof(*entry);
+}
@@ -0,0 +1,92 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the sparse time index written alongside each journaled sample log run
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * The log is cut into spans, each starting where a reader can start decoding: at every delta sync marker
+ * (see delta_codec.hpp), or every DELTA_SYNC_INTERVAL bytes of a raw log. For each span the index holds its
+ * place in the log and the range of uptimes and Tello motor times of the records in it, so a query only
+ * reads the spans that can hold a match (see sample_query.hpp). Records are not stored strictly in time
+ * order (window summaries carry the start of their window, events bring back a few seconds of raw records),
+ * which is why each span has a range rather than one timestamp.
+ *
+ * The index of run 7 is "/run0007.idx" (sample_index_path): a SampleIndexHeader, then one SampleIndexEntry
+ * per span once the span is closed. The span still open is not in the index, nor are spans closed since the
+ * last commit if the power went; readers scan whatever follows the last entry instead.
+*/
+
+#ifndef SAMPLE_INDEX_HPP
+#define SAMPLE_INDEX_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+#include "sample_record.hpp"
+
+#define SAMPLE_INDEX_MAGIC 0x58444945 /* "EIDX" */
+#define SAMPLE_INDEX_VERSION 1
+#define SAMPLE_INDEX_PATH_LEN 32
+#define SAMPLE_INDEX_BUFFER 16 /* Closed spans kept in RAM until the next flush, about 40 s of log at the default rates */
+#define SAMPLE_INDEX_NO_MOTOR 0xFFFF /* motor_min of a span without any Tello motor time in it */
+
+struct __attribute__((packed)) SampleIndexHeader{
+    uint32_t magic;   /* SAMPLE_INDEX_MAGIC */
+    uint16_t version; /* SAMPLE_INDEX_VERSION */
+    uint16_t reserved;
+    uint32_t run;     /* Journaled run the index is for */
+};
+
+/* One span of the log, 20 bytes */
+struct __attribute__((packed)) SampleIndexEntry{
+    uint32_t offset;    /* Log offset the span starts at */
+    uint32_t size;      /* Bytes in the span */
+    uint32_t first_ms;  /* Earliest and latest uptime of the records in it */
+    uint32_t last_ms;
+    uint16_t motor_min; /* Range of Tello motor time (s) in its Tello records and summaries, SAMPLE_INDEX_NO_MOTOR if none */
+    uint16_t motor_max;
+};
+
+/* Path of the index of a run */
+void sample_index_path(char out[SAMPLE_INDEX_PATH_LEN], uint32_t run);
+/* Tello motor time range (s) a stored record carries, false if it has none */
+bool sample_motor_time(const uint8_t* rec, uint16_t* min_s, uint16_t* max_s);
+
+/* Builds the index as records are stored. Safe to call from multiple tasks */
+class SampleIndexWriter{
+    public:
+        /* Start the index of run, whose first record goes at offset */
+        bool begin(uint32_t run, uint32_t offset);
+        /* Note the record about to be stored at offset. start_span if decoding can start there */
+        void add(const uint8_t* rec, uint32_t offset, bool start_span);
+        /* Write out and commit every closed span. Also done whenever SAMPLE_INDEX_BUFFER of them are waiting */
+        void flush();
+        /* Close the open span, which ends at offset, then write everything out and close the index */
+        void end(uint32_t offset);
+
+        bool is_open() const { return file.is_open(); }
+        uint32_t spans = 0; /* Closed since begin() */
+
+    private:
+        hal::File file;
+        hal::Mutex lock;
+        SampleIndexEntry span; /* Open span */
+        bool span_used = false; /* Has records */
+        SampleIndexEntry pending[SAMPLE_INDEX_BUFFER];
+        uint8_t num_pending = 0;
+
+        void close_span(uint32_t end);
+        void write_pending();
+};
+
+/* Reads a run's index back, one span at a time */
+class SampleIndexReader{
+    public:
+        /* False if the run has no usable index, a reader then has to scan the whole log */
+        bool open(uint32_t run);
+        bool next(SampleIndexEntry* entry);
+        void close() { file.close(); }
+
+    private:
+        hal::File file;
+};
+
+#endif // SAMPLE_INDEX_HPP
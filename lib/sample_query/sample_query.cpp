@@ -0,0 +1,244 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for range queries over journaled sample log runs
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include "sample_query.hpp"
+#include "sample_index.hpp"
+#include "log_journal.hpp"
+#include "delta_codec.hpp"
+
+#define QUERY_ARENA 512 /* Larger than any encoded record, so a chunk always holds at least one */
+
+typedef void (*RecordVisitor)(const uint8_t* rec, void* ctx);
+
+/* Decodes the spans of one run that a query needs, handing every record in them to a visitor */
+class QueryScan{
+    public:
+        QueryScan() : reader(arena, sizeof(arena)) {}
+
+        bool open(uint32_t run, SampleQueryStats* stats);
+        /* Visit the records of every span that could hold a match for [lo, hi], by uptime or by motor time,
+         * then the records after the last indexed span */
+        void visit(uint32_t lo, uint32_t hi, bool by_motor, RecordVisitor fn, void* ctx);
+        void close() { reader.close(); }
+
+        SampleLogHeader header;
+
+    private:
+        uint8_t arena[QUERY_ARENA];
+        LogJournalReader reader;
+        DeltaDecoder decoder;
+        SampleQueryStats* stats = nullptr;
+
+        void scan(uint32_t start, uint32_t end, RecordVisitor fn, void* ctx);
+        int decode(const uint8_t* data, size_t n, uint32_t offset, uint8_t* rec, size_t* len);
+};
+
+bool QueryScan::open(uint32_t run, SampleQueryStats* stats){
+    this->stats = stats;
+    const uint8_t* data;
+    if(!run || !reader.open(run) || reader.next(&data, sizeof(header)) != sizeof(header)){
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    stats->log_bytes = reader.size();
+    return sample_check_header(&header);
+}
+
+void QueryScan::visit(uint32_t lo, uint32_t hi, bool by_motor, RecordVisitor fn, void* ctx){
+    SampleIndexReader index;
+    SampleIndexEntry e;
+    uint32_t tail = sizeof(SampleLogHeader);
+    if(index.open(reader.run)){
+        /* Spans tile the log, anything else means the index cannot be trusted from there on */
+        while(index.next(&e) && e.offset == tail && e.offset + e.size <= reader.size()){
+            bool hit = by_motor ? e.motor_min != SAMPLE_INDEX_NO_MOTOR && e.motor_min <= hi && e.motor_max >= lo
+                                : e.first_ms <= hi && e.last_ms >= lo;
+            if(!by_motor){
+                stats->spans++;
+                stats->spans_read += hit;
+            }
+            if(hit){
+                scan(e.offset, e.offset + e.size, fn, ctx);
+            }
+            tail = e.offset + e.size;
+        }
+        index.close();
+    }
+    /* Still being written, or lost with the index's last commit */
+    scan(tail, reader.size(), fn, ctx);
+}
+
+/* Raw records, or delta encoded ones through the decoder. Same returns as DeltaDecoder::decode */
+int QueryScan::decode(const uint8_t* data, size_t n, uint32_t offset, uint8_t* rec, size_t* len){
+    if(header.encoding == SAMPLE_ENCODING_DELTA){
+        return decoder.decode(data, n, offset, rec, len);
+    }
+    size_t size = sample_record_size(data[0]);
+    if(size == 0){
+        return -1;
+    }
+    if(size > n){
+        return 0;
+    }
+    memcpy(rec, data, size);
+    *len = size;
+    return size;
+}
+
+/* Decode the log from start, which a reader can start at, to end. Same walk as the serial dump in main.cpp */
+void QueryScan::scan(uint32_t start, uint32_t end, RecordVisitor fn, void* ctx){
+    uint32_t at = start;
+    decoder.reset();
+    if(at >= end || !reader.seek(at)){
+        return;
+    }
+    const uint8_t* data;
+    size_t n;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    while(at < end && (n = reader.next(&data, end - at)) > 0){
+        size_t i = 0, len;
+        int used = 0;
+        while(i < n && (used = decode(data + i, n - i, at + i, rec, &len)) > 0){
+            if(len){
+                stats->records_read++;
+                fn(rec, ctx);
+            }
+            i += used;
+        }
+        at += i;
+        stats->bytes_read += i;
+        if(used < 0){
+            /* Raw logs have nothing to pick up again at, delta logs resume at their next sync marker */
+            long sync = header.encoding == SAMPLE_ENCODING_DELTA ? DeltaDecoder::findSync(data + i, n - i, at) : -1;
+            if(sync < 0){
+                sync = header.encoding != SAMPLE_ENCODING_DELTA ? end - at :
+                       n - i > DELTA_SYNC_LEN ? n - i - DELTA_SYNC_LEN + 1 : 1;
+            }
+            at += sync;
+            decoder.reset();
+            if(at >= end || !reader.seek(at)){
+                break;
+            }
+        }
+        else if(i < n && (i == 0 || !reader.seek(at))){
+            break;
+        }
+    }
+}
+
+/* Queries ---------------------------------------------------------------------------------------------------------------------- */
+
+template<typename T> static T get_le(const uint8_t* p){
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+bool SampleQuery::parse(const uint8_t* req, size_t len){
+    if(len < SAMPLE_QUERY_LEN || req[0] != SAMPLE_QUERY_REQUEST || req[3] > SAMPLE_QUERY_MOTOR_TIME){
+        return false;
+    }
+    run = get_le<uint16_t>(req + 1);
+    key = req[3];
+    from = get_le<uint32_t>(req + 4);
+    to = get_le<uint32_t>(req + 8);
+    every = get_le<uint16_t>(req + 12);
+    streams = req[14];
+    every = every ? every : 1;
+    return from <= to;
+}
+
+/* Uptime range of the records whose motor time falls in [lo, hi] */
+struct MotorRange{
+    uint32_t lo, hi;
+    uint32_t from_ms = 0xFFFFFFFF, to_ms = 0;
+};
+
+static void match_motor_time(const uint8_t* rec, void* ctx){
+    MotorRange* m = (MotorRange*)ctx;
+    uint16_t lo, hi;
+    if(sample_motor_time(rec, &lo, &hi) && lo <= m->hi && hi >= m->lo){
+        uint32_t uptime = get_le<uint32_t>(rec + offsetof(SampleRecordHeader, uptime));
+        m->from_ms = uptime < m->from_ms ? uptime : m->from_ms;
+        m->to_ms = uptime > m->to_ms ? uptime : m->to_ms;
+    }
+}
+
+/* Matching records re-encoded into the result */
+struct QueryOutput{
+    const SampleQuery* query;
+    SampleQueryStats* stats;
+    hal::File* file;
+    DeltaEncoder encoder;
+    uint16_t seen[SAMPLE_NUM_STREAMS];
+};
+
+static void match_uptime(const uint8_t* rec, void* ctx){
+    QueryOutput* out = (QueryOutput*)ctx;
+    uint32_t uptime = get_le<uint32_t>(rec + offsetof(SampleRecordHeader, uptime));
+    if(uptime < out->stats->from_ms || uptime > out->stats->to_ms || rec[0] >= SAMPLE_NUM_STREAMS ||
+       (out->query->streams && !(out->query->streams & (1 << rec[0]))) || out->seen[rec[0]]++ % out->query->every){
+        return;
+    }
+    uint8_t enc[DELTA_MAX_ENCODED];
+    size_t n = out->encoder.encode(rec, enc);
+    if(n && out->file->write(enc, n) == n){
+        out->stats->records_out++;
+        out->stats->result_bytes += n;
+    }
+}
+
+bool SampleQuery::answer(const char* path, SampleQueryStats* stats) const{
+    *stats = SampleQueryStats();
+    stats->run = run ? run : logLastRun();
+    hal::File file;
+    SampleLogHeader hdr;
+    sample_init_header(&hdr, SAMPLE_ENCODING_DELTA);
+    if(!file.open(path, "w") || file.write(&hdr, sizeof(hdr)) != sizeof(hdr)){
+        hal::log("- failed to open query result for writing\n");
+        return false;
+    }
+    stats->result_bytes = sizeof(hdr);
+
+    /* About 2.5 kB between the scan and the encoder, keep them off the caller's stack */
+    static QueryScan scan;
+    static QueryOutput out;
+    bool ok = scan.open(stats->run, stats);
+    if(ok){
+        stats->from_ms = from;
+        stats->to_ms = to;
+        if(key == SAMPLE_QUERY_MOTOR_TIME){
+            MotorRange m;
+            m.lo = from;
+            m.hi = to;
+            scan.visit(m.lo, m.hi, true, match_motor_time, &m);
+            stats->from_ms = m.from_ms;
+            stats->to_ms = m.to_ms;
+            stats->records_read = 0;
+        }
+
+        out.query = this;
+        out.stats = stats;
+        out.file = &file;
+        out.encoder.reset(sizeof(hdr));
+        memset(out.seen, 0, sizeof(out.seen));
+        if(stats->from_ms <= stats->to_ms){
+            scan.visit(stats->from_ms, stats->to_ms, false, match_uptime, &out);
+        }
+    }
+    scan.close();
+    file.flush();
+    file.close();
+    return ok;
+}
+
+void SampleQueryStats::log() const{
+    hal::log("Query of run %lu: %lu of %lu indexed spans read, %lu of %lu log bytes decoded, %lu of %lu records kept "
+             "(uptime %lu-%lu ms), %lu byte result\n",
+             (unsigned long)run, (unsigned long)spans_read, (unsigned long)spans, (unsigned long)bytes_read,
+             (unsigned long)log_bytes, (unsigned long)records_out, (unsigned long)records_read, (unsigned long)from_ms,
+             (unsigned long)to_ms, (unsigned long)result_bytes);
+}
@@ -0,0 +1,65 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for range queries over journaled sample log runs, answered from the sparse time index
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A query picks the records of one run between two uptimes (or two Tello motor times), optionally only
+ * some streams and only every Nth matching record of each. Only the spans of the log whose index entry
+ * overlaps the range are read (see sample_index.hpp), plus whatever was stored after the last indexed span,
+ * so answering costs about as much as the result rather than the run.
+ *
+ * Over BLE a query is a transfer request of its own (see ble_comms.hpp), SAMPLE_QUERY_LEN bytes, little-endian:
+ *   'Q' u16 run, u8 key, u32 from, u32 to, u16 every, u8 streams
+ * and the result goes back as an ordinary transfer of a delta encoded sample log, so decode_log reads it.
+ *
+ * Motor time is matched through the Tello records and Tello summaries in the log: the query becomes the
+ * uptime range those records span, so with window aggregation on it is only as fine as the windows.
+*/
+
+#ifndef SAMPLE_QUERY_HPP
+#define SAMPLE_QUERY_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+#include "sample_record.hpp"
+
+#define SAMPLE_QUERY_REQUEST 'Q'
+#define SAMPLE_QUERY_LEN 15
+#define SAMPLE_QUERY_RESULT_PATH "/query.bin" /* Where the drone puts a result before sending it */
+
+enum SampleQueryKey{
+    SAMPLE_QUERY_UPTIME = 0,    /* from/to are ESP32 uptimes, in ms */
+    SAMPLE_QUERY_MOTOR_TIME = 1 /* from/to are Tello motor times, in s */
+};
+
+class SampleQueryStats{
+    public:
+        uint32_t run = 0;          /* Run answered */
+        uint32_t log_bytes = 0;    /* Size of its log */
+        uint32_t spans = 0;        /* In its index */
+        uint32_t spans_read = 0;   /* Indexed spans that could hold a match, read */
+        uint32_t bytes_read = 0;   /* Log bytes decoded, the unindexed tail and both passes of a motor time query included */
+        uint32_t records_read = 0; /* Records decoded that could have matched */
+        uint32_t records_out = 0;  /* Records in the result */
+        uint32_t result_bytes = 0; /* Size of the result, header included */
+        uint32_t from_ms = 0, to_ms = 0; /* Uptime range answered, once motor time has been matched */
+
+        void log() const;
+};
+
+class SampleQuery{
+    public:
+        uint32_t run = 0;                  /* 0 for the latest */
+        uint8_t key = SAMPLE_QUERY_UPTIME; /* SampleQueryKey */
+        uint32_t from = 0, to = 0xFFFFFFFF; /* Inclusive */
+        uint16_t every = 1;                /* Keep every Nth matching record of each stream */
+        uint8_t streams = 0;               /* Bit n set to return stream n (SampleStream), 0 for all */
+
+        /* Fill in from a request as sent over BLE, returns false if it is malformed */
+        bool parse(const uint8_t* req, size_t len);
+        /* Write the matching records to path as a delta encoded sample log. Returns false if the run cannot be read,
+         * the file then holds just a header so the client still gets a valid, empty log */
+        bool answer(const char* path, SampleQueryStats* stats) const;
+};
+
+#endif // SAMPLE_QUERY_HPP
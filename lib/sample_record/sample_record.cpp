@@ -0,0 +1,199 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the binary sample log format
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "sample_record.hpp"
+
+void sample_init_header(SampleLogHeader *hdr, SampleEncoding encoding){
+    hdr->magic = SAMPLE_LOG_MAGIC;
+    hdr->schema_id = SAMPLE_SCHEMA_ID;
+    hdr->record_size = sizeof(SampleRecordHeader);
+    hdr->encoding = encoding;
+    hdr->reserved = 0;
+}
+
+bool sample_check_header(const SampleLogHeader *hdr){
+    return hdr->magic == SAMPLE_LOG_MAGIC && hdr->schema_id == SAMPLE_SCHEMA_ID && hdr->record_size == sizeof(SampleRecordHeader) &&
+           hdr->encoding <= SAMPLE_ENCODING_DELTA;
+}
+
+size_t sample_record_size(uint8_t stream){
+    switch(stream){
+        case SAMPLE_STREAM_SCD4X: return sizeof(Scd4xRecord);
+        case SAMPLE_STREAM_BMP3XX: return sizeof(Bmp3xxRecord);
+        case SAMPLE_STREAM_TELLO: return sizeof(TelloRecord);
+        case SAMPLE_STREAM_SUMMARY: return sizeof(SummaryRecord);
+        case SAMPLE_STREAM_ALTITUDE: return sizeof(AltitudeRecord);
+        case SAMPLE_STREAM_POSITION: return sizeof(PositionRecord);
+        default: return 0;
+    }
+}
+
+#define COLUMN(type, field, sign) {(uint8_t)offsetof(type, field), (uint8_t)sizeof(((type *)0)->field), sign, #field}
+
+static const SampleColumn scd4x_columns[] = {
+    COLUMN(Scd4xRecord, hdr.uptime, false), COLUMN(Scd4xRecord, co2, false), COLUMN(Scd4xRecord, temp, true), COLUMN(Scd4xRecord, humd, false)
+};
+
+static const SampleColumn bmp3xx_columns[] = {
+    COLUMN(Bmp3xxRecord, hdr.uptime, false), COLUMN(Bmp3xxRecord, temp, true), COLUMN(Bmp3xxRecord, pres, false), COLUMN(Bmp3xxRecord, alt, true)
+};
+
+static const SampleColumn tello_columns[] = {
+    COLUMN(TelloRecord, hdr.uptime, false),
+#define TELLO_COLUMN(id, key, state, rec, dec, label, unit) COLUMN(TelloRecord, key, (rec)-1 < 0),
+    TELLO_FIELDS(TELLO_COLUMN)
+#undef TELLO_COLUMN
+};
+
+static const SampleColumn summary_columns[] = {
+    COLUMN(SummaryRecord, hdr.uptime, false), COLUMN(SummaryRecord, source, false), COLUMN(SummaryRecord, column, false),
+    COLUMN(SummaryRecord, count, false), COLUMN(SummaryRecord, min, true), COLUMN(SummaryRecord, max, true),
+    COLUMN(SummaryRecord, mean, true), COLUMN(SummaryRecord, stddev, false)
+};
+
+static const SampleColumn altitude_columns[] = {
+    COLUMN(AltitudeRecord, hdr.uptime, false), COLUMN(AltitudeRecord, alt, true), COLUMN(AltitudeRecord, vz, true),
+    COLUMN(AltitudeRecord, stddev, false)
+};
+
+static const SampleColumn position_columns[] = {
+    COLUMN(PositionRecord, hdr.uptime, false), COLUMN(PositionRecord, x, true), COLUMN(PositionRecord, y, true),
+    COLUMN(PositionRecord, z, true)
+};
+
+const SampleColumn *sample_columns(uint8_t stream, size_t *count){
+    switch(stream){
+        case SAMPLE_STREAM_SCD4X: *count = sizeof(scd4x_columns) / sizeof(scd4x_columns[0]); return scd4x_columns;
+        case SAMPLE_STREAM_BMP3XX: *count = sizeof(bmp3xx_columns) / sizeof(bmp3xx_columns[0]); return bmp3xx_columns;
+        case SAMPLE_STREAM_TELLO: *count = sizeof(tello_columns) / sizeof(tello_columns[0]); return tello_columns;
+        case SAMPLE_STREAM_SUMMARY: *count = sizeof(summary_columns) / sizeof(summary_columns[0]); return summary_columns;
+        case SAMPLE_STREAM_ALTITUDE: *count = sizeof(altitude_columns) / sizeof(altitude_columns[0]); return altitude_columns;
+        case SAMPLE_STREAM_POSITION: *count = sizeof(position_columns) / sizeof(position_columns[0]); return position_columns;
+        default: *count = 0; return NULL;
+    }
+}
+
+int64_t sample_column_value(const uint8_t *rec, const SampleColumn *col){
+    uint32_t v = 0;
+    for(uint8_t i = 0; i < col->size; i++){
+        v |= (uint32_t)rec[col->offset + i] << (8 * i);
+    }
+    if(col->is_signed && col->size < 4 && (v & (1u << (8 * col->size - 1)))){
+        v |= ~0u << (8 * col->size);
+    }
+    return col->is_signed ? (int64_t)(int32_t)v : (int64_t)v;
+}
+
+const char *sample_stream_name(uint8_t stream){
+    switch(stream){
+        case SAMPLE_STREAM_SCD4X: return "scd4x";
+        case SAMPLE_STREAM_BMP3XX: return "bmp3xx";
+        case SAMPLE_STREAM_TELLO: return "tello";
+        case SAMPLE_STREAM_SUMMARY: return "summary";
+        case SAMPLE_STREAM_ALTITUDE: return "altitude";
+        case SAMPLE_STREAM_POSITION: return "position";
+        default: return NULL;
+    }
+}
+
+const char *sample_csv_header(uint8_t stream){
+    switch(stream){
+        case SAMPLE_STREAM_SCD4X: return "Uptime (ms),CO2 (ppm),Temperature (SCD4x)(C),Relative Humidity (%)";
+        case SAMPLE_STREAM_BMP3XX: return "Uptime (ms),Temperature (BMP3xx)(C),Pressure (hPa),Approx. Altitude (m)";
+        case SAMPLE_STREAM_TELLO: return "Uptime (ms)"
+#define TELLO_CSV_COLUMN(id, key, state, rec, dec, label, unit) "," label " (" unit ")"
+                                         TELLO_FIELDS(TELLO_CSV_COLUMN);
+#undef TELLO_CSV_COLUMN
+        case SAMPLE_STREAM_ALTITUDE: return "Uptime (ms),Fused Altitude (m),Vertical Velocity (m/s),Altitude Std Dev (m)";
+        case SAMPLE_STREAM_POSITION: return "Uptime (ms),x (m),y (m),z (m)";
+        case SAMPLE_STREAM_SUMMARY: return "Window Start (ms),Stream,Column,Samples,Min,Max,Mean,Std Dev (fixed-point units of the column)";
+        default: return NULL;
+    }
+}
+
+/* Print a fixed-point value with the given number of decimal places, without going through float */
+static void format_fixed(char out[16], int32_t val, int decimals){
+    const char *sign = val < 0 ? "-" : "";
+    uint32_t mag = val < 0 ? -(uint32_t)val : val;
+    uint32_t scale = tello_pow10(decimals);
+    if(decimals == 0){
+        snprintf(out, 16, "%s%lu", sign, (unsigned long)mag);
+    } else{
+        snprintf(out, 16, "%s%lu.%0*lu", sign, (unsigned long)(mag / scale), decimals, (unsigned long)(mag % scale));
+    }
+}
+
+/* Append ",<val>" to a csv row of n characters so far, returns the new length as sample_format_csv does */
+static int append_fixed(char *out, size_t cap, int n, int32_t val, int decimals){
+    if(n < 0 || (size_t)n >= cap){
+        return n;
+    }
+    char a[16];
+    format_fixed(a, val, decimals);
+    return n + snprintf(out + n, cap - n, ",%s", a);
+}
+
+int sample_format_csv(const uint8_t *rec, char *out, size_t cap){
+    char a[16], b[16], c[16];
+
+    /* Copy out of the log buffer first, records are packed and may be unaligned */
+    switch(rec[0]){
+        case SAMPLE_STREAM_SCD4X:{
+            Scd4xRecord r;
+            memcpy(&r, rec, sizeof(r));
+            format_fixed(a, r.temp, 2);
+            format_fixed(b, r.humd, 2);
+            return snprintf(out, cap, "%lu,%u,%s,%s", (unsigned long)r.hdr.uptime, r.co2, a, b);
+        }
+        case SAMPLE_STREAM_BMP3XX:{
+            Bmp3xxRecord r;
+            memcpy(&r, rec, sizeof(r));
+            format_fixed(a, r.temp, 2);
+            format_fixed(b, (int32_t)r.pres, 2);
+            format_fixed(c, r.alt, 2);
+            return snprintf(out, cap, "%lu,%s,%s,%s", (unsigned long)r.hdr.uptime, a, b, c);
+        }
+        case SAMPLE_STREAM_TELLO:{
+            TelloRecord r;
+            memcpy(&r, rec, sizeof(r));
+            int n = snprintf(out, cap, "%lu", (unsigned long)r.hdr.uptime);
+#define TELLO_CSV_VALUE(id, key, state, rec, dec, label, unit) n = append_fixed(out, cap, n, r.key, dec);
+            TELLO_FIELDS(TELLO_CSV_VALUE)
+#undef TELLO_CSV_VALUE
+            return n;
+        }
+        case SAMPLE_STREAM_ALTITUDE:{
+            AltitudeRecord r;
+            memcpy(&r, rec, sizeof(r));
+            format_fixed(a, r.alt, 3);
+            format_fixed(b, r.vz, 3);
+            format_fixed(c, r.stddev, 3);
+            return snprintf(out, cap, "%lu,%s,%s,%s", (unsigned long)r.hdr.uptime, a, b, c);
+        }
+        case SAMPLE_STREAM_POSITION:{
+            PositionRecord r;
+            memcpy(&r, rec, sizeof(r));
+            format_fixed(a, r.x, 3);
+            format_fixed(b, r.y, 3);
+            format_fixed(c, r.z, 3);
+            return snprintf(out, cap, "%lu,%s,%s,%s", (unsigned long)r.hdr.uptime, a, b, c);
+        }
+        case SAMPLE_STREAM_SUMMARY:{
+            SummaryRecord r;
+            memcpy(&r, rec, sizeof(r));
+            size_t count;
+            const SampleColumn *cols = sample_columns(r.source, &count);
+            const char *stream = sample_stream_name(r.source);
+            return snprintf(out, cap, "%lu,%s,%s,%u,%ld,%ld,%ld,%lu", (unsigned long)r.hdr.uptime, stream ? stream : "?",
+                            cols && r.column < count ? cols[r.column].name : "?", r.count, (long)r.min, (long)r.max,
+                            (long)r.mean, (unsigned long)r.stddev);
+        }
+        default:
+            return -1;
+    }
+}
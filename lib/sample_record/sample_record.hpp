@@ -0,0 +1,140 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the binary sample log format shared by the firmware and the host-side decoder
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A log file is one SampleLogHeader followed by tagged records. Each sensor is its own stream, sampled
+ * at its own rate: every record starts with a SampleRecordHeader naming its stream and timestamp, and
+ * the stream fixes the record's size (see sample_record_size), so no row is ever padded with stale or
+ * zeroed readings from another sensor.
+ * Everything is stored little-endian (native on both the ESP32 and x86 hosts).
+ * Readings are quantised to fixed point so the acquisition loop never formats floats.
+ * Any change to a record must bump SAMPLE_SCHEMA_ID.
+*/
+
+#ifndef SAMPLE_RECORD_HPP
+#define SAMPLE_RECORD_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tello_fields.hpp"
+
+#define SAMPLE_LOG_MAGIC 0x444F4345 /* "ECOD" */
+#define SAMPLE_SCHEMA_ID 5
+
+/* Streams, the first byte of every record */
+enum SampleStream{
+    SAMPLE_STREAM_SCD4X = 1,
+    SAMPLE_STREAM_BMP3XX = 2,
+    SAMPLE_STREAM_TELLO = 3,
+    SAMPLE_STREAM_SUMMARY = 4, /* Window summaries of the other streams, see lib/sample_agg */
+    SAMPLE_STREAM_ALTITUDE = 5, /* Fused altitude, see lib/alt_fusion */
+    SAMPLE_STREAM_POSITION = 6, /* Dead-reckoned position, see lib/voxel_map */
+    SAMPLE_NUM_STREAMS = 7 /* One past the last stream id */
+};
+
+/* How the records after the header are stored */
+enum SampleEncoding{
+    SAMPLE_ENCODING_RAW = 0,  /* Records as declared below */
+    SAMPLE_ENCODING_DELTA = 1 /* Column-wise deltas, see lib/littlefs_io/delta_codec.hpp */
+};
+
+/* Written once at the start of every log file */
+struct __attribute__((packed)) SampleLogHeader{
+    uint32_t magic;       /* SAMPLE_LOG_MAGIC */
+    uint16_t schema_id;   /* SAMPLE_SCHEMA_ID the file was written with */
+    uint16_t record_size; /* sizeof(SampleRecordHeader) the file was written with */
+    uint16_t encoding;    /* SampleEncoding */
+    uint16_t reserved;
+};
+
+/* Start of every record */
+struct __attribute__((packed)) SampleRecordHeader{
+    uint8_t stream;  /* SampleStream */
+    uint32_t uptime; /* ESP32 uptime at acquisition, in ms */
+};
+
+/* SCD4x measurement, one per data-ready (every 5 s), 11 bytes */
+struct __attribute__((packed)) Scd4xRecord{
+    SampleRecordHeader hdr;
+    uint16_t co2;  /* CO2 concentration, in ppm */
+    int16_t temp;  /* Temperature, in 1/100 C */
+    uint16_t humd; /* Relative humidity, in 1/100 % */
+};
+
+/* BMP3xx measurement, 15 bytes */
+struct __attribute__((packed)) Bmp3xxRecord{
+    SampleRecordHeader hdr;
+    int16_t temp;  /* Temperature, in 1/100 C */
+    uint32_t pres; /* Pressure, in Pa (1/100 hPa) */
+    int32_t alt;   /* Approximate altitude, in cm */
+};
+
+/* Tello state packet, 36 bytes. One member per row of TELLO_FIELDS, in its record type and units */
+struct __attribute__((packed)) TelloRecord{
+    SampleRecordHeader hdr;
+#define TELLO_RECORD_MEMBER(id, key, state, rec, dec, label, unit) rec key;
+    TELLO_FIELDS(TELLO_RECORD_MEMBER)
+#undef TELLO_RECORD_MEMBER
+};
+static_assert(sizeof(TelloRecord) == 36, "TelloRecord changed size, bump SAMPLE_SCHEMA_ID");
+
+/* Fused altitude estimate, 13 bytes */
+struct __attribute__((packed)) AltitudeRecord{
+    SampleRecordHeader hdr;
+    int32_t alt;     /* Above the takeoff point, in mm */
+    int16_t vz;      /* Vertical velocity, in mm/s */
+    uint16_t stddev; /* Standard deviation of alt, in mm */
+};
+
+/* Dead-reckoned position relative to the takeoff point, one per Tello state packet, 17 bytes */
+struct __attribute__((packed)) PositionRecord{
+    SampleRecordHeader hdr;
+    int32_t x, y, z; /* In mm, x along the heading at takeoff, y to its right, z up */
+};
+
+/* Summary of one column of another stream over a window, 25 bytes.
+ * Values are in the summarised column's own fixed-point units */
+struct __attribute__((packed)) SummaryRecord{
+    SampleRecordHeader hdr; /* uptime is the start of the window */
+    uint8_t source;         /* Stream summarised */
+    uint8_t column;         /* Index into sample_columns(source) */
+    uint16_t count;         /* Samples in the window */
+    int32_t min, max, mean;
+    uint32_t stddev;
+};
+
+/* One fixed-point field of a record, for code that works column by column */
+struct SampleColumn{
+    uint8_t offset;   /* Byte offset in the record */
+    uint8_t size;     /* 1, 2 or 4 bytes */
+    bool is_signed;
+    const char* name; /* Field name in the record struct */
+};
+
+#define SAMPLE_MAX_RECORD_SIZE 64 /* Largest record of any stream */
+#define SAMPLE_MAX_COLUMNS 24     /* Most columns in any stream */
+
+/* Quantise a reading to fixed point with the given scale, rounding to nearest */
+static inline int32_t sample_quantise(float val, float scale){
+    float scaled = val * scale;
+    return (int32_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+}
+
+void sample_init_header(SampleLogHeader *hdr, SampleEncoding encoding = SAMPLE_ENCODING_RAW);
+/* Returns true if hdr describes a log this build knows how to decode */
+bool sample_check_header(const SampleLogHeader *hdr);
+
+/* Size of a record of the given stream, 0 for an unknown stream */
+size_t sample_record_size(uint8_t stream);
+/* Columns of a stream's records, including the uptime but not the stream id. NULL for an unknown stream */
+const SampleColumn *sample_columns(uint8_t stream, size_t *count);
+/* Value of column col of the record at rec, sign extended if the column is signed */
+int64_t sample_column_value(const uint8_t *rec, const SampleColumn *col);
+/* Short name of a stream ("scd4x", ...), NULL for an unknown stream */
+const char *sample_stream_name(uint8_t stream);
+/* csv columns of a stream, NULL for an unknown stream */
+const char *sample_csv_header(uint8_t stream);
+/* Format the record at rec as one csv row of its stream's columns (no newline), returns the length written or -1 */
+int sample_format_csv(const uint8_t *rec, char *out, size_t cap);
+
+#endif // SAMPLE_RECORD_HPP
@@ -0,0 +1,55 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file describing every field of a Tello state packet, in one table
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * TELLO_FIELDS(X) expands X once per field, in the order the Tello sends them. Everything that depends on
+ * the fields is generated from it: TelloState and the parser (tello_state_parser.hpp), TelloRecord and its
+ * columns (sample_record.hpp), the csv header and rows, and fill_tello_fields. To add a field, add a row
+ * here and bump SAMPLE_SCHEMA_ID.
+ *
+ *     X(id, key, state type, record type, decimals, csv label, unit)
+ *         id           TELLO_<id> in TelloStateField
+ *         key          key in the state packet, and the member's name in TelloState and TelloRecord
+ *         state type   int for whole numbers, float for fields the Tello sends with decimals
+ *         record type  fixed-point type in TelloRecord
+ *         decimals     the record holds the value times 10^decimals
+ *         csv label    column heading, followed by " (unit)"
+*/
+
+#ifndef TELLO_FIELDS_HPP
+#define TELLO_FIELDS_HPP
+
+#include <stdint.h>
+
+#define TELLO_FIELDS(X) \
+    X(PITCH, pitch, int,   int16_t,  0, "Pitch", "deg") \
+    X(ROLL,  roll,  int,   int16_t,  0, "Roll", "deg") \
+    X(YAW,   yaw,   int,   int16_t,  0, "Yaw", "deg") \
+    X(VGX,   vgx,   int,   int16_t,  0, "vgx", "dm/s") \
+    X(VGY,   vgy,   int,   int16_t,  0, "vgy", "dm/s") \
+    X(VGZ,   vgz,   int,   int16_t,  0, "vgz", "dm/s") \
+    X(TEMPL, templ, int,   int8_t,   0, "Lowest Temperature", "C") \
+    X(TEMPH, temph, int,   int8_t,   0, "Highest Temperature", "C") \
+    X(TOF,   tof,   int,   int16_t,  0, "Absolute Height (Tello TOF)", "cm") \
+    X(H,     h,     int,   int16_t,  0, "Relative Height", "cm") \
+    X(BAT,   bat,   int,   uint8_t,  0, "Battery", "%") \
+    X(BARO,  baro,  float, int32_t,  2, "Barometer", "cm") \
+    X(TIME,  time,  int,   uint16_t, 0, "Motor Time", "s") \
+    X(AGX,   agx,   float, int16_t,  0, "agx", "mg") \
+    X(AGY,   agy,   float, int16_t,  0, "agy", "mg") \
+    X(AGZ,   agz,   float, int16_t,  0, "agz", "mg")
+
+/* Index of each state field */
+enum TelloStateField{
+#define TELLO_FIELD_ENUM(id, key, state, rec, dec, label, unit) TELLO_##id,
+    TELLO_FIELDS(TELLO_FIELD_ENUM)
+#undef TELLO_FIELD_ENUM
+    TELLO_NUM_FIELDS
+};
+
+/* 10^n, for turning decimals into a fixed-point scale */
+static constexpr int32_t tello_pow10(int n){
+    return n > 0 ? 10 * tello_pow10(n - 1) : 1;
+}
+
+#endif // TELLO_FIELDS_HPP
@@ -0,0 +1,432 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the multi-rate sensor scheduler and the sample streams
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include "sensor_sched.hpp"
+#include "metrics.hpp"
+
+bool SensorScheduler::add(const char* name, uint32_t period_ms, SensorPollFn poll, void* ctx){
+    if(num_tasks >= SENSOR_SCHED_MAX_TASKS || period_ms == 0){
+        return false;
+    }
+    SensorTask& t = tasks[num_tasks++];
+    memset(&t, 0, sizeof(t));
+    t.name = name;
+    t.period_ms = period_ms;
+    t.poll = poll;
+    t.ctx = ctx;
+    t.next_ms = hal::millis();
+    if(tick_ms == 0 || period_ms < tick_ms){
+        tick_ms = period_ms;
+    }
+    return true;
+}
+
+uint32_t SensorScheduler::step(uint32_t now_ms){
+    uint32_t start = hal::micros();
+    uint32_t samples = 0;
+    for(uint8_t i = 0; i < num_tasks; ++i){
+        SensorTask& t = tasks[i];
+        if((int32_t)(now_ms - t.next_ms) < 0){
+            continue;
+        }
+        t.polls++;
+        if(t.poll(now_ms, t.ctx)){
+            t.samples++;
+            samples++;
+        }
+        t.next_ms += t.period_ms;
+        /* If we fell more than a period behind, skip ahead instead of polling back to back to catch up */
+        if((int32_t)(now_ms - t.next_ms) >= 0){
+            uint32_t missed = (now_ms - t.next_ms) / t.period_ms + 1;
+            t.skipped += missed;
+            t.next_ms += missed * t.period_ms;
+        }
+    }
+    uint32_t took = hal::micros() - start;
+    if(took > step_max_us){
+        step_max_us = took;
+    }
+    return samples;
+}
+
+void SensorScheduler::run(){
+    uint32_t wake = hal::millis();
+    running = true;
+    while(!stopping){
+        step(hal::millis());
+        uint32_t now = hal::millis();
+        if((int32_t)(now - (wake + tick_ms)) > 0){
+            /* Start the next tick straight away, but from now, so one slow poll doesn't leave us chasing the old cadence */
+            overruns++;
+            wake = now - tick_ms;
+        }
+        hal::delay_until(wake, tick_ms);
+    }
+    running = false;
+}
+
+void SensorScheduler::stop(){
+    stopping = true;
+    while(running){
+        hal::delay(tick_ms ? tick_ms : 1);
+    }
+}
+
+void SensorScheduler::print_stats() const{
+    hal::log("Sensor scheduler: %u ms tick, %u overruns, longest step %u us\n", tick_ms, overruns, step_max_us);
+    for(uint8_t i = 0; i < num_tasks; ++i){
+        const SensorTask& t = tasks[i];
+        hal::log("  %-8s every %4u ms: %u polls, %u samples, %u skipped\n", t.name, t.period_ms, t.polls, t.samples, t.skipped);
+    }
+}
+
+/* Sample streams ------------------------------------------------------------------------------------------------------------- */
+
+bool SampleStreams::begin(const char* path, SampleEncoding encoding){
+    SampleLogHeader hdr;
+    reset(&hdr, encoding);
+    return log.begin(path, (const uint8_t*)&hdr, sizeof(hdr));
+}
+
+bool SampleStreams::begin_run(SampleEncoding encoding){
+    SampleLogHeader hdr;
+    reset(&hdr, encoding);
+    if(!log.beginRun((const uint8_t*)&hdr, sizeof(hdr))){
+        return false;
+    }
+    if(!index.begin(log.run(), sizeof(hdr))){
+        hal::log("- failed to start the run's index, queries will scan the whole log\n");
+    }
+    return true;
+}
+
+/* Start every stream afresh for a new log, which begins with hdr */
+void SampleStreams::reset(SampleLogHeader* hdr, SampleEncoding encoding){
+    /* Log is a schema header followed by tagged per-sensor records, see sample_record.hpp */
+    sample_init_header(hdr, encoding);
+    this->encoding = encoding;
+    encoder.reset(sizeof(*hdr));
+    log_offset = span_start = sizeof(*hdr);
+    aggregator.reset();
+    track.reset();
+    voxels.clear();
+    fusion.reset();
+    fusion_in = AltitudeInputs();
+    fusion_max_us = fusion_over_budget = 0;
+    altitude.publish(fusion.estimate);
+    energy_model.reset();
+    last_readings = SensorReadings();
+    readings.publish(last_readings);
+    raw_bytes = 0;
+    pipe_stats.reset();
+    stored.store(0);
+}
+
+bool SampleStreams::start_storage_task(unsigned priority, int core){
+    if(pipe != NULL){
+        return true;
+    }
+    pipe = new hal::MessageBuffer(SAMPLE_PIPE_SIZE);
+    return hal::task_create(storage_task, "sample_store", 8192, this, priority, core) != NULL;
+}
+
+/* Wait until the storage task has finished with every record sent so far */
+bool SampleStreams::drain(uint32_t timeout_ms){
+    uint32_t target = pipe_stats.sent.load(std::memory_order_acquire);
+    uint32_t start = hal::millis();
+    while(pipe && (int32_t)(target - stored.load(std::memory_order_acquire)) > 0){
+        if(hal::millis() - start >= timeout_ms){
+            return false;
+        }
+        hal::delay(1);
+    }
+    return true;
+}
+
+bool SampleStreams::sync(){
+    bool caught_up = drain(SAMPLE_SYNC_TIMEOUT_MS);
+    index.flush();
+    return log.sync() && caught_up;
+}
+
+/* Once the scheduler has stopped and storage has caught up, nothing else touches the aggregator */
+void SampleStreams::end(){
+    drain(SAMPLE_SYNC_TIMEOUT_MS);
+    aggregator.finish();
+    index.end(log_offset);
+    log.end();
+}
+
+/* Only called from the scheduler's task. Without a storage task the aggregator and encoder are only touched
+ * here, so they need no lock of their own; with one, this never waits */
+void SampleStreams::write(const uint8_t* rec, size_t len){
+    raw_bytes += len;
+    if(pipe == NULL){
+        aggregator.add(rec, len);
+        if(tello.capture){
+            tello.capture->store();
+        }
+        return;
+    }
+
+    size_t space = pipe->space();
+    if(SAMPLE_PIPE_SIZE - space > pipe_stats.max_used){
+        pipe_stats.max_used = SAMPLE_PIPE_SIZE - space;
+    }
+    /* Shed the 50 Hz streams first so the rarer SCD4x, Tello and position records still get through.
+     * By default both are only stored as window summaries anyway, so a gap costs little */
+    bool shed = space < SAMPLE_PIPE_SHED_SIZE && (rec[0] == SAMPLE_STREAM_BMP3XX || rec[0] == SAMPLE_STREAM_ALTITUDE);
+    if(shed || !pipe->send(rec, len, 0)){
+        pipe_stats.shed += shed;
+        pipe_stats.dropped[rec[0]]++;
+        METRIC_COUNT(METRIC_RECORDS_DROPPED, 1);
+        return;
+    }
+    pipe_stats.sent.fetch_add(1, std::memory_order_release);
+}
+
+/* Takes records off the pipe and stores them, the only place flash is written while storage runs here */
+void SampleStreams::storage_task(void* params){
+    SampleStreams* s = (SampleStreams*)params;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    while(1){
+        size_t len = s->pipe->recv(rec, sizeof(rec), SAMPLE_STORE_IDLE_MS);
+        if(s->tello.capture){
+            s->tello.capture->store();
+        }
+        if(len == 0){
+            s->log.poll();
+            continue;
+        }
+        uint32_t start = hal::micros();
+        s->aggregator.add(rec, len);
+        uint32_t took = hal::micros() - start;
+        if(took > s->pipe_stats.store_max_us){
+            s->pipe_stats.store_max_us = took;
+        }
+        s->stored.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void SamplePipeStats::reset(){
+    sent.store(0);
+    shed = max_used = store_max_us = 0;
+    for(int i = 0; i < SAMPLE_NUM_STREAMS; ++i){
+        dropped[i] = 0;
+    }
+}
+
+void SamplePipeStats::log() const{
+    uint32_t lost = 0;
+    for(int i = 0; i < SAMPLE_NUM_STREAMS; ++i){
+        lost += dropped[i];
+    }
+    hal::log("Storage pipe: %u records sent, %u dropped (%u shed), most waiting %u of %u bytes, longest store %u us\n",
+             sent.load(), lost, shed, max_used, SAMPLE_PIPE_SIZE, store_max_us);
+    if(lost){
+        hal::log("Storage pipe drops:");
+        for(int i = 1; i < SAMPLE_NUM_STREAMS; ++i){
+            if(dropped[i]){
+                hal::log(" %s %u", sample_stream_name(i), dropped[i]);
+            }
+        }
+        hal::log("\n");
+    }
+}
+
+/* Aggregator sink, records (raw or summaries) that made it to storage */
+void SampleStreams::store(const uint8_t* rec, size_t len, void* ctx){
+    SampleStreams* s = (SampleStreams*)ctx;
+    METRIC_TIME(METRIC_STORE);
+    uint8_t out[DELTA_MAX_ENCODED];
+    const uint8_t* data = rec;
+    if(s->encoding == SAMPLE_ENCODING_DELTA){
+        len = s->encoder.encode(rec, out);
+        data = out;
+    }
+    /* A reader can start decoding at a sync marker, or anywhere between raw records */
+    bool start = s->encoding == SAMPLE_ENCODING_DELTA ? len && out[0] == DELTA_SYNC_BYTE
+                                                      : s->log_offset - s->span_start >= DELTA_SYNC_INTERVAL;
+    if(start){
+        s->span_start = s->log_offset;
+    }
+    if(len){
+        s->index.add(rec, s->log_offset, start);
+    }
+    s->log.write(data, len);
+    s->log_offset += len;
+}
+
+bool SampleStreams::add_to(SensorScheduler& sched){
+    /* Fusion goes after the BMP3xx so a step sees the reading taken in the same tick */
+    return sched.add("scd4x", SCD4X_POLL_MS, poll_scd4x, this) &&
+           sched.add("bmp3xx", BMP3XX_PERIOD_MS, poll_bmp3xx, this) &&
+           sched.add("tello", TELLO_POLL_MS, poll_tello, this) &&
+           sched.add("altitude", ALT_FUSION_PERIOD_MS, poll_altitude, this);
+}
+
+/* Only read the SCD4x once it flags a new measurement, instead of polling into NotEnoughDataError */
+bool SampleStreams::poll_scd4x(uint32_t now_ms, void* ctx){
+    SampleStreams* s = (SampleStreams*)ctx;
+    uint16_t co2;
+    float temp, humd;
+    if(!hal::scd4x_data_ready()){
+        return false;
+    }
+    bool ok;
+    {
+        METRIC_TIME(METRIC_SCD4X_READ);
+        ok = hal::scd4x_read(co2, temp, humd);
+    }
+    if(!ok){
+        METRIC_COUNT(METRIC_SENSOR_ERRORS, 1);
+        return false;
+    }
+    Scd4xRecord rec;
+    rec.hdr.stream = SAMPLE_STREAM_SCD4X;
+    rec.hdr.uptime = now_ms;
+    rec.co2 = co2;
+    rec.temp = sample_quantise(temp, 100);
+    rec.humd = sample_quantise(humd, 100);
+    s->write((const uint8_t*)&rec, sizeof(rec));
+    s->voxels.add_co2(s->track.pos, co2);
+    s->last_readings.scd4x_ms = now_ms;
+    s->last_readings.co2 = rec.co2;
+    s->last_readings.scd4x_temp = rec.temp;
+    s->last_readings.humd = rec.humd;
+    s->last_readings.seq++;
+    s->readings.publish(s->last_readings);
+    return true;
+}
+
+bool SampleStreams::poll_bmp3xx(uint32_t now_ms, void* ctx){
+    SampleStreams* s = (SampleStreams*)ctx;
+    float temp, pres, alt;
+    bool ok;
+    {
+        METRIC_TIME(METRIC_BMP3XX_READ);
+        ok = hal::bmp3xx_read(temp, pres, alt);
+    }
+    if(!ok){
+        METRIC_COUNT(METRIC_SENSOR_ERRORS, 1);
+        return false;
+    }
+    Bmp3xxRecord rec;
+    rec.hdr.stream = SAMPLE_STREAM_BMP3XX;
+    rec.hdr.uptime = now_ms;
+    rec.temp = sample_quantise(temp, 100);
+    rec.pres = sample_quantise(pres, 1);
+    rec.alt = sample_quantise(alt, 100);
+    s->write((const uint8_t*)&rec, sizeof(rec));
+    s->fusion_in.bmp = true;
+    s->fusion_in.pres_pa = pres;
+    s->voxels.add_temp(s->track.pos, temp);
+    s->last_readings.bmp3xx_ms = now_ms;
+    s->last_readings.bmp3xx_temp = rec.temp;
+    s->last_readings.pres = rec.pres;
+    s->last_readings.seq++;
+    s->readings.publish(s->last_readings);
+    return true;
+}
+
+/* Log each state packet once, stamped with when it arrived rather than when it was polled */
+bool SampleStreams::poll_tello(uint32_t now_ms, void* ctx){
+    SampleStreams* s = (SampleStreams*)ctx;
+    TelloStateSnapshot snap = s->tello.get_state();
+    if(snap.seq == s->tello_seq){
+        return false;
+    }
+    s->tello_seq = snap.seq;
+
+    TelloRecord rec;
+    rec.hdr.stream = SAMPLE_STREAM_TELLO;
+    rec.hdr.uptime = now_ms - (hal::micros() - snap.arrival_us) / 1000;
+    fill_tello_fields(rec, snap.state);
+    s->write((const uint8_t*)&rec, sizeof(rec));
+    return true;
+}
+
+/* Runs on the scheduler's task (core 0 on the ESP32), its time is tracked against ALT_FUSION_BUDGET_US */
+bool SampleStreams::poll_altitude(uint32_t now_ms, void* ctx){
+    SampleStreams* s = (SampleStreams*)ctx;
+    uint32_t start = hal::micros();
+
+    /* Read the Tello's state directly rather than waiting for poll_tello, which runs at a lower rate */
+    TelloStateSnapshot snap = s->tello.get_state();
+    bool new_state = snap.seq != s->fusion_tello_seq;
+    if(new_state){
+        s->fusion_tello_seq = snap.seq;
+        s->fusion_in.tello = true;
+        s->fusion_in.tof_cm = snap.state.tof;
+        s->fusion_in.h_cm = snap.state.h;
+        s->fusion_in.baro = snap.state.baro;
+    }
+    const AltitudeEstimate& est = s->fusion.step(now_ms, s->fusion_in);
+    s->fusion_in = AltitudeInputs();
+    s->altitude.publish(est);
+
+    /* Horizontal position moves with each state packet, height with every step */
+    uint32_t arrival_ms = now_ms - (hal::micros() - snap.arrival_us) / 1000;
+    if(new_state){
+        s->track.update(arrival_ms, snap.state.vgx, snap.state.vgy, snap.state.yaw, est.grounded);
+    }
+    s->track.pos.z_cm = est.alt_cm;
+    s->position.publish(s->track.pos);
+    if(new_state){
+        s->energy.publish(s->energy_model.update(arrival_ms, snap.state, est.vz_cms, est.grounded, s->track.pos));
+    }
+
+    uint32_t took = hal::micros() - start;
+    if(took > s->fusion_max_us){
+        s->fusion_max_us = took;
+    }
+    if(took > ALT_FUSION_BUDGET_US){
+        s->fusion_over_budget++;
+    }
+
+    AltitudeRecord rec;
+    rec.hdr.stream = SAMPLE_STREAM_ALTITUDE;
+    rec.hdr.uptime = now_ms;
+    rec.alt = sample_quantise(est.alt_cm, 10);
+    rec.vz = sample_quantise(est.vz_cms, 10);
+    rec.stddev = est.alt_std_cm < 6500 ? sample_quantise(est.alt_std_cm, 10) : UINT16_MAX;
+    s->write((const uint8_t*)&rec, sizeof(rec));
+
+    if(new_state){
+        PositionRecord pos;
+        pos.hdr.stream = SAMPLE_STREAM_POSITION;
+        pos.hdr.uptime = s->track.pos.uptime;
+        pos.x = sample_quantise(s->track.pos.x_cm, 10);
+        pos.y = sample_quantise(s->track.pos.y_cm, 10);
+        pos.z = sample_quantise(s->track.pos.z_cm, 10);
+        s->write((const uint8_t*)&pos, sizeof(pos));
+    }
+    return true;
+}
+
+SensorReadings SampleStreams::get_readings() const{
+    SensorReadings r;
+    readings.read(r);
+    return r;
+}
+
+AltitudeEstimate SampleStreams::get_altitude() const{
+    AltitudeEstimate est;
+    altitude.read(est);
+    return est;
+}
+
+Position SampleStreams::get_position() const{
+    Position pos;
+    position.read(pos);
+    return pos;
+}
+
+EnergyEstimate SampleStreams::get_energy() const{
+    EnergyEstimate est;
+    energy.read(est);
+    return est;
+}
@@ -0,0 +1,190 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the multi-rate sensor scheduler and the sample streams it drives
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Every sensor is polled at its own period from one fixed-rate tick, and only logs when it actually
+ * has something new: the SCD4x when its data-ready flag is set (every 5 s), the BMP3xx on every one
+ * of its 50 Hz conversions, the Tello when a new state packet has arrived.
+ *
+ * Acquisition and storage can run on separate tasks (start_storage_task): the scheduler then only hands
+ * fixed-size records to a message buffer, and a storage task on the other core aggregates, encodes and
+ * writes them, so a slow flash write never delays the next sample. If storage falls behind and the buffer
+ * runs low, the 50 Hz streams (BMP3xx, altitude) are dropped first, then anything that no longer fits;
+ * every drop is counted per stream in SamplePipeStats. A Tello capture being recorded (tello_capture.hpp) is
+ * written out by the same task.
+*/
+
+#ifndef SENSOR_SCHED_HPP
+#define SENSOR_SCHED_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "delta_codec.hpp"
+#include "sample_record.hpp"
+#include "sample_agg.hpp"
+#include "sample_index.hpp"
+#include "alt_fusion.hpp"
+#include "voxel_map.hpp"
+#include "energy_model.hpp"
+#include "tello_ctrl.hpp"
+
+#define SENSOR_SCHED_MAX_TASKS 8
+
+#define SCD4X_POLL_MS 500 /* How often the SCD4x data-ready flag is checked */
+#define BMP3XX_PERIOD_MS 20 /* Matches the BMP3xx's 50 Hz output data rate */
+#define TELLO_POLL_MS 50 /* The Tello sends state at about 10 Hz, poll faster so no packet is missed */
+
+#define SAMPLE_PIPE_SIZE 8192 /* Bytes of records storage can fall behind by, about 3 s at the default rates */
+#define SAMPLE_PIPE_SHED_SIZE 2048 /* With less than this free, BMP3xx and altitude records are dropped */
+#define SAMPLE_STORE_IDLE_MS 1000 /* The storage task wakes at least this often, so the log flushes on time */
+#define SAMPLE_SYNC_TIMEOUT_MS 2000 /* Longest sync() and end() wait for storage to catch up */
+
+/* Called when a task is due, returns true if it produced a sample */
+typedef bool (*SensorPollFn)(uint32_t now_ms, void* ctx);
+
+class SensorTask{
+    public:
+        const char* name;
+        uint32_t period_ms;
+        SensorPollFn poll;
+        void* ctx;
+        uint32_t next_ms; /* When the task is next due */
+
+        /* Statistics */
+        uint32_t polls; /* Times the task was due and polled */
+        uint32_t samples; /* Polls that produced a sample */
+        uint32_t skipped; /* Periods missed because the scheduler fell behind */
+};
+
+class SensorScheduler{
+    public:
+        /* Register a task polled every period_ms, returns false if the table is full.
+         * The tick is the shortest period, longer periods should be multiples of it */
+        bool add(const char* name, uint32_t period_ms, SensorPollFn poll, void* ctx);
+        /* Poll every task that is due at now_ms, returns the number of samples produced */
+        uint32_t step(uint32_t now_ms);
+        /* Run the tick on the calling task until stop() */
+        void run();
+        /* Make run() return after the tick it is on, and wait until it has. Call from another task */
+        void stop();
+        void print_stats() const;
+
+        uint32_t tick_ms = 0;
+        uint32_t overruns = 0; /* Ticks that took longer than tick_ms */
+        uint32_t step_max_us = 0; /* Longest step(), how late a tick can make the samples after it */
+
+    private:
+        SensorTask tasks[SENSOR_SCHED_MAX_TASKS];
+        uint8_t num_tasks = 0;
+        std::atomic<bool> running{false};
+        std::atomic<bool> stopping{false};
+};
+
+/* How records got from the scheduler to the storage task, see SampleStreams::start_storage_task */
+class SamplePipeStats{
+    public:
+        std::atomic<uint32_t> sent{0}; /* Records handed to the storage task, read by drain() on the caller's task */
+        uint32_t shed = 0; /* 50 Hz records dropped to keep room for the others */
+        uint32_t dropped[SAMPLE_NUM_STREAMS] = {0}; /* Records lost per stream, shed ones included */
+        uint32_t max_used = 0; /* Most bytes ever waiting */
+        uint32_t store_max_us = 0; /* Longest the storage task took over one record, flash writes included */
+
+        void reset();
+        void log() const;
+};
+
+/* Latest SCD4x and BMP3xx readings, as stored */
+class SensorReadings{
+    public:
+        uint32_t scd4x_ms = 0, bmp3xx_ms = 0; /* Uptime of each sensor's last reading, 0 = none yet */
+        uint16_t co2 = 0;             /* ppm */
+        int32_t scd4x_temp = 0;       /* 0.01 C */
+        int32_t humd = 0;             /* 0.01 % */
+        int32_t bmp3xx_temp = 0;      /* 0.01 C */
+        int32_t pres = 0;             /* Pa */
+        uint32_t seq = 0;             /* Readings taken since begin() */
+};
+
+/* The SCD4x, BMP3xx and Tello streams, each logged as its own records (see sample_record.hpp),
+ * and the fused altitude and dead-reckoned position computed from the last two.
+ * CO2 and temperature readings are also binned by position into a voxel map, and each state packet
+ * updates the battery model */
+class SampleStreams{
+    public:
+        SampleStreams(LogWriter& log, TelloControl& tello) : aggregator(store, this), log(log), tello(tello) {}
+        /* Start a new log at path, records are stored as given by encoding (see delta_codec.hpp).
+         * Call while the scheduler is not producing records */
+        bool begin(const char* path, SampleEncoding encoding = SAMPLE_ENCODING_DELTA);
+        /* Same, but as the next journaled run (see log_journal.hpp), so no earlier run is overwritten.
+         * The run is indexed by time as it is stored, for queries (see sample_query.hpp) */
+        bool begin_run(SampleEncoding encoding = SAMPLE_ENCODING_DELTA);
+        /* Store records on a task of their own from now on, rather than on the scheduler's */
+        bool start_storage_task(unsigned priority, int core);
+        /* Wait for storage to catch up with every record acquired so far, then commit the log to flash.
+         * Returns false if the file system refused data or storage did not catch up in SAMPLE_SYNC_TIMEOUT_MS */
+        bool sync();
+        /* Store the summaries of the windows still open and close the log, once the scheduler has stopped */
+        void end();
+        /* Register all streams at their default rates */
+        bool add_to(SensorScheduler& sched);
+
+        static bool poll_scd4x(uint32_t now_ms, void* ctx);
+        static bool poll_bmp3xx(uint32_t now_ms, void* ctx);
+        static bool poll_tello(uint32_t now_ms, void* ctx);
+        /* Step the altitude fusion with whatever the other polls saw since the last step */
+        static bool poll_altitude(uint32_t now_ms, void* ctx);
+
+        /* Latest sensor readings, safe to read from any task */
+        SensorReadings get_readings() const;
+        SeqLatch<SensorReadings> readings;
+
+        /* Latest fused altitude, safe to read from any task */
+        AltitudeEstimate get_altitude() const;
+        SeqLatch<AltitudeEstimate> altitude;
+        /* Only touched by the scheduler's task, configure before add_to() */
+        AltitudeFusion fusion;
+        uint32_t fusion_max_us = 0; /* Longest fusion step */
+        uint32_t fusion_over_budget = 0; /* Steps that took longer than ALT_FUSION_BUDGET_US */
+
+        /* Latest dead-reckoned position, safe to read from any task */
+        Position get_position() const;
+        SeqLatch<Position> position;
+        DeadReckoner track; /* Only touched by the scheduler's task */
+        VoxelMap voxels;
+
+        /* Latest battery estimate, safe to read from any task */
+        EnergyEstimate get_energy() const;
+        SeqLatch<EnergyEstimate> energy;
+        EnergyModel energy_model; /* Only touched by the scheduler's task, configure before begin() */
+
+        /* Decides which records reach the log, configure before begin() */
+        SampleAggregator aggregator;
+
+        uint32_t raw_bytes = 0; /* Size every record acquired since begin() would have taken stored raw */
+        SampleIndexWriter index; /* Of the current run, written by whichever task stores */
+        SamplePipeStats pipe_stats;
+
+    private:
+        LogWriter& log;
+        TelloControl& tello;
+        uint32_t tello_seq = 0; /* Last state packet logged */
+        uint32_t fusion_tello_seq = 0; /* Last state packet fused */
+        AltitudeInputs fusion_in; /* Readings gathered for the next fusion step */
+        SensorReadings last_readings; /* Only touched by the scheduler's task, published through readings */
+        SampleEncoding encoding = SAMPLE_ENCODING_RAW;
+        DeltaEncoder encoder; /* The aggregator and encoder belong to the storage task once it is started */
+        uint32_t log_offset = 0; /* Where the next stored record goes in the log, stored alongside the encoder */
+        uint32_t span_start = 0; /* Where the index's open span starts */
+        hal::MessageBuffer* pipe = NULL; /* Written by the scheduler's task, read by the storage task */
+        std::atomic<uint32_t> stored{0}; /* Records the storage task has finished with */
+
+        void reset(SampleLogHeader* hdr, SampleEncoding encoding);
+        void write(const uint8_t* rec, size_t len);
+        bool drain(uint32_t timeout_ms);
+        static void store(const uint8_t* rec, size_t len, void* ctx);
+        static void storage_task(void* params);
+};
+
+#endif // SENSOR_SCHED_HPP
@@ -0,0 +1,81 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the in-flight telemetry snapshot
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include "telemetry.hpp"
+
+static int16_t clamp16(float v){
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : (int16_t)v;
+}
+
+/* Updates to one source since the last frame, all but the latest of which were coalesced away */
+static void updates(uint32_t seq, uint32_t& last, uint32_t& coalesced){
+    uint32_t n = seq - last;
+    coalesced += n > 1 ? n - 1 : 0;
+    last = seq;
+}
+
+bool TelemetryBuilder::build(const SampleStreams& streams, const TelloControl& tello, uint32_t now_ms, TelemetryFrame* out){
+    AltitudeEstimate alt = streams.get_altitude();
+    SensorReadings readings = streams.get_readings();
+    TelloStateSnapshot snap = tello.get_state();
+    updates(alt.seq, alt_seq, coalesced);
+    updates(snap.seq, tello_seq, coalesced);
+    updates(readings.seq, readings_seq, coalesced);
+    Position pos = streams.get_position();
+    EnergyEstimate energy = streams.get_energy();
+
+    /* Values only: seq, uptime and tello_age_ms are filled in once the frame is known to be worth sending */
+    TelemetryFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.version = TELEMETRY_VERSION;
+    frame.flags = (alt.grounded ? TELEMETRY_GROUNDED : 0) | (alt.calibrated ? TELEMETRY_ALT_CALIBRATED : 0) |
+                  (pos.valid ? TELEMETRY_POSITION_VALID : 0);
+    frame.alt_cm = clamp16(alt.alt_cm);
+    frame.vz_cms = clamp16(alt.vz_cms);
+    frame.x_cm = clamp16(pos.x_cm);
+    frame.y_cm = clamp16(pos.y_cm);
+
+    if(snap.seq){
+        frame.flags |= TELEMETRY_TELLO;
+        frame.pitch = snap.state.pitch;
+        frame.roll = snap.state.roll;
+        frame.yaw = snap.state.yaw;
+        frame.bat = snap.state.bat;
+        frame.motor_time = snap.state.time;
+        frame.margin = clamp16(energy.margin_pct * 10);
+    }
+    if(readings.scd4x_ms){
+        frame.flags |= TELEMETRY_SCD4X;
+        frame.co2 = readings.co2;
+        frame.scd4x_temp = readings.scd4x_temp;
+        frame.humd = readings.humd;
+    }
+    if(readings.bmp3xx_ms){
+        frame.flags |= TELEMETRY_BMP3XX;
+        frame.bmp3xx_temp = readings.bmp3xx_temp;
+        frame.pres = readings.pres;
+    }
+
+    /* The fusion publishes every step, on the ground too, so compare what would be sent rather than sequences */
+    if(frames && memcmp(&frame, &last, sizeof(frame)) == 0){
+        unchanged++;
+        return false;
+    }
+    last = frame;
+    frame.seq = frames++;
+    frame.uptime = now_ms;
+    frame.tello_age_ms = TELEMETRY_NO_AGE;
+    if(snap.seq){
+        uint32_t age = (hal::micros() - snap.arrival_us) / 1000;
+        frame.tello_age_ms = age < TELEMETRY_NO_AGE ? age : TELEMETRY_NO_AGE;
+    }
+    *out = frame;
+    return true;
+}
+
+void TelemetryBuilder::log() const{
+    hal::log("Telemetry: %u frames, %u skipped as unchanged, %u updates coalesced\n", frames, unchanged, coalesced);
+}
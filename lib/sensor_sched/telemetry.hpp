@@ -0,0 +1,76 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the compact in-flight telemetry snapshot sent over BLE
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A TelemetryFrame is the latest of everything the streams publish (fused altitude, position, battery, the
+ * last SCD4x and BMP3xx readings and the Tello's attitude), built at a fixed rate from their SeqLatches.
+ * Building never waits on the tasks that publish, so it cannot delay sampling or the Tello receive task.
+ * Whatever was published between two frames is coalesced: only the latest value is sent, and a frame is
+ * skipped altogether if none of the values it carries changed since the last one sent.
+ *
+ * The frame is 42 bytes, little-endian, so one frame fits one notification once the client has raised
+ * the ATT MTU past the default 23 (see addl_resources/connect.py for a decoder).
+*/
+
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <stdint.h>
+#include "sensor_sched.hpp"
+#include "tello_ctrl.hpp"
+
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_PERIOD_MS 200 /* Default, 5 Hz */
+#define TELEMETRY_NO_AGE 0xFFFF /* tello_age_ms with no state packet yet, or one older than this */
+
+enum TelemetryFlags{
+    TELEMETRY_GROUNDED = 1,        /* As the altitude fusion sees it */
+    TELEMETRY_ALT_CALIBRATED = 2,  /* The altitude references are set */
+    TELEMETRY_POSITION_VALID = 4,  /* At least one state packet was dead-reckoned */
+    TELEMETRY_TELLO = 8,           /* pitch..margin are from a state packet */
+    TELEMETRY_SCD4X = 16,          /* co2, scd4x_temp and humd are a reading */
+    TELEMETRY_BMP3XX = 32          /* bmp3xx_temp and pres are a reading */
+};
+
+struct __attribute__((packed)) TelemetryFrame{
+    uint8_t version;      /* TELEMETRY_VERSION */
+    uint8_t flags;        /* TelemetryFlags */
+    uint16_t seq;         /* Frames built before this one, a gap means the client missed some */
+    uint32_t uptime;      /* When the frame was built, in ms */
+    int16_t alt_cm;       /* Fused altitude above the takeoff point */
+    int16_t vz_cms;
+    int16_t x_cm;         /* Dead-reckoned position, from the takeoff point */
+    int16_t y_cm;
+    int16_t pitch;        /* Tello attitude, in deg */
+    int16_t roll;
+    int16_t yaw;
+    uint8_t bat;          /* Tello battery, in % */
+    uint8_t reserved;
+    uint16_t motor_time;  /* Tello motor time, in s */
+    int16_t margin;       /* Battery the mission may still spend after getting home, in 1/10 % */
+    uint16_t co2;         /* SCD4x, in ppm */
+    int16_t scd4x_temp;   /* In 1/100 C */
+    uint16_t humd;        /* In 1/100 % */
+    int16_t bmp3xx_temp;  /* In 1/100 C */
+    uint32_t pres;        /* BMP3xx, in Pa */
+    uint16_t tello_age_ms; /* How old the state packet was when the frame was built */
+};
+static_assert(sizeof(TelemetryFrame) == 42, "TelemetryFrame changed size, bump TELEMETRY_VERSION");
+
+class TelemetryBuilder{
+    public:
+        /* Fill out with the latest of everything streams and tello have published, at now_ms.
+         * Returns false, leaving out alone, if none of the values in it changed since the last frame built */
+        bool build(const SampleStreams& streams, const TelloControl& tello, uint32_t now_ms, TelemetryFrame* out);
+        void log() const;
+
+        uint32_t frames = 0;    /* Built */
+        uint32_t unchanged = 0; /* Skipped as no value had changed */
+        uint32_t coalesced = 0; /* Updates replaced by a newer one before they could be sent */
+
+    private:
+        uint32_t alt_seq = 0, tello_seq = 0, readings_seq = 0; /* Of the last frame */
+        TelemetryFrame last = {}; /* Values of the last frame built, without seq, uptime and tello_age_ms */
+};
+
+#endif // TELEMETRY_HPP
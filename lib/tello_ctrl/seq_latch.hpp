@@ -0,0 +1,57 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for SeqLatch, a lock-free single-writer/multi-reader snapshot of a value
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Two copies of the value are kept and a sequence counter tells readers which copy is stable:
+ * while the writer updates one copy, readers are pointed at the other. The writer never waits,
+ * and a reader never waits on a writer that has been preempted mid-update (e.g. by the reader
+ * itself on the same core). A reader only retries if the writer finished a whole publish during
+ * its copy, so for a value published at packet rates a read takes at most one or two copies.
+ * T must be trivially copyable.
+*/ 
+
+#ifndef SEQ_LATCH_HPP
+#define SEQ_LATCH_HPP
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T>
+class SeqLatch{
+    public:
+        SeqLatch() : seq(0) {}
+
+        /* Publish a new value, must only be called from one task */
+        void publish(const T& val){
+            uint32_t s = seq.load(std::memory_order_relaxed);
+
+            /* Odd: readers use slot[1] while slot[0] is updated. The store releases the last publish's slot[1]
+             * to readers it sends there; the fence after it keeps the slot[0] writes from moving ahead of it, so a
+             * reader that copied any of them sees the sequence change and retries */
+            seq.store(s + 1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot[0] = val;
+
+            /* Even: readers use slot[0] while slot[1] is updated. Same ordering, with the slots swapped */
+            seq.store(s + 2, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot[1] = val;
+        }
+
+        /* Copy the latest published value into out, safe from any task or core */
+        void read(T& out) const{
+            uint32_t s1, s2;
+            do{
+                s1 = seq.load(std::memory_order_acquire);
+                out = slot[s1 & 1];
+                std::atomic_thread_fence(std::memory_order_acquire);
+                s2 = seq.load(std::memory_order_relaxed);
+            } while(s1 != s2);
+        }
+
+    private:
+        std::atomic<uint32_t> seq;
+        T slot[2];
+};
+
+#endif // SEQ_LATCH_HPP
@@ -0,0 +1,158 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for Tello packet captures
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include "tello_capture.hpp"
+
+static size_t put_varint(uint8_t* out, uint32_t v){
+    size_t n = 0;
+    while(v >= 0x80){
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+bool TelloCapture::begin(const char* path){
+    TelloCaptureHeader hdr;
+    hdr.magic = TELLO_CAPTURE_MAGIC;
+    hdr.version = TELLO_CAPTURE_VERSION;
+    hdr.reserved = 0;
+    hdr.start_us = hal::micros();
+    if(pipe == NULL){
+        pipe = new hal::MessageBuffer(TELLO_CAPTURE_PIPE_SIZE);
+    }
+    lock.lock();
+    last_us = hdr.start_us;
+    packets = bytes = dropped = 0;
+    open = log.begin(path, (const uint8_t*)&hdr, sizeof(hdr));
+    lock.unlock();
+    return open;
+}
+
+void TelloCapture::record(uint8_t kind, const void* data, size_t len, uint32_t time_us){
+    if(!open){
+        return;
+    }
+    uint8_t entry[TELLO_CAPTURE_MAX_ENTRY];
+    len = len < TELLO_CAPTURE_MAX_LEN ? len : TELLO_CAPTURE_MAX_LEN;
+
+    /* The time delta depends on the entry before, so it is taken and queued under one lock */
+    lock.lock();
+    if(!open){
+        lock.unlock();
+        return;
+    }
+    int32_t dt = (int32_t)(time_us - last_us);
+    size_t n = 0;
+    entry[n++] = kind;
+    n += put_varint(entry + n, ((uint32_t)dt << 1) ^ (uint32_t)(dt >> 31));
+    n += put_varint(entry + n, len);
+    memcpy(entry + n, data, len);
+    n += len;
+    if(pipe->send(entry, n, 0)){
+        last_us = time_us;
+        packets++;
+        bytes += n;
+    }
+    else{
+        dropped++;
+    }
+    lock.unlock();
+}
+
+void TelloCapture::store(){
+    uint8_t entry[TELLO_CAPTURE_MAX_ENTRY];
+    if(pipe == NULL){
+        return;
+    }
+    store_lock.lock();
+    size_t n;
+    while((n = pipe->recv(entry, sizeof(entry), 0)) > 0){
+        log.write(entry, n);
+    }
+    store_lock.unlock();
+}
+
+void TelloCapture::end(){
+    lock.lock();
+    bool was_open = open;
+    open = false;
+    lock.unlock();
+    if(was_open){
+        store();
+        log.end();
+    }
+}
+
+/* Reader --------------------------------------------------------------------------------------------------------------------- */
+
+bool TelloCaptureReader::open(const char* path){
+    pos = fill = 0;
+    corrupt = false;
+    if(!file.open(path, "r")){
+        return false;
+    }
+    if(file.read(&header, sizeof(header)) != sizeof(header) || header.magic != TELLO_CAPTURE_MAGIC || header.version != TELLO_CAPTURE_VERSION){
+        hal::log("%s: not a version %d Tello capture\n", path, TELLO_CAPTURE_VERSION);
+        file.close();
+        return false;
+    }
+    time_us = header.start_us;
+    return true;
+}
+
+bool TelloCaptureReader::byte(uint8_t* b){
+    if(pos == fill){
+        fill = file.is_open() ? file.read(buf, sizeof(buf)) : 0;
+        pos = 0;
+        if(fill == 0){
+            return false;
+        }
+    }
+    *b = buf[pos++];
+    return true;
+}
+
+bool TelloCaptureReader::varint(uint32_t* v){
+    uint8_t b;
+    *v = 0;
+    for(int shift = 0; shift < 35; shift += 7){
+        if(!byte(&b)){
+            return false;
+        }
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TelloCaptureReader::next(uint8_t* kind, uint32_t* time_us, uint8_t* data, size_t* len){
+    uint32_t zz, n;
+    if(!byte(kind)){
+        return false; /* Clean end */
+    }
+    if(*kind < TELLO_CAPTURE_STATE || *kind > TELLO_CAPTURE_RC || !varint(&zz) || !varint(&n) || n > TELLO_CAPTURE_MAX_LEN){
+        corrupt = true;
+        return false;
+    }
+    for(uint32_t i = 0; i < n; ++i){
+        if(!byte(&data[i])){
+            corrupt = true;
+            return false;
+        }
+    }
+    this->time_us += (int32_t)((zz >> 1) ^ -(zz & 1));
+    *time_us = this->time_us;
+    *len = n;
+    return true;
+}
+
+void TelloCaptureReader::close(){
+    file.close();
+}
@@ -0,0 +1,92 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for capturing every datagram exchanged with the Tello, and reading captures back for replay
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * A capture is a TelloCaptureHeader followed by one entry per datagram, in the order they were recorded:
+ *     u8 kind            TelloCaptureKind
+ *     varint time        micros() when it arrived or was sent, minus the previous entry's, zigzag encoded
+ *                        (entries from different tasks can be recorded slightly out of order)
+ *     varint len         then len bytes of the datagram exactly as it was on the wire
+ * Varints are 7 bits per byte, least significant first. A state packet takes about 140 bytes, ~1.4 KB/s at 10 Hz.
+ * Recording only encodes an entry and queues it, the storage task (see SampleStreams::start_storage_task) writes
+ * queued entries out through a LogWriter of their own, so the rx task and command engine never wait on flash.
+*/
+
+#ifndef TELLO_CAPTURE_HPP
+#define TELLO_CAPTURE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "tello_state_parser.hpp"
+
+#define TELLO_CAPTURE_MAGIC 0x50434345 /* "ECCP" */
+#define TELLO_CAPTURE_VERSION 1
+#define TELLO_CAPTURE_MAX_LEN TELLO_STATE_MAX_LEN /* Longest datagram kept, longer ones are truncated */
+#define TELLO_CAPTURE_MAX_ENTRY (1 + 5 + 2 + TELLO_CAPTURE_MAX_LEN)
+#define TELLO_CAPTURE_PIPE_SIZE 4096 /* Bytes of entries storage can fall behind by, about 2 s of state packets */
+
+enum TelloCaptureKind{
+    TELLO_CAPTURE_STATE = 1, /* State packet received on port 8890 */
+    TELLO_CAPTURE_CMD = 2,   /* Command sent to port 8889 */
+    TELLO_CAPTURE_REPLY = 3, /* Reply received on the control port */
+    TELLO_CAPTURE_RC = 4     /* rc setpoint sent, never answered */
+};
+
+struct __attribute__((packed)) TelloCaptureHeader{
+    uint32_t magic;    /* TELLO_CAPTURE_MAGIC */
+    uint16_t version;  /* TELLO_CAPTURE_VERSION */
+    uint16_t reserved;
+    uint32_t start_us; /* micros() when the capture began, the first entry's time is relative to it */
+};
+
+/* Writes a capture, safe to record into from any task */
+class TelloCapture{
+    public:
+        bool begin(const char* path);
+        /* Queue one datagram, time_us is micros() when it arrived or was sent. Never waits, the entry is
+         * dropped (and counted) if storage has fallen TELLO_CAPTURE_PIPE_SIZE bytes behind */
+        void record(uint8_t kind, const void* data, size_t len, uint32_t time_us);
+        /* Write out every entry queued so far, called from the storage task */
+        void store();
+        /* Stop recording, store what is still queued and close the capture */
+        void end();
+        bool is_open() const { return open; }
+
+        uint32_t packets = 0;
+        uint32_t bytes = 0;   /* Entry bytes, not counting the header */
+        uint32_t dropped = 0; /* Entries lost because the pipe was full, not counted in packets */
+
+    private:
+        LogWriter log;
+        hal::MessageBuffer* pipe = NULL;
+        hal::Mutex lock;       /* Held by senders, there are several and the pipe takes one at a time */
+        hal::Mutex store_lock; /* Held while receiving, by the storage task or end() */
+        uint32_t last_us = 0;
+        bool open = false;
+};
+
+/* Reads a capture back one entry at a time, through a small buffer */
+class TelloCaptureReader{
+    public:
+        bool open(const char* path);
+        /* Read the next entry: its kind, absolute time in us on the capturing clock, and the datagram into data
+         * (TELLO_CAPTURE_MAX_LEN bytes). Returns false at the end of the capture or if it is corrupt */
+        bool next(uint8_t* kind, uint32_t* time_us, uint8_t* data, size_t* len);
+        void close();
+
+        TelloCaptureHeader header;
+        bool corrupt = false; /* next() stopped on a malformed entry rather than the end of the file */
+
+    private:
+        hal::File file;
+        uint8_t buf[512];
+        size_t pos = 0, fill = 0;
+        uint32_t time_us = 0;
+
+        bool byte(uint8_t* b);
+        bool varint(uint32_t* v);
+};
+
+#endif // TELLO_CAPTURE_HPP
@@ -4,55 +4,425 @@
 */ 
 
 #include "tello_ctrl.hpp"
+#include "metrics.hpp"
 
-// Given the IP address of the ESP32, bind it to Tello control & state ports
-void TelloControl::bindPorts(IPAddress localIP){
-    control.begin(localIP, control_port);
-    state_server.begin(state_port);
+// Bind the local Tello control & state ports
+bool TelloControl::bindPorts(){
+    return control.bind(control_bind_port) && state_server.bind(state_port);
 }
 
-/* TODO: lots of error checking. reference djitellopy and their implementation for what to look out for */
-/* Send a synchronous command to drone (wait for and display response) */
+/* Commands that are safe to send twice if the first reply is lost: queries, settings, and stopping */
+static bool is_idempotent(const char* cmd){
+    static const char* const words[] = {"command", "streamon", "streamoff", "speed", "land", "emergency"};
+    size_t len = strlen(cmd);
+    if(len && cmd[len - 1] == '?'){
+        return true;
+    }
+    for(size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i){
+        size_t n = strlen(words[i]);
+        if(strncmp(cmd, words[i], n) == 0 && (cmd[n] == '\0' || cmd[n] == ' ')){
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t tello_cmd_default_timeout(const char* cmd){
+    if(strcmp(cmd, "takeoff") == 0){
+        return TELLO_TAKEOFF_TIMEOUT_MS;
+    }
+    if(is_idempotent(cmd) && strcmp(cmd, "land") != 0){
+        return TELLO_CMD_TIMEOUT_MS;
+    }
+    return TELLO_MOVE_TIMEOUT_MS;
+}
+
+uint8_t tello_cmd_default_retries(const char* cmd){
+    return is_idempotent(cmd) ? TELLO_CMD_RETRIES : 0;
+}
+
+TelloCommand::TelloCommand(const char* cmd) : TelloCommand(cmd, tello_cmd_default_timeout(cmd), tello_cmd_default_retries(cmd)) {}
+
+TelloCommand::TelloCommand(const char* cmd, uint32_t timeout_ms, uint8_t retries){
+    snprintf(this->cmd, sizeof(this->cmd), "%s", cmd);
+    this->timeout_ms = timeout_ms;
+    this->retries = retries;
+    notify = NULL;
+    chained = false;
+    status = TELLO_CMD_PENDING;
+    resp[0] = '\0';
+    rtt_us = 0;
+    attempts = 0;
+}
+
+/* Start the task that sends queued commands and matches their replies */
+bool TelloControl::start_cmd_engine(unsigned priority, int core){
+    if(cmd_queue != NULL){
+        return true;
+    }
+    cmd_queue = new hal::Queue(TELLO_CMD_QUEUE_LEN, sizeof(TelloCommand*));
+    return hal::task_create(cmd_engine_task, "tello_cmd", 4096, this, priority, core) != NULL;
+}
+
+bool TelloControl::submit(TelloCommand* cmd){
+    cmd->status = TELLO_CMD_PENDING;
+    cmd->resp[0] = '\0';
+    cmd->attempts = 0;
+    if(cmd_queue == NULL || !cmd_queue->send(&cmd, 0)){
+        cmd->status = TELLO_CMD_REJECTED;
+        return false;
+    }
+    return true;
+}
+
+/* Block until cmd completes, sleeping on a task notification if cmd->notify is the calling task.
+ * The completion notification is always consumed, so it cannot wake an unrelated ulTaskNotifyTake later. */
+TelloCmdStatus TelloControl::wait(TelloCommand* cmd){
+    if(cmd->notify != hal::current_task()){
+        while(cmd->status == TELLO_CMD_PENDING){
+            hal::delay(1);
+        }
+        return cmd->status;
+    }
+
+    uint32_t bits = 0;
+    while(!(bits & TELLO_CMD_NOTIFY_BIT) || cmd->status == TELLO_CMD_PENDING){
+        hal::notify_wait(TELLO_CMD_NOTIFY_BIT, &bits, HAL_FOREVER);
+    }
+    return cmd->status;
+}
+
+TelloCmdStatus TelloControl::send_cmd(TelloCommand* cmd){
+    cmd->notify = hal::current_task();
+    if(!submit(cmd)){
+        return cmd->status;
+    }
+    return wait(cmd);
+}
+
+TelloLinkStats TelloControl::get_link_stats() const{
+    TelloLinkStats stats;
+    link_latch.read(stats);
+    return stats;
+}
+
+static int clamp_rc(int v){
+    return v < -100 ? -100 : v > 100 ? 100 : v;
+}
+
+/* Sending on the control port alongside the engine is safe, only receiving replies needs to be in one task */
+bool TelloControl::send_rc(int a, int b, int c, int d){
+    char cmd[TELLO_CMD_MAX_LEN];
+    int len = snprintf(cmd, sizeof(cmd), "rc %d %d %d %d", clamp_rc(a), clamp_rc(b), clamp_rc(c), clamp_rc(d));
+    if(capture){
+        capture->record(TELLO_CAPTURE_RC, cmd, len, hal::micros());
+    }
+    return control.send_to(ip, control_port, cmd, len);
+}
+
+#ifdef ARDUINO
+/* Send a synchronous command to drone (wait for and display response)
+ * Returns the response, or "timeout" if the drone never answered */
 String TelloControl::send_cmd_sync(const char* cmd){
     
     Serial.printf("Sending message \"%s\"... ", cmd);
 
-    control.beginPacket(ip, control_port);
-    control.write((const uint8_t*)cmd, strlen(cmd));
-    control.endPacket();
+    TelloCommand c(cmd);
+    switch(send_cmd(&c)){
+        case TELLO_CMD_TIMEOUT:
+            return "timeout";
+        case TELLO_CMD_REJECTED:
+            return "rejected";
+        default:
+            return String(c.resp);
+    }
+}
+#endif
+
+void TelloControl::cmd_engine_task(void* params){
+    TelloControl* tello = (TelloControl*)params;
+    TelloCommand* cmd;
+    hal::Task failed = NULL; /* Notify task of the last command that did not succeed, until one for it does */
 
     while(1){
-        int packetSize = control.parsePacket();
-        if (packetSize){
-            String resp;
-            while (control.available()) {
-                char c = control.read();
-                if(c == '\n' || c == '\r'|| c == '\0'){
-                    continue;
-                }
-                resp += c;
+        if(!tello->cmd_queue->recv(&cmd, HAL_FOREVER)){
+            continue;
+        }
+        /* cmd may be released by its owner as soon as its status changes, grab what we need first */
+        hal::Task notify = cmd->notify;
+        TelloCmdStatus status = TELLO_CMD_CANCELLED;
+        if(cmd->chained && notify != NULL && notify == failed){
+            cmd->status = status;
+        }
+        else{
+            status = tello->run_cmd(cmd);
+            tello->link_latch.publish(tello->link_stats);
+        }
+        if(status != TELLO_CMD_OK){
+            failed = notify;
+        }
+        else if(notify == failed){
+            failed = NULL;
+        }
+        if(notify != NULL){
+            hal::notify(notify, TELLO_CMD_NOTIFY_BIT);
+        }
+    }
+}
+
+/* Send cmd and wait for its reply, resending on timeout if it has retries left. Sets cmd->status last, and returns it */
+TelloCmdStatus TelloControl::run_cmd(TelloCommand* cmd){
+    char resp[TELLO_RESP_MAX_LEN];
+    size_t len = strlen(cmd->cmd);
+    uint32_t arrival_us;
+
+    for(uint8_t attempt = 0; attempt <= cmd->retries; ++attempt){
+        /* Tello replies carry no id, anything already waiting is a late reply to an earlier command */
+        while(recv_resp(resp, sizeof(resp), 0, &arrival_us) >= 0){
+            link_stats.stale++;
+        }
+
+        /* Start the clock first, the receive task may stamp the reply before send_to() even returns */
+        uint32_t start = hal::micros();
+        if(capture){
+            capture->record(TELLO_CAPTURE_CMD, cmd->cmd, len, start);
+        }
+        control.send_to(ip, control_port, cmd->cmd, len);
+        cmd->attempts++;
+        link_stats.sent++;
+        if(attempt){
+            link_stats.retries++;
+        }
+
+        uint32_t waited_ms;
+        while((waited_ms = (hal::micros() - start) / 1000) < cmd->timeout_ms){
+            if(recv_resp(resp, sizeof(resp), cmd->timeout_ms - waited_ms, &arrival_us) >= 0){
+                uint32_t rtt = arrival_us - start;
+                link_stats.answered++;
+                link_stats.rtt_last_us = rtt;
+                link_stats.rtt_sum_us += rtt;
+                if(link_stats.answered == 1 || rtt < link_stats.rtt_min_us){
+                    link_stats.rtt_min_us = rtt;
+                }
+                if(rtt > link_stats.rtt_max_us){
+                    link_stats.rtt_max_us = rtt;
+                }
+
+                memcpy(cmd->resp, resp, sizeof(resp));
+                cmd->rtt_us = rtt;
+                METRIC_RECORD(METRIC_CMD_RTT, rtt);
+                TelloCmdStatus status = strncasecmp(resp, "error", 5) == 0 ? TELLO_CMD_ERROR : TELLO_CMD_OK;
+                cmd->status = status;
+                return status;
             }
-            return resp;
-        } 
-    }
-}
-
-/* Given 16 float values from Tello, update the TelloState class's values */
-void TelloControl::update_state_values(float vals[16]){
-    state.pitch = vals[0];
-    state.roll = vals[1];
-    state.yaw = vals[2];
-    state.vgx = vals[3];
-    state.vgy = vals[4];
-    state.vgz = vals[5];
-    state.templ = vals[6];
-    state.temph = vals[7];
-    state.tof = vals[8];
-    state.h = vals[9];
-    state.bat = vals[10];
-    state.baro = vals[11];
-    state.time = vals[12];
-    state.agx = vals[13];
-    state.agy = vals[14];
-    state.agz = vals[15];
+        }
+    }
+    link_stats.timeouts++;
+    METRIC_COUNT(METRIC_CMD_TIMEOUTS, 1);
+    cmd->status = TELLO_CMD_TIMEOUT;
+    return TELLO_CMD_TIMEOUT;
+}
+
+/* A reply as the receive task hands it to the engine */
+struct TelloReply{
+    char resp[TELLO_RESP_MAX_LEN];
+    int len;
+    uint32_t arrival_us;
+};
+
+/* Wait up to timeout_ms for a reply on the control port and copy it into resp, without line endings,
+ * and when it arrived into arrival_us. Returns its length, or -1 if none came */
+int TelloControl::recv_resp(char* resp, size_t cap, uint32_t timeout_ms, uint32_t* arrival_us){
+    int len;
+    if(reply_queue != NULL){
+        TelloReply reply;
+        if(!reply_queue->recv(&reply, timeout_ms)){
+            return -1;
+        }
+        len = reply.len < (int)cap ? reply.len : (int)cap - 1;
+        memcpy(resp, reply.resp, len);
+        *arrival_us = reply.arrival_us;
+    }
+    else{
+        /* No receive task, poll the socket, yielding rather than spinning so lower priority tasks on this core keep running */
+        uint32_t start = hal::millis();
+        while((len = control.recv(resp, cap - 1)) < 0 && hal::millis() - start < timeout_ms){
+            hal::delay(1);
+        }
+        if(len < 0){
+            return -1;
+        }
+        *arrival_us = hal::micros();
+        if(capture){
+            capture->record(TELLO_CAPTURE_REPLY, resp, len, *arrival_us);
+        }
+    }
+    while(len > 0 && (resp[len - 1] == '\n' || resp[len - 1] == '\r' || resp[len - 1] == '\0')){
+        --len;
+    }
+    resp[len] = '\0';
+    return len;
+}
+
+/* Start the receive task, and hand replies to the engine through a queue from now on */
+bool TelloControl::start_rx_task(unsigned priority, int core){
+    if(reply_queue != NULL){
+        return true;
+    }
+    reply_queue = new hal::Queue(TELLO_REPLY_QUEUE_LEN, sizeof(TelloReply));
+    return hal::task_create(rx_task, "tello_rx", 4096, this, priority, core) != NULL;
+}
+
+TelloRxStats TelloControl::get_rx_stats() const{
+    TelloRxStats stats;
+    rx_latch.read(stats);
+    return stats;
+}
+
+void TelloRxStats::log() const{
+    static const char* const buckets[TELLO_RX_LATENCY_BUCKETS] = {"<50", "<100", "<200", "<400", "<800", "<1600", "<3200", ">=3200"};
+    hal::log("Tello rx: %u wakeups (%u idle) for %u state packets and %u replies (%u dropped), state latency mean/max %u/%u us\n",
+             wakeups, idle_wakeups, states, replies, replies_dropped, states ? (uint32_t)(latency_sum_us / states) : 0, latency_max_us);
+    hal::log("Tello rx latency (us):");
+    for(int i = 0; i < TELLO_RX_LATENCY_BUCKETS; ++i){
+        hal::log(" %s %u", buckets[i], latency_hist[i]);
+    }
+    hal::log("\n");
+    uint32_t reported = 0;
+    log_errors(reported);
+}
+
+void TelloRxStats::log_errors(uint32_t& reported) const{
+    if(bad_states != reported){
+        hal::log("Tello rx: %u bad state packets (%u in all), the last missing 0x%04x, malformed 0x%04x\n",
+                 bad_states - reported, bad_states, bad_missing, bad_malformed);
+        reported = bad_states;
+    }
+}
+
+/* Sleeps until either port has a datagram, and reads each whole into a buffer that lives as long as the task.
+ * Everything that arrived together is stamped with the time select() returned */
+void TelloControl::rx_task(void* params){
+    TelloControl* tello = (TelloControl*)params;
+    TelloRxStats& st = tello->rx_stats;
+    hal::UdpSocket* const socks[2] = {&tello->state_server, &tello->control};
+
+    while(1){
+        uint32_t ready = hal::UdpSocket::wait_any(socks, 2, TELLO_RX_IDLE_MS);
+        uint32_t arrival_us = hal::micros();
+        st.wakeups++;
+        if(ready == 0){
+            st.idle_wakeups++;
+        }
+        int len;
+        if(ready & 1){
+            while((len = tello->state_server.recv(tello->rx_buf, sizeof(tello->rx_buf))) >= 0){
+                if(tello->capture){
+                    tello->capture->record(TELLO_CAPTURE_STATE, tello->rx_buf, len, arrival_us);
+                }
+                TelloParseResult res = tello->handle_state(tello->rx_buf, len, arrival_us);
+                if(!res.ok()){
+                    /* Only counted here, printing from this task would hold up the next packet */
+                    st.bad_states++;
+                    st.bad_missing = res.missing();
+                    st.bad_malformed = res.malformed;
+                }
+                uint32_t latency = hal::micros() - arrival_us;
+                int b = 0;
+                for(uint32_t limit = 50; b < TELLO_RX_LATENCY_BUCKETS - 1 && latency >= limit; limit *= 2){
+                    b++;
+                }
+                st.latency_hist[b]++;
+                st.latency_sum_us += latency;
+                if(latency > st.latency_max_us){
+                    st.latency_max_us = latency;
+                }
+                st.states++;
+            }
+        }
+        if(ready & 2){
+            TelloReply reply;
+            while((reply.len = tello->control.recv(reply.resp, sizeof(reply.resp) - 1)) >= 0){
+                reply.arrival_us = arrival_us;
+                if(tello->capture){
+                    tello->capture->record(TELLO_CAPTURE_REPLY, reply.resp, reply.len, arrival_us);
+                }
+                st.replies++;
+                /* Never wait on the engine, state keeps arriving meanwhile */
+                if(!tello->reply_queue->send(&reply, 0)){
+                    st.replies_dropped++;
+                    METRIC_COUNT(METRIC_REPLIES_DROPPED, 1);
+                }
+            }
+        }
+        tello->rx_latch.publish(st);
+    }
+}
+
+/* Receive one waiting state packet, parse it and publish it */
+bool TelloControl::poll_state(){
+    char buf[TELLO_STATE_MAX_LEN];
+    int len = state_server.recv(buf, sizeof(buf));
+    if(len < 0){
+        return false;
+    }
+    uint32_t arrival_us = hal::micros();
+    if(capture){
+        capture->record(TELLO_CAPTURE_STATE, buf, len, arrival_us);
+    }
+    handle_state(buf, len, arrival_us);
+    return true;
+}
+
+/* Parse a state datagram and publish it, returns how it parsed.
+ * Packets that fail to parse are dropped whole rather than mixed with the previous state */
+TelloParseResult TelloControl::handle_state(const char* buf, int len, uint32_t arrival_us){
+    TelloState state;
+
+    /* Format: "key:value;" for each row of TELLO_FIELDS, then "\r\n" */
+    TelloParseResult res;
+    {
+        METRIC_TIME(METRIC_STATE_PARSE);
+        res = parse_tello_state(buf, len, &state);
+    }
+    METRIC_COUNT(METRIC_STATE_PACKETS, 1);
+    if(res.ok()){
+        publish_state(state, arrival_us);
+    }
+    else{
+        ++state_errors;
+        METRIC_COUNT(METRIC_PARSE_ERRORS, 1);
+    }
+    return res;
+}
+
+/* Publish a parsed state as the latest TelloState. Only the state task may call this. */
+void TelloControl::publish_state(const TelloState& state, uint32_t arrival_us){
+    TelloStateSnapshot snap;
+    snap.state = state;
+    snap.seq = ++state_seq;
+    snap.arrival_us = arrival_us;
+    state_latch.publish(snap);
+}
+
+/* Get a consistent copy of the latest state, never blocks the state task */
+TelloStateSnapshot TelloControl::get_state() const{
+    TelloStateSnapshot snap;
+    state_latch.read(snap);
+    return snap;
+}
+
+/* Whole numbers are copied as they are, fields kept as float are rounded to the record's fixed point */
+static inline int32_t tello_fixed(int v, int32_t scale){
+    return v * scale;
+}
+
+static inline int32_t tello_fixed(float v, int32_t scale){
+    return sample_quantise(v, scale);
+}
+
+void fill_tello_fields(TelloRecord& rec, const TelloState& state){
+#define TELLO_FILL(id, key, state_type, rec_type, dec, label, unit) rec.key = tello_fixed(state.key, tello_pow10(dec));
+    TELLO_FIELDS(TELLO_FILL)
+#undef TELLO_FILL
 }
\ No newline at end of file
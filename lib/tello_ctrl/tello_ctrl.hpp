@@ -1,31 +1,115 @@
 /* EcoDrone: Autonomous Environmental Monitoring
- * Header file for controlling the DJI Tello, contains the TelloState and TelloControl classes
+ * Header file for controlling the DJI Tello, contains the TelloControl class (TelloState is in tello_state_parser.hpp)
  * Author: Brandon Lee, brandon.kf.lee@gmail.com
 */ 
 
 #ifndef TELLO_CTRL_HPP
 #define TELLO_CTRL_HPP
 
-#include <Arduino.h>
-#include <WiFiUdp.h>
+#include <string.h>
+#include "hal.hpp"
+#include "tello_state_parser.hpp"
+#include "seq_latch.hpp"
+#include "tello_capture.hpp"
+#include "sample_record.hpp"
 
-/* Class for storing all the various state values as reported by Tello */
-class TelloState{
-    public: 
-        TelloState(){
-           num_vals = 16;
-        }       
-        int num_vals; /* Total number of state values */
-        int pitch, roll, yaw; /* Drone orientation, in degrees*/
-        int vgx, vgy, vgz; /* Speed in x, y, z directions */
-        int templ, temph; /* Lowest and highest temperature, in celcius */
-        int tof; /* Time of flight distance sensor measurement, mounted below the drone, in cm, */
-        int h; /* Relative height, in cm */
-        int bat; /* Battery level, in % */
-        float baro; /* Barometer measurement, in cm */
-        int time; /* Time since motor on, in s */
-        float agx, agy, agz; /* Acceleration in x, y, z directions */
-};  
+/* A consistent copy of TelloState along with when it arrived */
+class TelloStateSnapshot{
+    public:
+        TelloStateSnapshot(){
+            seq = 0;
+            arrival_us = 0;
+        }
+        TelloState state;
+        uint32_t seq; /* Sequence number of the state packet, starting at 1 (0 = no packet received yet) */
+        uint32_t arrival_us; /* micros() when the state packet arrived, subtract from micros() to get its age */
+};
+
+#define TELLO_CMD_MAX_LEN 40 /* Longest command string, including the terminator */
+#define TELLO_RESP_MAX_LEN 32 /* Longest response kept, longer responses are truncated */
+#define TELLO_CMD_QUEUE_LEN 8 /* Commands that can be waiting for the engine at once */
+#define TELLO_CMD_NOTIFY_BIT (1u << 31) /* Task notification bit set when a command completes */
+#define TELLO_CMD_TIMEOUT_MS 3000 /* Reply timeout for queries and settings */
+#define TELLO_MOVE_TIMEOUT_MS 7000 /* Movements only reply once the move has finished */
+#define TELLO_TAKEOFF_TIMEOUT_MS 20000
+#define TELLO_CMD_RETRIES 2 /* Default extra attempts for idempotent commands */
+#define TELLO_REPLY_QUEUE_LEN 4 /* Replies the receive task can hold for the command engine */
+#define TELLO_RX_IDLE_MS 1000 /* The receive task wakes at least this often, even with nothing arriving */
+#define TELLO_RX_LATENCY_BUCKETS 8
+
+enum TelloCmdStatus{
+    TELLO_CMD_PENDING, /* Queued or in flight */
+    TELLO_CMD_OK, /* Tello replied with anything but an error */
+    TELLO_CMD_ERROR, /* Tello replied "error..." */
+    TELLO_CMD_TIMEOUT, /* No reply within the timeout, after all retries */
+    TELLO_CMD_REJECTED, /* Engine not running or queue full, never sent */
+    TELLO_CMD_CANCELLED /* Chained to a command that did not succeed, never sent */
+};
+
+/* One command for the command engine. Owned by the caller, and must stay alive until status leaves TELLO_CMD_PENDING */
+class TelloCommand{
+    public:
+        TelloCommand(const char* cmd = "");
+        TelloCommand(const char* cmd, uint32_t timeout_ms, uint8_t retries);
+
+        char cmd[TELLO_CMD_MAX_LEN];
+        uint32_t timeout_ms; /* How long to wait for each reply */
+        uint8_t retries; /* Extra attempts after a timeout, only safe for idempotent commands */
+        hal::Task notify; /* Task given TELLO_CMD_NOTIFY_BIT on completion (and which must then wait() on it), NULL for none */
+        bool chained; /* Cancelled rather than sent if the command before it for the same notify task did not succeed */
+
+        /* Filled in by the engine */
+        volatile TelloCmdStatus status;
+        char resp[TELLO_RESP_MAX_LEN];
+        uint32_t rtt_us; /* Round trip time of the answered attempt */
+        uint8_t attempts; /* Number of times the command was sent */
+};
+
+/* Round trip statistics of the command link */
+class TelloLinkStats{
+    public:
+        TelloLinkStats(){
+            sent = answered = timeouts = retries = stale = 0;
+            rtt_last_us = rtt_min_us = rtt_max_us = 0;
+            rtt_sum_us = 0;
+        }
+        uint32_t sent; /* Datagrams sent, including retries */
+        uint32_t answered; /* Commands that got a reply */
+        uint32_t timeouts; /* Commands that never got a reply */
+        uint32_t retries; /* Resends after a timeout */
+        uint32_t stale; /* Late replies to earlier commands that were discarded */
+        uint32_t rtt_last_us, rtt_min_us, rtt_max_us;
+        uint64_t rtt_sum_us; /* Divide by answered for the mean */
+};
+
+/* What the receive task saw, see TelloControl::start_rx_task() */
+class TelloRxStats{
+    public:
+        uint32_t wakeups = 0; /* Times the task woke, idle ones included */
+        uint32_t idle_wakeups = 0; /* Woke on TELLO_RX_IDLE_MS with nothing waiting */
+        uint32_t states = 0; /* State datagrams received */
+        uint32_t replies = 0; /* Command replies received */
+        uint32_t replies_dropped = 0; /* Replies the command engine had no room for */
+        uint32_t bad_states = 0; /* State datagrams dropped because they failed to parse */
+        uint16_t bad_missing = 0, bad_malformed = 0; /* Fields missing and malformed in the last of them */
+        /* Latency from select() returning with a state datagram to its state being published, in us. Time the
+         * datagram spent waiting in the socket before the task woke is not included */
+        uint32_t latency_max_us = 0;
+        uint64_t latency_sum_us = 0; /* Divide by states for the mean */
+        uint32_t latency_hist[TELLO_RX_LATENCY_BUCKETS] = {0}; /* <50, <100, <200, ... >=3200 us */
+
+        void log() const;
+        /* Report the bad state packets since the count in reported, then update it. Prints nothing if there
+         * are none, so it can be called at a steady pace from a task that is not receiving */
+        void log_errors(uint32_t& reported) const;
+};
+
+/* Default reply timeout and retry policy for a command, based on what it does */
+uint32_t tello_cmd_default_timeout(const char* cmd);
+uint8_t tello_cmd_default_retries(const char* cmd);
+
+/* Copy Tello state into a Tello stream record (everything but its header) */
+void fill_tello_fields(TelloRecord& rec, const TelloState& state);
 
 /* Class to faciitate the movement controls of the Tello */
 class TelloControl{
@@ -34,19 +118,67 @@ class TelloControl{
         const char* ip = "192.168.10.1";
         const int control_port = 8889; /* Port to send commands (control, set, read) */
         const int state_port = 8890; /* Port to recieve Tello state */
+        int control_bind_port = 8889; /* Local port commands are sent from, 0 for any (e.g. when the simulator runs on the same host) */
+
+        hal::UdpSocket control; /* UDP port to send control signals through */
+        hal::UdpSocket state_server; /* UDP port to recieve state updates from Tello*/
 
-        WiFiUDP control; /* UDP port to send control signals through */
-        WiFiUDP state_server; /* UDP port to recieve state updates from Tello*/
-        TelloState state; /* Class for storing Tello state */
+        uint32_t state_errors = 0; /* State packets dropped because they failed to parse */
+        TelloCapture* capture = NULL; /* When set (and begun), every datagram sent or received is recorded into it */
 
         /* Connection Methods */
-        void bindPorts(IPAddress localIP);
+        bool bindPorts();
+        /* Start the task that receives on both ports: it sleeps in select() until a datagram arrives, then
+         * publishes state packets and hands command replies to the engine, each timestamped when select() returns.
+         * Once it runs, poll_state() must not be called. Call after bindPorts() */
+        bool start_rx_task(unsigned priority, int core);
+        TelloRxStats get_rx_stats() const;
+
+        /* Command Engine Methods
+         * All commands go through one engine task that owns the control port, so only one command
+         * is ever in flight and each reply can be matched to the command that caused it. */
+        bool start_cmd_engine(unsigned priority, int core);
+        bool submit(TelloCommand* cmd); /* Queue without waiting, returns false if rejected */
+        TelloCmdStatus wait(TelloCommand* cmd); /* Block until a submitted command completes */
+        TelloCmdStatus send_cmd(TelloCommand* cmd); /* Submit and wait */
+        TelloLinkStats get_link_stats() const;
+        /* Send an "rc a b c d" stick setpoint (each -100..100) straight to the drone. The Tello never answers
+         * these, so they bypass the engine and can go out at a fixed rate; only send them while no movement
+         * command is in flight. Returns false if the datagram could not be sent */
+        bool send_rc(int a, int b, int c, int d);
 
+#ifdef ARDUINO
         /* Movement Methods */
         String send_cmd_sync(const char* cmd);
+#endif
 
         /* State Value Methods */
-        void update_state_values(float val[16]);
+        bool poll_state(); /* Parse and publish one waiting state packet, returns false if none was waiting.
+                            * Only for when the receive task is not running */
+        /* Parse a state datagram that arrived at arrival_us and publish it, e.g. one replayed from a capture.
+         * Returns how it parsed, bad packets are only counted in state_errors. Only the task receiving state may call this */
+        TelloParseResult handle_state(const char* buf, int len, uint32_t arrival_us);
+        void publish_state(const TelloState& state, uint32_t arrival_us);
+        TelloStateSnapshot get_state() const;
+
+    private:
+        SeqLatch<TelloStateSnapshot> state_latch; /* Latest state, written by the state task and read by everyone else */
+        uint32_t state_seq = 0; /* Number of state packets published */
+
+        hal::Queue* cmd_queue = NULL; /* Pending TelloCommand pointers */
+        TelloLinkStats link_stats; /* Only touched by the engine task, published through link_latch */
+        SeqLatch<TelloLinkStats> link_latch;
+
+        static void cmd_engine_task(void* params);
+        TelloCmdStatus run_cmd(TelloCommand* cmd);
+        int recv_resp(char* resp, size_t cap, uint32_t timeout_ms, uint32_t* arrival_us);
+
+        hal::Queue* reply_queue = NULL; /* Replies from the receive task, NULL until it starts */
+        TelloRxStats rx_stats; /* Only touched by the receive task, published through rx_latch */
+        SeqLatch<TelloRxStats> rx_latch;
+        char rx_buf[TELLO_STATE_MAX_LEN]; /* Only touched by the receive task */
+
+        static void rx_task(void* params);
 
 };
 
@@ -0,0 +1,174 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for parsing Tello state packets without allocating
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#include <stdio.h>
+#include <string.h>
+#include "tello_state_parser.hpp"
+
+const char* const tello_state_keys[TELLO_NUM_FIELDS] = {
+#define TELLO_KEY(id, key, state, rec, dec, label, unit) #key,
+    TELLO_FIELDS(TELLO_KEY)
+#undef TELLO_KEY
+};
+
+static const float pow10_neg[] = {1.0f, 0.1f, 0.01f, 0.001f, 0.0001f, 0.00001f, 0.000001f};
+
+/* FNV-1a hash of key[0..len), usable in case labels so every key gets its own case at compile time.
+ * Keys are a few characters long, so the recursion is shallow even where it is not turned into a loop */
+static constexpr uint32_t key_hash(const char* key, size_t len, uint32_t h = 2166136261u){
+    return len == 0 ? h : key_hash(key + 1, len - 1, (h ^ (uint8_t)*key) * 16777619u);
+}
+
+/* Split [-+]digits[.digits] spanning exactly str[0..len) into its sign, whole part and fraction.
+ * frac holds the first frac_digits digits after the point, later ones are dropped */
+static bool split_number(const char* str, size_t len, bool* neg, uint32_t* whole, uint32_t* frac, size_t* frac_digits){
+    size_t i = 0;
+    *neg = false;
+    if(i < len && (str[i] == '-' || str[i] == '+')){
+        *neg = str[i] == '-';
+        ++i;
+    }
+
+    *whole = 0;
+    size_t digits = 0;
+    while(i < len && str[i] >= '0' && str[i] <= '9'){
+        *whole = *whole * 10 + (str[i] - '0');
+        ++i;
+        ++digits;
+    }
+
+    *frac = 0;
+    *frac_digits = 0;
+    if(i < len && str[i] == '.'){
+        ++i;
+        while(i < len && str[i] >= '0' && str[i] <= '9'){
+            /* Digits beyond what a float can resolve are dropped */
+            if(*frac_digits < sizeof(pow10_neg) / sizeof(pow10_neg[0]) - 1){
+                *frac = *frac * 10 + (str[i] - '0');
+                ++*frac_digits;
+            }
+            ++i;
+            ++digits;
+        }
+    }
+    return digits > 0 && i == len;
+}
+
+/* Whole-number fields: any fraction is truncated toward zero, as a float to int conversion would */
+static bool parse_value(const char* str, size_t len, int* out){
+    bool neg;
+    uint32_t whole, frac;
+    size_t frac_digits;
+    if(!split_number(str, len, &neg, &whole, &frac, &frac_digits)){
+        return false;
+    }
+    *out = neg ? -(int)whole : (int)whole;
+    return true;
+}
+
+static bool parse_value(const char* str, size_t len, float* out){
+    bool neg;
+    uint32_t whole, frac;
+    size_t frac_digits;
+    if(!split_number(str, len, &neg, &whole, &frac, &frac_digits)){
+        return false;
+    }
+    float val = whole + frac * pow10_neg[frac_digits];
+    *out = neg ? -val : val;
+    return true;
+}
+
+TelloParseResult parse_tello_state(const char* buf, size_t len, TelloState* state){
+    TelloParseResult res = {0, 0, 0};
+    const char* end = buf + len;
+    const char* p = buf;
+
+    while(p < end){
+        /* Packet is terminated by "\r\n" (or the end of the buffer) */
+        if(*p == '\r' || *p == '\n' || *p == '\0'){
+            break;
+        }
+
+        const char* colon = (const char*)memchr(p, ':', end - p);
+        const char* semi = (const char*)memchr(p, ';', end - p);
+        if(semi == NULL){
+            semi = end;
+        }
+        if(colon == NULL || colon > semi){
+            /* Key without a value, nothing to attribute it to */
+            res.unknown++;
+            p = semi < end ? semi + 1 : end;
+            continue;
+        }
+
+        const char* val = colon + 1;
+        const char* val_end = semi;
+        /* The last field may run up to the line ending if the trailing ';' is missing */
+        while(val_end > val && (val_end[-1] == '\r' || val_end[-1] == '\n' || val_end[-1] == '\0')){
+            --val_end;
+        }
+
+        size_t key_len = colon - p;
+        int field = TELLO_NUM_FIELDS;
+        bool valid = false;
+        /* The hash picks the only field the key can be, the memcmp rules out unknown keys that collide with it.
+         * Every key is shorter than 8 characters, longer ones are not hashed at all */
+        switch(key_len < 8 ? key_hash(p, key_len) : 0){
+#define TELLO_KEY_CASE(id, key, state_type, rec, dec, label, unit) \
+            case key_hash(#key, sizeof(#key) - 1): \
+                if(key_len == sizeof(#key) - 1 && memcmp(p, #key, key_len) == 0){ \
+                    field = TELLO_##id; \
+                    valid = parse_value(val, val_end - val, &state->key); \
+                } \
+                break;
+            TELLO_FIELDS(TELLO_KEY_CASE)
+#undef TELLO_KEY_CASE
+            default: break;
+        }
+
+        if(field == TELLO_NUM_FIELDS){
+            res.unknown++;
+        } else if(valid){
+            res.found |= 1u << field;
+            res.malformed &= ~(1u << field);
+        } else{
+            res.malformed |= 1u << field;
+        }
+        p = semi < end ? semi + 1 : end;
+    }
+    return res;
+}
+
+/* The Tello prints whole numbers with %d and the rest with %.2f */
+static int format_value(char* out, size_t cap, const char* key, int v){
+    return snprintf(out, cap, "%s:%d;", key, v);
+}
+
+static int format_value(char* out, size_t cap, const char* key, float v){
+    return snprintf(out, cap, "%s:%.2f;", key, v);
+}
+
+/* n counts what would have been written, as snprintf does, but once out is full each value is formatted at its end
+ * with no room rather than past it */
+int format_tello_state(const TelloState& state, char* out, size_t cap){
+    int n = 0;
+    size_t at = 0;
+#define TELLO_FORMAT(id, key, state_type, rec, dec, label, unit) \
+    n += format_value(out + at, cap - at, #key, state.key); \
+    at = (size_t)n < cap ? (size_t)n : cap;
+    TELLO_FIELDS(TELLO_FORMAT)
+#undef TELLO_FORMAT
+    n += snprintf(out + at, cap - at, "\r\n");
+    return n;
+}
+
+int32_t tello_state_value(const TelloState& state, int field){
+    switch(field){
+#define TELLO_VALUE(id, key, state_type, rec, dec, label, unit) case TELLO_##id: return (int32_t)state.key;
+        TELLO_FIELDS(TELLO_VALUE)
+#undef TELLO_VALUE
+        default: return 0;
+    }
+}
@@ -0,0 +1,56 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the Tello's state, and for parsing its state packets without allocating
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/ 
+
+#ifndef TELLO_STATE_PARSER_HPP
+#define TELLO_STATE_PARSER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tello_fields.hpp"
+
+/* Largest state packet the Tello sends (SDK 1.3 packets are ~150 bytes) */
+#define TELLO_STATE_MAX_LEN 256
+
+/* Class for storing all the various state values as reported by Tello, one member per row of TELLO_FIELDS
+ * (see tello_fields.hpp for their units) */
+class TelloState{
+    public:
+        static const int num_vals = TELLO_NUM_FIELDS; /* Total number of state values */
+#define TELLO_STATE_MEMBER(id, key, state, rec, dec, label, unit) state key = 0;
+        TELLO_FIELDS(TELLO_STATE_MEMBER)
+#undef TELLO_STATE_MEMBER
+};
+
+#define TELLO_ALL_FIELDS ((uint16_t)((1u << TELLO_NUM_FIELDS) - 1))
+
+/* Outcome of parsing one state packet */
+struct TelloParseResult{
+    uint16_t found;     /* Bit i set if field i was present with a valid value */
+    uint16_t malformed; /* Bit i set if field i was present but its value could not be parsed */
+    uint8_t unknown;    /* Number of keys that are not Tello state fields (ignored) */
+
+    /* Every field was present and valid */
+    bool ok() const { return found == TELLO_ALL_FIELDS && malformed == 0; }
+    /* Bitmask of fields that did not appear in the packet at all */
+    uint16_t missing() const { return TELLO_ALL_FIELDS & ~(found | malformed); }
+};
+
+/* Key of each TelloStateField, as sent by Tello */
+extern const char* const tello_state_keys[TELLO_NUM_FIELDS];
+
+/* Parse a "key:value;key:value;...\r\n" state packet in place.
+ * Fields are matched by key, so their order does not matter and unknown keys are skipped. Each key is
+ * dispatched through a switch generated from TELLO_FIELDS and parsed straight into its member's type, so
+ * whole-number fields never go through float. A member of state is only written for fields reported in found.
+ * Never allocates or modifies buf. */
+TelloParseResult parse_tello_state(const char* buf, size_t len, TelloState* state);
+
+/* Format state as the Tello sends it, for simulators and benchmarks. Returns the length written, as snprintf */
+int format_tello_state(const TelloState& state, char* out, size_t cap);
+
+/* Value of one field, whole numbers only (fractions are truncated) */
+int32_t tello_state_value(const TelloState& state, int field);
+
+#endif // TELLO_STATE_PARSER_HPP
@@ -0,0 +1,168 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the dead-reckoned position track and the voxel map
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+#include "voxel_map.hpp"
+
+/* Dead reckoning ------------------------------------------------------------------------------------------------------------- */
+
+void DeadReckoner::reset(){
+    pos = Position();
+    vx = vy = 0;
+}
+
+const Position& DeadReckoner::update(uint32_t uptime_ms, int vgx, int vgy, int yaw_deg, bool grounded){
+    float rad = yaw_deg * (float)M_PI / 180;
+    float c = cosf(rad), s = sinf(rad);
+    float bx = vgx * config.vel_cm_per_unit, by = vgy * config.vel_cm_per_unit;
+    float nvx = bx * c - by * s;
+    float nvy = bx * s + by * c;
+
+    uint32_t gap = uptime_ms - pos.uptime;
+    if(pos.valid && !grounded && gap <= config.max_gap_ms){
+        /* Trapezoidal, the speed is sampled at both ends of the gap */
+        float dt = gap / 1000.0f;
+        pos.x_cm += (vx + nvx) / 2 * dt;
+        pos.y_cm += (vy + nvy) / 2 * dt;
+    }
+    vx = nvx;
+    vy = nvy;
+    pos.uptime = uptime_ms;
+    pos.valid = true;
+    return pos;
+}
+
+/* Voxel map ------------------------------------------------------------------------------------------------------------------ */
+
+static int16_t cube_index(float cm){
+    float i = floorf(cm / VOXEL_CELL_CM);
+    return i < INT16_MIN ? INT16_MIN : i > INT16_MAX ? INT16_MAX : (int16_t)i;
+}
+
+/* Fibonacci hashing of the packed cube index */
+static uint32_t cube_hash(int16_t x, int16_t y, int16_t z){
+    uint64_t key = (uint64_t)(uint16_t)x | ((uint64_t)(uint16_t)y << 16) | ((uint64_t)(uint16_t)z << 32);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (VOXEL_MAP_CAPACITY - 1);
+}
+
+void VoxelMap::clear(){
+    lock.lock();
+    memset(cells, 0, sizeof(cells));
+    count = 0;
+    dropped = 0;
+    lock.unlock();
+}
+
+VoxelCell* VoxelMap::find(const Position& pos){
+    int16_t x = cube_index(pos.x_cm), y = cube_index(pos.y_cm), z = cube_index(pos.z_cm);
+    /* Linear probing, the fill limit guarantees an empty slot ends the search */
+    for(uint32_t i = cube_hash(x, y, z);; i = (i + 1) & (VOXEL_MAP_CAPACITY - 1)){
+        VoxelCell& c = cells[i];
+        if(!c.used()){
+            if(count >= VOXEL_MAP_MAX_FILL){
+                dropped++;
+                return NULL;
+            }
+            count++;
+            c.x = x;
+            c.y = y;
+            c.z = z;
+            return &c;
+        }
+        if(c.x == x && c.y == y && c.z == z){
+            return &c;
+        }
+    }
+}
+
+bool VoxelMap::add_co2(const Position& pos, uint16_t co2){
+    lock.lock();
+    VoxelCell* c = pos.valid ? find(pos) : NULL;
+    if(c && c->co2_n < UINT16_MAX){
+        c->co2_n++;
+        c->co2 += (co2 - c->co2) / c->co2_n;
+        if(co2 > c->co2_max){
+            c->co2_max = co2;
+        }
+    }
+    lock.unlock();
+    return c != NULL;
+}
+
+bool VoxelMap::add_temp(const Position& pos, float temp){
+    lock.lock();
+    VoxelCell* c = pos.valid ? find(pos) : NULL;
+    if(c && c->temp_n < UINT16_MAX){
+        c->temp_n++;
+        c->temp += (temp - c->temp) / c->temp_n;
+    }
+    lock.unlock();
+    return c != NULL;
+}
+
+static int compare_records(const void* a, const void* b){
+    const VoxelCellRecord& ra = *(const VoxelCellRecord*)a;
+    const VoxelCellRecord& rb = *(const VoxelCellRecord*)b;
+    if(ra.z != rb.z){
+        return ra.z < rb.z ? -1 : 1;
+    }
+    if(ra.y != rb.y){
+        return ra.y < rb.y ? -1 : 1;
+    }
+    return ra.x < rb.x ? -1 : ra.x > rb.x;
+}
+
+bool VoxelMap::save(const char* path){
+    /* Too big for the caller's stack, and only needed once a flight */
+    VoxelCellRecord* recs = new (std::nothrow) VoxelCellRecord[VOXEL_MAP_MAX_FILL];
+    if(recs == NULL){
+        return false;
+    }
+
+    /* Only copy the cells under the lock, so the tasks adding readings never wait on the sort or the file system */
+    VoxelFileHeader hdr;
+    uint32_t n = 0;
+    lock.lock();
+    for(uint32_t i = 0; i < VOXEL_MAP_CAPACITY && n < VOXEL_MAP_MAX_FILL; ++i){
+        const VoxelCell& c = cells[i];
+        if(!c.used()){
+            continue;
+        }
+        VoxelCellRecord& r = recs[n++];
+        r.x = c.x;
+        r.y = c.y;
+        r.z = c.z;
+        r.co2_n = c.co2_n;
+        r.co2_mean = (uint16_t)(c.co2 + 0.5f);
+        r.co2_max = c.co2_max;
+        r.temp_n = c.temp_n;
+        r.temp_mean = c.temp_n ? (int16_t)lroundf(c.temp * 100) : 0;
+    }
+    hdr.dropped = dropped;
+    lock.unlock();
+
+    qsort(recs, n, sizeof(recs[0]), compare_records);
+    hdr.magic = VOXEL_FILE_MAGIC;
+    hdr.version = VOXEL_FILE_VERSION;
+    hdr.cell_cm = VOXEL_CELL_CM;
+    hdr.count = n;
+
+    hal::File file;
+    bool ok = file.open(path, "w") && file.write(&hdr, sizeof(hdr)) == sizeof(hdr);
+    /* Written a batch at a time, one write per cell is slow on LittleFS */
+    for(uint32_t i = 0; i < n && ok; i += 32){
+        size_t len = (n - i < 32 ? n - i : 32) * sizeof(recs[0]);
+        ok = file.write(recs + i, len) == len;
+    }
+    delete[] recs;
+    if(file.is_open()){
+        file.flush();
+        file.close();
+    }
+    return ok;
+}
@@ -0,0 +1,113 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the dead-reckoned position track and the voxel map of gas and temperature readings
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * DeadReckoner integrates the Tello's velocities, rotated by its yaw, into a horizontal position relative
+ * to the takeoff point; the caller fills in the height from the fused altitude (lib/alt_fusion).
+ * Without any absolute horizontal reference the position drifts, so it is only good for the scale of one flight.
+ *
+ * VoxelMap bins readings into cubes of VOXEL_CELL_CM around the takeoff point and keeps running means per
+ * cube. Only cubes that were visited take memory: they live in a fixed-size open addressing hash table,
+ * and once it is full readings in new cubes are counted as dropped rather than evicting old ones.
+ *
+ * The map is saved as a VoxelFileHeader followed by the occupied cells as VoxelCellRecords, sorted by
+ * (z, y, x) so a reader can binary search it. Little-endian, like the sample logs.
+*/
+
+#ifndef VOXEL_MAP_HPP
+#define VOXEL_MAP_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.hpp"
+
+#define VOXEL_CELL_CM 50 /* Edge of a cube */
+#define VOXEL_MAP_CAPACITY 512 /* Cells in the hash table, a power of 2 */
+#define VOXEL_MAP_MAX_FILL (VOXEL_MAP_CAPACITY * 3 / 4) /* Occupied cells before new ones are refused, keeps probes short */
+#define VOXEL_MAP_PATH "/voxels.bin"
+
+#define VOXEL_FILE_MAGIC 0x4C584F56 /* "VOXL" */
+#define VOXEL_FILE_VERSION 1
+
+/* Position relative to the takeoff point, x along the heading at takeoff, y to its right, z up */
+class Position{
+    public:
+        uint32_t uptime = 0; /* Of the last update, in ms */
+        float x_cm = 0, y_cm = 0, z_cm = 0;
+        bool valid = false; /* At least one state packet was integrated */
+};
+
+class DeadReckonerConfig{
+    public:
+        float vel_cm_per_unit = 10; /* vgx/vgy are reported in dm/s */
+        uint32_t max_gap_ms = 500; /* Don't integrate across a longer gap in state packets, the speed in between is unknown */
+};
+
+class DeadReckoner{
+    public:
+        DeadReckoner() { reset(); }
+        void reset();
+        /* Fold in a state packet that arrived at uptime_ms. vgx/vgy are in the drone's frame (x forward, y right),
+         * yaw in degrees clockwise. While grounded the position is held, so the track doesn't creep on the pad */
+        const Position& update(uint32_t uptime_ms, int vgx, int vgy, int yaw_deg, bool grounded);
+
+        DeadReckonerConfig config;
+        Position pos;
+
+    private:
+        float vx, vy; /* Last velocity in the takeoff frame, cm/s */
+};
+
+/* One cube of the map */
+class VoxelCell{
+    public:
+        int16_t x, y, z; /* Cube index, floor(position / VOXEL_CELL_CM) */
+        uint16_t co2_n;
+        uint16_t co2_max;
+        float co2; /* Running mean, ppm */
+        uint16_t temp_n;
+        float temp; /* Running mean, C */
+
+        bool used() const { return co2_n || temp_n; }
+};
+
+struct __attribute__((packed)) VoxelFileHeader{
+    uint32_t magic;   /* VOXEL_FILE_MAGIC */
+    uint16_t version; /* VOXEL_FILE_VERSION */
+    uint16_t cell_cm; /* VOXEL_CELL_CM the map was built with */
+    uint32_t count;   /* VoxelCellRecords that follow */
+    uint32_t dropped; /* Readings that fell in cubes the map had no room for */
+};
+
+struct __attribute__((packed)) VoxelCellRecord{
+    int16_t x, y, z;
+    uint16_t co2_n;
+    uint16_t co2_mean; /* ppm */
+    uint16_t co2_max;  /* ppm */
+    uint16_t temp_n;
+    int16_t temp_mean; /* 1/100 C */
+};
+
+/* All methods are safe to call from multiple tasks */
+class VoxelMap{
+    public:
+        VoxelMap() { clear(); }
+        void clear();
+        bool add_co2(const Position& pos, uint16_t co2);
+        bool add_temp(const Position& pos, float temp);
+        /* Write the map to path (on the file system mounted by hal::fs_begin), returns false on failure */
+        bool save(const char* path);
+
+        uint32_t size() const { return count; }
+        uint32_t dropped;
+
+    private:
+        VoxelCell cells[VOXEL_MAP_CAPACITY];
+        uint32_t count;
+        hal::Mutex lock;
+
+        /* The cell for pos, creating it if there is room. NULL if the map is full */
+        VoxelCell* find(const Position& pos);
+};
+
+#endif // VOXEL_MAP_HPP
@@ -5,33 +5,66 @@
  */ 
 
 #include <Arduino.h>
-#include <Wire.h>
 #include <WiFi.h>
-#include <WiFiUdp.h>
-#include <Adafruit_Sensor.h>
-#include <Adafruit_BMP3XX.h>
 #include <Adafruit_NeoPixel.h>
-#include <SensirionI2CScd4x.h>
 
-#include "littlefs_io.hpp"
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "log_journal.hpp"
+#include "sample_record.hpp"
+#include "delta_codec.hpp"
 #include "tello_ctrl.hpp"
+#include "tello_capture.hpp"
+#include "flight_plan.hpp"
+#include "sensor_sched.hpp"
+#include "telemetry.hpp"
+#include "sample_query.hpp"
+#include "metrics.hpp"
 #include "ble_comms.hpp"
 
-#define SEALEVELPRESSURE_HPA 1013.25
-
 TelloControl tello;
-
-SensirionI2CScd4x scd4x;
-Adafruit_BMP3XX bmp;
+LogWriter logger;
+TelloCapture capture;
+SensorScheduler sensors;
+SampleStreams streams(logger, tello);
+TelemetryBuilder telemetry;
 
 TaskHandle_t sensor_read_t;
-TaskHandle_t update_state_t;
 TaskHandle_t drone_ctrl_t;
 
-const char* file_name = "/data1.csv"; /* TODO: hard coded for now, fine a way to change the name every time the program is run */
+const char* plan_name = "/mission.plan"; /* Flight plan, see data/mission.plan */
+const char* capture_name = NULL; /* e.g. "/tello.cap" to record every Tello datagram for replay on the host, see tello_capture.hpp */
+
+/* Flown if plan_name is missing or invalid */
+const char* default_plan =
+    "takeoff\n"
+    "up 75\n"
+    "dwell 2\n"
+    "land\n";
+
+FlightPlan plan;
 
 /* Helper functions --------------------------------------------------------------------------------------------------------- */
 
+/* Telemetry source for ble_comms, runs on its telemetry task */
+size_t build_telemetry(uint8_t* out, size_t cap, void* ctx){
+    TelemetryFrame frame;
+    if(cap < sizeof(frame) || !telemetry.build(streams, tello, millis(), &frame)){
+        return 0;
+    }
+    memcpy(out, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+/* Metrics source for ble_comms, runs on the BLE stack's task */
+size_t build_metrics(uint8_t* out, size_t cap){
+    /* Packed, so it can be written in place */
+    if(cap < sizeof(MetricsSnapshot) || !metrics_snapshot((MetricsSnapshot*)out)){
+        return 0;
+    }
+    return sizeof(MetricsSnapshot);
+}
+
 /* Initialise connection from ESP32 to Tello */
 void init_connection() {
    int connected;
@@ -46,14 +79,17 @@ void init_connection() {
     }
 
     //Bind to Tello control & state port
-    tello.bindPorts(WiFi.localIP());
+    if(!tello.bindPorts()){
+        Serial.println("Unable to bind Tello ports.");
+    }
     Serial.printf("%s connected.\n", tello.ssid);
 }
 
 /* Read stored sensor data from flash and send it to a device over Bluetooth Low Energy (BLE)
-   A device will recieve that message, decode it, and write it out to a .csv file. 
+   A device will recieve that message and write it out to a .bin file, decoded to .csv with addl_resources/decode_log.cpp 
    Returns -1 if flash is empty/cannot be read 
    Returns -2 if the BLE device has disconnected 
+   Once sent, stays up answering range queries (see sample_query.hpp) and does not return
 */
 int sendDataOverBLE(){
     /* Initialise and turn on built-in Neopixel to blue*/
@@ -63,131 +99,75 @@ int sendDataOverBLE(){
     pixels.fill(pixels.Color(0, 0, 255));  // R, G, B (0-255)
     pixels.show();
 
-    /* Initialise BLE server */
-    initBLE("EcoDrone_Data");
-
-    /* Wait for drone connection task signal from ble_comms before reading from flash and writing data to BLE characteristic */
+    /* The BLE server has been up since setup() for telemetry, a client may already be connected */
     Serial.println("Waiting for BLE connection...");
-    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while(!bleConnected()){
+        delay(100);
+    }
     Serial.println("BLE client connected. Proceeding to write...");
     
-    String msg = readFile(LittleFS, file_name);
-    if(msg.isEmpty()){
+    /* Stream this flight's log run in MTU-sized chunks, the client can resume after a disconnect.
+     * Earlier runs stay on flash under their own numbers (see log_journal.hpp) */
+    if(logger.run() == 0){
         Serial.print("Unable to read from flash.");
         return -1;
     }
-    if(!writeData(msg)){
+    /* A client that only wants part of it sends a query instead, which ends the full offload */
+    if(!sendRunOverBLE(logger.run()) && !bleQueryPending()){
         Serial.print("Unable to write over BLE.");
         return -2;
     }
+    /* Then the voxel map, as a transfer of its own */
+    if(!bleQueryPending() && hal::file_exists(VOXEL_MAP_PATH) && !sendFileOverBLE(VOXEL_MAP_PATH)){
+        Serial.print("Unable to write the voxel map over BLE.");
+        return -2;
+    }
     Serial.println("Data successfully written.");
     pixels.fill(pixels.Color(0, 0, 0));
     pixels.show();
-    
-    return 1;
-}
-/* End helper functions --------------------------------------------------------------------------------------------------------- */
-
-/* Tasks------------------------------------------------------------------------------------------------------------------------- */
-
-/* Task to read Tello's state and measurements from all external sensors */
-void sensor_read(void* params){
-    uint16_t error;
-    char errorMessage[256];
-    
-    writeFile(LittleFS, file_name, "Motor Time (s),Battery (%),Absolute Height (Tello TOF) (cm),CO2 (ppm),Temperature (SCD4x)(C),Temperature (BMP3xx)(C),Relative Humidity (%),Pressure (hPa),Approx. Altitude (m)");
-    Serial.printf("sensor_read running on core %d\n", xPortGetCoreID());
 
+    /* Answer range queries of this or any earlier run for as long as clients keep asking */
     while(1){
-        uint16_t co2;
-        float scd_temp, humd, alt;
-        double bmp_temp, pres;
-
-        /* Read SCD4x measurements */
-        error = scd4x.readMeasurement(co2, scd_temp, humd);
-        if(error){
-            /* Print out error message unless it is "NotEnoughDataError". We are polling data every second, but the SCD4x isn't ready until 5 seconds, so ignore those messages.
-               Grab lower byte since NotEnoughDataError is a low level error (see SensirionErrors.cpp) */
-            if ((error & 0x00FF) != NotEnoughDataError){
-                //Serial.print("SCD4x: Error trying to execute readMeasurement(): ");
-                errorToString(error, errorMessage, 256);
-                //Serial.println(errorMessage);            
-            }
-            else{
-                /* Zero out variables to write into file */
-                /* TODO: set to -1, and if it is -1, don't put it in the "line" variable? */
-                co2 = 0;
-                scd_temp = 0.0;
-                humd = 0;
-            }
+        uint8_t req[BLE_XFER_QUERY_MAX];
+        size_t len = waitQueryOverBLE(req, sizeof(req));
+        SampleQuery query;
+        SampleQueryStats stats;
+        if(!query.parse(req, len)){
+            Serial.println("BLE: ignoring malformed query");
+            continue;
         }
-        else if (co2 == 0){
-            //Serial.println("SCD4x: Invalid sample detected, skipping.");
-        }
-        else{
-            //Serial.printf("SCD4x: CO2: %d ppm, Temperature: %.2f C, Humidity: %.2f%%\n", co2, scd_temp, humd);
+        query.answer(SAMPLE_QUERY_RESULT_PATH, &stats);
+        stats.log();
+        if(!sendFileOverBLE(SAMPLE_QUERY_RESULT_PATH) && !bleQueryPending()){
+            Serial.print("Unable to write the query result over BLE.");
         }
+    }
+}
 
-        if(!bmp.performReading()) {
-            //Serial.println("BMP3xx: Failed to perform reading.");
-        }else{
-            bmp_temp = bmp.temperature;
-            pres = (bmp.pressure / 100.0);
-            alt = bmp.readAltitude(SEALEVELPRESSURE_HPA);
-            //Serial.printf("BMP3xx: Temperature: %.2f C, Pressure: %.2f hPa, Approx. Altitude: %.2f m\n", bmp_temp, pres, alt);
-        }
+/* End helper functions --------------------------------------------------------------------------------------------------------- */
 
-        // TODO: Add current time as known by ESP32, relative height as reported by Tello
-        String line = "\n" + String(tello.state.time) + "," + String(tello.state.bat) + "," + String(tello.state.tof) + "," + String(co2) + "," + String(scd_temp, 2) + "," + String(bmp_temp, 2) + "," + String(humd, 2) + "," + String(pres, 2) + "," + String(alt, 2);
-        appendFile(LittleFS, file_name, line.c_str());
-        
-        //Serial.printf("Tello Battery: %d\n", tello_state.bat);
-        //TODO: use neopixel to flash battery life?
-        //Serial.println(line);
+/* Tasks------------------------------------------------------------------------------------------------------------------------- */
 
-        delay(1000);
-    }
-    vTaskDelete(NULL);
-}
+/* Task to sample Tello's state and all external sensors, each at its own rate */
+void sensor_read(void* params){
+    hal::task_watch(hal::current_task(), "sensor_read", 10000);
+    /* The BMP3xx and Tello are summarised per window, raw around CO2 events (see sample_agg.hpp),
+     * and what is stored is delta encoded (see delta_codec.hpp). Every boot logs to a run of its own */
+    streams.begin_run();
+    Serial.printf("Logging to run %u\n", logger.run());
+    Serial.printf("sensor_read running on core %d\n", xPortGetCoreID());
 
-/* Task to continiously update tello_state every 10ms in the background */
-void update_state(void* params){
-    while(1){
-        /* Grab the first packet that comes in */
-        int packetSize = tello.state_server.parsePacket();
-        if (packetSize) {
-            String state;
-            /* Parse data into state */
-            while (tello.state_server.available()) {
-                char c = tello.state_server.read();
-                if(c == '\n' || c == '\r'|| c == '\0'){
-                    continue;
-                }
-                state += c;
-            }
-          
-            /* Parse the state string
-             * Format: "pitch:%d;roll:%d;yaw:%d;vgx:%d;vgy%d;vgz:%d;templ:%d;temph:%d;tof:%d;h:%d;bat:%d;baro:%.2f;time:%d;agx:%.2f;agy:%.2f;agz:%.2f;\r\n"
-             * The code loops through all 16 states, shifting the substring start index along as it 
-             * hits each data point between the colon and semicolon
-             */
-            int start_ind = 0;
-            int end_ind = 0;
-            float vals[tello.state.num_vals];
-            for(int i = 0; i < tello.state.num_vals; ++i){
-                start_ind = state.indexOf(':', start_ind) + 1;
-                end_ind = state.indexOf(';', start_ind);
-                vals[i] = state.substring(start_ind, end_ind).toFloat();
-            }
-            tello.update_state_values(vals);
-        }
-        delay(10);
-    }
+    //TODO: use neopixel to flash battery life?
+    streams.add_to(sensors);
+    sensors.run();
+    /* Stopped by drone_ctrl once the drone has landed */
+    hal::task_forget(hal::current_task());
     vTaskDelete(NULL);
 }
 
 /* Task to control drone movements */
 void drone_ctrl(void* params){
+    hal::task_watch(hal::current_task(), "drone_ctrl", 10000);
     Serial.printf("drone_ctrl running on core %d\n", xPortGetCoreID());
 
     /* Blink red LED 3 times before takeoff */
@@ -202,20 +182,44 @@ void drone_ctrl(void* params){
     /* Start sending movement data to the drone */
     digitalWrite(LED_BUILTIN, HIGH);
 
-    Serial.println("Resp: " + tello.send_cmd_sync("takeoff"));
-    Serial.println("Resp: " + tello.send_cmd_sync("up 75"));
-    delay(2000);
-
-    // Serial.println("Resp: " + tello.send_cmd_sync("forward 50"));
-    // Serial.println("Resp: " + tello.send_cmd_sync("back 50"));
-
-    Serial.println("Resp: " + tello.send_cmd_sync("land"));
+    FlightPlanResult res = run_flight_plan(tello, plan, &streams.altitude, &streams.position, &streams.energy, streams.energy_model.config);
+    Serial.printf("Flight plan %s: %u commands in %u ms\n", res.ok ? "completed" : "aborted", res.cmds, res.elapsed_ms);
+    if(res.rc.ticks){
+        res.rc.log();
+        Serial.printf("Mission budget: %u waypoints dropped, lowest margin %.1f%%\n", res.waypoints_dropped, res.worst_margin_pct);
+    }
+    EnergyEstimate energy = streams.get_energy();
+    Serial.printf("Battery: %d%% left, drain hover/fly/climb %.3f/%.3f/%.3f %%/s from %u drops\n", energy.bat,
+                  energy.rate[ENERGY_HOVER], energy.rate[ENERGY_FLY], energy.rate[ENERGY_CLIMB], energy.drops);
+    Serial.printf("Altitude fusion: longest step %u us, %u over budget\n", streams.fusion_max_us, streams.fusion_over_budget);
+
+    tello.get_rx_stats().log();
+    if(capture.is_open()){
+        capture.end();
+        Serial.printf("Capture: %u datagrams, %u bytes saved to %s, %u dropped\n", capture.packets, capture.bytes, capture_name, capture.dropped);
+    }
+    TelloLinkStats link = tello.get_link_stats();
+    Serial.printf("Command link: %u sent, %u answered, %u timeouts, %u retries, rtt min/avg/max %u/%u/%u us\n",
+                  link.sent, link.answered, link.timeouts, link.retries, link.rtt_min_us,
+                  link.answered ? (uint32_t)(link.rtt_sum_us / link.answered) : 0, link.rtt_max_us);
+
+    /* Stop sampling, then store the windows still open and close the run (and its index) before offloading it */
+    sensors.stop();
+    streams.end();
+    streams.pipe_stats.log();
+    sensors.print_stats();
+    telemetry.log();
+    metrics_log();
+    if(streams.voxels.save(VOXEL_MAP_PATH)){
+        Serial.printf("Voxel map: %u cells saved to %s, %u readings dropped\n", streams.voxels.size(), VOXEL_MAP_PATH, streams.voxels.dropped);
+    }
 
     digitalWrite(LED_BUILTIN, LOW);
 
     /* Send data to receiving device */
     sendDataOverBLE();
 
+    hal::task_forget(hal::current_task());
     vTaskDelete(NULL);
 }
 
@@ -231,53 +235,31 @@ void setup() {
 
     pinMode(LED_BUILTIN, OUTPUT);
 
-    /* Initialise Sensirion SCD4x */
-    Wire.begin();
-    scd4x.begin(Wire);
-    uint16_t error;
-    char errorMessage[256];
-
-    /* Stop potentially previously started measurement */
-    error = scd4x.stopPeriodicMeasurement();
-    if (error) {
-        Serial.print("SCD4x: Error trying to execute stopPeriodicMeasurement(): ");
-        errorToString(error, errorMessage, 256);
-        Serial.println(errorMessage);
-    }
-
-    /* Start Measurement */
-    error = scd4x.startPeriodicMeasurement();
-    if (error) {
-        Serial.print("Error trying to execute startPeriodicMeasurement(): ");
-        errorToString(error, errorMessage, 256);
-        Serial.println(errorMessage);
-    }
-
-    /* Initialise Bosch BMP3xx 
-     * hardware I2C mode, can pass in address & alt Wire */
-    if (!bmp.begin_I2C()) {   
-        Serial.println("Could not find a valid BMP3 sensor, check wiring!");
+    /* Initialise SCD4x & BMP3xx, then the file system to write into */
+    if(!hal::sensors_begin()){
+        Serial.println("Error initialising sensors.");
         return;
     }
-
-    /* Set up oversampling and filter initialization */
-    bmp.setTemperatureOversampling(BMP3_OVERSAMPLING_8X);
-    bmp.setPressureOversampling(BMP3_OVERSAMPLING_4X);
-    bmp.setIIRFilterCoeff(BMP3_IIR_FILTER_COEFF_3);
-    bmp.setOutputDataRate(BMP3_ODR_50_HZ);
-
-
-    /* Initialise file system & file to write into */
-    /* TODO: Using LittleFS library, but partition label is ffat, strange */
-    /* TODO: move using LittleFS.begin into littlefs_io library, possibly make it a class */
-    if (!LittleFS.begin(true, "/littlefs", 10, "ffat")){
+    if(!hal::fs_begin()){
         Serial.println("An Error has occurred while mounting LittleFS");
         return;
     }
+    /* See how the last run ended, a brownout only costs what came after its last commit */
+    LogRecovery last;
+    if(logRecover(logLastRun(), &last)){
+        last.log();
+    }
 
     /* Initialise connection to Tello, enable SDK mode */
     //TODO: Split off into its own function?
     init_connection();
+    /* Record before the first datagram so a replay sees the whole session */
+    if(capture_name && capture.begin(capture_name)){
+        tello.capture = &capture;
+    }
+    /* Tello state and replies are received by a task that sleeps until a datagram arrives, rather than polled */
+    tello.start_rx_task(6, 0);
+    tello.start_cmd_engine(8, 1);
     String resp = tello.send_cmd_sync("command");
     if(!resp.equalsIgnoreCase("ok")){
         Serial.println("Error enabling SDK mode.");
@@ -286,16 +268,81 @@ void setup() {
         Serial.println("Successfully entered SDK mode.");
     }
 
+    /* Compile the flight plan now so nothing is parsed in flight */
+    FlightPlanError err;
+    if(!plan.load(plan_name, &err)){
+        Serial.printf("Flight plan %s: line %u: %s, using the default plan\n", plan_name, err.line, err.msg);
+        plan.compile(default_plan, &err);
+    }
+
+    /* Sampling stays on core 0 and storage runs on core 1, so a slow flash write never delays a sample */
+    streams.start_storage_task(3, 1);
+
+    /* Watch the flight live over BLE. Telemetry only reads what the other tasks publish, at the lowest priority
+     * on core 1, so the Tello receive and sampling tasks on core 0 never wait on it */
+    initBLE("EcoDrone_Data");
+    startTelemetryOverBLE(build_telemetry, NULL, TELEMETRY_PERIOD_MS, 1, 1);
+    serveMetricsOverBLE(build_metrics);
+
     /* Create perpetual sensor reading & flight path task*/
     xTaskCreatePinnedToCore(sensor_read, "sensor_read", 10000, NULL, 4, &sensor_read_t, 0);
-    xTaskCreatePinnedToCore(update_state, "update_state", 10000, NULL, 2, &update_state_t, 0);
     xTaskCreatePinnedToCore(drone_ctrl, "drone_ctrl", 10000, NULL, 8, &drone_ctrl_t, 1);
 }
 
 void loop(){
+    /* Dump samples logged since the last pass, streaming them through a small buffer rather than reading the whole log */
+    static uint8_t arena[256];
+    static uint32_t dumped = sizeof(SampleLogHeader);
+    static DeltaDecoder decoder;
+    static uint32_t bad_states = 0;
     if(Serial){
-        readFile(LittleFS, file_name);
-        //Serial.printf("\n\nString data: %s\n\n", data);
+        /* The receive task only counts bad state packets, they are reported from here */
+        tello.get_rx_stats().log_errors(bad_states);
+        /* Send 'm' for the runtime metrics so far */
+        while(Serial.available() > 0){
+            if(Serial.read() == 'm'){
+                metrics_log();
+            }
+        }
+        /* Read up to the run's last commit, which the logger knows, rather than recovering the run on every pass */
+        LogJournalReader reader(arena, sizeof(arena));
+        if(logger.run() && reader.open(logger.run(), dumped, logger.committed())){
+            const uint8_t* data;
+            size_t n;
+            uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+            char line[160];
+            while((n = reader.next(&data)) > 0){
+                /* Records vary in size, so a chunk can end part way through one. Only consume whole records,
+                 * then carry on reading from the first one that was cut off */
+                size_t i = 0, len;
+                int used;
+                while(i < n && (used = decoder.decode(data + i, n - i, dumped + i, rec, &len)) > 0){
+                    if(len){
+                        sample_format_csv(rec, line, sizeof(line));
+                        Serial.printf("%s: %s\n", sample_stream_name(rec[0]), line);
+                    }
+                    i += used;
+                }
+                dumped += i;
+                if(used < 0){
+                    /* Resynchronise at the next sync marker rather than printing garbage */
+                    Serial.printf("Corrupt sample log at offset %u\n", dumped);
+                    long sync = DeltaDecoder::findSync(data + i, n - i, dumped);
+                    if(sync < 0){
+                        sync = n - i > DELTA_SYNC_LEN ? n - i - DELTA_SYNC_LEN + 1 : 1;
+                    }
+                    dumped += sync;
+                    decoder.reset();
+                    if(!reader.seek(dumped)){
+                        break;
+                    }
+                }
+                else if(i < n && (i == 0 || !reader.seek(dumped))){
+                    break;
+                }
+            }
+            reader.close();
+        }
         delay(5000);
     }
-}
\ No newline at end of file
+}
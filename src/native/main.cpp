@@ -0,0 +1,544 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Main file for the native (host) build: runs TelloControl, the state pipeline and the logger against the Tello simulator
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Build & run with "pio run -e native && .pio/build/native/program [options]", options:
+ *   --rate HZ        state packets per second (default 10)
+ *   --loss P         probability each reply/state packet is lost, 0..1
+ *   --corrupt P      probability each state packet is mangled, 0..1
+ *   --latency MS     latency added to every reply/state packet
+ *   --jitter MS      random extra latency, up to this much
+ *   --move-speed CMS movements reply once flown at this speed (default 0, reply at once)
+ *   --settle MS      movements reply this much later again, as the drone brakes and steadies
+ *   --battery PCT    charge the simulated drone starts with (default 100)
+ *   --reserve PCT    battery the mission budget keeps to land with (default 10, see lib/energy_model)
+ *   --queries N      "battery?" round trips to time after the flight (default 100)
+ *   --seconds S      how long the default flight plan hovers for (default 5)
+ *   --plan PATH      fly this plan (under native_fs/, e.g. a copy of data/mission.plan) instead of the default
+ *   --raw            log records unencoded instead of delta encoded
+ *   --window MS      summarise the BMP3xx and Tello over windows this long (default 10000, 0 logs every record)
+ *   --flash-ms MS    make every file write take this much longer, as a slow flash would
+ *   --inline-store   aggregate, encode and write records on the sampling task, instead of a storage task of their own
+ *   --bench-rc       fly the same transect with discrete moves and as an rc path (lib/rc_ctrl) and compare,
+ *                    instead of a plan. Unless given, moves fly at 60 cm/s and settle for 1000 ms
+ *   --poll-state     poll for state packets like the old update_state task instead of running the receive task,
+ *                    to compare wakeups
+ *   --capture PATH   record every datagram exchanged with the simulator into PATH (see lib/tello_ctrl/tello_capture.hpp)
+ *   --replay PATH    instead of flying, feed a capture (e.g. one pulled off the drone) through the state pipeline and
+ *                    the logger at the speed it was recorded, no simulator needed
+ *   --fast           replay as fast as possible on a simulated clock, which gives the same log every time
+ *   --log PATH       log to a single file at PATH, instead of the next journaled run (see lib/littlefs_io/log_journal.hpp)
+ *   --export PATH    afterwards, read the run back into PATH as one log, as the BLE offload would send it
+ *   --recover RUN    only check how a run ended (0 for the last one), as the ESP32 does at boot, and export it if asked
+ *   --query FROM:TO  only answer a range query of the last run (see lib/sample_query), as the ESP32 does over BLE,
+ *                    into the --export path or /query.bin. FROM and TO are uptimes in ms
+ *   --motor-time     the query's FROM and TO are Tello motor times in s instead
+ *   --every N        the query keeps every Nth matching record of each stream
+ *   --streams MASK   the query only returns streams whose bit is set (see SampleStream), e.g. 8 for the Tello
+ *   --run RUN        query this run instead of the last one
+ *   --telemetry MS   build an in-flight telemetry frame every MS, as the ESP32 notifies them over BLE (see
+ *                    lib/sensor_sched/telemetry.hpp), and save them to /telemetry.bin
+ *   --metrics        print the runtime metrics (see lib/metrics) at the end, and save the snapshot a BLE client would
+ *                    read to /metrics.bin
+ *   --sim-only       only run the simulator (e.g. for addl_resources tools), until killed
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "log_journal.hpp"
+#include "sample_record.hpp"
+#include "tello_ctrl.hpp"
+#include "flight_plan.hpp"
+#include "sensor_sched.hpp"
+#include "telemetry.hpp"
+#include "sample_query.hpp"
+#include "metrics.hpp"
+#include "rc_ctrl.hpp"
+#include "tello_sim.hpp"
+#include "tello_capture.hpp"
+
+TelloControl tello;
+LogWriter logger;
+SensorScheduler sensors;
+SampleStreams streams(logger, tello);
+
+TelloCapture capture;
+
+static std::atomic<bool> running{true};
+static const char* log_path = NULL; /* NULL logs to the next journaled run */
+static SampleEncoding encoding = SAMPLE_ENCODING_DELTA;
+
+static uint32_t poll_wakeups = 0;
+static uint32_t telemetry_ms = 0; /* 0 for no telemetry */
+static TelemetryBuilder telemetry;
+static bool show_metrics = false;
+
+/* The old update_state loop on the ESP32: wake every 10 ms and drain whatever state packets came in */
+static void update_state(void* params){
+    while(running){
+        while(tello.poll_state()){}
+        poll_wakeups++;
+        hal::delay(10);
+    }
+}
+
+/* The ESP32's BLE telemetry task, with a file standing in for the client */
+static void send_telemetry(void* params){
+    hal::File out;
+    if(!out.open("/telemetry.bin", "w")){
+        return;
+    }
+    TelemetryFrame frame;
+    uint32_t wake = hal::millis();
+    while(running){
+        hal::delay_until(wake, telemetry_ms);
+        if(telemetry.build(streams, tello, hal::millis(), &frame)){
+            out.write(&frame, sizeof(frame));
+        }
+    }
+    out.close();
+}
+
+/* Print the runtime metrics and save the snapshot, as a read of the BLE metrics characteristic returns it */
+static void save_metrics(){
+    if(!show_metrics){
+        return;
+    }
+    metrics_log();
+    MetricsSnapshot snap;
+    hal::File out;
+    if(metrics_snapshot(&snap) && out.open("/metrics.bin", "w")){
+        out.write(&snap, sizeof(snap));
+        out.close();
+    }
+}
+
+static bool begin_log(){
+    return log_path ? streams.begin(log_path, encoding) : streams.begin_run(encoding);
+}
+
+/* Read a run back into path as one log, the way sendRunOverBLE does on the ESP32 */
+static bool export_run(uint32_t run, const char* path){
+    uint8_t arena[512];
+    LogJournalReader reader(arena, sizeof(arena));
+    hal::File out;
+    if(!reader.open(run) || !out.open(path, "w")){
+        hal::log("Unable to export run %u to %s\n", run, path);
+        return false;
+    }
+    const uint8_t* data;
+    size_t n;
+    while((n = reader.next(&data)) > 0){
+        out.write(data, n);
+    }
+    hal::log("Exported run %u: %u bytes to %s, %u corrupt blocks read as zeros\n", run, reader.size(), path, reader.badBlocks);
+    return true;
+}
+
+/* Check how a run ended, as setup() does for the last one on the ESP32 */
+static int recover(uint32_t run, const char* export_path){
+    LogRecovery last;
+    if(!hal::fs_begin() || !logRecover(run ? run : logLastRun(), &last)){
+        hal::log("No log run to recover\n");
+        return 1;
+    }
+    last.log();
+    return export_path && !export_run(last.run, export_path) ? 1 : 0;
+}
+
+/* Answer a range query, as the ESP32 does for a BLE client */
+static int query(const SampleQuery& q, const char* export_path){
+    SampleQueryStats stats;
+    const char* path = export_path ? export_path : SAMPLE_QUERY_RESULT_PATH;
+    if(!hal::fs_begin() || !q.answer(path, &stats)){
+        hal::log("Unable to query run %u\n", stats.run);
+        return 1;
+    }
+    stats.log();
+    hal::log("Result in %s\n", path);
+    return 0;
+}
+
+/* What the run just logged looks like to recovery, then export it if asked */
+static void finish_log(const char* export_path){
+    LogRecovery rec;
+    if(logger.run() && logRecover(logger.run(), &rec)){
+        rec.log();
+        if(export_path){
+            export_run(rec.run, export_path);
+        }
+    }
+}
+
+/* Same as sensor_read on the ESP32, but stops when the run is over */
+static void sensor_read(void* params){
+    begin_log();
+
+    streams.add_to(sensors);
+    uint32_t wake = hal::millis();
+    while(running){
+        sensors.step(hal::millis());
+        hal::delay_until(wake, sensors.tick_ms);
+    }
+}
+
+static void print_cmd(const char* cmd){
+    TelloCommand c(cmd);
+    TelloCmdStatus status = tello.send_cmd(&c);
+    hal::log("%-10s -> %s (%u attempts, %u us)\n", cmd, status == TELLO_CMD_TIMEOUT ? "timeout" : c.resp, c.attempts, c.rtt_us);
+}
+
+/* A 300 x 200 cm rectangle at the height "up 50" leaves the drone at, flown both ways */
+#define BENCH_RC_SETUP "takeoff\nup 50\n"
+#define BENCH_RC_MOVES "forward 300\nright 200\nback 300\nleft 200\n"
+#define BENCH_RC_LENGTH_CM 1000
+
+static FlightPlanResult bench_fly(const char* name, const char* text, const TelloSim& sim){
+    FlightPlan plan;
+    FlightPlanError err;
+    if(!plan.compile(text, &err)){
+        hal::log("%s: line %u: %s\n", name, err.line, err.msg);
+        return FlightPlanResult();
+    }
+    float bat = sim.battery();
+    FlightPlanResult res = run_flight_plan(tello, plan, &streams.altitude, &streams.position);
+    Position pos = streams.get_position();
+    hal::log("%-14s %s in %5u ms, %5.1f cm/s, %4.0f cm per battery %%, ended %.0f cm from the start\n", name,
+             res.ok ? "flown" : "ABORTED", res.elapsed_ms, BENCH_RC_LENGTH_CM * 1000.0f / res.elapsed_ms,
+             BENCH_RC_LENGTH_CM / (bat - sim.battery()), sqrtf(pos.x_cm * pos.x_cm + pos.y_cm * pos.y_cm));
+    return res;
+}
+
+static FlightPlanResult bench_rc(const TelloSim& sim){
+    const TelloSimConfig& config = sim.config;
+    FlightPlan plan;
+    FlightPlanError err;
+    plan.compile(BENCH_RC_SETUP, &err);
+    run_flight_plan(tello, plan, &streams.altitude, &streams.position);
+    hal::delay(1000);
+    int z = (int)lroundf(streams.get_position().z_cm);
+    int speed = (int)config.move_speed_cms;
+
+    char moves[128], path[160];
+    snprintf(moves, sizeof(moves), "speed %d\n" BENCH_RC_MOVES, speed);
+    snprintf(path, sizeof(path), "fly 300 0 %d %d\nfly 300 200 %d %d\nfly 0 200 %d %d\nfly 0 0 %d %d\n",
+             z, speed, z, speed, z, speed, z, speed);
+    hal::log("\nTransect: %d cm rectangle at %d cm/s, %d cm up, moves settle for %u ms\n", BENCH_RC_LENGTH_CM, speed, z, config.settle_ms);
+    bench_fly("discrete moves", moves, sim);
+    FlightPlanResult res = bench_fly("rc path", path, sim);
+
+    plan.compile("land\n", &err);
+    run_flight_plan(tello, plan);
+    return res;
+}
+
+/* Move the manual clock forward to at_us, never back */
+static void advance_to(uint32_t at_us){
+    if((int32_t)(at_us - hal::micros()) > 0){
+        hal::native_clock_advance(at_us - hal::micros());
+    }
+}
+
+/* Move the manual clock forward to at_us, running every scheduler tick on the way as sensor_read would */
+static void replay_until(uint32_t at_us, uint32_t& tick_ms){
+    while((int32_t)(at_us - tick_ms * 1000) >= 0){
+        advance_to(tick_ms * 1000);
+        sensors.step(tick_ms);
+        tick_ms += sensors.tick_ms;
+    }
+    advance_to(at_us);
+}
+
+/* Feed a capture through the parser, the state pipeline and the logger, see --replay */
+static int replay(const char* path, bool fast, bool inline_store, const char* export_path){
+    TelloCaptureReader reader;
+    if(!hal::fs_begin() || !reader.open(path)){
+        hal::log("Unable to open capture %s\n", path);
+        return 1;
+    }
+    if(fast){
+        hal::native_clock_manual(reader.header.start_us);
+    }
+    hal::sensors_begin();
+    uint32_t tick_ms = hal::millis();
+    if(fast){
+        begin_log();
+        streams.add_to(sensors);
+    }
+    else{
+        /* A storage task would make the simulated clock depend on how threads happen to be scheduled */
+        if(!inline_store){
+            streams.start_storage_task(3, 1);
+        }
+        hal::task_create(sensor_read, "sensor_read", 10000, NULL, 4, 0);
+    }
+
+    /* On the real clock, entries are due this long after they were captured */
+    uint32_t offset_us = hal::micros() - reader.header.start_us;
+    uint32_t start_ms = hal::millis();
+    uint32_t counts[TELLO_CAPTURE_RC + 1] = {0};
+    uint8_t kind, data[TELLO_CAPTURE_MAX_LEN + 1];
+    uint32_t at_us, last_us = reader.header.start_us;
+    size_t len;
+    while(reader.next(&kind, &at_us, data, &len)){
+        if(fast){
+            replay_until(at_us, tick_ms);
+        }
+        else if((int32_t)(at_us + offset_us - hal::micros()) > 1000){
+            hal::delay((at_us + offset_us - hal::micros()) / 1000);
+        }
+        counts[kind]++;
+        last_us = at_us;
+        data[len] = '\0';
+        switch(kind){
+            case TELLO_CAPTURE_STATE: tello.handle_state((const char*)data, len, hal::micros()); break;
+            case TELLO_CAPTURE_CMD: hal::log("%10.3f s > %s\n", (at_us - reader.header.start_us) / 1e6, (const char*)data); break;
+            case TELLO_CAPTURE_REPLY: hal::log("%10.3f s < %s\n", (at_us - reader.header.start_us) / 1e6, (const char*)data); break;
+            default: break;
+        }
+    }
+    if(fast){
+        /* Let the windows still open see the end of the capture, then stop as sensor_read would */
+        replay_until(last_us + 200000, tick_ms);
+    }
+    else{
+        hal::delay(200);
+    }
+    running = false;
+    hal::delay(50);
+    streams.end();
+    streams.voxels.save(VOXEL_MAP_PATH);
+    reader.close();
+
+    hal::log("\nReplay: %.1f s of capture in %u ms%s, %u state packets (%u rejected by the parser), %u commands, %u replies, %u rc setpoints%s\n",
+             (last_us - reader.header.start_us) / 1e6, hal::millis() - start_ms, fast ? " of simulated time" : "",
+             counts[TELLO_CAPTURE_STATE], tello.state_errors, counts[TELLO_CAPTURE_CMD], counts[TELLO_CAPTURE_REPLY],
+             counts[TELLO_CAPTURE_RC], reader.corrupt ? ", stopped at a corrupt entry" : "");
+    sensors.print_stats();
+    if(!fast && !inline_store){
+        streams.pipe_stats.log();
+    }
+    hal::log("Log: %u records, %u bytes in %u flash writes, %u commits, %u bytes dropped\n",
+             logger.records, logger.bytes_written, logger.flash_writes, logger.commits, logger.dropped);
+    finish_log(export_path);
+    Position pos = streams.get_position();
+    hal::log("Position: ended at (%.1f, %.1f, %.1f) cm, voxel map of %u cells in %s\n",
+             pos.x_cm, pos.y_cm, pos.z_cm, streams.voxels.size(), VOXEL_MAP_PATH);
+    save_metrics();
+    return reader.corrupt ? 1 : 0;
+}
+
+int main(int argc, char** argv){
+    TelloSimConfig config;
+    int queries = 100;
+    float seconds = 5;
+    bool sim_only = false;
+    bool bench = false, settle_given = false, poll_state = false;
+    const char* plan_path = NULL;
+    const char* capture_path = NULL;
+    const char* replay_path = NULL;
+    const char* export_path = NULL;
+    int recover_run = -1;
+    SampleQuery sample_query;
+    bool querying = false;
+    bool fast = false;
+    bool inline_store = false;
+
+    for(int i = 1; i < argc; ++i){
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : "0";
+        if(strcmp(arg, "--rate") == 0){ config.state_rate_hz = atof(val); ++i; }
+        else if(strcmp(arg, "--loss") == 0){ config.loss = atof(val); ++i; }
+        else if(strcmp(arg, "--corrupt") == 0){ config.corrupt = atof(val); ++i; }
+        else if(strcmp(arg, "--latency") == 0){ config.latency_ms = atoi(val); ++i; }
+        else if(strcmp(arg, "--jitter") == 0){ config.jitter_ms = atoi(val); ++i; }
+        else if(strcmp(arg, "--move-speed") == 0){ config.move_speed_cms = atof(val); ++i; }
+        else if(strcmp(arg, "--battery") == 0){ config.battery_pct = atof(val); ++i; }
+        else if(strcmp(arg, "--reserve") == 0){ streams.energy_model.config.reserve_pct = atof(val); ++i; }
+        else if(strcmp(arg, "--queries") == 0){ queries = atoi(val); ++i; }
+        else if(strcmp(arg, "--seconds") == 0){ seconds = atof(val); ++i; }
+        else if(strcmp(arg, "--plan") == 0){ plan_path = val; ++i; }
+        else if(strcmp(arg, "--settle") == 0){ config.settle_ms = atoi(val); settle_given = true; ++i; }
+        else if(strcmp(arg, "--bench-rc") == 0){ bench = true; }
+        else if(strcmp(arg, "--sim-only") == 0){ sim_only = true; }
+        else if(strcmp(arg, "--telemetry") == 0){ telemetry_ms = atoi(val); ++i; }
+        else if(strcmp(arg, "--metrics") == 0){ show_metrics = true; }
+        else if(strcmp(arg, "--poll-state") == 0){ poll_state = true; }
+        else if(strcmp(arg, "--capture") == 0){ capture_path = val; ++i; }
+        else if(strcmp(arg, "--replay") == 0){ replay_path = val; ++i; }
+        else if(strcmp(arg, "--fast") == 0){ fast = true; }
+        else if(strcmp(arg, "--log") == 0){ log_path = val; ++i; }
+        else if(strcmp(arg, "--export") == 0){ export_path = val; ++i; }
+        else if(strcmp(arg, "--recover") == 0){ recover_run = atoi(val); ++i; }
+        else if(strcmp(arg, "--query") == 0){
+            const char* colon = strchr(val, ':');
+            sample_query.from = strtoul(val, NULL, 10);
+            sample_query.to = colon ? strtoul(colon + 1, NULL, 10) : sample_query.from;
+            querying = true;
+            ++i;
+        }
+        else if(strcmp(arg, "--motor-time") == 0){ sample_query.key = SAMPLE_QUERY_MOTOR_TIME; }
+        else if(strcmp(arg, "--every") == 0){ sample_query.every = atoi(val) > 0 ? atoi(val) : 1; ++i; }
+        else if(strcmp(arg, "--streams") == 0){ sample_query.streams = strtoul(val, NULL, 0); ++i; }
+        else if(strcmp(arg, "--run") == 0){ sample_query.run = atoi(val); ++i; }
+        else if(strcmp(arg, "--raw") == 0){ encoding = SAMPLE_ENCODING_RAW; }
+        else if(strcmp(arg, "--window") == 0){ streams.aggregator.config.window_ms = atoi(val); ++i; }
+        else if(strcmp(arg, "--flash-ms") == 0){ hal::native_set_flash_latency(atoi(val)); ++i; }
+        else if(strcmp(arg, "--inline-store") == 0){ inline_store = true; }
+        else{
+            fprintf(stderr, "Unknown option %s, see the top of src/native/main.cpp\n", arg);
+            return 1;
+        }
+    }
+
+    if(recover_run >= 0){
+        return recover(recover_run, export_path);
+    }
+    if(querying){
+        return query(sample_query, export_path);
+    }
+    if(replay_path){
+        return replay(replay_path, fast, inline_store, export_path);
+    }
+    if(bench){
+        if(config.move_speed_cms <= 0){
+            config.move_speed_cms = 60;
+        }
+        config.fly_cms = config.move_speed_cms;
+        if(!settle_given){
+            config.settle_ms = 1000;
+        }
+    }
+
+    TelloSim sim(config);
+    if(!sim.start()){
+        return 1;
+    }
+    if(sim_only){
+        hal::log("Tello simulator on 127.0.0.1:%d, state to port %d at %.1f Hz\n", config.control_port, config.state_port, config.state_rate_hz);
+        while(1){
+            hal::delay(1000);
+        }
+    }
+
+    /* The simulator already owns port 8889 on this host, so send commands from any free port */
+    tello.ip = "127.0.0.1";
+    tello.control_bind_port = 0;
+    if(!hal::fs_begin() || !hal::sensors_begin() || !tello.bindPorts() || !(poll_state || tello.start_rx_task(6, 0)) ||
+       !tello.start_cmd_engine(8, 1)){
+        hal::log("Setup failed\n");
+        return 1;
+    }
+    if(poll_state){
+        hal::task_create(update_state, "update_state", 10000, NULL, 2, 0);
+    }
+    if(!inline_store){
+        streams.start_storage_task(3, 1);
+    }
+    hal::task_create(sensor_read, "sensor_read", 10000, NULL, 4, 0);
+    if(telemetry_ms){
+        hal::task_create(send_telemetry, "ble_telemetry", 4096, NULL, 1, 1);
+    }
+
+    FlightPlan plan;
+    FlightPlanError err;
+    char default_plan[64];
+    snprintf(default_plan, sizeof(default_plan), "takeoff\nup 75\ndwell %.1f\nland\n", seconds);
+    if(plan_path ? !plan.load(plan_path, &err) : !plan.compile(default_plan, &err)){
+        hal::log("Flight plan: line %u: %s\n", err.line, err.msg);
+        return 1;
+    }
+    if(capture_path){
+        tello.capture = &capture;
+        if(!capture.begin(capture_path)){
+            hal::log("Unable to capture to %s\n", capture_path);
+            return 1;
+        }
+    }
+    print_cmd("command");
+    FlightPlanResult res;
+    if(bench){
+        res = bench_rc(sim);
+    }
+    else{
+        plan.dump();
+        res = run_flight_plan(tello, plan, &streams.altitude, &streams.position, &streams.energy, streams.energy_model.config);
+    }
+
+    /* Hammer the command link with queries to get a round trip distribution */
+    uint32_t start = hal::millis();
+    uint32_t failed = 0;
+    for(int i = 0; i < queries; ++i){
+        TelloCommand c("battery?");
+        if(tello.send_cmd(&c) != TELLO_CMD_OK){
+            ++failed;
+        }
+    }
+    uint32_t query_ms = hal::millis() - start;
+
+    running = false;
+    hal::delay(200);
+    capture.end();
+    streams.end();
+    streams.voxels.save(VOXEL_MAP_PATH);
+    sim.stop();
+
+    TelloStateSnapshot snap = tello.get_state();
+    TelloLinkStats link = tello.get_link_stats();
+    hal::log("\nSimulator: %u cmds, %u replies (%u dropped), %u state packets sent (%u dropped, %u corrupted)\n",
+             sim.stats.cmds.load(), sim.stats.replies.load(), sim.stats.replies_dropped.load(),
+             sim.stats.states.load(), sim.stats.states_dropped.load(), sim.stats.states_corrupted.load());
+    hal::log("State: %u packets published, %u rejected by the parser, last h %d cm, bat %d%%\n",
+             snap.seq, tello.state_errors, snap.state.h, snap.state.bat);
+    if(poll_state){
+        hal::log("State polling: %u wakeups for %u packets\n", poll_wakeups, snap.seq);
+    }
+    else{
+        tello.get_rx_stats().log();
+    }
+    hal::log("Command link: %u sent, %u answered, %u timeouts, %u retries, %u stale, rtt min/avg/max %u/%u/%u us\n",
+             link.sent, link.answered, link.timeouts, link.retries, link.stale, link.rtt_min_us,
+             link.answered ? (uint32_t)(link.rtt_sum_us / link.answered) : 0, link.rtt_max_us);
+    hal::log("Flight plan: %s, %u commands in %u ms\n", res.ok ? "completed" : "aborted", res.cmds, res.elapsed_ms);
+    if(res.rc.ticks){
+        res.rc.log();
+        hal::log("Mission budget: %u waypoints dropped, lowest margin %.1f%%\n", res.waypoints_dropped, res.worst_margin_pct);
+    }
+    EnergyEstimate energy = streams.get_energy();
+    hal::log("Battery: %d%% left (simulator %.1f%%), drain hover/fly/climb %.3f/%.3f/%.3f %%/s from %u drops\n", energy.bat,
+             sim.battery(), energy.rate[ENERGY_HOVER], energy.rate[ENERGY_FLY], energy.rate[ENERGY_CLIMB], energy.drops);
+    hal::log("Queries: %d in %u ms, %u failed\n", queries, query_ms, failed);
+    if(telemetry_ms){
+        telemetry.log();
+    }
+    if(capture_path){
+        hal::log("Capture: %u datagrams, %u bytes in %s, %u dropped\n", capture.packets, capture.bytes, capture_path, capture.dropped);
+    }
+    sensors.print_stats();
+    if(!inline_store){
+        streams.pipe_stats.log();
+    }
+    AltitudeEstimate alt = streams.get_altitude();
+    hal::log("Altitude fusion: last %.1f cm (+-%.1f), %u ToF readings used, %u gated out, longest step %u us, %u over budget\n",
+             alt.alt_cm, alt.alt_std_cm, streams.fusion.tof_used, streams.fusion.tof_rejected, streams.fusion_max_us,
+             streams.fusion_over_budget);
+    hal::log("Log: %u records, %u bytes in %u flash writes, %u commits, %u bytes dropped\n",
+             logger.records, logger.bytes_written, logger.flash_writes, logger.commits, logger.dropped);
+    finish_log(export_path);
+    Position pos = streams.get_position();
+    hal::log("Position: ended at (%.1f, %.1f, %.1f) cm, voxel map of %u cells in %s, %u readings dropped\n",
+             pos.x_cm, pos.y_cm, pos.z_cm, streams.voxels.size(), VOXEL_MAP_PATH, streams.voxels.dropped);
+    hal::log("Aggregation: %u records in, %u kept raw, %u summaries, %u events\n", streams.aggregator.records_in,
+             streams.aggregator.records_kept, streams.aggregator.summaries, streams.aggregator.events);
+    hal::log("Encoding: %s, %u bytes of records stored in %u (%.2fx)\n", encoding == SAMPLE_ENCODING_DELTA ? "delta" : "raw",
+             streams.raw_bytes, logger.bytes_written - (uint32_t)sizeof(SampleLogHeader),
+             streams.raw_bytes / (float)(logger.bytes_written - sizeof(SampleLogHeader)));
+    save_metrics();
+    return 0;
+}
@@ -0,0 +1,365 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Implementation file for the localhost Tello simulator
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include "tello_sim.hpp"
+#include "hal.hpp"
+#include "tello_state_parser.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/* Small, fast PRNG so each thread has its own repeatable stream */
+static uint32_t xorshift(uint32_t* s){
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static bool chance(uint32_t* rng, float p){
+    return p > 0 && (xorshift(rng) >> 8) < p * (1u << 24);
+}
+
+static int open_udp(uint16_t port){
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0){
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    /* Wake up regularly so stop() is noticed */
+    struct timeval tv = {0, 100000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+TelloSim::TelloSim(const TelloSimConfig& config) : config(config), battery_pct(config.battery_pct) {}
+
+TelloSim::~TelloSim(){
+    stop();
+}
+
+bool TelloSim::start(){
+    control_sock = open_udp(config.control_port);
+    state_sock = open_udp(0);
+    if(control_sock < 0 || state_sock < 0){
+        hal::log("TelloSim: unable to open port %d\n", config.control_port);
+        stop();
+        return false;
+    }
+    running = true;
+    control_thread = std::thread(&TelloSim::control_loop, this);
+    if(config.state_rate_hz > 0){
+        state_thread = std::thread(&TelloSim::state_loop, this);
+    }
+    return true;
+}
+
+void TelloSim::stop(){
+    running = false;
+    if(control_thread.joinable()){
+        control_thread.join();
+    }
+    if(state_thread.joinable()){
+        state_thread.join();
+    }
+    if(control_sock >= 0){
+        close(control_sock);
+        control_sock = -1;
+    }
+    if(state_sock >= 0){
+        close(state_sock);
+        state_sock = -1;
+    }
+}
+
+uint32_t TelloSim::latency(uint32_t* rng){
+    return config.latency_ms + (config.jitter_ms ? xorshift(rng) % (config.jitter_ms + 1) : 0);
+}
+
+/* Answer one SDK command the way the drone does. busy_ms is how long the drone takes before replying */
+void TelloSim::handle_cmd(const char* cmd, char* resp, size_t cap, uint32_t* busy_ms){
+    int arg = 0;
+    const char* space = strchr(cmd, ' ');
+    if(space){
+        arg = atoi(space + 1);
+    }
+    size_t word = space ? (size_t)(space - cmd) : strlen(cmd);
+    std::string w(cmd, word);
+    *busy_ms = 0;
+
+    if(w == "command" || w == "streamon" || w == "streamoff" || w == "speed" || w == "emergency"){
+        snprintf(resp, cap, "ok");
+    }
+    else if(w == "takeoff"){
+        flying = true;
+        target_height = 80;
+        takeoff_ms = hal::millis();
+        snprintf(resp, cap, "ok");
+    }
+    else if(w == "land"){
+        flying = false;
+        target_height = 0;
+        snprintf(resp, cap, "ok");
+    }
+    else if(w == "up" || w == "down" || w == "forward" || w == "back" || w == "left" || w == "right" || w == "cw" || w == "ccw"){
+        if(!flying){
+            snprintf(resp, cap, "error Not joystick");
+            return;
+        }
+        if(w == "up"){
+            target_height += arg;
+        }
+        else if(w == "down"){
+            target_height = target_height > arg ? target_height - arg : 0;
+        }
+        else if(w == "forward" || w == "back" || w == "left" || w == "right"){
+            float rad = yaw * (float)M_PI / 180;
+            float fx = cosf(rad), fy = sinf(rad); /* Forward, in the startup frame */
+            float d = w == "back" || w == "left" ? -arg : arg;
+            if(w == "forward" || w == "back"){
+                target_x = target_x + d * fx;
+                target_y = target_y + d * fy;
+            }
+            else{
+                target_x = target_x - d * fy;
+                target_y = target_y + d * fx;
+            }
+        }
+        else if(w == "cw"){
+            yaw = (yaw + arg) % 360;
+        }
+        else if(w == "ccw"){
+            yaw = (yaw - arg) % 360;
+        }
+        if(config.move_speed_cms > 0){
+            *busy_ms = (uint32_t)(arg * 1000 / config.move_speed_cms);
+        }
+        *busy_ms += config.settle_ms;
+        snprintf(resp, cap, "ok");
+    }
+    else if(w == "rc"){
+        /* Never answered, the sticks just take effect */
+        int a = 0, b = 0, c = 0, d = 0;
+        sscanf(cmd, "rc %d %d %d %d", &a, &b, &c, &d);
+        rc_a = a;
+        rc_b = b;
+        rc_c = c;
+        rc_d = d;
+        rc_ms = hal::millis();
+        resp[0] = '\0';
+    }
+    else if(w == "battery?"){
+        snprintf(resp, cap, "%d", (int)battery_pct);
+    }
+    else if(w == "speed?"){
+        snprintf(resp, cap, "100.0");
+    }
+    else if(w == "time?"){
+        snprintf(resp, cap, "%us", flying ? (hal::millis() - takeoff_ms) / 1000 : 0);
+    }
+    else if(w == "height?"){
+        snprintf(resp, cap, "%ddm", height / 10);
+    }
+    else{
+        snprintf(resp, cap, "error");
+    }
+}
+
+void TelloSim::control_loop(){
+    uint32_t rng = config.seed * 2654435761u + 1;
+    char cmd[64];
+    char resp[64];
+
+    while(running){
+        sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(control_sock, cmd, sizeof(cmd) - 1, 0, (sockaddr*)&from, &from_len);
+        if(len <= 0){
+            continue;
+        }
+        cmd[len] = '\0';
+        stats.cmds++;
+
+        uint32_t busy_ms;
+        handle_cmd(cmd, resp, sizeof(resp), &busy_ms);
+        /* The drone only handles one command at a time, so replies can simply be held back in order */
+        if(resp[0] == '\0'){
+            continue;
+        }
+        hal::delay(busy_ms + latency(&rng));
+        if(chance(&rng, config.loss)){
+            stats.replies_dropped++;
+            continue;
+        }
+        sendto(control_sock, resp, strlen(resp), 0, (sockaddr*)&from, from_len);
+        stats.replies++;
+    }
+}
+
+void TelloSim::state_loop(){
+    uint32_t rng = config.seed * 40503u + 7;
+    uint32_t period_us = (uint32_t)(1000000 / config.state_rate_hz);
+    uint32_t next_us = hal::micros();
+
+    sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(config.state_port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* Delay line so latency shifts packets in time without lowering their rate */
+    struct Pending{
+        uint32_t due_us;
+        std::string packet;
+    };
+    std::deque<Pending> pending;
+    char buf[256];
+
+    float h_cm = 0, x_cm = 0, y_cm = 0;
+    float last_h_cm = 0;
+    float vx = 0, vy = 0; /* Horizontal velocity in the startup frame, cm/s */
+    float yaw_f = 0; /* Yaw, kept in float while rc turns the drone a fraction of a degree at a time */
+    uint32_t last_us = next_us;
+    while(running){
+        uint32_t now = hal::micros();
+        float dt = (now - last_us) / 1e6f;
+        last_us = now;
+
+        if(lroundf(yaw_f) != yaw){
+            yaw_f = yaw; /* Turned by cw/ccw */
+        }
+        if(flying && rc_ms && hal::millis() - rc_ms < config.rc_hold_ms){
+            /* Fly by the sticks: the speed eases towards what they ask for, in the drone's own frame */
+            yaw_f += rc_d / 100.0f * config.rc_yaw_dps * dt;
+            yaw_f = fmodf(yaw_f + 540, 360) - 180;
+            yaw = (int)lroundf(yaw_f);
+            float rad = yaw_f * (float)M_PI / 180;
+            float bx = rc_b / 100.0f * config.rc_cms, by = rc_a / 100.0f * config.rc_cms;
+            float k = fminf(1, dt / config.rc_tau_s);
+            vx += (bx * cosf(rad) - by * sinf(rad) - vx) * k;
+            vy += (bx * sinf(rad) + by * cosf(rad) - vy) * k;
+            x_cm += vx * dt;
+            y_cm += vy * dt;
+            h_cm = fmaxf(0, h_cm + rc_c / 100.0f * config.climb_cms * dt);
+            target_x = x_cm;
+            target_y = y_cm;
+            target_height = (int)lroundf(h_cm);
+        }
+        else{
+            /* Fly towards the commanded height */
+            float step = config.climb_cms * dt;
+            int target = target_height;
+            h_cm = h_cm < target ? fminf(h_cm + step, target) : fmaxf(h_cm - step, target);
+
+            /* and towards the commanded position */
+            float dx = target_x - x_cm, dy = target_y - y_cm;
+            float dist = sqrtf(dx * dx + dy * dy);
+            step = config.fly_cms * dt;
+            if(dist > step && dt > 0){
+                vx = dx / dist * config.fly_cms;
+                vy = dy / dist * config.fly_cms;
+                x_cm += dx / dist * step;
+                y_cm += dy / dist * step;
+            }
+            else{
+                vx = vy = 0;
+                x_cm += dx;
+                y_cm += dy;
+            }
+        }
+        /* Drain the battery by how hard the motors work */
+        if(dt > 0){
+            float vz = (h_cm - last_h_cm) / dt;
+            float per_s = flying ? (1 + config.drain_fly * sqrtf(vx * vx + vy * vy) / 100 + config.drain_climb * fabsf(vz) / 100) / config.drain_s_per_pct
+                                 : 1 / config.ground_s_per_pct;
+            battery_pct = fmaxf(0, battery_pct - per_s * dt);
+        }
+        last_h_cm = h_cm;
+
+        /* Let the native BMP3xx see the height */
+        height = (int)h_cm;
+        hal::native_set_height(h_cm);
+
+        if((int32_t)(now - next_us) >= 0){
+            next_us += period_us;
+            float t = now / 1e6f;
+            int h = height;
+            /* Speeds are reported in dm/s in the drone's own frame (x forward, y right), as lib/voxel_map expects */
+            float rad = yaw * (float)M_PI / 180;
+            int vgx = (int)lroundf((vx * cosf(rad) + vy * sinf(rad)) / 10);
+            int vgy = (int)lroundf((-vx * sinf(rad) + vy * cosf(rad)) / 10);
+            TelloState st;
+            st.pitch = (int)(2 * sinf(t));
+            st.roll = (int)(2 * cosf(t));
+            st.yaw = (int)yaw;
+            st.vgx = vgx;
+            st.vgy = vgy;
+            st.templ = 60;
+            st.temph = 63;
+            st.tof = h ? h + 10 : 10;
+            st.h = h;
+            st.bat = (int)battery_pct;
+            st.baro = 4500.0f + h / 100.0f + (int)(xorshift(&rng) % 21 - 10) / 100.0f;
+            st.time = flying ? (int)((hal::millis() - takeoff_ms) / 1000) : 0;
+            st.agx = -2.0f;
+            st.agy = 1.0f;
+            st.agz = -1000.0f + sinf(t) * 5;
+            int len = format_tello_state(st, buf, sizeof(buf));
+
+            if(chance(&rng, config.corrupt)){
+                /* Mangle one value so the packet fails to parse */
+                char* colon = strchr(buf + xorshift(&rng) % (len / 2), ':');
+                if(colon){
+                    colon[1] = 'x';
+                }
+                stats.states_corrupted++;
+            }
+            if(chance(&rng, config.loss)){
+                stats.states_dropped++;
+            }
+            else{
+                pending.push_back({now + latency(&rng) * 1000, std::string(buf, len)});
+            }
+        }
+
+        /* Send whatever is due, jitter can reorder packets just like on the air */
+        for(auto it = pending.begin(); it != pending.end();){
+            if((int32_t)(now - it->due_us) >= 0){
+                sendto(state_sock, it->packet.data(), it->packet.size(), 0, (sockaddr*)&to, sizeof(to));
+                stats.states++;
+                it = pending.erase(it);
+            }
+            else{
+                ++it;
+            }
+        }
+
+        /* Sleep until the next packet is due, or at most 1 ms */
+        uint32_t wait = next_us - hal::micros();
+        if((int32_t)wait > 0){
+            std::this_thread::sleep_for(std::chrono::microseconds(wait < 1000 ? wait : 1000));
+        }
+    }
+}
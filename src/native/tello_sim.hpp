@@ -0,0 +1,91 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Header file for the localhost Tello simulator used by the native build
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Answers SDK commands on 127.0.0.1:8889 like the real drone and streams state packets to
+ * 127.0.0.1:8890, with configurable packet rate, loss, latency and corruption. Movements and rc
+ * setpoints move the simulated drone, which the state packets and the native BMP3xx follow, and the battery
+ * drains faster the faster it flies and climbs.
+*/
+
+#ifndef TELLO_SIM_HPP
+#define TELLO_SIM_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+class TelloSimConfig{
+    public:
+        int control_port = 8889; /* Port the simulator answers commands on */
+        int state_port = 8890; /* Port state packets are sent to */
+        float state_rate_hz = 10; /* The real drone sends about 10 packets a second */
+        float loss = 0; /* Probability a reply or state packet is dropped, 0..1 */
+        float corrupt = 0; /* Probability a state packet has a field mangled, 0..1 */
+        uint32_t latency_ms = 0; /* Added to every reply and state packet */
+        uint32_t jitter_ms = 0; /* Random extra latency, up to this much */
+        float move_speed_cms = 0; /* Movements reply once flown at this speed, 0 replies at once */
+        float climb_cms = 100; /* Vertical speed the drone changes height at */
+        float fly_cms = 100; /* Horizontal speed the drone flies forward/back/left/right at */
+        uint32_t settle_ms = 0; /* Movements reply this much later again, the drone brakes and steadies at the end of each */
+        float rc_cms = 100; /* Horizontal speed at full rc stick */
+        float rc_yaw_dps = 100; /* Yaw rate at full rc stick */
+        float rc_tau_s = 0.3f; /* Time constant the speed follows the rc sticks with */
+        uint32_t rc_hold_ms = 500; /* The drone hovers once it has had no rc setpoint for this long */
+        float battery_pct = 100; /* Charge at startup */
+        float drain_s_per_pct = 6; /* Hovering, the battery loses 1% every this many seconds */
+        float drain_fly = 0.15f; /* and drains faster by this fraction of that per 100 cm/s flown horizontally */
+        float drain_climb = 0.6f; /* and by this fraction per 100 cm/s climbed or descended */
+        float ground_s_per_pct = 60; /* On the ground it loses 1% every this many seconds */
+        uint32_t seed = 1;
+};
+
+class TelloSimStats{
+    public:
+        std::atomic<uint32_t> cmds{0}; /* Commands received */
+        std::atomic<uint32_t> replies{0}; /* Replies sent */
+        std::atomic<uint32_t> replies_dropped{0};
+        std::atomic<uint32_t> states{0}; /* State packets sent */
+        std::atomic<uint32_t> states_dropped{0};
+        std::atomic<uint32_t> states_corrupted{0};
+};
+
+class TelloSim{
+    public:
+        TelloSim(const TelloSimConfig& config);
+        ~TelloSim();
+
+        bool start();
+        void stop();
+        /* Charge left, % */
+        float battery() const { return battery_pct; }
+
+        TelloSimConfig config;
+        TelloSimStats stats;
+
+    private:
+        int control_sock = -1;
+        int state_sock = -1;
+        std::atomic<bool> running{false};
+        std::thread control_thread, state_thread;
+
+        /* Simulated flight, shared between the two threads */
+        std::atomic<bool> flying{false};
+        std::atomic<int> height{0}; /* cm, follows target_height at climb_cms */
+        std::atomic<int> target_height{0};
+        std::atomic<int> yaw{0}; /* Degrees clockwise from the heading at startup */
+        /* Where forward/back/left/right sent the drone, in cm, x along the startup heading and y to its right */
+        std::atomic<float> target_x{0}, target_y{0};
+        std::atomic<uint32_t> takeoff_ms{0};
+        /* Last rc setpoint, and when it arrived */
+        std::atomic<int> rc_a{0}, rc_b{0}, rc_c{0}, rc_d{0};
+        std::atomic<uint32_t> rc_ms{0}; /* 0 before the first */
+        std::atomic<float> battery_pct{100}; /* Drains with how hard the drone works, see TelloSimConfig */
+
+        void control_loop();
+        void state_loop();
+        void handle_cmd(const char* cmd, char* resp, size_t cap, uint32_t* busy_ms);
+        uint32_t latency(uint32_t* rng);
+};
+
+#endif // TELLO_SIM_HPP
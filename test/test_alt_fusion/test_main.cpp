@@ -0,0 +1,376 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the altitude fusion (lib/alt_fusion), and a tool to replay a sample log through it and benchmark it
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Run as a test ("pio test -e native -f test_alt_fusion"), a synthetic flight is turned into BMP3xx and Tello
+ * records and replayed through the filter, and the fused altitude is checked against the height flown.
+ * As a tool, build it optimised (from the repository root):
+ *   g++ -O2 -I lib/sample_record -I lib/littlefs_io -I lib/alt_fusion -I <unity> test/test_alt_fusion/test_main.cpp \
+ *       lib/sample_record/sample_record.cpp lib/littlefs_io/delta_codec.cpp lib/alt_fusion/alt_fusion.cpp \
+ *       <unity>/unity.c -o replay_altitude
+ * where <unity> is Unity's src/ directory (PlatformIO keeps a copy under .pio/libdeps/native/Unity/src).
+ * Usage:
+ *   ./replay_altitude data.bin [out.csv] [--check TOL_CM]
+ *   ./replay_altitude --bench [STEPS]
+ * The log needs raw BMP3xx and Tello records (e.g. from the native build with --window 0). The BMP3xx and Tello
+ * readings are fed through the same filter the drone runs, at the times the drone stepped it (taken from the
+ * logged altitude records, or every ALT_FUSION_PERIOD_MS without them), and the result goes to out.csv.
+ * With --check, exits with 1 if the replay strays more than TOL_CM from the altitude the drone logged, so
+ * changes to the filter can be checked against recorded flights.
+ * --bench times the filter alone on synthetic readings.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <unity.h>
+#include "sample_record.hpp"
+#include "delta_codec.hpp"
+#include "alt_fusion.hpp"
+
+typedef std::vector<std::vector<uint8_t>> Records;
+
+/* Raw records of the log, in file order */
+static bool read_log(const char *path, Records &recs){
+    FILE *in = fopen(path, "rb");
+    if(!in){
+        perror(path);
+        return false;
+    }
+    SampleLogHeader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || !sample_check_header(&hdr)){
+        fprintf(stderr, "%s: not a schema %d sample log\n", path, SAMPLE_SCHEMA_ID);
+        fclose(in);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0){
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    DeltaDecoder decoder;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    size_t pos = 0, len;
+    while(pos < data.size()){
+        int used;
+        if(hdr.encoding == SAMPLE_ENCODING_DELTA){
+            used = decoder.decode(data.data() + pos, data.size() - pos, pos + sizeof(hdr), rec, &len);
+        }
+        else{
+            len = sample_record_size(data[pos]);
+            used = len && pos + len <= data.size() ? (int)len : -1;
+            if(used > 0){
+                memcpy(rec, data.data() + pos, len);
+            }
+        }
+        if(used <= 0){
+            fprintf(stderr, "%s: stopped at a bad or cut off record at offset %lu\n", path, (unsigned long)(pos + sizeof(hdr)));
+            break;
+        }
+        pos += used;
+        if(len){
+            recs.push_back(std::vector<uint8_t>(rec, rec + len));
+        }
+    }
+    return true;
+}
+
+static uint32_t uptime_of(const std::vector<uint8_t> &rec){
+    SampleRecordHeader h;
+    memcpy(&h, rec.data(), sizeof(h));
+    return h.uptime;
+}
+
+/* Step fusion at every uptime in steps with the BMP3xx and Tello readings taken up to it, Tello records in uptime
+ * order. Returns the estimate after each step */
+static std::vector<AltitudeEstimate> replay(AltitudeFusion &fusion, const Records &bmp, const Records &tello,
+                                            const std::vector<uint32_t> &steps){
+    std::vector<AltitudeEstimate> est;
+    size_t b = 0, t = 0;
+    for(size_t i = 0; i < steps.size(); ++i){
+        AltitudeInputs in;
+        /* Every reading taken up to this step, the filter only uses the latest of each */
+        while(b < bmp.size() && (int32_t)(uptime_of(bmp[b]) - steps[i]) <= 0){
+            Bmp3xxRecord r;
+            memcpy(&r, bmp[b++].data(), sizeof(r));
+            in.bmp = true;
+            in.pres_pa = r.pres;
+        }
+        while(t < tello.size() && (int32_t)(uptime_of(tello[t]) - steps[i]) <= 0){
+            TelloRecord r;
+            memcpy(&r, tello[t++].data(), sizeof(r));
+            in.tello = true;
+            in.tof_cm = r.tof;
+            in.h_cm = r.h;
+            in.baro = r.baro / 100.0f;
+        }
+        est.push_back(fusion.step(steps[i], in));
+    }
+    return est;
+}
+
+static int bench(long steps){
+    AltitudeFusion fusion;
+    AltitudeInputs in;
+    uint32_t now = 0;
+    /* A minute on the ground, then climb: the ground path is cheaper and would flatter the numbers */
+    for(int i = 0; i < 3000; ++i, now += ALT_FUSION_PERIOD_MS){
+        in.bmp = true;
+        in.pres_pa = 101300;
+        in.tello = i % 5 == 0;
+        fusion.step(now, in);
+    }
+    float sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(long i = 0; i < steps; ++i, now += ALT_FUSION_PERIOD_MS){
+        float h = (i % 10000) * 0.02f;
+        in.bmp = true;
+        in.pres_pa = 101300 - 0.12f * h + (i % 7) - 3;
+        in.tello = i % 5 == 0;
+        in.h_cm = in.tof_cm = (int)h + 10;
+        in.baro = 4500 + h / 100;
+        sink += fusion.step(now, in).alt_cm;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / steps;
+    printf("%ld steps, %.1f ns per step (%.4f%% of a %d ms period), mean altitude %.1f cm\n", steps, ns,
+           ns / (ALT_FUSION_PERIOD_MS * 1e4), ALT_FUSION_PERIOD_MS, sink / steps);
+    return 0;
+}
+
+static int replay_log(int argc, char **argv){
+    const char *in_path = NULL, *out_path = NULL;
+    float tol = -1;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--bench") == 0){
+            return bench(i + 1 < argc ? atol(argv[i + 1]) : 10000000);
+        }
+        else if(strcmp(argv[i], "--check") == 0 && i + 1 < argc){
+            tol = atof(argv[++i]);
+        }
+        else if(!in_path){
+            in_path = argv[i];
+        }
+        else{
+            out_path = argv[i];
+        }
+    }
+    if(!in_path){
+        fprintf(stderr, "Usage: %s <log.bin> [out.csv] [--check TOL_CM]\n       %s --bench [STEPS]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    Records recs;
+    if(!read_log(in_path, recs)){
+        return 1;
+    }
+
+    /* Split the streams, each ordered by uptime (Tello records are stamped with their arrival, which can lag the file order) */
+    Records bmp, tello, logged;
+    for(const auto &r : recs){
+        switch(r[0]){
+            case SAMPLE_STREAM_BMP3XX: bmp.push_back(r); break;
+            case SAMPLE_STREAM_TELLO: tello.push_back(r); break;
+            case SAMPLE_STREAM_ALTITUDE: logged.push_back(r); break;
+        }
+    }
+    auto by_uptime = [](const std::vector<uint8_t> &a, const std::vector<uint8_t> &b){ return (int32_t)(uptime_of(a) - uptime_of(b)) < 0; };
+    std::stable_sort(tello.begin(), tello.end(), by_uptime);
+    if(bmp.empty() || tello.empty()){
+        fprintf(stderr, "%s: needs raw BMP3xx and Tello records, %lu and %lu found\n", in_path, (unsigned long)bmp.size(), (unsigned long)tello.size());
+        return 1;
+    }
+
+    std::vector<uint32_t> steps;
+    if(logged.size()){
+        for(const auto &r : logged){
+            steps.push_back(uptime_of(r));
+        }
+    }
+    else{
+        uint32_t end = uptime_of(bmp.back());
+        for(uint32_t t = uptime_of(bmp.front()); (int32_t)(t - end) <= 0; t += ALT_FUSION_PERIOD_MS){
+            steps.push_back(t);
+        }
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : NULL;
+    if(out_path && !out){
+        perror(out_path);
+        return 1;
+    }
+    if(out){
+        fprintf(out, "Uptime (ms),Replayed Altitude (cm),Replayed Vertical Velocity (cm/s),Replayed Std Dev (cm)%s\n",
+                logged.size() ? ",Logged Altitude (cm)" : "");
+    }
+
+    AltitudeFusion fusion;
+    std::vector<AltitudeEstimate> est = replay(fusion, bmp, tello, steps);
+    float max_err = 0;
+    uint32_t max_err_at = 0;
+    for(size_t i = 0; i < steps.size(); ++i){
+        float logged_cm = 0;
+        if(logged.size()){
+            AltitudeRecord r;
+            memcpy(&r, logged[i].data(), sizeof(r));
+            logged_cm = r.alt / 10.0f;
+            if(fabsf(est[i].alt_cm - logged_cm) > max_err){
+                max_err = fabsf(est[i].alt_cm - logged_cm);
+                max_err_at = steps[i];
+            }
+        }
+        if(out){
+            fprintf(out, "%lu,%.1f,%.1f,%.1f", (unsigned long)steps[i], est[i].alt_cm, est[i].vz_cms, est[i].alt_std_cm);
+            if(logged.size()){
+                fprintf(out, ",%.1f", logged_cm);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    if(out){
+        fclose(out);
+    }
+
+    fprintf(stderr, "Replayed %lu steps from %lu BMP3xx and %lu Tello records, %u ToF readings used, %u gated out\n",
+            (unsigned long)steps.size(), (unsigned long)bmp.size(), (unsigned long)tello.size(), fusion.tof_used, fusion.tof_rejected);
+    if(logged.size()){
+        fprintf(stderr, "Largest difference from the logged altitude: %.1f cm at %lu ms\n", max_err, (unsigned long)max_err_at);
+        if(tol >= 0 && max_err > tol){
+            fprintf(stderr, "FAIL: more than %.1f cm\n", tol);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Tests ---------------------------------------------------------------------------------------------------------------------- */
+
+#define FLIGHT_TAKEOFF_MS 3000
+#define FLIGHT_HOVER_MS 6000   /* Climbed to FLIGHT_HOVER_CM at 50 cm/s */
+#define FLIGHT_DESCEND_MS 12000
+#define FLIGHT_LANDED_MS 15000
+#define FLIGHT_END_MS 16000
+#define FLIGHT_HOVER_CM 150
+
+static Records bmp, tello;
+static std::vector<uint32_t> steps;
+static std::vector<float> truth; /* Height flown at each step */
+
+static float height_at(uint32_t ms){
+    if(ms < FLIGHT_TAKEOFF_MS || ms >= FLIGHT_LANDED_MS){
+        return 0;
+    }
+    if(ms < FLIGHT_HOVER_MS){
+        return (ms - FLIGHT_TAKEOFF_MS) * 0.05f;
+    }
+    if(ms < FLIGHT_DESCEND_MS){
+        return FLIGHT_HOVER_CM;
+    }
+    return FLIGHT_HOVER_CM - (ms - FLIGHT_DESCEND_MS) * 0.05f;
+}
+
+/* Records of a flight as the drone logs them: the BMP3xx at 50 Hz with a few Pa of noise, the Tello at 10 Hz.
+ * While the ToF is over an obstacle between hide_from and hide_to ms, it reads obstacle_cm less */
+static void synthetic_flight(uint32_t hide_from = 0, uint32_t hide_to = 0, int obstacle_cm = 0){
+    uint32_t rng = 1;
+    bmp.clear();
+    tello.clear();
+    steps.clear();
+    truth.clear();
+    for(uint32_t ms = 0; ms < FLIGHT_END_MS; ms += ALT_FUSION_PERIOD_MS){
+        float h = height_at(ms);
+        rng = rng * 1103515245 + 12345;
+        Bmp3xxRecord b = {{SAMPLE_STREAM_BMP3XX, ms}, 2000, (uint32_t)lroundf(101300 - 0.12f * h + (int)((rng >> 16) % 7) - 3), 0};
+        bmp.push_back(std::vector<uint8_t>((uint8_t *)&b, (uint8_t *)&b + sizeof(b)));
+        if(ms % 100 == 0){
+            TelloRecord t;
+            memset(&t, 0, sizeof(t));
+            t.hdr.stream = SAMPLE_STREAM_TELLO;
+            t.hdr.uptime = ms;
+            t.h = (int16_t)lroundf(h);
+            t.tof = (int16_t)lroundf(h) + 10 - (ms >= hide_from && ms < hide_to ? obstacle_cm : 0);
+            t.baro = (int32_t)lroundf((4500 + h / 100) * 100);
+            tello.push_back(std::vector<uint8_t>((uint8_t *)&t, (uint8_t *)&t + sizeof(t)));
+        }
+        /* Steps run just after the readings, as on the drone */
+        steps.push_back(ms + 5);
+        truth.push_back(h);
+    }
+}
+
+void setUp(){}
+void tearDown(){}
+
+/* On the ground the estimate stays at 0 while the references settle */
+void test_ground_calibration(){
+    synthetic_flight();
+    AltitudeFusion fusion;
+    std::vector<AltitudeEstimate> est = replay(fusion, bmp, tello, steps);
+    for(size_t i = 0; steps[i] < FLIGHT_TAKEOFF_MS; ++i){
+        TEST_ASSERT_TRUE(est[i].grounded);
+        TEST_ASSERT_EQUAL(0, est[i].alt_cm);
+        TEST_ASSERT_EQUAL(i + 1, est[i].seq);
+    }
+    TEST_ASSERT_FALSE(est[0].calibrated);
+    TEST_ASSERT_TRUE(est[FLIGHT_TAKEOFF_MS / ALT_FUSION_PERIOD_MS - 1].calibrated);
+}
+
+/* The fused altitude follows the height flown through the climb, the hover and the descent */
+void test_replay_tracks_flight(){
+    synthetic_flight();
+    AltitudeFusion fusion;
+    std::vector<AltitudeEstimate> est = replay(fusion, bmp, tello, steps);
+    float worst = 0, worst_hover = 0, climb_vz = 0, hover_vz = 0;
+    int climb_n = 0, hover_n = 0;
+    for(size_t i = 0; i < est.size(); ++i){
+        float err = fabsf(est[i].alt_cm - truth[i]);
+        worst = err > worst ? err : worst;
+        if(steps[i] >= FLIGHT_TAKEOFF_MS + 1000 && steps[i] < FLIGHT_HOVER_MS){
+            climb_vz += est[i].vz_cms;
+            climb_n++;
+        }
+        if(steps[i] >= FLIGHT_HOVER_MS + 1000 && steps[i] < FLIGHT_DESCEND_MS){
+            worst_hover = err > worst_hover ? err : worst_hover;
+            hover_vz += est[i].vz_cms;
+            hover_n++;
+        }
+    }
+    TEST_ASSERT_LESS_THAN(10, worst);
+    TEST_ASSERT_LESS_THAN(5, worst_hover);
+    TEST_ASSERT_FLOAT_WITHIN(5, 50, climb_vz / climb_n);
+    TEST_ASSERT_FLOAT_WITHIN(3, 0, hover_vz / hover_n);
+    TEST_ASSERT_GREATER_THAN(0, fusion.tof_used);
+    TEST_ASSERT_EQUAL(0, fusion.tof_rejected);
+    TEST_ASSERT_TRUE(est.back().grounded);
+    TEST_ASSERT_EQUAL(0, est.back().alt_cm);
+}
+
+/* Flying over something tall, the ToF readings jump and are gated out while the baros hold the altitude */
+void test_tof_obstacle_gated(){
+    synthetic_flight(8000, 9000, 100);
+    AltitudeFusion fusion;
+    std::vector<AltitudeEstimate> est = replay(fusion, bmp, tello, steps);
+    TEST_ASSERT_EQUAL(10, fusion.tof_rejected);
+    for(size_t i = 0; i < est.size(); ++i){
+        if(steps[i] >= FLIGHT_HOVER_MS + 1000 && steps[i] < FLIGHT_DESCEND_MS){
+            TEST_ASSERT_FLOAT_WITHIN(10, FLIGHT_HOVER_CM, est[i].alt_cm);
+        }
+    }
+}
+
+int main(int argc, char **argv){
+    if(argc > 1){
+        return strcmp(argv[1], "--bench") == 0 ? bench(argc > 2 ? atol(argv[2]) : 10000000) : replay_log(argc, argv);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_ground_calibration);
+    RUN_TEST(test_replay_tracks_flight);
+    RUN_TEST(test_tof_obstacle_gated);
+    return UNITY_END();
+}
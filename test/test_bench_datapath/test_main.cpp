@@ -0,0 +1,520 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Host-side benchmark of the data path: state parsing, csv formatting, log encoding, chunked reads and BLE framing
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Run as a test ("pio test -e native -f test_bench_datapath"), every benchmark runs briefly on synthetic readings
+ * and must consume its input without allocating. For timings, build it optimised (from the repository root):
+ *   g++ -O2 -I lib/hal -I lib/tello_ctrl -I lib/sample_record -I lib/littlefs_io -I lib/crc32 -I lib/metrics -I <unity> \
+ *       test/test_bench_datapath/test_main.cpp lib/tello_ctrl/tello_state_parser.cpp lib/sample_record/sample_record.cpp \
+ *       lib/littlefs_io/delta_codec.cpp lib/littlefs_io/log_writer.cpp lib/littlefs_io/log_journal.cpp lib/crc32/crc32.cpp \
+ *       lib/metrics/metrics.cpp lib/hal/hal_native.cpp <unity>/unity.c -lpthread -o bench_datapath
+ * where <unity> is Unity's src/ directory (PlatformIO keeps a copy under .pio/libdeps/native/Unity/src).
+ * Add -DECODRONE_METRICS=0 to leave the hot path instrumentation (lib/metrics) out of the timings.
+ * Usage:
+ *   ./bench_datapath --bench [--log data.bin] [--min-ms MS] [--reps N] [--compare old.csv [--tolerance FRAC]] > new.csv
+ * Every benchmark runs the code the drone runs on the same inputs: synthetic readings by default, or the records
+ * of a log (e.g. one offloaded from a flight, or from the native build with --window 0) with --log, the Tello
+ * records of which are turned back into state packets. Each is repeated reps times for at least min-ms (default
+ * 5 times 200 ms) and the fastest repetition is kept, the one least disturbed by the rest of the computer.
+ *
+ * Results go to stdout as csv, one row per benchmark:
+ *   bench,ops,ns_per_op,alloc_bytes_per_op,allocs_per_op,bytes_per_op,mb_per_s
+ * where bytes_per_op is what one op consumes (a state packet, a raw record, a file chunk...) and allocations are
+ * counted through operator new. With --compare, each benchmark is also checked against the ns_per_op and
+ * allocations of an earlier run, and the tool exits with 1 if any got slower by more than tolerance (default 0.15)
+ * or allocates more, so firmware versions can be compared on the same computer.
+ *
+ * The file benchmarks write a scratch file under native_fs/, as the native build does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <unity.h>
+#include "hal.hpp"
+#include "tello_state_parser.hpp"
+#include "sample_record.hpp"
+#include "delta_codec.hpp"
+#include "log_writer.hpp"
+#include "crc32.hpp"
+
+#define BENCH_FILE "/bench_chunks.bin"
+#define BENCH_FILE_SIZE (256 * 1024)
+#define BENCH_ARENA 256 /* Arena loop() dumps the log through */
+#define BENCH_BLE_MTU 247 /* A typical negotiated ATT MTU, see BLE_XFER_MTU */
+#define BENCH_BLE_DATA_HDR_LEN 7 /* BLE_XFER_DATA_HDR_LEN, ble_comms.hpp needs the ESP32 BLE stack */
+
+/* Allocation counting -------------------------------------------------------------------------------------------------------- */
+
+static size_t alloc_count = 0, alloc_bytes = 0;
+
+void *operator new(size_t size){
+    alloc_count++;
+    alloc_bytes += size;
+    void *p = malloc(size ? size : 1);
+    if(!p){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size){
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept{
+    free(p);
+}
+
+/* Inputs --------------------------------------------------------------------------------------------------------------------- */
+
+static std::vector<std::vector<uint8_t>> records; /* Raw records, every stream */
+static std::vector<std::string> states; /* State packets as the Tello sends them */
+
+/* A state packet in the Tello's format, from a logged or synthetic Tello record */
+static std::string format_state(const TelloRecord &r){
+    TelloState st;
+#define STATE_FROM_RECORD(id, key, state, rec, dec, label, unit) st.key = (state)r.key / tello_pow10(dec);
+    TELLO_FIELDS(STATE_FROM_RECORD)
+#undef STATE_FROM_RECORD
+    char buf[TELLO_STATE_MAX_LEN];
+    int len = format_tello_state(st, buf, sizeof(buf));
+    return std::string(buf, len);
+}
+
+template <typename T>
+static void add_record(const T &rec){
+    const uint8_t *p = (const uint8_t *)&rec;
+    records.push_back(std::vector<uint8_t>(p, p + sizeof(rec)));
+}
+
+/* A minute of flight at the rates the drone samples at: BMP3xx and altitude at 50 Hz, Tello and position at 10 Hz,
+ * SCD4x every 5 s */
+static void synthetic_inputs(){
+    uint32_t rng = 1;
+    for(uint32_t ms = 0; ms < 60000; ms += 20){
+        rng = rng * 1103515245 + 12345;
+        int noise = (int)(rng >> 16) % 7 - 3;
+        int h = ms / 300;
+
+        Bmp3xxRecord bmp;
+        bmp.hdr.stream = SAMPLE_STREAM_BMP3XX;
+        bmp.hdr.uptime = ms;
+        bmp.temp = 2150 + noise;
+        bmp.pres = 101300 - h * 12 / 100 + noise;
+        bmp.alt = 1200 + h + noise;
+        add_record(bmp);
+
+        AltitudeRecord alt;
+        alt.hdr.stream = SAMPLE_STREAM_ALTITUDE;
+        alt.hdr.uptime = ms;
+        alt.alt = h * 10 + noise;
+        alt.vz = 33 + noise;
+        alt.stddev = 40;
+        add_record(alt);
+
+        if(ms % 100 == 0){
+            TelloRecord t;
+            memset(&t, 0, sizeof(t));
+            t.hdr.stream = SAMPLE_STREAM_TELLO;
+            t.hdr.uptime = ms;
+            t.pitch = noise;
+            t.roll = -noise;
+            t.yaw = (ms / 1000) % 360 - 180;
+            t.vgx = 5;
+            t.vgy = noise;
+            t.templ = 60;
+            t.temph = 63;
+            t.tof = h + 10;
+            t.h = h;
+            t.bat = 100 - ms / 6000;
+            t.baro = 450000 + h * 100 + noise;
+            t.time = ms / 1000;
+            t.agx = -2;
+            t.agy = 1;
+            t.agz = -1000 + noise;
+            add_record(t);
+            states.push_back(format_state(t));
+
+            PositionRecord pos;
+            pos.hdr.stream = SAMPLE_STREAM_POSITION;
+            pos.hdr.uptime = ms;
+            pos.x = ms / 2;
+            pos.y = noise;
+            pos.z = h * 10;
+            add_record(pos);
+        }
+        if(ms % 5000 == 0){
+            Scd4xRecord scd;
+            scd.hdr.stream = SAMPLE_STREAM_SCD4X;
+            scd.hdr.uptime = ms;
+            scd.co2 = 420 + noise;
+            scd.temp = 2200;
+            scd.humd = 4500;
+            add_record(scd);
+        }
+    }
+}
+
+/* Raw records of a log, whichever way it is encoded */
+static bool log_inputs(const char *path){
+    FILE *in = fopen(path, "rb");
+    if(!in){
+        perror(path);
+        return false;
+    }
+    SampleLogHeader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || !sample_check_header(&hdr)){
+        fprintf(stderr, "%s: not a schema %d sample log\n", path, SAMPLE_SCHEMA_ID);
+        fclose(in);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0){
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    DeltaDecoder decoder;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    size_t pos = 0, len;
+    while(pos < data.size()){
+        int used;
+        if(hdr.encoding == SAMPLE_ENCODING_DELTA){
+            used = decoder.decode(data.data() + pos, data.size() - pos, pos + sizeof(hdr), rec, &len);
+        }
+        else{
+            len = sample_record_size(data[pos]);
+            used = len && pos + len <= data.size() ? (int)len : -1;
+            if(used > 0){
+                memcpy(rec, data.data() + pos, len);
+            }
+        }
+        if(used <= 0){
+            break;
+        }
+        pos += used;
+        if(len){
+            records.push_back(std::vector<uint8_t>(rec, rec + len));
+            if(rec[0] == SAMPLE_STREAM_TELLO){
+                TelloRecord t;
+                memcpy(&t, rec, sizeof(t));
+                states.push_back(format_state(t));
+            }
+        }
+    }
+    if(records.empty() || states.empty()){
+        fprintf(stderr, "%s: needs raw Tello records and at least one other stream (log with --window 0)\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* Benchmarks ----------------------------------------------------------------------------------------------------------------- */
+
+/* One benchmark: setup runs untimed before every repetition, op(i) runs the i-th operation and returns the bytes it consumed */
+class Bench{
+    public:
+        const char *name;
+        void (*setup)();
+        size_t (*op)(size_t i);
+};
+
+class BenchResult{
+    public:
+        std::string name;
+        long ops = 0;
+        double ns_per_op = 0;
+        double alloc_bytes_per_op = 0;
+        double allocs_per_op = 0;
+        double bytes_per_op = 0;
+};
+
+static volatile size_t sink; /* Keeps the compiler from dropping results */
+
+static size_t op_parse_state(size_t i){
+    const std::string &s = states[i % states.size()];
+    TelloState st;
+    TelloParseResult res = parse_tello_state(s.data(), s.size(), &st);
+    sink += res.ok() + (size_t)st.h;
+    return s.size();
+}
+
+static size_t op_format_csv(size_t i){
+    const std::vector<uint8_t> &r = records[i % records.size()];
+    char line[160];
+    sink += sample_format_csv(r.data(), line, sizeof(line));
+    return r.size();
+}
+
+static DeltaEncoder encoder;
+static uint8_t encoded[DELTA_MAX_ENCODED];
+
+static void setup_encode(){
+    encoder.reset(sizeof(SampleLogHeader));
+}
+
+static size_t op_delta_encode(size_t i){
+    const std::vector<uint8_t> &r = records[i % records.size()];
+    sink += encoder.encode(r.data(), encoded);
+    return r.size();
+}
+
+static uint8_t arena[BENCH_ARENA];
+static FileChunkReader chunk_reader(arena, sizeof(arena));
+
+/* Reopen at the start, as loop() does every pass */
+static void setup_chunks(){
+    chunk_reader.close();
+    chunk_reader.open(BENCH_FILE, 0);
+}
+
+/* One chunk of a log dump, wrapping around at the end of the file */
+static size_t op_file_chunk(size_t i){
+    const uint8_t *data;
+    size_t n = chunk_reader.next(&data);
+    if(n == 0){
+        chunk_reader.seek(0);
+        n = chunk_reader.next(&data);
+    }
+    sink += data[0];
+    return n;
+}
+
+/* The data frame loop of sendFileOverBLE() without the radio: read a chunk behind the frame header, fill the
+ * header in and fold the payload into the CRC */
+static uint8_t frame[BENCH_BLE_MTU - 3];
+static FileChunkReader frame_reader(frame + BENCH_BLE_DATA_HDR_LEN, sizeof(frame) - BENCH_BLE_DATA_HDR_LEN);
+static uint16_t frame_seq;
+static uint32_t frame_crc;
+
+static void setup_frames(){
+    frame_reader.close();
+    frame_reader.open(BENCH_FILE, 0);
+    frame_reader.setChunkSize(sizeof(frame) - BENCH_BLE_DATA_HDR_LEN);
+    frame_seq = 0;
+    frame_crc = 0;
+}
+
+static size_t op_ble_frame(size_t i){
+    const uint8_t *data;
+    uint32_t offset = frame_reader.position();
+    size_t n = frame_reader.next(&data);
+    if(n == 0){
+        frame_reader.seek(0);
+        offset = 0;
+        frame_crc = 0;
+        n = frame_reader.next(&data);
+    }
+    frame[0] = 'D';
+    memcpy(frame + 1, &frame_seq, 2);
+    memcpy(frame + 3, &offset, 4);
+    frame_seq++;
+    frame_crc = crc32_update(frame_crc, data, n);
+    sink += frame_crc;
+    return n;
+}
+
+static const Bench benches[] = {
+    {"tello_state_parse", NULL, op_parse_state},
+    {"sample_csv_format", NULL, op_format_csv},
+    {"delta_encode", setup_encode, op_delta_encode},
+    {"file_chunk_read", setup_chunks, op_file_chunk},
+    {"ble_data_frame", setup_frames, op_ble_frame},
+};
+
+static BenchResult run(const Bench &b, int reps, double min_ms){
+    BenchResult best;
+    best.name = b.name;
+    for(int r = 0; r < reps; ++r){
+        if(b.setup){
+            b.setup();
+        }
+        size_t count0 = alloc_count, bytes0 = alloc_bytes;
+        size_t bytes = 0;
+        long ops = 0, batch = 64;
+        double elapsed_ms = 0;
+        auto start = std::chrono::steady_clock::now();
+        /* Check the clock every batch of ops rather than every op */
+        while(elapsed_ms < min_ms){
+            for(long i = 0; i < batch; ++i, ++ops){
+                bytes += b.op(ops);
+            }
+            elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            batch = batch < (1 << 16) ? batch * 2 : batch;
+        }
+        double ns = elapsed_ms * 1e6 / ops;
+        if(r == 0 || ns < best.ns_per_op){
+            best.ops = ops;
+            best.ns_per_op = ns;
+            best.alloc_bytes_per_op = (double)(alloc_bytes - bytes0) / ops;
+            best.allocs_per_op = (double)(alloc_count - count0) / ops;
+            best.bytes_per_op = (double)bytes / ops;
+        }
+    }
+    return best;
+}
+
+/* Regression check ----------------------------------------------------------------------------------------------------------- */
+
+/* Compare against an earlier run's csv, returns false if anything regressed */
+static bool compare(const char *path, const std::vector<BenchResult> &results, double tolerance){
+    FILE *in = fopen(path, "r");
+    if(!in){
+        perror(path);
+        return false;
+    }
+    bool ok = true;
+    char line[256], name[64];
+    long ops;
+    double ns, alloc_bytes_op, allocs_op;
+    while(fgets(line, sizeof(line), in)){
+        if(sscanf(line, "%63[^,],%ld,%lf,%lf,%lf", name, &ops, &ns, &alloc_bytes_op, &allocs_op) != 5){
+            continue; /* The header */
+        }
+        for(const BenchResult &r : results){
+            if(r.name != name){
+                continue;
+            }
+            double change = r.ns_per_op / ns - 1;
+            bool slower = change > tolerance, allocs = r.allocs_per_op > allocs_op;
+            fprintf(stderr, "%-18s %8.1f -> %8.1f ns/op (%+5.1f%%)%s%s\n", name, ns, r.ns_per_op, change * 100,
+                    slower ? "  SLOWER" : "", allocs ? "  ALLOCATES MORE" : "");
+            ok = ok && !slower && !allocs;
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+/* Write the log-sized scratch file the chunked reads go through */
+static bool write_scratch(){
+    if(!hal::fs_begin()){
+        fprintf(stderr, "Unable to open native_fs/\n");
+        return false;
+    }
+    hal::File f;
+    if(!f.open(BENCH_FILE, "w")){
+        fprintf(stderr, "Unable to write native_fs%s\n", BENCH_FILE);
+        return false;
+    }
+    for(size_t n = 0; n < BENCH_FILE_SIZE; ){
+        const std::vector<uint8_t> &r = records[n % records.size()];
+        n += f.write(r.data(), r.size());
+    }
+    f.close();
+    return true;
+}
+
+static void remove_scratch(){
+    chunk_reader.close();
+    frame_reader.close();
+    hal::file_remove(BENCH_FILE);
+}
+
+static int bench(int argc, char **argv){
+    const char *log_path = NULL, *baseline = NULL;
+    double min_ms = 200, tolerance = 0.15;
+    int reps = 5;
+    for(int i = 2; i < argc; ++i){
+        if(strcmp(argv[i], "--log") == 0 && i + 1 < argc){
+            log_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc){
+            min_ms = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--reps") == 0 && i + 1 < argc){
+            reps = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--compare") == 0 && i + 1 < argc){
+            baseline = argv[++i];
+        }
+        else if(strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc){
+            tolerance = atof(argv[++i]);
+        }
+        else{
+            fprintf(stderr, "Usage: %s --bench [--log data.bin] [--min-ms MS] [--reps N] [--compare old.csv [--tolerance FRAC]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(log_path == NULL){
+        synthetic_inputs();
+    }
+    else if(!log_inputs(log_path)){
+        return 1;
+    }
+    if(!write_scratch()){
+        return 1;
+    }
+    fprintf(stderr, "%zu records, %zu state packets from %s\n", records.size(), states.size(), log_path ? log_path : "synthetic inputs");
+
+    std::vector<BenchResult> results;
+    printf("bench,ops,ns_per_op,alloc_bytes_per_op,allocs_per_op,bytes_per_op,mb_per_s\n");
+    for(const Bench &b : benches){
+        BenchResult r = run(b, reps, min_ms);
+        printf("%s,%ld,%.2f,%.2f,%.3f,%.1f,%.1f\n", r.name.c_str(), r.ops, r.ns_per_op, r.alloc_bytes_per_op, r.allocs_per_op,
+               r.bytes_per_op, r.bytes_per_op * 1e3 / r.ns_per_op);
+        fflush(stdout);
+        results.push_back(r);
+    }
+    remove_scratch();
+
+    return baseline && !compare(baseline, results, tolerance) ? 1 : 0;
+}
+
+/* Tests ---------------------------------------------------------------------------------------------------------------------- */
+
+void setUp(){}
+void tearDown(){}
+
+/* Every synthetic state packet is one the parser accepts, or the parse benchmark times the error path */
+void test_inputs_parse(){
+    TelloState st;
+    TEST_ASSERT_GREATER_THAN(0, states.size());
+    for(const std::string &s : states){
+        TEST_ASSERT_TRUE(parse_tello_state(s.data(), s.size(), &st).ok());
+    }
+}
+
+/* The hot path never allocates, and every op consumes input */
+void test_no_allocations(){
+    for(const Bench &b : benches){
+        BenchResult r = run(b, 1, 10);
+        TEST_ASSERT_GREATER_THAN(0, r.ops);
+        TEST_ASSERT_TRUE(r.bytes_per_op > 0);
+        TEST_ASSERT_TRUE_MESSAGE(r.alloc_bytes_per_op == 0, r.name.c_str());
+    }
+}
+
+int main(int argc, char **argv){
+    if(argc > 1 && strcmp(argv[1], "--bench") == 0){
+        return bench(argc, argv);
+    }
+    synthetic_inputs();
+    if(!write_scratch()){
+        return 1;
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_inputs_parse);
+    RUN_TEST(test_no_allocations);
+    remove_scratch();
+    return UNITY_END();
+}
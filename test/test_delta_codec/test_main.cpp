@@ -0,0 +1,166 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the delta + varint sample log encoding (lib/littlefs_io/delta_codec), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <unity.h>
+#include "delta_codec.hpp"
+
+#define NUM_RECORDS 600
+#define LOG_START sizeof(SampleLogHeader) /* Offset of the first encoded byte, as in a log file */
+
+/* Raw records of a few streams at their own rates, and the log they encode to */
+static uint8_t records[NUM_RECORDS][SAMPLE_MAX_RECORD_SIZE];
+static uint8_t encoded[NUM_RECORDS * DELTA_MAX_ENCODED];
+static size_t encoded_len;
+static size_t encoded_at[NUM_RECORDS]; /* Where each record's encoding starts */
+
+void setUp(){}
+void tearDown(){}
+
+static void make_records(){
+    memset(records, 0, sizeof(records));
+    for(int i = 0; i < NUM_RECORDS; ++i){
+        uint32_t uptime = 1000 + i * 20;
+        if(i % 10 == 9){
+            Scd4xRecord* r = (Scd4xRecord*)records[i];
+            r->hdr = {SAMPLE_STREAM_SCD4X, uptime};
+            r->co2 = 420 + i % 7;
+            r->temp = 2150 - i;
+            r->humd = 4000;
+        }
+        else if(i % 5 == 4){
+            TelloRecord* r = (TelloRecord*)records[i];
+            r->hdr = {SAMPLE_STREAM_TELLO, uptime};
+            r->yaw = -180 + i % 360;
+            r->h = i / 3;
+            r->bat = 100 - i / 60;
+            r->baro = -1234567 + i;
+            r->agz = -1000;
+        }
+        else{
+            Bmp3xxRecord* r = (Bmp3xxRecord*)records[i];
+            r->hdr = {SAMPLE_STREAM_BMP3XX, uptime};
+            r->temp = 2200 + (i % 3) - 1;
+            r->pres = 101325 - i / 4;
+            r->alt = -(int32_t)(i % 11);
+        }
+    }
+}
+
+static void encode_all(uint32_t sync_interval){
+    DeltaEncoder enc;
+    enc.reset(LOG_START);
+    enc.syncInterval = sync_interval;
+    encoded_len = 0;
+    for(int i = 0; i < NUM_RECORDS; ++i){
+        encoded_at[i] = encoded_len;
+        size_t n = enc.encode(records[i], encoded + encoded_len);
+        TEST_ASSERT_TRUE(n > 0 && n <= DELTA_MAX_ENCODED);
+        encoded_len += n;
+    }
+}
+
+/* Decode encoded[from, encoded_len), the way readers walk a log. Returns the records decoded into out,
+ * and where decoding stopped in *stop */
+static int decode_from(size_t from, uint8_t (*out)[SAMPLE_MAX_RECORD_SIZE], size_t* stop){
+    DeltaDecoder dec;
+    size_t i = from, len;
+    int n = 0, used;
+    while(i < encoded_len && (used = dec.decode(encoded + i, encoded_len - i, LOG_START + i, out[n], &len)) > 0){
+        n += len ? 1 : 0;
+        i += used;
+    }
+    *stop = i;
+    return n;
+}
+
+static void assert_records(uint8_t (*decoded)[SAMPLE_MAX_RECORD_SIZE], int first, int count){
+    for(int i = 0; i < count; ++i){
+        const uint8_t* rec = records[first + i];
+        TEST_ASSERT_EQUAL_MEMORY(rec, decoded[i], sample_record_size(rec[0]));
+    }
+}
+
+void test_round_trip(){
+    static uint8_t decoded[NUM_RECORDS][SAMPLE_MAX_RECORD_SIZE];
+    make_records();
+    encode_all(DELTA_SYNC_INTERVAL);
+    size_t raw = 0;
+    for(int i = 0; i < NUM_RECORDS; ++i){
+        raw += sample_record_size(records[i][0]);
+    }
+    TEST_ASSERT_LESS_THAN(raw / 2, encoded_len);
+
+    size_t stop;
+    TEST_ASSERT_EQUAL(NUM_RECORDS, decode_from(0, decoded, &stop));
+    TEST_ASSERT_EQUAL(encoded_len, stop);
+    assert_records(decoded, 0, NUM_RECORDS);
+}
+
+/* A record cut off by the end of the data asks for more rather than failing */
+void test_partial_record(){
+    make_records();
+    encode_all(DELTA_SYNC_INTERVAL);
+    DeltaDecoder dec;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    size_t len;
+    int used = dec.decode(encoded, 1, LOG_START, rec, &len);
+    TEST_ASSERT_EQUAL(0, used);
+    used = dec.decode(encoded, encoded_len, LOG_START, rec, &len);
+    TEST_ASSERT_GREATER_THAN(0, used);
+    TEST_ASSERT_EQUAL_MEMORY(records[0], rec, len);
+}
+
+/* A reader dropped in the middle of the log finds the next sync marker and decodes everything after it */
+void test_resync_from_middle(){
+    static uint8_t decoded[NUM_RECORDS][SAMPLE_MAX_RECORD_SIZE];
+    make_records();
+    encode_all(512);
+    size_t middle = encoded_len / 2;
+    long sync = DeltaDecoder::findSync(encoded + middle, encoded_len - middle, LOG_START + middle);
+    TEST_ASSERT_TRUE(sync >= 0);
+
+    size_t stop;
+    int n = decode_from(middle + sync, decoded, &stop);
+    TEST_ASSERT_EQUAL(encoded_len, stop);
+    TEST_ASSERT_GREATER_THAN(0, n);
+    assert_records(decoded, NUM_RECORDS - n, n);
+
+    /* A marker only counts at the offset it names */
+    TEST_ASSERT_EQUAL(-1, DeltaDecoder::findSync(encoded + middle + sync, DELTA_SYNC_LEN, LOG_START + middle + sync + 1));
+}
+
+/* A corrupt stretch stops the decoder, which picks up at the next marker. Like a journal block that failed its
+ * checksum, it starts on a record and reads as zeros */
+void test_resync_after_corruption(){
+    static uint8_t decoded[NUM_RECORDS][SAMPLE_MAX_RECORD_SIZE];
+    make_records();
+    encode_all(512);
+    size_t bad = encoded_at[NUM_RECORDS / 3];
+    memset(encoded + bad, 0, 300);
+
+    size_t stop;
+    int before = decode_from(0, decoded, &stop);
+    TEST_ASSERT_EQUAL(bad, stop);
+    TEST_ASSERT_EQUAL(NUM_RECORDS / 3, before);
+    assert_records(decoded, 0, before);
+
+    long sync = DeltaDecoder::findSync(encoded + stop, encoded_len - stop, LOG_START + stop);
+    TEST_ASSERT_TRUE(sync >= 0);
+    TEST_ASSERT_GREATER_OR_EQUAL(bad + 300, stop + sync);
+    int after = decode_from(stop + sync, decoded, &stop);
+    TEST_ASSERT_EQUAL(encoded_len, stop);
+    assert_records(decoded, NUM_RECORDS - after, after);
+    TEST_ASSERT_LESS_THAN(NUM_RECORDS, before + after);
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_partial_record);
+    RUN_TEST(test_resync_from_middle);
+    RUN_TEST(test_resync_after_corruption);
+    return UNITY_END();
+}
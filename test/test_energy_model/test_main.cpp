@@ -0,0 +1,186 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the battery model and the mission budget (lib/energy_model), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include <unity.h>
+#include "energy_model.hpp"
+
+static EnergyModel model;
+
+void setUp(){
+    model.config = EnergyModelConfig();
+    model.reset();
+}
+void tearDown(){}
+
+/* Feed the model a flight at 10 Hz where the battery drains at rate %/s, starting part way down a percent */
+static void fly(float seconds, float rate, int vgx, float vz_cms, bool grounded){
+    TelloState state;
+    Position pos;
+    for(uint32_t ms = 0; ms <= seconds * 1000; ms += 100){
+        state.bat = 100 - (int)(ms / 1000.0f * rate + 0.4f);
+        state.time = ms / 1000;
+        state.vgx = vgx;
+        model.update(ms, state, vz_cms, grounded, pos);
+    }
+}
+
+/* The hover rate converges on the true drain, the rates of manoeuvres never flown stay where they were */
+void test_learns_hover_rate(){
+    fly(300, 0.2f, 0, 0, false);
+    const EnergyEstimate& e = model.estimate;
+    TEST_ASSERT_EQUAL(60, 100 - e.bat);
+    /* The first drop only lines up the intervals */
+    TEST_ASSERT_EQUAL(59, e.drops);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0.2f, e.rate[ENERGY_HOVER]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, model.config.prior_rate[ENERGY_FLY], e.rate[ENERGY_FLY]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, model.config.prior_rate[ENERGY_CLIMB], e.rate[ENERGY_CLIMB]);
+    TEST_ASSERT_EQUAL(3001, e.seq);
+}
+
+void test_sorts_manoeuvres(){
+    fly(200, 0.3f, 5, 0, false);
+    TEST_ASSERT_FLOAT_WITHIN(0.015f, 0.3f, model.estimate.rate[ENERGY_FLY]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, model.config.prior_rate[ENERGY_HOVER], model.estimate.rate[ENERGY_HOVER]);
+
+    setUp();
+    fly(200, 0.3f, 5, -30, false);
+    TEST_ASSERT_FLOAT_WITHIN(0.015f, 0.3f, model.estimate.rate[ENERGY_CLIMB]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, model.config.prior_rate[ENERGY_FLY], model.estimate.rate[ENERGY_FLY]);
+}
+
+/* Drops on the pad say nothing about flying */
+void test_grounded(){
+    fly(100, 0.5f, 0, 0, true);
+    TEST_ASSERT_EQUAL(0, model.estimate.drops);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, model.config.prior_rate[ENERGY_HOVER], model.estimate.rate[ENERGY_HOVER]);
+}
+
+void test_home_estimate(){
+    TelloState state;
+    state.bat = 50;
+    Position pos;
+    pos.x_cm = 300;
+    pos.y_cm = 400;
+    pos.z_cm = 100;
+    model.update(0, state, 0, false, pos);
+    const EnergyEstimate& e = model.estimate;
+    /* 10 s flying home at 50 cm/s and 2 s coming down */
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 12, e.home_s);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 10 * 0.14f + 2 * 0.2f, e.home_pct);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 50 - e.home_pct - 10, e.margin_pct);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, e.home_pct, model.cost_pct(0, 10, 2));
+}
+
+/* Mission budget ------------------------------------------------------------------------------------------------------------- */
+
+static SeqLatch<EnergyEstimate> energy;
+
+static void publish(int bat, int time){
+    EnergyEstimate e;
+    e.bat = bat;
+    e.time = time;
+    EnergyModelConfig config;
+    for(int i = 0; i < ENERGY_NUM_MANOEUVRES; ++i){
+        e.rate[i] = config.prior_rate[i];
+    }
+    e.seq = 1;
+    energy.publish(e);
+}
+
+static void add(RcPathFollower& path, float x){
+    RcWaypoint wp;
+    wp.x_cm = x;
+    wp.z_cm = 100;
+    path.add(wp);
+}
+
+/* From (0, 0, 100): out to 100 cm, a long detour to 2000 cm, then 200 cm, about 11.6% to finish and get home */
+static void make_path(RcPathFollower& path){
+    path.clear();
+    add(path, 100);
+    add(path, 2000);
+    add(path, 200);
+}
+
+static Position start(){
+    Position pos;
+    pos.z_cm = 100;
+    pos.valid = true;
+    return pos;
+}
+
+void test_budget_fits(){
+    MissionBudget budget(energy, EnergyModelConfig());
+    RcPathFollower path;
+    make_path(path);
+    budget.begin(path);
+
+    /* No estimate yet, nothing to go on */
+    energy.publish(EnergyEstimate());
+    TEST_ASSERT_EQUAL(0, budget.check(path, start()));
+    TEST_ASSERT_EQUAL(0, budget.checks);
+
+    publish(100, 0);
+    TEST_ASSERT_EQUAL(0, budget.check(path, start()));
+    TEST_ASSERT_EQUAL(3, path.num_points);
+    TEST_ASSERT_EQUAL(1, budget.checks);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 100 - 11.6f - 10, budget.worst_margin_pct);
+}
+
+/* Short of battery, the waypoint whose detour costs the most goes first */
+void test_budget_drops_detour(){
+    MissionBudget budget(energy, EnergyModelConfig());
+    RcPathFollower path;
+    make_path(path);
+    budget.begin(path);
+    publish(20, 0);
+    TEST_ASSERT_EQUAL(1, budget.check(path, start()));
+    TEST_ASSERT_EQUAL(2, path.num_points);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 100, path.points[0].x_cm);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 200, path.points[1].x_cm);
+    TEST_ASSERT_EQUAL(1, budget.dropped);
+    TEST_ASSERT_TRUE(budget.worst_margin_pct < 0);
+
+    /* With too little for anything, every waypoint but the last is given up */
+    make_path(path);
+    budget.begin(path);
+    publish(10, 0);
+    TEST_ASSERT_EQUAL(2, budget.check(path, start()));
+    TEST_ASSERT_EQUAL(1, path.num_points);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 200, path.points[0].x_cm);
+    TEST_ASSERT_EQUAL(3, budget.dropped);
+}
+
+/* max_flight_s bounds the motor time the same way */
+void test_budget_flight_time(){
+    EnergyModelConfig config;
+    config.max_flight_s = 60;
+    MissionBudget budget(energy, config);
+    RcPathFollower path;
+    make_path(path);
+    budget.begin(path);
+    publish(100, 0);
+    TEST_ASSERT_EQUAL(1, budget.check(path, start()));
+    TEST_ASSERT_EQUAL(2, path.num_points);
+
+    /* Already 55 s in, the 10 s left of the path no longer fits either */
+    make_path(path);
+    budget.begin(path);
+    publish(100, 55);
+    TEST_ASSERT_EQUAL(2, budget.check(path, start()));
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_learns_hover_rate);
+    RUN_TEST(test_sorts_manoeuvres);
+    RUN_TEST(test_grounded);
+    RUN_TEST(test_home_estimate);
+    RUN_TEST(test_budget_fits);
+    RUN_TEST(test_budget_drops_detour);
+    RUN_TEST(test_budget_flight_time);
+    return UNITY_END();
+}
@@ -0,0 +1,192 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the flight plan compiler (lib/flight_plan), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "hal.hpp"
+#include "flight_plan.hpp"
+
+static FlightPlan plan;
+static FlightPlanError err;
+
+void setUp(){
+    err = FlightPlanError();
+}
+void tearDown(){}
+
+static void assert_cmd(uint16_t i, const char* cmd){
+    TEST_ASSERT_EQUAL(FLIGHT_OP_CMD, plan.ops[i].code);
+    TEST_ASSERT_EQUAL_STRING(cmd, plan.ops[i].cmd);
+    TEST_ASSERT_EQUAL(tello_cmd_default_timeout(cmd), plan.ops[i].timeout_ms);
+    TEST_ASSERT_EQUAL(tello_cmd_default_retries(cmd), plan.ops[i].retries);
+}
+
+/* The example in flight_plan.hpp, with the jumps resolved to op indices */
+void test_example_plan(){
+    const char* text =
+        "takeoff\n"
+        "speed 50\n"
+        "repeat 3                 # loops nest up to FLIGHT_PLAN_MAX_DEPTH deep\n"
+        "    go 100 0 0 50\n"
+        "    dwell 5\n"
+        "    if bat < 30 goto home\n"
+        "end\n"
+        "home:\n"
+        "land\n";
+    TEST_ASSERT_TRUE(plan.compile(text, &err));
+    TEST_ASSERT_EQUAL(9, plan.num_ops);
+    assert_cmd(0, "takeoff");
+    assert_cmd(1, "speed 50");
+    TEST_ASSERT_EQUAL(FLIGHT_OP_LOOP, plan.ops[2].code);
+    TEST_ASSERT_EQUAL(3, plan.ops[2].value);
+    TEST_ASSERT_EQUAL(0, plan.ops[2].slot);
+    assert_cmd(3, "go 100 0 0 50");
+    TEST_ASSERT_EQUAL(4, plan.ops[3].line);
+    TEST_ASSERT_EQUAL(FLIGHT_OP_DWELL, plan.ops[4].code);
+    TEST_ASSERT_EQUAL(5000, plan.ops[4].value);
+    TEST_ASSERT_EQUAL(FLIGHT_OP_JUMP_IF, plan.ops[5].code);
+    TEST_ASSERT_EQUAL(TELLO_BAT, plan.ops[5].field);
+    TEST_ASSERT_EQUAL(FLIGHT_CMP_LT, plan.ops[5].cmp);
+    TEST_ASSERT_EQUAL(30, plan.ops[5].value);
+    TEST_ASSERT_EQUAL(7, plan.ops[5].target);
+    TEST_ASSERT_EQUAL(FLIGHT_OP_NEXT, plan.ops[6].code);
+    TEST_ASSERT_EQUAL(0, plan.ops[6].slot);
+    TEST_ASSERT_EQUAL(3, plan.ops[6].target);
+    assert_cmd(7, "land");
+    TEST_ASSERT_EQUAL(FLIGHT_OP_END, plan.ops[8].code);
+}
+
+/* Commands reach the drone rebuilt from their words, whatever the spacing, and the last line needs no newline */
+void test_spacing_and_comments(){
+    TEST_ASSERT_TRUE(plan.compile("\n  # just a comment\n\t forward   50  # go\r\nbattery?", &err));
+    TEST_ASSERT_EQUAL(3, plan.num_ops);
+    assert_cmd(0, "forward 50");
+    TEST_ASSERT_EQUAL(3, plan.ops[0].line);
+    assert_cmd(1, "battery?");
+}
+
+void test_nested_loops_and_conditions(){
+    const char* text =
+        "repeat 2\n"
+        "  repeat 4\n"
+        "    cw 90\n"
+        "    if alt >= 150 goto out\n"
+        "  end\n"
+        "  if margin != -5 goto out\n"
+        "end\n"
+        "out:\n";
+    TEST_ASSERT_TRUE(plan.compile(text, &err));
+    TEST_ASSERT_EQUAL(8, plan.num_ops);
+    TEST_ASSERT_EQUAL(0, plan.ops[0].slot);
+    TEST_ASSERT_EQUAL(1, plan.ops[1].slot);
+    TEST_ASSERT_EQUAL(FLIGHT_FIELD_ALT, plan.ops[3].field);
+    TEST_ASSERT_EQUAL(FLIGHT_CMP_GE, plan.ops[3].cmp);
+    TEST_ASSERT_EQUAL(7, plan.ops[3].target);
+    TEST_ASSERT_EQUAL(FLIGHT_OP_NEXT, plan.ops[4].code);
+    TEST_ASSERT_EQUAL(1, plan.ops[4].slot);
+    TEST_ASSERT_EQUAL(2, plan.ops[4].target);
+    TEST_ASSERT_EQUAL(FLIGHT_FIELD_MARGIN, plan.ops[5].field);
+    TEST_ASSERT_EQUAL(FLIGHT_CMP_NE, plan.ops[5].cmp);
+    TEST_ASSERT_EQUAL(-5, plan.ops[5].value);
+    TEST_ASSERT_EQUAL(0, plan.ops[6].slot);
+    TEST_ASSERT_EQUAL(1, plan.ops[6].target);
+    TEST_ASSERT_EQUAL(FLIGHT_OP_END, plan.ops[7].code);
+}
+
+void test_fly_path(){
+    TEST_ASSERT_TRUE(plan.compile("takeoff\nfly 100 0 80 50\nfly 100 -200 120 40\nland\n", &err));
+    TEST_ASSERT_EQUAL(FLIGHT_OP_FLY, plan.ops[1].code);
+    TEST_ASSERT_EQUAL(100, plan.ops[1].point[0]);
+    TEST_ASSERT_EQUAL(80, plan.ops[1].point[2]);
+    TEST_ASSERT_EQUAL(-200, plan.ops[2].point[1]);
+    TEST_ASSERT_EQUAL(40, plan.ops[2].point[3]);
+
+    char text[64 * (RC_PATH_MAX_POINTS + 1)];
+    size_t len = 0;
+    for(int i = 0; i <= RC_PATH_MAX_POINTS; ++i){
+        len += snprintf(text + len, sizeof(text) - len, "fly %d 0 100 50\n", i * 10);
+    }
+    TEST_ASSERT_FALSE(plan.compile(text, &err));
+    TEST_ASSERT_EQUAL(RC_PATH_MAX_POINTS + 1, err.line);
+}
+
+/* Every mistake is caught at load time, on the line that made it, and leaves the plan empty */
+void test_errors(){
+    static const struct{
+        const char* text;
+        uint16_t line;
+        const char* msg;
+    } cases[] = {
+        {"takeoff\nforward 600\n", 2, "600 out of range 20..500"},
+        {"takeoff\nforward fifty\n", 2, "\"fifty\" is not a number"},
+        {"jump\n", 1, "unknown command \"jump\""},
+        {"flip x\n", 1, "flip takes one of l, r, f or b"},
+        {"go 10 -10 20 50\n", 1, "go point too close, needs a coordinate beyond +-20 cm"},
+        {"dwell 0\n", 1, "bad dwell time \"0\""},
+        {"repeat 2\ncw 90\n", 0, "1 repeat block(s) missing end"},
+        {"cw 90\nend\n", 2, "end without repeat"},
+        {"takeoff\ngoto nowhere\n", 2, "undefined label \"nowhere\""},
+        {"a:\ncw 90\na:\n", 3, "label \"a\" defined twice"},
+        {"top:\nif bat < 30 goto top\n", 2, "loop without a command or dwell"},
+        {"if volts < 3 goto x\n", 1, "unknown state field \"volts\""},
+        {"if bat = 3 goto x\n", 1, "unknown comparison \"=\""},
+        {"repeat 2\nrepeat 2\nrepeat 2\nrepeat 2\nrepeat 2\n", 5, "repeat nested more than 4 deep"},
+        {"land\ncw 90 90 90 90 90 90 90 90 90\n", 2, "too many words"},
+    };
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i){
+        TEST_ASSERT_TRUE(plan.compile("takeoff\nland\n", &err));
+        TEST_ASSERT_FALSE_MESSAGE(plan.compile(cases[i].text, &err), cases[i].text);
+        TEST_ASSERT_EQUAL_STRING(cases[i].msg, err.msg);
+        TEST_ASSERT_EQUAL(cases[i].line, err.line);
+        TEST_ASSERT_EQUAL(0, plan.num_ops);
+    }
+
+    char text[FLIGHT_PLAN_MAX_LINE + 16];
+    memset(text, 'x', sizeof(text));
+    memcpy(text, "land\n", 5);
+    text[sizeof(text) - 1] = '\0';
+    TEST_ASSERT_FALSE(plan.compile(text, &err));
+    TEST_ASSERT_EQUAL(2, err.line);
+}
+
+/* Plans are read off the file system a block at a time, lines that straddle two blocks included */
+void test_load(){
+    TEST_ASSERT_TRUE(hal::fs_begin());
+    hal::File f;
+    TEST_ASSERT_TRUE(f.open("/test.plan", "w"));
+    f.write("takeoff\n", 8);
+    char line[32];
+    for(int i = 0; i < 20; ++i){
+        int n = snprintf(line, sizeof(line), "cw %d   # turn %d\n", 10 + i, i);
+        f.write(line, n);
+    }
+    f.write("land", 4);
+    f.close();
+
+    TEST_ASSERT_TRUE(plan.load("/test.plan", &err));
+    TEST_ASSERT_EQUAL(23, plan.num_ops);
+    for(int i = 0; i < 20; ++i){
+        snprintf(line, sizeof(line), "cw %d", 10 + i);
+        assert_cmd(1 + i, line);
+        TEST_ASSERT_EQUAL(2 + i, plan.ops[1 + i].line);
+    }
+    assert_cmd(21, "land");
+    hal::file_remove("/test.plan");
+
+    TEST_ASSERT_FALSE(plan.load("/missing.plan", &err));
+    TEST_ASSERT_EQUAL_STRING("cannot open /missing.plan", err.msg);
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_example_plan);
+    RUN_TEST(test_spacing_and_comments);
+    RUN_TEST(test_nested_loops_and_conditions);
+    RUN_TEST(test_fly_path);
+    RUN_TEST(test_errors);
+    RUN_TEST(test_load);
+    return UNITY_END();
+}
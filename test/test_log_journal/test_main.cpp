@@ -0,0 +1,242 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for journaled log runs and their recovery (lib/littlefs_io/log_journal), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Runs are written to the native HAL's file system (native_fs/ under the working directory), each test in a new run.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <unity.h>
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "log_journal.hpp"
+
+#define RECORD_LEN 100
+#define MAX_RECORDS 800 /* About 80 kB, so a run spans two segments */
+#define HEADER_LEN 16
+
+/* Everything the last run was sent, and where each write() ended */
+static uint8_t expected[HEADER_LEN + MAX_RECORDS * RECORD_LEN];
+static uint32_t expected_len;
+static uint32_t write_end[MAX_RECORDS + 1];
+
+void setUp(){
+    TEST_ASSERT_TRUE(hal::fs_begin());
+}
+void tearDown(){}
+
+/* Log a header and num records in a new run, committing halfway through. Returns the run */
+static uint32_t write_run(int num){
+    LogWriter writer;
+    for(int i = 0; i < HEADER_LEN; ++i){
+        expected[i] = 0xE0 + i;
+    }
+    TEST_ASSERT_TRUE(writer.beginRun(expected, HEADER_LEN));
+    expected_len = HEADER_LEN;
+    write_end[0] = expected_len;
+    for(int i = 0; i < num; ++i){
+        uint8_t* rec = expected + expected_len;
+        for(int b = 0; b < RECORD_LEN; ++b){
+            rec[b] = (uint8_t)(i * 7 + b + 1);
+        }
+        TEST_ASSERT_EQUAL(RECORD_LEN, writer.write(rec, RECORD_LEN));
+        expected_len += RECORD_LEN;
+        write_end[i + 1] = expected_len;
+        if(i == num / 2){
+            TEST_ASSERT_TRUE(writer.sync());
+        }
+    }
+    uint32_t run = writer.run();
+    writer.end();
+    return run;
+}
+
+/* Path of a segment file on the host */
+static void host_path(char* out, size_t cap, uint32_t run, uint32_t segment){
+    char path[LOG_PATH_LEN];
+    logSegmentPath(path, run, segment);
+    snprintf(out, cap, "native_fs%s", path);
+}
+
+static long host_size(const char* path){
+    FILE* f = fopen(path, "rb");
+    if(f == NULL){
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/* Read a whole run back through a small arena into out, returns its length */
+static uint32_t read_run(uint32_t run, uint8_t* out, size_t cap, uint32_t* bad_blocks){
+    uint8_t arena[512];
+    LogJournalReader reader(arena, sizeof(arena));
+    TEST_ASSERT_TRUE(reader.open(run));
+    const uint8_t* data;
+    size_t n;
+    uint32_t len = 0;
+    while((n = reader.next(&data)) > 0){
+        TEST_ASSERT_LESS_OR_EQUAL(cap, len + n);
+        memcpy(out + len, data, n);
+        len += n;
+    }
+    TEST_ASSERT_EQUAL(reader.size(), len);
+    *bad_blocks = reader.badBlocks;
+    reader.close();
+    return len;
+}
+
+static bool is_write_end(uint32_t offset, int num){
+    for(int i = 0; i <= num; ++i){
+        if(write_end[i] == offset){
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_clean_run(){
+    static uint8_t got[sizeof(expected)];
+    uint32_t run = write_run(150);
+    TEST_ASSERT_EQUAL(run, logLastRun());
+
+    LogRecovery rec;
+    TEST_ASSERT_TRUE(logRecover(run, &rec));
+    TEST_ASSERT_TRUE(rec.closed);
+    TEST_ASSERT_EQUAL(expected_len, rec.bytes);
+    TEST_ASSERT_EQUAL(expected_len, rec.committed);
+    TEST_ASSERT_EQUAL(0, rec.bad);
+    TEST_ASSERT_EQUAL(0, rec.torn);
+
+    uint32_t bad;
+    TEST_ASSERT_EQUAL(expected_len, read_run(run, got, sizeof(got), &bad));
+    TEST_ASSERT_EQUAL(0, bad);
+    TEST_ASSERT_EQUAL_MEMORY(expected, got, expected_len);
+}
+
+/* Power lost part way through writing a block: the run ends with the last whole block, on a record */
+void test_truncated_block(){
+    static uint8_t got[sizeof(expected)];
+    uint32_t run = write_run(MAX_RECORDS);
+    uint16_t segments = logSegmentCount(run);
+    TEST_ASSERT_GREATER_THAN(1, segments);
+
+    /* Cut off the final commit marker and the end of the data block before it */
+    char path[64];
+    host_path(path, sizeof(path), run, segments - 1);
+    long size = host_size(path);
+    long cut = sizeof(LogBlockHeader) + 50;
+    TEST_ASSERT_EQUAL(0, truncate(path, size - cut));
+
+    LogRecovery rec;
+    TEST_ASSERT_TRUE(logRecover(run, &rec));
+    TEST_ASSERT_FALSE(rec.closed);
+    TEST_ASSERT_EQUAL(segments, rec.segments);
+    TEST_ASSERT_GREATER_THAN(0, rec.torn);
+    TEST_ASSERT_LESS_THAN(expected_len, rec.bytes);
+    TEST_ASSERT_LESS_OR_EQUAL(rec.bytes, rec.committed);
+    TEST_ASSERT_TRUE(is_write_end(rec.bytes, MAX_RECORDS));
+
+    uint32_t bad;
+    TEST_ASSERT_EQUAL(rec.bytes, read_run(run, got, sizeof(got), &bad));
+    TEST_ASSERT_EQUAL(0, bad);
+    TEST_ASSERT_EQUAL_MEMORY(expected, got, rec.bytes);
+}
+
+/* A block that fails its checksum reads as zeros, everything around it as written */
+void test_corrupt_block(){
+    static uint8_t got[sizeof(expected)];
+    uint32_t run = write_run(150);
+
+    /* Flip a payload byte of the first block of the first segment */
+    char path[64];
+    host_path(path, sizeof(path), run, 0);
+    FILE* f = fopen(path, "r+b");
+    TEST_ASSERT_NOT_NULL(f);
+    long at = sizeof(LogSegmentHeader) + sizeof(LogBlockHeader) + 10;
+    fseek(f, at, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, at, SEEK_SET);
+    fputc(c ^ 0xFF, f);
+    fclose(f);
+
+    uint32_t bad;
+    TEST_ASSERT_EQUAL(expected_len, read_run(run, got, sizeof(got), &bad));
+    TEST_ASSERT_EQUAL(1, bad);
+    TEST_ASSERT_EQUAL(0, got[10]);
+    uint32_t zeros = 0;
+    while(zeros < expected_len && got[zeros] == 0){
+        zeros++;
+    }
+    TEST_ASSERT_TRUE(is_write_end(zeros, 150));
+    TEST_ASSERT_EQUAL_MEMORY(expected + zeros, got + zeros, expected_len - zeros);
+}
+
+/* A record that would not fit in one block is refused rather than split, so blocks still end on records */
+void test_oversized_record(){
+    static uint8_t big[LOG_BLOCK_PAYLOAD + 1];
+    LogWriter writer;
+    uint8_t header[HEADER_LEN] = {0};
+    TEST_ASSERT_TRUE(writer.beginRun(header, HEADER_LEN));
+    TEST_ASSERT_EQUAL(0, writer.write(big, sizeof(big)));
+    TEST_ASSERT_EQUAL(sizeof(big), writer.dropped);
+    TEST_ASSERT_EQUAL(LOG_BLOCK_PAYLOAD, writer.write(big, LOG_BLOCK_PAYLOAD));
+    uint32_t run = writer.run();
+    writer.end();
+
+    LogRecovery rec;
+    TEST_ASSERT_TRUE(logRecover(run, &rec));
+    TEST_ASSERT_TRUE(rec.closed);
+    TEST_ASSERT_EQUAL(HEADER_LEN + LOG_BLOCK_PAYLOAD, rec.bytes);
+}
+
+/* A run still being written reads back up to its last commit, given the size rather than recovering it */
+void test_read_while_writing(){
+    static uint8_t got[sizeof(expected)];
+    LogWriter writer;
+    for(int i = 0; i < HEADER_LEN; ++i){
+        expected[i] = 0xE0 + i;
+    }
+    TEST_ASSERT_TRUE(writer.beginRun(expected, HEADER_LEN));
+    expected_len = HEADER_LEN;
+    for(int i = 0; i < 200; ++i){
+        uint8_t* rec = expected + expected_len;
+        memset(rec, i + 1, RECORD_LEN);
+        writer.write(rec, RECORD_LEN);
+        expected_len += RECORD_LEN;
+        if(i == 120){
+            TEST_ASSERT_TRUE(writer.sync());
+        }
+    }
+    uint32_t committed = writer.committed();
+    TEST_ASSERT_EQUAL(HEADER_LEN + 121 * RECORD_LEN, committed);
+
+    uint8_t arena[512];
+    LogJournalReader reader(arena, sizeof(arena));
+    TEST_ASSERT_TRUE(reader.open(writer.run(), 0, committed));
+    const uint8_t* data;
+    size_t n;
+    uint32_t len = 0;
+    while((n = reader.next(&data)) > 0){
+        memcpy(got + len, data, n);
+        len += n;
+    }
+    reader.close();
+    TEST_ASSERT_EQUAL(committed, len);
+    TEST_ASSERT_EQUAL_MEMORY(expected, got, committed);
+    writer.end();
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_clean_run);
+    RUN_TEST(test_truncated_block);
+    RUN_TEST(test_corrupt_block);
+    RUN_TEST(test_oversized_record);
+    RUN_TEST(test_read_while_writing);
+    return UNITY_END();
+}
@@ -0,0 +1,119 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the hot-path instrumentation (lib/metrics), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <thread>
+#include <vector>
+#include <unity.h>
+#include "hal.hpp"
+#include "metrics.hpp"
+
+static MetricsSnapshot snap;
+
+void setUp(){
+    metrics_reset();
+}
+void tearDown(){}
+
+/* Each bucket holds durations up to twice the last one's, from METRIC_BUCKET_BASE_US, and the last holds the rest */
+void test_buckets(){
+    const uint32_t us[] = {0, 7, 8, 15, 16, 1000, 131071, 1000000};
+    const unsigned bucket[] = {0, 0, 1, 1, 2, 7, 14, 15};
+    for(uint32_t u : us){
+        METRIC_RECORD(METRIC_CMD_RTT, u);
+    }
+    TEST_ASSERT_TRUE(metrics_snapshot(&snap));
+    const MetricSiteStats& s = snap.site[METRIC_CMD_RTT];
+    TEST_ASSERT_EQUAL(8, s.count);
+    TEST_ASSERT_EQUAL(0 + 7 + 8 + 15 + 16 + 1000 + 131071 + 1000000, s.sum_us);
+    TEST_ASSERT_EQUAL(1000000, s.max_us);
+    uint16_t expect[METRIC_BUCKETS] = {0};
+    for(unsigned b : bucket){
+        expect[b]++;
+    }
+    for(int b = 0; b < METRIC_BUCKETS; ++b){
+        TEST_ASSERT_EQUAL(expect[b], s.buckets[b]);
+    }
+    TEST_ASSERT_EQUAL(0, snap.site[METRIC_STATE_PARSE].count);
+}
+
+void test_timer_and_counters(){
+    {
+        METRIC_TIME(METRIC_FLASH_COMMIT);
+        hal::delay(5);
+    }
+    METRIC_COUNT(METRIC_FLASH_BYTES, 512);
+    METRIC_COUNT(METRIC_FLASH_BYTES, 100);
+    METRIC_COUNT(METRIC_PARSE_ERRORS, 1);
+    metrics_snapshot(&snap);
+    TEST_ASSERT_EQUAL(1, snap.site[METRIC_FLASH_COMMIT].count);
+    TEST_ASSERT_TRUE(snap.site[METRIC_FLASH_COMMIT].max_us >= 5000);
+    TEST_ASSERT_TRUE(snap.site[METRIC_FLASH_COMMIT].max_us < 1000000);
+    TEST_ASSERT_EQUAL(612, snap.counter[METRIC_FLASH_BYTES]);
+    TEST_ASSERT_EQUAL(1, snap.counter[METRIC_PARSE_ERRORS]);
+    TEST_ASSERT_EQUAL(0, snap.counter[METRIC_CMD_TIMEOUTS]);
+
+    metrics_reset();
+    metrics_snapshot(&snap);
+    TEST_ASSERT_EQUAL(0, snap.site[METRIC_FLASH_COMMIT].count);
+    TEST_ASSERT_EQUAL(0, snap.site[METRIC_FLASH_COMMIT].max_us);
+    TEST_ASSERT_EQUAL(0, snap.counter[METRIC_FLASH_BYTES]);
+}
+
+/* Tasks record without a lock and no sample is lost */
+void test_concurrent(){
+    std::vector<std::thread> threads;
+    for(uint32_t t = 0; t < 4; ++t){
+        threads.emplace_back([t]{
+            for(uint32_t i = 0; i < 10000; ++i){
+                METRIC_RECORD(METRIC_STORE, t * 10 + i % 3);
+                METRIC_COUNT(METRIC_STATE_PACKETS, 1);
+            }
+        });
+    }
+    for(std::thread& th : threads){
+        th.join();
+    }
+    metrics_snapshot(&snap);
+    TEST_ASSERT_EQUAL(40000, snap.site[METRIC_STORE].count);
+    TEST_ASSERT_EQUAL(40000, snap.counter[METRIC_STATE_PACKETS]);
+    TEST_ASSERT_EQUAL(32, snap.site[METRIC_STORE].max_us);
+    uint32_t total = 0;
+    for(int b = 0; b < METRIC_BUCKETS; ++b){
+        total += snap.site[METRIC_STORE].buckets[b];
+    }
+    TEST_ASSERT_EQUAL(40000, total);
+}
+
+/* Buckets saturate rather than wrap, and the snapshot describes itself and the watched tasks */
+void test_snapshot(){
+    TEST_ASSERT_EQUAL(488, sizeof(MetricsSnapshot));
+    for(uint32_t i = 0; i < 70000; ++i){
+        METRIC_RECORD(METRIC_SCD4X_READ, 1);
+    }
+    hal::task_watch(hal::current_task(), "a_long_task_name", 8192);
+    metrics_snapshot(&snap);
+    hal::task_forget(hal::current_task());
+
+    TEST_ASSERT_EQUAL(70000, snap.site[METRIC_SCD4X_READ].count);
+    TEST_ASSERT_EQUAL(65535, snap.site[METRIC_SCD4X_READ].buckets[0]);
+    TEST_ASSERT_EQUAL(METRICS_VERSION, snap.version);
+    TEST_ASSERT_EQUAL(METRIC_NUM_SITES, snap.sites);
+    TEST_ASSERT_EQUAL(METRIC_BUCKETS, snap.buckets);
+    TEST_ASSERT_EQUAL(METRIC_NUM_COUNTERS, snap.counters);
+    TEST_ASSERT_EQUAL(1, snap.tasks);
+    TEST_ASSERT_EQUAL(0, memcmp("a_long_task_", snap.task[0].name, METRIC_TASK_NAME_LEN));
+    TEST_ASSERT_EQUAL(8192, snap.task[0].stack);
+    metrics_log();
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_buckets);
+    RUN_TEST(test_timer_and_counters);
+    RUN_TEST(test_concurrent);
+    RUN_TEST(test_snapshot);
+    return UNITY_END();
+}
@@ -0,0 +1,208 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the windowed aggregation stage (lib/sample_agg), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <unity.h>
+#include "sample_agg.hpp"
+
+/* Everything the aggregator stored, in order */
+static std::vector<std::vector<uint8_t>> stored;
+
+static void sink(const uint8_t* rec, size_t len, void* ctx){
+    stored.push_back(std::vector<uint8_t>(rec, rec + len));
+}
+
+static SampleAggregator agg(sink, NULL);
+
+void setUp(){
+    stored.clear();
+    agg.config = AggregatorConfig();
+    agg.reset();
+}
+void tearDown(){}
+
+static void add_bmp(uint32_t uptime, int16_t temp, uint32_t pres, int32_t alt){
+    Bmp3xxRecord r;
+    r.hdr = {SAMPLE_STREAM_BMP3XX, uptime};
+    r.temp = temp;
+    r.pres = pres;
+    r.alt = alt;
+    agg.add((const uint8_t*)&r, sizeof(r));
+}
+
+static void add_scd(uint32_t uptime, uint16_t co2){
+    Scd4xRecord r;
+    r.hdr = {SAMPLE_STREAM_SCD4X, uptime};
+    r.co2 = co2;
+    r.temp = 2100;
+    r.humd = 4500;
+    agg.add((const uint8_t*)&r, sizeof(r));
+}
+
+static uint32_t uptime_of(const std::vector<uint8_t>& rec){
+    SampleRecordHeader hdr;
+    memcpy(&hdr, rec.data(), sizeof(hdr));
+    return hdr.uptime;
+}
+
+/* Summaries of source in the order they were stored */
+static std::vector<SummaryRecord> summaries_of(uint8_t source){
+    std::vector<SummaryRecord> out;
+    for(const std::vector<uint8_t>& rec : stored){
+        if(rec[0] == SAMPLE_STREAM_SUMMARY){
+            SummaryRecord r;
+            memcpy(&r, rec.data(), sizeof(r));
+            if(r.source == source){
+                out.push_back(r);
+            }
+        }
+    }
+    return out;
+}
+
+static size_t count_raw(uint8_t stream){
+    size_t n = 0;
+    for(const std::vector<uint8_t>& rec : stored){
+        n += rec[0] == stream;
+    }
+    return n;
+}
+
+void test_channel_stats(){
+    ChannelStats c;
+    c.reset();
+    TEST_ASSERT_EQUAL_FLOAT(0, c.stddev());
+    for(int v = 1; v <= 5; ++v){
+        c.add(v);
+    }
+    TEST_ASSERT_EQUAL(5, c.count);
+    TEST_ASSERT_EQUAL(1, c.min);
+    TEST_ASSERT_EQUAL(5, c.max);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 3, c.mean);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, sqrtf(2), c.stddev());
+
+    /* Small spread on a large offset, where a float sum of squares would have nothing left */
+    c.reset();
+    for(int i = 0; i < 1000; ++i){
+        c.add(101300 + (i % 2 ? 2 : -2));
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 101300, c.mean);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 2, c.stddev());
+}
+
+/* A 10 Hz BMP3xx stream over 25 s turns into three windows of one summary per column, and the SCD4x stays raw */
+void test_window_summaries(){
+    for(uint32_t t = 0; t < 25000; t += 100){
+        add_bmp(t, 2000 + (t / 100) % 2, 101300, t < 10000 ? 0 : 150);
+        if(t % 5000 == 0){
+            add_scd(t, 420);
+        }
+    }
+    std::vector<SummaryRecord> sums = summaries_of(SAMPLE_STREAM_BMP3XX);
+    TEST_ASSERT_EQUAL(6, sums.size());
+    agg.finish();
+    sums = summaries_of(SAMPLE_STREAM_BMP3XX);
+    TEST_ASSERT_EQUAL(9, sums.size());
+
+    for(size_t i = 0; i < sums.size(); ++i){
+        TEST_ASSERT_EQUAL(SAMPLE_STREAM_BMP3XX, sums[i].source);
+        TEST_ASSERT_EQUAL(1 + i % 3, sums[i].column);
+        TEST_ASSERT_EQUAL(i / 3 * 10000, sums[i].hdr.uptime);
+        TEST_ASSERT_EQUAL(i < 6 ? 100 : 50, sums[i].count);
+    }
+    /* temp alternates 2000/2001 */
+    TEST_ASSERT_EQUAL(2000, sums[0].min);
+    TEST_ASSERT_EQUAL(2001, sums[0].max);
+    TEST_ASSERT_INT_WITHIN(1, 2000, sums[0].mean);
+    TEST_ASSERT_INT_WITHIN(1, 1, sums[0].stddev);
+    TEST_ASSERT_EQUAL(101300, sums[1].mean);
+    TEST_ASSERT_EQUAL(0, sums[2].max);
+    TEST_ASSERT_EQUAL(150, sums[5].min);
+
+    TEST_ASSERT_EQUAL(0, count_raw(SAMPLE_STREAM_BMP3XX));
+    TEST_ASSERT_EQUAL(5, count_raw(SAMPLE_STREAM_SCD4X));
+    TEST_ASSERT_EQUAL(255, agg.records_in);
+    TEST_ASSERT_EQUAL(5, agg.records_kept);
+    TEST_ASSERT_EQUAL(9, agg.summaries);
+    TEST_ASSERT_EQUAL(0, agg.events);
+}
+
+/* A stream that goes quiet still gets its summary once any record passes the end of its window */
+void test_quiet_stream(){
+    for(uint32_t t = 0; t < 3000; t += 100){
+        add_bmp(t, 2000, 101300, 0);
+    }
+    add_scd(9000, 420);
+    TEST_ASSERT_EQUAL(0, summaries_of(SAMPLE_STREAM_BMP3XX).size());
+    add_scd(14000, 420);
+    std::vector<SummaryRecord> sums = summaries_of(SAMPLE_STREAM_BMP3XX);
+    TEST_ASSERT_EQUAL(3, sums.size());
+    TEST_ASSERT_EQUAL(30, sums[0].count);
+    TEST_ASSERT_EQUAL(0, sums[0].hdr.uptime);
+
+    agg.finish();
+    TEST_ASSERT_EQUAL(3, summaries_of(SAMPLE_STREAM_BMP3XX).size());
+}
+
+/* A CO2 spike stores the raw records of the pre_ms before it and the post_ms after it, next to the summaries */
+void test_event_retention(){
+    for(uint32_t t = 0; t < 60000; t += 100){
+        add_bmp(t, 2000, 101300, 0);
+        if(t % 5000 == 0){
+            add_scd(t, t == 30000 ? 600 : 420);
+        }
+    }
+    agg.finish();
+    TEST_ASSERT_EQUAL(1, agg.events);
+
+    uint32_t first = UINT32_MAX, last = 0;
+    size_t raw = 0;
+    for(const std::vector<uint8_t>& rec : stored){
+        if(rec[0] == SAMPLE_STREAM_BMP3XX){
+            uint32_t t = uptime_of(rec);
+            first = t < first ? t : first;
+            last = t > last ? t : last;
+            raw++;
+        }
+    }
+    TEST_ASSERT_EQUAL(30000 - agg.config.pre_ms, first);
+    TEST_ASSERT_EQUAL(30000 + agg.config.post_ms, last);
+    TEST_ASSERT_EQUAL((agg.config.pre_ms + agg.config.post_ms) / 100 + 1, raw);
+    /* Retention does not take records out of the summaries */
+    TEST_ASSERT_EQUAL(18, summaries_of(SAMPLE_STREAM_BMP3XX).size());
+
+    /* A level over co2_high_ppm is an event too, and so is each later spike */
+    setUp();
+    add_scd(0, 420);
+    add_scd(5000, 2500);
+    add_scd(10000, 420);
+    add_scd(15000, 520);
+    TEST_ASSERT_EQUAL(2, agg.events);
+}
+
+void test_no_window(){
+    agg.config.window_ms = 0;
+    for(uint32_t t = 0; t < 20000; t += 100){
+        add_bmp(t, 2000, 101300, 0);
+    }
+    agg.finish();
+    TEST_ASSERT_EQUAL(200, count_raw(SAMPLE_STREAM_BMP3XX));
+    TEST_ASSERT_EQUAL(0, agg.summaries);
+    for(size_t i = 0; i < stored.size(); ++i){
+        TEST_ASSERT_EQUAL(i * 100, uptime_of(stored[i]));
+    }
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_channel_stats);
+    RUN_TEST(test_window_summaries);
+    RUN_TEST(test_quiet_stream);
+    RUN_TEST(test_event_retention);
+    RUN_TEST(test_no_window);
+    return UNITY_END();
+}
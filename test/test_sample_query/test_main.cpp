@@ -0,0 +1,217 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the sparse time index and range queries over it (lib/sample_query), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * Logs one run the way SampleStreams stores records (delta encoded, indexed as written) to the native HAL's
+ * file system, then queries it.
+*/
+
+#include <string.h>
+#include <unity.h>
+#include "hal.hpp"
+#include "log_writer.hpp"
+#include "log_journal.hpp"
+#include "delta_codec.hpp"
+#include "sample_index.hpp"
+#include "sample_query.hpp"
+
+#define RUN_MS 120000
+#define BMP_PERIOD_MS 20
+#define TELLO_PERIOD_MS 100
+#define MOTOR_START_MS 10000 /* Tello motor time starts counting here */
+#define RESULT_PATH "/test_query.bin"
+
+static uint32_t run;
+
+void setUp(){}
+void tearDown(){}
+
+static uint16_t motor_time(uint32_t uptime){
+    return uptime < MOTOR_START_MS ? 0 : (uptime - MOTOR_START_MS) / 1000;
+}
+
+/* As SampleStreams::store: encode, note the record in the index, then log it */
+static void store(LogWriter& log, SampleIndexWriter& index, DeltaEncoder& encoder, uint32_t& offset, const uint8_t* rec){
+    uint8_t out[DELTA_MAX_ENCODED];
+    size_t len = encoder.encode(rec, out);
+    TEST_ASSERT_GREATER_THAN(0, len);
+    index.add(rec, offset, out[0] == DELTA_SYNC_BYTE);
+    log.write(out, len);
+    offset += len;
+}
+
+/* Every other test queries the run this one writes */
+void test_write_indexed_run(){
+    LogWriter log;
+    SampleIndexWriter index;
+    DeltaEncoder encoder;
+    SampleLogHeader hdr;
+    sample_init_header(&hdr, SAMPLE_ENCODING_DELTA);
+    TEST_ASSERT_TRUE(log.beginRun((const uint8_t*)&hdr, sizeof(hdr)));
+    TEST_ASSERT_TRUE(index.begin(log.run(), sizeof(hdr)));
+    encoder.reset(sizeof(hdr));
+    uint32_t offset = sizeof(hdr);
+
+    for(uint32_t t = 0; t < RUN_MS; t += BMP_PERIOD_MS){
+        Bmp3xxRecord bmp;
+        memset(&bmp, 0, sizeof(bmp));
+        bmp.hdr = {SAMPLE_STREAM_BMP3XX, t};
+        bmp.temp = 2200 + (t / 1000) % 5;
+        bmp.pres = 101325 - t / 500;
+        bmp.alt = t / 400;
+        store(log, index, encoder, offset, (const uint8_t*)&bmp);
+        if(t % TELLO_PERIOD_MS == 0){
+            TelloRecord tello;
+            memset(&tello, 0, sizeof(tello));
+            tello.hdr = {SAMPLE_STREAM_TELLO, t};
+            tello.h = t / 400;
+            tello.bat = 100 - t / 6000;
+            tello.time = motor_time(t);
+            store(log, index, encoder, offset, (const uint8_t*)&tello);
+        }
+    }
+    run = log.run();
+    index.end(offset);
+    log.end();
+    TEST_ASSERT_GREATER_THAN(4, index.spans);
+}
+
+/* Decode a query result, checking every record is of an allowed stream and inside [from_ms, to_ms].
+ * Returns the records in it, counts[stream] per stream */
+static uint32_t read_result(uint32_t from_ms, uint32_t to_ms, uint8_t streams, uint32_t counts[SAMPLE_NUM_STREAMS]){
+    static uint8_t data[256 * 1024];
+    hal::File file;
+    TEST_ASSERT_TRUE(file.open(RESULT_PATH, "r"));
+    size_t len = file.read(data, sizeof(data));
+    file.close();
+    TEST_ASSERT_LESS_THAN(sizeof(data), len);
+
+    SampleLogHeader hdr;
+    TEST_ASSERT_TRUE(len >= sizeof(hdr));
+    memcpy(&hdr, data, sizeof(hdr));
+    TEST_ASSERT_TRUE(sample_check_header(&hdr));
+    TEST_ASSERT_EQUAL(SAMPLE_ENCODING_DELTA, hdr.encoding);
+
+    memset(counts, 0, SAMPLE_NUM_STREAMS * sizeof(uint32_t));
+    DeltaDecoder decoder;
+    uint8_t rec[SAMPLE_MAX_RECORD_SIZE];
+    size_t i = sizeof(hdr), rec_len;
+    uint32_t total = 0;
+    int used;
+    while(i < len && (used = decoder.decode(data + i, len - i, i, rec, &rec_len)) > 0){
+        if(rec_len){
+            uint32_t uptime;
+            memcpy(&uptime, rec + offsetof(SampleRecordHeader, uptime), sizeof(uptime));
+            TEST_ASSERT_TRUE(uptime >= from_ms && uptime <= to_ms);
+            TEST_ASSERT_TRUE(!streams || (streams & (1 << rec[0])));
+            counts[rec[0]]++;
+            total++;
+        }
+        i += used;
+    }
+    TEST_ASSERT_EQUAL(len, i);
+    return total;
+}
+
+/* Only the spans overlapping the range are read, and the result holds exactly the records in it */
+void test_uptime_range(){
+    SampleQuery q;
+    q.run = run;
+    q.from = 30000;
+    q.to = 35000;
+    SampleQueryStats stats;
+    TEST_ASSERT_TRUE(q.answer(RESULT_PATH, &stats));
+    TEST_ASSERT_EQUAL(run, stats.run);
+    TEST_ASSERT_GREATER_THAN(0, stats.spans_read);
+    TEST_ASSERT_LESS_THAN(stats.spans, stats.spans_read);
+    TEST_ASSERT_LESS_THAN(stats.log_bytes / 2, stats.bytes_read);
+
+    uint32_t counts[SAMPLE_NUM_STREAMS];
+    uint32_t total = read_result(q.from, q.to, 0, counts);
+    TEST_ASSERT_EQUAL(5000 / BMP_PERIOD_MS + 1, counts[SAMPLE_STREAM_BMP3XX]);
+    TEST_ASSERT_EQUAL(5000 / TELLO_PERIOD_MS + 1, counts[SAMPLE_STREAM_TELLO]);
+    TEST_ASSERT_EQUAL(stats.records_out, total);
+}
+
+void test_streams_and_every(){
+    SampleQuery q;
+    q.run = 0; /* The latest */
+    q.from = 0;
+    q.to = 9999;
+    q.streams = 1 << SAMPLE_STREAM_TELLO;
+    q.every = 4;
+    SampleQueryStats stats;
+    TEST_ASSERT_TRUE(q.answer(RESULT_PATH, &stats));
+    TEST_ASSERT_EQUAL(run, stats.run);
+
+    uint32_t counts[SAMPLE_NUM_STREAMS];
+    read_result(q.from, q.to, q.streams, counts);
+    TEST_ASSERT_EQUAL(10000 / TELLO_PERIOD_MS / 4, counts[SAMPLE_STREAM_TELLO]);
+}
+
+/* Motor time becomes the uptimes of the Tello records that carry it */
+void test_motor_time_range(){
+    SampleQuery q;
+    q.run = run;
+    q.key = SAMPLE_QUERY_MOTOR_TIME;
+    q.from = 20;
+    q.to = 24;
+    SampleQueryStats stats;
+    TEST_ASSERT_TRUE(q.answer(RESULT_PATH, &stats));
+    TEST_ASSERT_EQUAL(MOTOR_START_MS + 20000, stats.from_ms);
+    TEST_ASSERT_EQUAL(MOTOR_START_MS + 25000 - TELLO_PERIOD_MS, stats.to_ms);
+    TEST_ASSERT_LESS_THAN(stats.spans, stats.spans_read);
+
+    uint32_t counts[SAMPLE_NUM_STREAMS];
+    read_result(stats.from_ms, stats.to_ms, 0, counts);
+    TEST_ASSERT_EQUAL(5000 / TELLO_PERIOD_MS, counts[SAMPLE_STREAM_TELLO]);
+}
+
+/* Without its index a run is scanned whole, with the same answer */
+void test_without_index(){
+    char path[SAMPLE_INDEX_PATH_LEN];
+    sample_index_path(path, run);
+    TEST_ASSERT_TRUE(hal::file_remove(path));
+
+    SampleQuery q;
+    q.run = run;
+    q.from = 30000;
+    q.to = 35000;
+    SampleQueryStats stats;
+    TEST_ASSERT_TRUE(q.answer(RESULT_PATH, &stats));
+    TEST_ASSERT_EQUAL(0, stats.spans);
+    TEST_ASSERT_EQUAL(stats.log_bytes - sizeof(SampleLogHeader), stats.bytes_read);
+
+    uint32_t counts[SAMPLE_NUM_STREAMS];
+    read_result(q.from, q.to, 0, counts);
+    TEST_ASSERT_EQUAL(5000 / BMP_PERIOD_MS + 1, counts[SAMPLE_STREAM_BMP3XX]);
+    TEST_ASSERT_EQUAL(5000 / TELLO_PERIOD_MS + 1, counts[SAMPLE_STREAM_TELLO]);
+}
+
+void test_malformed_request(){
+    uint8_t req[SAMPLE_QUERY_LEN] = {SAMPLE_QUERY_REQUEST};
+    SampleQuery q;
+    TEST_ASSERT_FALSE(q.parse(req, SAMPLE_QUERY_LEN - 1));
+    req[3] = SAMPLE_QUERY_MOTOR_TIME + 1;
+    TEST_ASSERT_FALSE(q.parse(req, SAMPLE_QUERY_LEN));
+
+    /* to before from */
+    req[3] = SAMPLE_QUERY_UPTIME;
+    req[4] = 1;
+    TEST_ASSERT_FALSE(q.parse(req, SAMPLE_QUERY_LEN));
+    req[8] = 2;
+    TEST_ASSERT_TRUE(q.parse(req, SAMPLE_QUERY_LEN));
+    TEST_ASSERT_EQUAL(1, q.every);
+}
+
+int main(){
+    hal::fs_begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_write_indexed_run);
+    RUN_TEST(test_uptime_range);
+    RUN_TEST(test_streams_and_every);
+    RUN_TEST(test_motor_time_range);
+    RUN_TEST(test_without_index);
+    RUN_TEST(test_malformed_request);
+    return UNITY_END();
+}
@@ -0,0 +1,103 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for SeqLatch (lib/tello_ctrl/seq_latch), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * The concurrent case runs a writer and readers on threads of their own, as the rx task and its readers run.
+*/
+
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <unity.h>
+#include "seq_latch.hpp"
+
+#define WORDS 32 /* Big enough that a copy takes a while, so readers overlap the writer */
+#define PUBLISHES 200000
+#define READERS 3
+
+/* Every word holds the publish count, a torn read mixes two of them */
+struct Value{
+    uint32_t word[WORDS];
+};
+
+static Value make(uint32_t n){
+    Value v;
+    for(int i = 0; i < WORDS; ++i){
+        v.word[i] = n;
+    }
+    return v;
+}
+
+static bool consistent(const Value& v){
+    for(int i = 1; i < WORDS; ++i){
+        if(v.word[i] != v.word[0]){
+            return false;
+        }
+    }
+    return true;
+}
+
+void setUp(){}
+void tearDown(){}
+
+void test_read_latest(){
+    SeqLatch<Value> latch;
+    Value v;
+    latch.publish(make(7));
+    latch.read(v);
+    TEST_ASSERT_EQUAL(7, v.word[0]);
+    TEST_ASSERT_TRUE(consistent(v));
+    latch.publish(make(8));
+    latch.publish(make(9));
+    latch.read(v);
+    TEST_ASSERT_EQUAL(9, v.word[WORDS - 1]);
+    TEST_ASSERT_TRUE(consistent(v));
+}
+
+/* Readers racing the writer never see a torn value, and never see one older than the last they saw */
+void test_concurrent_reads(){
+    static SeqLatch<Value> latch;
+    latch.publish(make(0));
+    std::atomic<bool> done(false);
+    std::atomic<uint32_t> torn(0), backwards(0), reads(0);
+
+    std::thread readers[READERS];
+    for(int r = 0; r < READERS; ++r){
+        readers[r] = std::thread([&]{
+            uint32_t last = 0;
+            Value v;
+            while(!done.load()){
+                latch.read(v);
+                if(!consistent(v)){
+                    torn++;
+                }
+                if(v.word[0] < last){
+                    backwards++;
+                }
+                last = v.word[0];
+                reads++;
+            }
+        });
+    }
+    for(uint32_t n = 1; n <= PUBLISHES; ++n){
+        latch.publish(make(n));
+    }
+    done = true;
+    for(int r = 0; r < READERS; ++r){
+        readers[r].join();
+    }
+
+    TEST_ASSERT_GREATER_THAN(0, reads.load());
+    TEST_ASSERT_EQUAL(0, torn.load());
+    TEST_ASSERT_EQUAL(0, backwards.load());
+    Value v;
+    latch.read(v);
+    TEST_ASSERT_EQUAL(PUBLISHES, v.word[0]);
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_read_latest);
+    RUN_TEST(test_concurrent_reads);
+    return UNITY_END();
+}
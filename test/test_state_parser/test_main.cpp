@@ -0,0 +1,123 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for parsing Tello state packets (lib/tello_ctrl/tello_state_parser), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <unity.h>
+#include "tello_state_parser.hpp"
+
+/* As sent by a Tello on SDK 1.3 */
+static const char* packet =
+    "pitch:-2;roll:3;yaw:-45;vgx:1;vgy:-1;vgz:0;templ:60;temph:63;tof:42;h:30;bat:87;baro:152.31;time:12;"
+    "agx:-3.00;agy:1.00;agz:-999.00;\r\n";
+
+void setUp(){}
+void tearDown(){}
+
+static TelloParseResult parse(const char* buf, TelloState* state){
+    return parse_tello_state(buf, strlen(buf), state);
+}
+
+void test_full_packet(){
+    TelloState state;
+    TelloParseResult res = parse(packet, &state);
+    TEST_ASSERT_TRUE(res.ok());
+    TEST_ASSERT_EQUAL_HEX16(TELLO_ALL_FIELDS, res.found);
+    TEST_ASSERT_EQUAL(0, res.unknown);
+    TEST_ASSERT_EQUAL_INT(-2, state.pitch);
+    TEST_ASSERT_EQUAL_INT(-45, state.yaw);
+    TEST_ASSERT_EQUAL_INT(42, state.tof);
+    TEST_ASSERT_EQUAL_INT(87, state.bat);
+    TEST_ASSERT_EQUAL_INT(12, state.time);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 152.31, state.baro);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, -999.0, state.agz);
+}
+
+/* Fields are matched by key, so order does not matter and newer SDKs' extra keys are skipped */
+void test_order_and_unknown_keys(){
+    TelloState state;
+    TelloParseResult res = parse(
+        "mid:-1;x:0;y:0;z:0;agz:-1001.00;agy:2.00;agx:0.00;time:5;baro:-3.5;bat:50;h:10;tof:20;temph:70;templ:68;"
+        "vgz:-2;vgy:0;vgx:0;yaw:90;roll:0;pitch:1;\r\n", &state);
+    TEST_ASSERT_TRUE(res.ok());
+    TEST_ASSERT_EQUAL(4, res.unknown);
+    TEST_ASSERT_EQUAL_INT(90, state.yaw);
+    TEST_ASSERT_EQUAL_INT(-2, state.vgz);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, -3.5, state.baro);
+}
+
+void test_missing_field(){
+    TelloState state;
+    TelloParseResult res = parse("pitch:0;roll:0;yaw:0;\r\n", &state);
+    TEST_ASSERT_FALSE(res.ok());
+    TEST_ASSERT_EQUAL_HEX16((1 << TELLO_PITCH) | (1 << TELLO_ROLL) | (1 << TELLO_YAW), res.found);
+    TEST_ASSERT_EQUAL_HEX16(TELLO_ALL_FIELDS & ~res.found, res.missing());
+}
+
+void test_malformed_value(){
+    char buf[TELLO_STATE_MAX_LEN];
+    strcpy(buf, packet);
+    memcpy(strstr(buf, "bat:87"), "bat:8x", 6);
+    TelloState state;
+    TelloParseResult res = parse(buf, &state);
+    TEST_ASSERT_FALSE(res.ok());
+    TEST_ASSERT_EQUAL_HEX16(1 << TELLO_BAT, res.malformed);
+    TEST_ASSERT_EQUAL_HEX16(0, res.missing());
+}
+
+/* Only len bytes are read, the packet need not be terminated */
+void test_length_bounded(){
+    size_t cut = strstr(packet, "agz:") - packet;
+    TelloState state;
+    TelloParseResult res = parse_tello_state(packet, cut, &state);
+    TEST_ASSERT_FALSE(res.ok());
+    TEST_ASSERT_EQUAL_HEX16(1 << TELLO_AGZ, res.missing());
+
+    /* A value cut short by the end of the buffer still parses, as the last field of a packet without its ';' */
+    res = parse_tello_state(packet, strlen(packet) - 4, &state);
+    TEST_ASSERT_TRUE(res.ok());
+    TEST_ASSERT_FLOAT_WITHIN(0.001, -999.0, state.agz);
+}
+
+/* format_tello_state writes what parse_tello_state reads */
+void test_format_round_trip(){
+    TelloState in, out;
+    parse(packet, &in);
+    char buf[TELLO_STATE_MAX_LEN];
+    int n = format_tello_state(in, buf, sizeof(buf));
+    TEST_ASSERT_TRUE(n > 0 && n < (int)sizeof(buf));
+    TEST_ASSERT_TRUE(parse_tello_state(buf, n, &out).ok());
+    for(int i = 0; i < TELLO_NUM_FIELDS; ++i){
+        TEST_ASSERT_EQUAL_INT32(tello_state_value(in, i), tello_state_value(out, i));
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.001, in.baro, out.baro);
+}
+
+/* A buffer too small is filled and terminated, never written past, and the full length is still returned */
+void test_format_truncated(){
+    TelloState in;
+    parse(packet, &in);
+    char full[TELLO_STATE_MAX_LEN];
+    int n = format_tello_state(in, full, sizeof(full));
+    char buf[40];
+    memset(buf, '#', sizeof(buf));
+    TEST_ASSERT_EQUAL_INT(n, format_tello_state(in, buf, 32));
+    TEST_ASSERT_EQUAL_INT('\0', buf[31]);
+    TEST_ASSERT_EQUAL_MEMORY(full, buf, 31);
+    for(size_t i = 32; i < sizeof(buf); ++i){
+        TEST_ASSERT_EQUAL_INT('#', buf[i]);
+    }
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_full_packet);
+    RUN_TEST(test_order_and_unknown_keys);
+    RUN_TEST(test_missing_field);
+    RUN_TEST(test_malformed_value);
+    RUN_TEST(test_length_bounded);
+    RUN_TEST(test_format_round_trip);
+    RUN_TEST(test_format_truncated);
+    return UNITY_END();
+}
@@ -0,0 +1,145 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the in-flight telemetry snapshot (lib/sensor_sched/telemetry), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <unity.h>
+#include "hal.hpp"
+#include "telemetry.hpp"
+
+/* Fresh for every test, nothing published yet */
+static LogWriter* logger;
+static TelloControl* tello;
+static SampleStreams* streams;
+static TelemetryBuilder* builder;
+
+void setUp(){
+    logger = new LogWriter();
+    tello = new TelloControl();
+    streams = new SampleStreams(*logger, *tello);
+    builder = new TelemetryBuilder();
+}
+void tearDown(){
+    delete builder;
+    delete streams;
+    delete tello;
+    delete logger;
+}
+
+static AltitudeEstimate flying(float alt_cm, uint32_t seq){
+    AltitudeEstimate alt;
+    alt.alt_cm = alt_cm;
+    alt.vz_cms = -20.6f;
+    alt.grounded = false;
+    alt.calibrated = true;
+    alt.seq = seq;
+    return alt;
+}
+
+/* Before anything is published the frame only says so, and the same again is skipped */
+void test_nothing_yet(){
+    TelemetryFrame frame;
+    TEST_ASSERT_TRUE(builder->build(*streams, *tello, 1000, &frame));
+    TEST_ASSERT_EQUAL(TELEMETRY_VERSION, frame.version);
+    TEST_ASSERT_EQUAL(TELEMETRY_GROUNDED, frame.flags);
+    TEST_ASSERT_EQUAL(0, frame.seq);
+    TEST_ASSERT_EQUAL(1000, frame.uptime);
+    TEST_ASSERT_EQUAL(TELEMETRY_NO_AGE, frame.tello_age_ms);
+
+    frame.seq = 99;
+    TEST_ASSERT_FALSE(builder->build(*streams, *tello, 1200, &frame));
+    TEST_ASSERT_EQUAL(99, frame.seq);
+    TEST_ASSERT_EQUAL(1, builder->frames);
+    TEST_ASSERT_EQUAL(1, builder->unchanged);
+}
+
+void test_values(){
+    streams->altitude.publish(flying(123.7f, 1));
+    Position pos;
+    pos.x_cm = -250.4f;
+    pos.y_cm = 80;
+    pos.valid = true;
+    streams->position.publish(pos);
+    EnergyEstimate energy;
+    energy.margin_pct = 12.34f;
+    energy.seq = 1;
+    streams->energy.publish(energy);
+    SensorReadings readings;
+    readings.scd4x_ms = 5000;
+    readings.co2 = 612;
+    readings.scd4x_temp = 2143;
+    readings.humd = 4512;
+    readings.bmp3xx_ms = 5100;
+    readings.bmp3xx_temp = 2201;
+    readings.pres = 100930;
+    readings.seq = 2;
+    streams->readings.publish(readings);
+    TelloState state;
+    state.pitch = -3;
+    state.roll = 2;
+    state.yaw = -170;
+    state.bat = 76;
+    state.time = 41;
+    tello->publish_state(state, hal::micros() - 50000);
+
+    TelemetryFrame frame;
+    TEST_ASSERT_TRUE(builder->build(*streams, *tello, 6000, &frame));
+    TEST_ASSERT_EQUAL(TELEMETRY_ALT_CALIBRATED | TELEMETRY_POSITION_VALID | TELEMETRY_TELLO | TELEMETRY_SCD4X | TELEMETRY_BMP3XX,
+                      frame.flags);
+    TEST_ASSERT_EQUAL(123, frame.alt_cm);
+    TEST_ASSERT_EQUAL(-20, frame.vz_cms);
+    TEST_ASSERT_EQUAL(-250, frame.x_cm);
+    TEST_ASSERT_EQUAL(80, frame.y_cm);
+    TEST_ASSERT_EQUAL(-3, frame.pitch);
+    TEST_ASSERT_EQUAL(2, frame.roll);
+    TEST_ASSERT_EQUAL(-170, frame.yaw);
+    TEST_ASSERT_EQUAL(76, frame.bat);
+    TEST_ASSERT_EQUAL(41, frame.motor_time);
+    TEST_ASSERT_EQUAL(123, frame.margin);
+    TEST_ASSERT_EQUAL(612, frame.co2);
+    TEST_ASSERT_EQUAL(2143, frame.scd4x_temp);
+    TEST_ASSERT_EQUAL(4512, frame.humd);
+    TEST_ASSERT_EQUAL(2201, frame.bmp3xx_temp);
+    TEST_ASSERT_EQUAL(100930, frame.pres);
+    TEST_ASSERT_TRUE(frame.tello_age_ms >= 50 && frame.tello_age_ms < 1000);
+
+    /* Out of range values saturate rather than wrap */
+    streams->altitude.publish(flying(1e6f, 2));
+    pos.x_cm = -1e6f;
+    streams->position.publish(pos);
+    TEST_ASSERT_TRUE(builder->build(*streams, *tello, 6200, &frame));
+    TEST_ASSERT_EQUAL(32767, frame.alt_cm);
+    TEST_ASSERT_EQUAL(-32768, frame.x_cm);
+    TEST_ASSERT_EQUAL(1, frame.seq);
+}
+
+/* Updates between two frames are coalesced into the latest, and new updates with the same values send nothing */
+void test_coalesced(){
+    TelemetryFrame frame;
+    for(uint32_t seq = 1; seq <= 5; ++seq){
+        streams->altitude.publish(flying(100 + seq, seq));
+    }
+    TEST_ASSERT_TRUE(builder->build(*streams, *tello, 1000, &frame));
+    TEST_ASSERT_EQUAL(105, frame.alt_cm);
+    TEST_ASSERT_EQUAL(4, builder->coalesced);
+
+    /* The fusion keeps publishing on the ground, a fraction of a cm changes nothing that is sent */
+    streams->altitude.publish(flying(105.2f, 6));
+    TEST_ASSERT_FALSE(builder->build(*streams, *tello, 1200, &frame));
+    streams->altitude.publish(flying(110, 7));
+    TEST_ASSERT_TRUE(builder->build(*streams, *tello, 1400, &frame));
+    TEST_ASSERT_EQUAL(1, frame.seq);
+    TEST_ASSERT_EQUAL(110, frame.alt_cm);
+    TEST_ASSERT_EQUAL(2, builder->frames);
+    TEST_ASSERT_EQUAL(1, builder->unchanged);
+    TEST_ASSERT_EQUAL(4, builder->coalesced);
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_nothing_yet);
+    RUN_TEST(test_values);
+    RUN_TEST(test_coalesced);
+    return UNITY_END();
+}
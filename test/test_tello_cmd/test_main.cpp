@@ -0,0 +1,217 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the Tello command engine (lib/tello_ctrl), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+ *
+ * The engine and receive task run as they do on the drone, against a scripted stand-in for the Tello on
+ * 127.0.0.1:8889 that can answer, answer late, lose datagrams or stay silent. Needs ports 8889 and 8890 free.
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unity.h>
+#include "hal.hpp"
+#include "tello_ctrl.hpp"
+
+/* Scripted Tello ------------------------------------------------------------------------------------------------------------- */
+
+static std::mutex script_lock;
+static std::string reply = "ok";   /* Answer to every command, empty for none */
+static std::string fail_cmd;       /* Answered with "error" instead */
+static uint32_t reply_delay_ms = 0;
+static int lose = 0;               /* Datagrams to ignore before answering again */
+static std::atomic<int> received(0);
+
+static void fake_tello(int sock){
+    char buf[64];
+    sockaddr_in from;
+    socklen_t from_len;
+    while(1){
+        from_len = sizeof(from);
+        int n = recvfrom(sock, buf, sizeof(buf) - 1, 0, (sockaddr*)&from, &from_len);
+        if(n <= 0){
+            continue;
+        }
+        buf[n] = '\0';
+        received++;
+        std::string resp;
+        uint32_t delay;
+        {
+            std::lock_guard<std::mutex> lk(script_lock);
+            if(lose > 0){
+                lose--;
+                continue;
+            }
+            resp = fail_cmd == buf ? "error" : reply;
+            delay = reply_delay_ms;
+        }
+        if(resp.empty()){
+            continue;
+        }
+        hal::delay(delay);
+        sendto(sock, resp.data(), resp.size(), 0, (sockaddr*)&from, from_len);
+    }
+}
+
+static void script(const char* resp, uint32_t delay_ms = 0, int lost = 0, const char* fail = ""){
+    std::lock_guard<std::mutex> lk(script_lock);
+    reply = resp;
+    reply_delay_ms = delay_ms;
+    lose = lost;
+    fail_cmd = fail;
+}
+
+static TelloControl tello;
+
+static bool start(){
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tello.control_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock < 0 || bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0){
+        return false;
+    }
+    std::thread(fake_tello, sock).detach();
+
+    tello.ip = "127.0.0.1";
+    tello.control_bind_port = 0;
+    return tello.bindPorts() && tello.start_rx_task(6, 0) && tello.start_cmd_engine(8, 1);
+}
+
+/* Wait for a command submitted with notify set to this task, as flight plans do */
+static TelloCmdStatus finish(TelloCommand& cmd){
+    while(cmd.status == TELLO_CMD_PENDING){
+        hal::notify_wait(TELLO_CMD_NOTIFY_BIT, NULL, 100);
+    }
+    return cmd.status;
+}
+
+/* Tests ---------------------------------------------------------------------------------------------------------------------- */
+
+void setUp(){
+    script("ok");
+    received = 0;
+}
+void tearDown(){}
+
+/* Only commands that are safe to repeat are retried, and movements get longer to answer */
+void test_default_policy(){
+    TEST_ASSERT_EQUAL(TELLO_CMD_TIMEOUT_MS, tello_cmd_default_timeout("battery?"));
+    TEST_ASSERT_EQUAL(TELLO_CMD_RETRIES, tello_cmd_default_retries("battery?"));
+    TEST_ASSERT_EQUAL(TELLO_CMD_RETRIES, tello_cmd_default_retries("speed 50"));
+    TEST_ASSERT_EQUAL(TELLO_MOVE_TIMEOUT_MS, tello_cmd_default_timeout("forward 50"));
+    TEST_ASSERT_EQUAL(0, tello_cmd_default_retries("forward 50"));
+    TEST_ASSERT_EQUAL(TELLO_TAKEOFF_TIMEOUT_MS, tello_cmd_default_timeout("takeoff"));
+    TEST_ASSERT_EQUAL(0, tello_cmd_default_retries("takeoff"));
+    TEST_ASSERT_EQUAL(TELLO_MOVE_TIMEOUT_MS, tello_cmd_default_timeout("land"));
+    TEST_ASSERT_EQUAL(TELLO_CMD_RETRIES, tello_cmd_default_retries("land"));
+}
+
+void test_reply(){
+    script("87\r\n");
+    TelloCommand cmd("battery?");
+    TEST_ASSERT_EQUAL(TELLO_CMD_OK, tello.send_cmd(&cmd));
+    TEST_ASSERT_EQUAL_STRING("87", cmd.resp);
+    TEST_ASSERT_EQUAL(1, cmd.attempts);
+    TEST_ASSERT_GREATER_THAN(0, cmd.rtt_us);
+
+    script("error Motor stop");
+    TelloCommand err("forward 50");
+    TEST_ASSERT_EQUAL(TELLO_CMD_ERROR, tello.send_cmd(&err));
+    TEST_ASSERT_EQUAL_STRING("error Motor stop", err.resp);
+}
+
+/* A lost datagram is resent, as many times as the command allows, then it times out */
+void test_retries(){
+    TelloLinkStats before = tello.get_link_stats();
+    script("ok", 0, 1);
+    TelloCommand cmd("battery?", 100, 2);
+    TEST_ASSERT_EQUAL(TELLO_CMD_OK, tello.send_cmd(&cmd));
+    TEST_ASSERT_EQUAL(2, cmd.attempts);
+
+    script("");
+    TelloCommand silent("speed 50", 50, 1);
+    TEST_ASSERT_EQUAL(TELLO_CMD_TIMEOUT, tello.send_cmd(&silent));
+    TEST_ASSERT_EQUAL(2, silent.attempts);
+    TEST_ASSERT_EQUAL(4, received.load());
+
+    TelloLinkStats after = tello.get_link_stats();
+    TEST_ASSERT_EQUAL(2, after.retries - before.retries);
+    TEST_ASSERT_EQUAL(1, after.timeouts - before.timeouts);
+    TEST_ASSERT_EQUAL(4, after.sent - before.sent);
+}
+
+/* A reply that arrives after its command timed out is not taken for the next command's */
+void test_late_reply_discarded(){
+    TelloLinkStats before = tello.get_link_stats();
+    script("late", 150);
+    TelloCommand slow("forward 50", 50, 0);
+    TEST_ASSERT_EQUAL(TELLO_CMD_TIMEOUT, tello.send_cmd(&slow));
+    script("ok");
+    hal::delay(250);
+    TelloCommand next("battery?");
+    TEST_ASSERT_EQUAL(TELLO_CMD_OK, tello.send_cmd(&next));
+    TEST_ASSERT_EQUAL_STRING("ok", next.resp);
+    TEST_ASSERT_EQUAL(1, tello.get_link_stats().stale - before.stale);
+}
+
+/* Once a command fails, the ones chained after it for the same task are cancelled unsent, until one that is not
+ * chained goes through */
+void test_chained_cancel(){
+    script("ok", 20, 0, "forward 50");
+    TelloCommand a("up 50", 500, 0), b("forward 50", 500, 0), c("cw 90", 500, 0), d("back 50", 500, 0), e("battery?");
+    TelloCommand* cmds[] = {&a, &b, &c, &d, &e};
+    for(TelloCommand* cmd : cmds){
+        cmd->notify = hal::current_task();
+        cmd->chained = cmd != &a && cmd != &e;
+        TEST_ASSERT_TRUE(tello.submit(cmd));
+    }
+    TEST_ASSERT_EQUAL(TELLO_CMD_OK, finish(a));
+    TEST_ASSERT_EQUAL(TELLO_CMD_ERROR, finish(b));
+    TEST_ASSERT_EQUAL(TELLO_CMD_CANCELLED, finish(c));
+    TEST_ASSERT_EQUAL(TELLO_CMD_CANCELLED, finish(d));
+    TEST_ASSERT_EQUAL(TELLO_CMD_OK, finish(e));
+    TEST_ASSERT_EQUAL(0, c.attempts);
+    TEST_ASSERT_EQUAL(3, received.load());
+}
+
+/* With the queue full, a command is rejected at once rather than blocking the caller */
+void test_queue_full(){
+    script("ok", 100);
+    static TelloCommand cmds[TELLO_CMD_QUEUE_LEN + 2];
+    int rejected = 0;
+    for(TelloCommand& cmd : cmds){
+        cmd = TelloCommand("battery?");
+        if(!tello.submit(&cmd)){
+            TEST_ASSERT_EQUAL(TELLO_CMD_REJECTED, cmd.status);
+            rejected++;
+        }
+    }
+    TEST_ASSERT_GREATER_THAN(0, rejected);
+    for(TelloCommand& cmd : cmds){
+        tello.wait(&cmd);
+    }
+}
+
+int main(){
+    if(!start()){
+        printf("Unable to start the command engine against 127.0.0.1:8889\n");
+        return 1;
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_default_policy);
+    RUN_TEST(test_reply);
+    RUN_TEST(test_retries);
+    RUN_TEST(test_late_reply_discarded);
+    RUN_TEST(test_chained_cancel);
+    RUN_TEST(test_queue_full);
+    return UNITY_END();
+}
@@ -0,0 +1,162 @@
+/* EcoDrone: Autonomous Environmental Monitoring
+ * Unit tests for the dead-reckoned position track and the voxel map (lib/voxel_map), run with "pio test -e native"
+ * Author: Brandon Lee, brandon.kf.lee@gmail.com
+*/
+
+#include <string.h>
+#include <vector>
+#include <unity.h>
+#include "voxel_map.hpp"
+
+static VoxelMap map;
+
+void setUp(){
+    map.clear();
+}
+void tearDown(){}
+
+static Position at(float x, float y, float z){
+    Position p;
+    p.x_cm = x;
+    p.y_cm = y;
+    p.z_cm = z;
+    p.valid = true;
+    return p;
+}
+
+/* 2 s at 50 cm/s along the takeoff heading, then 1 s to the right after turning 90 degrees clockwise */
+void test_dead_reckoning(){
+    DeadReckoner dr;
+    uint32_t t = 1000;
+    TEST_ASSERT_FALSE(dr.pos.valid);
+    for(int i = 0; i <= 20; ++i, t += 100){
+        dr.update(t, 5, 0, 0, false);
+    }
+    TEST_ASSERT_TRUE(dr.pos.valid);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 100, dr.pos.x_cm);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 0, dr.pos.y_cm);
+
+    /* The first packet after the turn still averages in the old heading */
+    dr.update(t, 5, 0, 90, false);
+    for(int i = 0; i < 10; ++i){
+        t += 100;
+        dr.update(t, 5, 0, 90, false);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 102.5f, dr.pos.x_cm);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 52.5f, dr.pos.y_cm);
+
+    /* Sideways velocity in the drone's frame, heading 90 degrees, is backwards in the takeoff frame */
+    DeadReckoner side;
+    side.update(0, 0, 5, 90, false);
+    side.update(400, 0, 5, 90, false);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, -20, side.pos.x_cm);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 0, side.pos.y_cm);
+}
+
+/* Nothing is integrated on the pad or across a gap longer than max_gap_ms */
+void test_dead_reckoning_holds(){
+    DeadReckoner dr;
+    dr.update(0, 5, 5, 0, true);
+    dr.update(100, 5, 5, 0, true);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, dr.pos.x_cm);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, dr.pos.y_cm);
+
+    dr.reset();
+    TEST_ASSERT_FALSE(dr.pos.valid);
+    dr.update(200, 5, 0, 0, false);
+    dr.update(200 + dr.config.max_gap_ms + 1, 5, 0, 0, false);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, dr.pos.x_cm);
+    TEST_ASSERT_EQUAL(200 + dr.config.max_gap_ms + 1, dr.pos.uptime);
+}
+
+void test_map_means(){
+    TEST_ASSERT_TRUE(map.add_co2(at(10, 10, 10), 400));
+    TEST_ASSERT_TRUE(map.add_co2(at(49, 0, 49), 500));
+    TEST_ASSERT_TRUE(map.add_temp(at(0, 0, 0), 20.5f));
+    TEST_ASSERT_TRUE(map.add_temp(at(1, 1, 1), 21.5f));
+    TEST_ASSERT_EQUAL(1, map.size());
+    /* Negative positions round down, so -1 cm is in a different cube from +1 cm */
+    TEST_ASSERT_TRUE(map.add_co2(at(-1, 0, 0), 450));
+    TEST_ASSERT_EQUAL(2, map.size());
+
+    Position nowhere;
+    TEST_ASSERT_FALSE(map.add_co2(nowhere, 400));
+    TEST_ASSERT_FALSE(map.add_temp(nowhere, 20));
+    TEST_ASSERT_EQUAL(2, map.size());
+    TEST_ASSERT_EQUAL(0, map.dropped);
+}
+
+/* Once VOXEL_MAP_MAX_FILL cubes are in use new cubes are dropped, old ones still take readings */
+void test_map_full(){
+    uint32_t n = 0;
+    for(int z = 0; n < VOXEL_MAP_MAX_FILL; ++z){
+        for(int y = -4; y < 4 && n < VOXEL_MAP_MAX_FILL; ++y){
+            for(int x = -4; x < 4 && n < VOXEL_MAP_MAX_FILL; ++x, ++n){
+                TEST_ASSERT_TRUE(map.add_co2(at(x * VOXEL_CELL_CM, y * VOXEL_CELL_CM, z * VOXEL_CELL_CM), 400));
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL(VOXEL_MAP_MAX_FILL, map.size());
+    TEST_ASSERT_FALSE(map.add_co2(at(0, 0, -100), 400));
+    TEST_ASSERT_FALSE(map.add_temp(at(0, 0, -100), 20));
+    TEST_ASSERT_EQUAL(2, map.dropped);
+    TEST_ASSERT_TRUE(map.add_co2(at(0, 0, 0), 400));
+    TEST_ASSERT_EQUAL(VOXEL_MAP_MAX_FILL, map.size());
+
+    map.clear();
+    TEST_ASSERT_EQUAL(0, map.size());
+    TEST_ASSERT_EQUAL(0, map.dropped);
+}
+
+/* The saved map is sorted by (z, y, x) and holds the rounded means */
+void test_save(){
+    TEST_ASSERT_TRUE(hal::fs_begin());
+    map.add_co2(at(60, 0, 0), 401);
+    map.add_co2(at(60, 0, 0), 402);
+    map.add_co2(at(-60, 0, 100), 900);
+    map.add_temp(at(-60, 0, 100), 19.254f);
+    map.add_co2(at(0, -60, 0), 600);
+    map.add_co2(at(0, -60, 0), 800);
+
+    TEST_ASSERT_TRUE(map.save("/test_voxels.bin"));
+    hal::File f;
+    TEST_ASSERT_TRUE(f.open("/test_voxels.bin", "r"));
+    VoxelFileHeader hdr;
+    TEST_ASSERT_EQUAL(sizeof(hdr), f.read(&hdr, sizeof(hdr)));
+    TEST_ASSERT_EQUAL(VOXEL_FILE_MAGIC, hdr.magic);
+    TEST_ASSERT_EQUAL(VOXEL_FILE_VERSION, hdr.version);
+    TEST_ASSERT_EQUAL(VOXEL_CELL_CM, hdr.cell_cm);
+    TEST_ASSERT_EQUAL(3, hdr.count);
+    TEST_ASSERT_EQUAL(0, hdr.dropped);
+    VoxelCellRecord recs[3];
+    TEST_ASSERT_EQUAL(sizeof(recs), f.read(recs, sizeof(recs)));
+    TEST_ASSERT_EQUAL(0, f.read(recs, 1));
+    f.close();
+    hal::file_remove("/test_voxels.bin");
+
+    TEST_ASSERT_EQUAL(-2, recs[0].y);
+    TEST_ASSERT_EQUAL(2, recs[0].co2_n);
+    TEST_ASSERT_EQUAL(700, recs[0].co2_mean);
+    TEST_ASSERT_EQUAL(800, recs[0].co2_max);
+    TEST_ASSERT_EQUAL(0, recs[0].temp_n);
+
+    TEST_ASSERT_EQUAL(1, recs[1].x);
+    TEST_ASSERT_EQUAL(0, recs[1].y);
+    TEST_ASSERT_EQUAL(0, recs[1].z);
+    TEST_ASSERT_EQUAL(402, recs[1].co2_mean);
+
+    TEST_ASSERT_EQUAL(-2, recs[2].x);
+    TEST_ASSERT_EQUAL(2, recs[2].z);
+    TEST_ASSERT_EQUAL(1, recs[2].temp_n);
+    TEST_ASSERT_EQUAL(1925, recs[2].temp_mean);
+}
+
+int main(){
+    UNITY_BEGIN();
+    RUN_TEST(test_dead_reckoning);
+    RUN_TEST(test_dead_reckoning_holds);
+    RUN_TEST(test_map_means);
+    RUN_TEST(test_map_full);
+    RUN_TEST(test_save);
+    return UNITY_END();
+}